@@ -0,0 +1,162 @@
+#ifndef ASYNC_LOGGER_H__
+#define ASYNC_LOGGER_H__
+
+#include "log.h"
+#include "cond_var.h"
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+// Log from the timer, pop and callback paths without taking locks or doing
+// file I/O.  Nothing is formatted (or even evaluated) unless the level is
+// enabled, and then the line is formatted straight into a buffer belonging
+// to the calling thread, for the AsyncLogger to write out later.
+#define ASYNC_LOG(LEVEL, ...)                                                 \
+  do {                                                                        \
+    if (Log::loggingLevel >= (LEVEL))                                         \
+    {                                                                         \
+      AsyncLogger::log((LEVEL), __FILE__, __LINE__, __VA_ARGS__);             \
+    }                                                                         \
+  } while (0)
+
+#define ASYNC_LOG_WARNING(...) ASYNC_LOG(Log::WARNING_LEVEL, __VA_ARGS__)
+#define ASYNC_LOG_INFO(...) ASYNC_LOG(Log::INFO_LEVEL, __VA_ARGS__)
+#define ASYNC_LOG_VERBOSE(...) ASYNC_LOG(Log::VERBOSE_LEVEL, __VA_ARGS__)
+#define ASYNC_LOG_DEBUG(...) ASYNC_LOG(Log::DEBUG_LEVEL, __VA_ARGS__)
+
+// Log a warning that could be hit for every timer (for example, when a
+// callback destination is down), writing it at most once a second.  The next
+// warning written says how many were suppressed in between.
+#define ASYNC_LOG_WARNING_RATE_LIMITED(...)                                   \
+  do {                                                                        \
+    if (Log::loggingLevel >= Log::WARNING_LEVEL)                              \
+    {                                                                         \
+      static LogRateLimiter _limiter(1000);                                   \
+      uint64_t _suppressed;                                                   \
+      if (_limiter.allow(_suppressed))                                        \
+      {                                                                       \
+        if (_suppressed > 0)                                                  \
+        {                                                                     \
+          AsyncLogger::log(Log::WARNING_LEVEL, __FILE__, __LINE__,            \
+                           "Suppressed %lu similar warnings", _suppressed);   \
+        }                                                                     \
+        AsyncLogger::log(Log::WARNING_LEVEL, __FILE__, __LINE__, __VA_ARGS__);\
+      }                                                                       \
+    }                                                                         \
+  } while (0)
+
+// Limits how often a log statement is written.  Safe to use from any thread.
+class LogRateLimiter
+{
+public:
+  LogRateLimiter(uint64_t interval_ms);
+
+  // Returns true if a line may be written now, in which case `suppressed` is
+  // set to the number of lines that weren't allowed since the last one.
+  bool allow(uint64_t& suppressed);
+
+private:
+  uint64_t _interval_ms;
+  std::atomic<uint64_t> _next_ms;
+  std::atomic<uint64_t> _suppressed;
+};
+
+// Logger that writes lines to another logger (normally the log file) from a
+// background thread, so that threads logging never wait for the disk or for
+// each other.
+//
+// Each thread that logs gets a ring buffer of its own, which it adds lines to
+// without locking.  The background thread empties the rings every few
+// milliseconds, so lines from one thread stay in order but may be interleaved
+// differently with other threads' lines.  If a thread fills its ring (because
+// the disk can't keep up) further lines are dropped until there is room, and
+// the number dropped is logged.  When a thread exits its ring is marked as
+// released, and freed once the background thread has emptied it.
+//
+// There should only be one AsyncLogger at a time, and it must outlive any
+// logging.  Lines logged with `log()` while there is no AsyncLogger are
+// written through Log::write instead.
+class AsyncLogger : public Logger
+{
+public:
+  // Takes ownership of the logger.
+  AsyncLogger(Logger* logger);
+  virtual ~AsyncLogger();
+
+  // Queue a line written through Log::write (which has already formatted
+  // it).
+  virtual void write(const char* data);
+
+  // Replace the logger that lines are written to, deleting the old one.
+  void set_logger(Logger* logger);
+
+  // Write out everything queued so far, on the calling thread.
+  void flush();
+
+  // Flush the current AsyncLogger, unless it's in the middle of writing
+  // (in which case the lines it's writing are lost).  Used when crashing.
+  static void flush_on_crash();
+
+  // Format a line and queue it on the calling thread's ring.
+  static void log(int level, const char* module, int line_number, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+  static void* flush_thread_entry_point(void*);
+
+private:
+  struct Ring
+  {
+    Ring();
+    ~Ring();
+
+    char* buffer;
+
+    // Total bytes ever added by the owning thread and removed by the flush
+    // thread.  The bytes between them are queued.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<uint64_t> dropped;
+
+    // Set when the owning thread exits, after which nothing more is added.
+    std::atomic<bool> released;
+  };
+
+  void enqueue(const char* data, size_t length);
+  Ring* thread_ring();
+  static void release_ring(void*);
+  void run();
+  void flush_rings();
+
+  Logger* _logger;
+  std::vector<Ring*> _rings;
+  std::vector<char> _line;
+  uint64_t _generation;
+
+  // Each thread's ring is also held against this key, so it's released when
+  // the thread exits.
+  pthread_key_t _ring_key;
+
+  // Protects the logger and the list of rings.
+  pthread_mutex_t _mutex;
+  CondVar* _cond;
+  bool _terminated;
+  pthread_t _flush_thread;
+
+  static std::atomic<AsyncLogger*> _instance;
+  static std::atomic<uint64_t> _next_generation;
+
+  // The calling thread's ring, and which AsyncLogger it belongs to.
+  static __thread Ring* _thread_ring;
+  static __thread uint64_t _thread_generation;
+
+  // For testing purposes.
+  friend class TestAsyncLogger;
+
+  // Not copyable.
+  AsyncLogger(const AsyncLogger&);
+  AsyncLogger& operator=(const AsyncLogger&);
+};
+
+#endif
@@ -1,7 +1,65 @@
 #ifndef CALLBACK_H__
 #define CALLBACK_H__
 
+#include "timer.h"
+#include "rapidjson/document.h"
+
 #include <string>
+#include <vector>
+#include <time.h>
+
+// A single timer pop to be delivered by a callback, along with its outcome
+// once the callback has completed.
+struct CallbackRequest
+{
+  CallbackRequest(Timer* timer) :
+    timer(timer),
+    success(false),
+    deferred(false),
+    cancel(false),
+    reschedule(false),
+    interval(0),
+    repeat_for(0),
+    dequeued_us(0),
+    started_us(0),
+    completed_us(0)
+  {}
+
+  Timer* timer;
+  bool success;
+
+  // Set if the callback wasn't attempted because the deadline for starting
+  // callbacks passed first.
+  bool deferred;
+
+  // Set if the response to a successful callback asked for the timer to be
+  // cancelled, or rescheduled with new timing (in ms) from now, rather than
+  // the consumer updating the timer with a separate request.
+  bool cancel;
+  bool reschedule;
+  uint32_t interval;
+  uint32_t repeat_for;
+
+  // Pick up a cancel or new timing from the response to the callback (see
+  // api.md for the format).  Responses that aren't in the format are ignored.
+  // Returns true if the response asked for a change.
+  bool parse_response(const char* data, size_t length);
+  bool parse_response(const rapidjson::Value& response);
+
+  // Monotonic timestamps for when the timer was taken from the store and when
+  // its callback was started and completed (zero if the callback was never
+  // attempted), for latency statistics.
+  uint64_t dequeued_us;
+  uint64_t started_us;
+  uint64_t completed_us;
+
+  static uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+};
 
 // Virtual class for handling timer callbacks.
 class Callback
@@ -21,7 +79,27 @@ public:
   //  * The third argument is the sequence number for the callback.
   //
   //  Returns true if the callback was successful, false otherwise.
-  virtual bool perform(std::string, std::string, unsigned int) = 0;
+  virtual bool perform(std::string, const SharedBuffer&, unsigned int) = 0;
+
+  // Perform a batch of callbacks, filling in the `success` flag and the
+  // start and completion times of each request.  This returns once every
+  // callback in the batch has completed.
+  //
+  // If a deadline is given (as a CallbackRequest::now_us() time), callbacks
+  // that haven't started by then are skipped and marked as `deferred`.  At
+  // least one callback is always attempted, so that progress is made.
+  //
+  // The default implementation performs the callbacks one at a time,
+  // callbacks that can run requests in parallel should override this.
+  virtual void perform_all(std::vector<CallbackRequest>& requests,
+                           uint64_t start_deadline_us = 0);
+
+  // Prepare to perform the callbacks for timers that are about to pop, for
+  // example by opening connections to their callback servers.  The timers
+  // are still owned by the timer store, so must not be kept hold of.
+  //
+  // The default implementation does nothing.
+  virtual void prepare(const std::vector<Timer*>& timers) {};
 };
 
 #endif
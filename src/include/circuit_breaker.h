@@ -0,0 +1,51 @@
+#ifndef CIRCUIT_BREAKER_H__
+#define CIRCUIT_BREAKER_H__
+
+#include <stdint.h>
+
+// Tracks the health of a single callback destination.
+//
+// The circuit starts closed, allowing every request.  After a configured
+// number of consecutive failures it opens and requests are rejected without
+// being attempted.  Once the reset period has passed, a single probe request
+// is allowed through (half-open): if it succeeds the circuit closes again,
+// otherwise it re-opens for another reset period.
+//
+// Times are passed in (in ms, from any monotonic clock) so the breaker never
+// reads the clock itself.
+class CircuitBreaker
+{
+public:
+  enum State
+  {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  CircuitBreaker();
+  ~CircuitBreaker();
+
+  // Set the number of consecutive failures that open the circuit (zero
+  // disables the breaker) and how long it stays open before probing.
+  void configure(int failure_threshold, int reset_ms);
+
+  // Returns whether a request may be attempted now.  If this returns true,
+  // the outcome must be reported through success() or failure().
+  bool allow(uint64_t now_ms);
+
+  void success();
+  void failure(uint64_t now_ms);
+
+  State state() { return _state; }
+
+private:
+  State _state;
+  int _consecutive_failures;
+  uint64_t _open_until_ms;
+
+  int _failure_threshold;
+  int _reset_ms;
+};
+
+#endif
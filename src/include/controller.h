@@ -19,11 +19,13 @@ public:
 
   static void controller_cb(struct evhttp_request*, void*);
   static void controller_ping_cb(struct evhttp_request*, void*);
+  static void controller_statistics_cb(struct evhttp_request*, void*);
 
 private:
   Replicator* _replicator;
   TimerHandler* _handler;
 
+  void handle_batch(struct evhttp_request*);
   void send_error(struct evhttp_request*, int, const char*);
   std::string get_req_body(struct evhttp_request*);
 };
@@ -0,0 +1,68 @@
+#ifndef EPOLL_ENGINE_H__
+#define EPOLL_ENGINE_H__
+
+#include "io_engine.h"
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+// I/O engine using readiness notifications from epoll.  Sends are attempted
+// as soon as `wait()` is called, only waiting for the socket to become
+// writable if it can't take all the data, and received data is read into a
+// fixed set of buffers that are reused on each call to `wait()`.
+class EpollEngine : public IOEngine
+{
+public:
+  EpollEngine();
+  ~EpollEngine();
+
+  // Create the epoll instance.  Returns false on failure.
+  bool init();
+
+  const char* name() { return "epoll"; };
+  void send(int fd, const struct iovec* iov, int iovcnt, void* context);
+  void receive(int fd, void* context);
+  void cancel(int fd);
+  void wait(std::vector<Completion>& completions, int timeout_ms);
+
+private:
+  struct Socket
+  {
+    Socket() :
+      receive_context(NULL),
+      receiving(false),
+      send_context(NULL),
+      send_iov(NULL),
+      send_iovcnt(0),
+      sending(false),
+      events(0)
+    {}
+
+    void* receive_context;
+    bool receiving;
+    void* send_context;
+    const struct iovec* send_iov;
+    int send_iovcnt;
+    bool sending;
+
+    // The events currently registered with epoll.
+    uint32_t events;
+  };
+
+  bool try_send(int fd, Socket& socket, std::vector<Completion>& completions);
+  void try_receive(int fd, Socket& socket, std::vector<Completion>& completions);
+  void update(int fd, Socket& socket);
+
+  int _epoll_fd;
+  std::map<int, Socket> _sockets;
+
+  // Sockets with a send queued since the last call to `wait()`.
+  std::vector<int> _queued_sends;
+
+  // Buffers for received data, handed out in turn on each call to `wait()`.
+  std::vector<char> _buffers;
+  size_t _buffers_used;
+};
+
+#endif
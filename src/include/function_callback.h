@@ -0,0 +1,45 @@
+#ifndef FUNCTION_CALLBACK_H__
+#define FUNCTION_CALLBACK_H__
+
+#include "callback.h"
+
+#include <string>
+#include <map>
+#include <functional>
+#include <pthread.h>
+
+// Callback handler that delivers pops to functions in the same process, for
+// services that embed the timer engine (see timer_engine.h).  A timer's
+// callback URL is the name the function was registered under.
+//
+// The functions are called on the timer handler thread, so should return
+// quickly (handing off any real work to other threads).  A function returns
+// true if it handled the pop successfully.  The opaque data is shared with
+// the timer, so a function can hold on to it without copying it.
+class FunctionCallback : public Callback
+{
+public:
+  typedef std::function<bool(TimerID id,
+                             uint32_t sequence_number,
+                             const SharedBuffer& opaque)> Function;
+
+  FunctionCallback();
+  ~FunctionCallback();
+
+  std::string protocol() { return "function"; };
+  bool perform(std::string, const SharedBuffer&, unsigned int);
+  void perform_all(std::vector<CallbackRequest>&, uint64_t start_deadline_us = 0);
+
+  // Register (or replace) the function for a name, or remove it.  These may
+  // be called from any thread.
+  void register_function(const std::string& name, Function function);
+  void unregister_function(const std::string& name);
+
+private:
+  bool call(const std::string& name, TimerID id, uint32_t sequence_number, const SharedBuffer& opaque);
+
+  std::map<std::string, Function> _functions;
+  pthread_rwlock_t _lock;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <vector>
 #include <boost/program_options.hpp>
 #include "updater.h"
+#include "async_logger.h"
 
 // Defines a global variable and it's associated get and set
 // functions.  Note that, although get functions are protected
@@ -35,7 +36,9 @@
 class Globals
 {
 public:
-  Globals();
+  // Unless `manage_logging` is false, the configuration also sets up the log
+  // file and logging level for the process.
+  Globals(bool manage_logging = true);
   ~Globals();
 
   GLOBAL(bind_address, std::string);
@@ -43,6 +46,27 @@ public:
   GLOBAL(cluster_local_ip, std::string);
   GLOBAL(cluster_hashes, std::map<std::string, uint64_t>);
   GLOBAL(cluster_addresses, std::vector<std::string>);
+  GLOBAL(callback_max_requests_per_host, int);
+  GLOBAL(callback_connection_pool_size, int);
+  GLOBAL(callback_http2_hosts, std::vector<std::string>);
+  GLOBAL(callback_http2_upgrade_hosts, std::vector<std::string>);
+  GLOBAL(callback_http2_max_streams_per_host, int);
+  GLOBAL(callback_timeout_ms, int);
+  GLOBAL(callback_max_retries, int);
+  GLOBAL(callback_retry_backoff_ms, int);
+  GLOBAL(callback_circuit_breaker_failures, int);
+  GLOBAL(callback_circuit_breaker_reset_ms, int);
+  GLOBAL(callback_tcp_io_engine, std::string);
+  GLOBAL(pop_max_slice_size, int);
+  GLOBAL(pop_slice_budget_us, int);
+  GLOBAL(pop_lookahead_ms, int);
+  GLOBAL(replication_batch_size, int);
+  GLOBAL(replication_batch_window_ms, int);
+  GLOBAL(replication_connections_per_node, int);
+  GLOBAL(replication_max_queued_per_node, int);
+  GLOBAL(replication_stagger_floor_ms, int);
+  GLOBAL(replication_stagger_margin_ms, int);
+  GLOBAL(replication_stagger_max_ms, int);
 
 public:
   void update_config();
@@ -54,6 +78,8 @@ private:
 
   pthread_rwlock_t _lock;
   Updater<void, Globals>* _updater;
+  bool _manage_logging;
+  AsyncLogger* _logger;
   boost::program_options::options_description _desc;
 };
 
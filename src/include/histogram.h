@@ -0,0 +1,56 @@
+#ifndef HISTOGRAM_H__
+#define HISTOGRAM_H__
+
+#include <atomic>
+#include <stdint.h>
+
+// A lock-free histogram of non-negative integer values (typically latencies in
+// microseconds), in the style of an HDR histogram.
+//
+// Values are counted in log-linear buckets: values below 16 are counted
+// exactly, and each power of two above that is split into 16 equal buckets,
+// so any value is recorded to within 1/16th (~6%) of its true value.  This
+// covers the whole 64-bit range in a fixed 976 buckets.
+//
+// Recording a value is a handful of relaxed atomic operations, so may be done
+// from any number of threads at once.  Reads are not a consistent snapshot
+// while values are being recorded, which is fine for statistics.
+class Histogram
+{
+public:
+  Histogram();
+  ~Histogram();
+
+  void record(uint64_t value);
+
+  // Forget every value recorded so far.  Values recorded while this is
+  // running may or may not be kept.
+  void reset();
+
+  uint64_t count();
+  uint64_t max();
+  uint64_t mean();
+
+  // Returns the value at the given percentile (0-100), accurate to the
+  // resolution of the buckets.
+  uint64_t percentile(double percent);
+
+private:
+  static const int SUB_BUCKET_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static int bucket_index(uint64_t value);
+  static uint64_t bucket_highest_value(int index);
+
+  std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sum;
+  std::atomic<uint64_t> _max;
+
+  // Not copyable.
+  Histogram(const Histogram&);
+  Histogram& operator=(const Histogram&);
+};
+
+#endif
@@ -2,21 +2,182 @@
 #define HTTP_CALLBACK_H__
 
 #include "callback.h"
+#include "circuit_breaker.h"
+#include "resolver.h"
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <sys/socket.h>
 #include <curl/curl.h>
 
+// Callback handler that POSTs the opaque data to an HTTP URL.
+//
+// Requests are run in parallel through a single cURL multi handle, so that
+// connections to each callback server are kept alive and reused between pops.
+// Each destination (scheme, host and port) is limited to a configurable number
+// of requests in flight at once, with any excess queued until a slot frees up.
+//
+// Destinations can be configured to receive their callbacks over HTTP/2 (h2c,
+// either with prior knowledge or after an upgrade from HTTP/1.1), in which case
+// requests are multiplexed as streams over a small number of connections.
+//
+// Each destination has a circuit breaker, so that once a callback server has
+// failed repeatedly its callbacks fail immediately (and are retried later)
+// rather than holding up the callbacks to other servers.
+//
+// Timers that have opted in to batched callbacks and pop together with other
+// timers for the same URL are delivered in a single request (see api.md for
+// the format), with the response acknowledging each timer individually.  Only
+// callbacks passed to the same perform_all (one slice of popped timers) are
+// combined: callbacks aren't held back to wait for more.
+//
+// Ahead of timers popping, connections are opened to their destinations (up to
+// the number of requests that will be made in parallel), so that when the
+// timers pop their callbacks can be sent straight away.
+//
+// Destinations that haven't been used for a while are forgotten, once cURL
+// has closed its connections to them.
 class HTTPCallback : public Callback
 {
 public:
   HTTPCallback();
   ~HTTPCallback();
 
+  // For testing purposes.
+  friend class TestHTTPCallback;
+
   std::string protocol() { return "http"; };
-  bool perform(std::string, std::string, unsigned int);
+  bool perform(std::string, const SharedBuffer&, unsigned int);
+  void perform_all(std::vector<CallbackRequest>&, uint64_t start_deadline_us = 0);
+  void prepare(const std::vector<Timer*>&);
 
 private:
-  CURL* _curl;
+  struct Destination;
+
+  // A single callback request, either in flight or queued on its destination.
+  struct Transfer
+  {
+    const std::string* url;
+    const SharedBuffer* body;
+    unsigned int sequence_number;
+    bool* success;
+    Destination* destination;
+    CURL* curl;
+    struct curl_slist* headers;
+
+    // The timer pop this request delivers, if it's a single callback from
+    // perform_all (rather than a batch or a call to perform).
+    CallbackRequest* request;
+
+    // Set if the request was never started as the deadline for starting
+    // requests passed while it was queued.
+    bool deferred;
+
+    // For batched requests, the callbacks carried by the request, the body
+    // built from them and the response from the callback server.  Single
+    // callbacks keep a short response, in case it has new timing for the
+    // timer, unless it turns out to be too long.
+    std::vector<CallbackRequest*> batch;
+    SharedBuffer batch_body;
+    bool batch_success;
+    std::string response;
+    bool response_truncated;
+  };
+
+  // A connection opened to a destination ahead of any callbacks to it, along
+  // with when it was opened.
+  struct WarmSocket
+  {
+    curl_socket_t fd;
+    uint64_t opened_ms;
+  };
+
+  // The per-destination connection pool.  This holds the easy handles not
+  // currently in use, the number of requests in flight and the queue of
+  // requests waiting for an in-flight slot, along with the HTTP version to use
+  // and the resulting in-flight limit, and the health of the destination.
+  //
+  // We also track the number of connections cURL has open to the destination
+  // and any connections opened in advance that cURL hasn't yet picked up,
+  // along with the address those connections were opened to, and when the
+  // destination was last used.
+  struct Destination
+  {
+    Destination() :
+      idle_handles(),
+      in_flight(0),
+      pending(),
+      http_version(CURL_HTTP_VERSION_1_1),
+      max_in_flight(1),
+      breaker(),
+      connections(0),
+      warm_sockets(),
+      handed_over(CURL_SOCKET_BAD),
+      address(),
+      address_len(0),
+      used_ms(0)
+    {}
+
+    std::vector<CURL*> idle_handles;
+    int in_flight;
+    std::deque<Transfer*> pending;
+    long http_version;
+    int max_in_flight;
+    CircuitBreaker breaker;
+    int connections;
+    std::vector<WarmSocket> warm_sockets;
+    curl_socket_t handed_over;
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    uint64_t used_ms;
+  };
+
+  void refresh_config();
+  Destination* get_destination(const std::string& key);
+  void evict_idle_destinations();
+  void run(Transfer* transfers, size_t count);
+  void submit(Transfer*);
+  void start(Transfer*);
+  void complete(CURL*, CURLcode);
+  void reject(Transfer*);
+  void defer(Transfer*);
+  static void timestamp(Transfer*, uint64_t CallbackRequest::*field);
+  CURL* get_handle(Destination*);
+  void release_handle(Destination*, CURL*);
+  void configure(const std::string& key, Destination*);
+  void warm(const std::string& key, Destination*, int wanted);
+  bool resolve(const std::string& key, Destination*);
+  static void close_warm_sockets(Destination*, bool stale_only);
+
+  static std::string destination_key(const std::string& url);
+  static void split_host_port(const std::string& key, std::string& host, std::string& port);
+  static std::string host_port(const std::string& key);
+  static uint64_t monotonic_time_ms();
+  static bool batch_order(const CallbackRequest*, const CallbackRequest*);
+  static std::string build_batch_body(const std::vector<CallbackRequest*>&);
+  static void handle_batch_response(Transfer*);
+  static size_t write_response(char*, size_t, size_t, void*);
+  static curl_socket_t open_socket(void*, curlsocktype, struct curl_sockaddr*);
+  static int close_socket(void*, curl_socket_t);
+  static int configure_socket(void*, curl_socket_t, curlsocktype);
+
+  CURLM* _multi;
+  std::vector<Transfer> _transfers;
+  std::vector<CallbackRequest*> _batched;
+  std::map<std::string, Destination> _destinations;
+  Resolver _resolver;
+  std::vector<std::string> _http2_hosts;
+  std::vector<std::string> _http2_upgrade_hosts;
+  int _max_requests_per_host;
+  int _max_streams_per_host;
+  int _timeout_ms;
+  int _breaker_failures;
+  int _breaker_reset_ms;
+  int _outstanding;
+  uint64_t _start_deadline_us;
+  uint64_t _next_eviction_ms;
 };
 
 #endif
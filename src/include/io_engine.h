@@ -0,0 +1,66 @@
+#ifndef IO_ENGINE_H__
+#define IO_ENGINE_H__
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Drives non-blocking socket I/O for the callback handlers, batching the work
+// for many sockets into as few system calls as possible.
+//
+// Sends and receives are started on sockets and their completions are picked
+// up in batches by calling `wait()`.  Each socket may have at most one send in
+// flight at a time, and the data being sent (and the array describing it) must
+// stay valid until the send completes.  Once receiving has started on a
+// socket, data is reported as it arrives until the socket is closed by the
+// other end or fails.
+//
+// Before closing a socket, `cancel()` must be called so that no further
+// completions are reported for it.  Once `cancel()` returns, the engine has
+// finished with any data that was being sent on the socket.
+//
+// Engines are not thread-safe, and are used from a single thread.
+class IOEngine
+{
+public:
+  // The result of a send or receive.  For sends, `result` is the number of
+  // bytes sent (which may be fewer than requested).  For receives, it is the
+  // number of bytes received (with the data valid until the next call to
+  // `wait()`), or zero if the other end closed the socket.  In either case
+  // a negative result is an errno value.
+  struct Completion
+  {
+    void* context;
+    bool is_send;
+    ssize_t result;
+    const char* data;
+  };
+
+  virtual ~IOEngine() {};
+
+  // The name of the engine, for logging.
+  virtual const char* name() = 0;
+
+  // Send data gathered from a number of buffers on a socket (at most IOV_MAX
+  // of them).  The send may not be started until the next call to `wait()`.
+  virtual void send(int fd, const struct iovec* iov, int iovcnt, void* context) = 0;
+
+  // Start receiving on a socket.
+  virtual void receive(int fd, void* context) = 0;
+
+  // Stop all I/O on a socket, waiting for any I/O already started to stop.
+  virtual void cancel(int fd) = 0;
+
+  // Start any queued I/O and wait up to `timeout_ms` for completions (which
+  // are appended to `completions`).  Returns once there is at least one
+  // completion or the timeout expires.
+  virtual void wait(std::vector<Completion>& completions, int timeout_ms) = 0;
+
+  // Create an engine of the given type: "io_uring", "epoll" or "auto" (which
+  // uses io_uring where the kernel supports it, falling back to epoll).
+  // Returns NULL if the type is unknown or unsupported.
+  static IOEngine* create(const std::string& type);
+};
+
+#endif
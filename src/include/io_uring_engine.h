@@ -0,0 +1,115 @@
+#ifndef IO_URING_ENGINE_H__
+#define IO_URING_ENGINE_H__
+
+#include "io_engine.h"
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// I/O engine using an io_uring submission and completion queue shared with
+// the kernel.  All the sends (and any other requests) queued since the last
+// call to `wait()` are submitted, and the completions waited for, in a single
+// system call.
+//
+// Each socket has a single multishot receive, which keeps delivering data
+// until the socket closes without being re-armed.  Received data goes into a
+// ring of buffers registered with the kernel up front, so there's no copy out
+// of the kernel's buffers beyond the one into the ring.  Buffers are given
+// back to the kernel on the next call to `wait()`.
+//
+// This needs a recent kernel (multishot receive and provided buffer rings
+// arrived in Linux 6.0), and `init()` fails on older kernels or where
+// io_uring is disabled.
+class IOUringEngine : public IOEngine
+{
+public:
+  IOUringEngine();
+  ~IOUringEngine();
+
+  // Set up the ring and register the receive buffers.  Returns false if the
+  // kernel doesn't support everything we need.
+  bool init();
+
+  const char* name() { return "io_uring"; };
+  void send(int fd, const struct iovec* iov, int iovcnt, void* context);
+  void receive(int fd, void* context);
+  void cancel(int fd);
+  void wait(std::vector<Completion>& completions, int timeout_ms);
+
+private:
+  // Each socket is given a new generation number whenever it is registered,
+  // so that completions for requests on a socket that has since been
+  // cancelled (and whose file descriptor may have been reused) are ignored.
+  //
+  // A cancelled socket is kept until its send and receive have completed, as
+  // the kernel may still be using their buffers until then.
+  struct Socket
+  {
+    void* receive_context;
+    void* send_context;
+    uint32_t generation;
+    bool receiving;
+    bool sending;
+    bool cancelled;
+
+    // The message header for the send in flight, which must stay put until
+    // the send completes.
+    struct msghdr send_msg;
+  };
+
+  Socket& get_socket(int fd);
+  struct io_uring_sqe* get_sqe();
+  void arm_receive(int fd, Socket& socket);
+  void recycle_buffer(uint16_t buffer_id);
+  void publish_buffers();
+  void drain(int fd);
+  int enter(unsigned min_complete, int timeout_ms);
+  void reap(std::vector<Completion>& completions);
+
+  int _ring_fd;
+
+  // The submission queue.
+  void* _sq_ring;
+  size_t _sq_ring_size;
+  unsigned* _sq_head;
+  unsigned* _sq_tail;
+  unsigned _sq_mask;
+  unsigned _sq_entries;
+  struct io_uring_sqe* _sqes;
+  size_t _sqes_size;
+
+  // The completion queue (which may share a mapping with the submission
+  // queue).
+  void* _cq_ring;
+  size_t _cq_ring_size;
+  unsigned* _cq_head;
+  unsigned* _cq_tail;
+  unsigned _cq_mask;
+  struct io_uring_cqe* _cqes;
+
+  // The receive buffers, and the ring used to hand them to the kernel.
+  struct io_uring_buf_ring* _buf_ring;
+  size_t _buf_ring_size;
+  std::vector<char> _buffers;
+  uint16_t _buf_tail;
+  std::vector<uint16_t> _buffers_in_use;
+
+  // Completions (and the buffers holding their data) picked up while waiting
+  // for cancelled sockets, reported on the next call to `wait()`.
+  std::vector<Completion> _deferred;
+  std::vector<uint16_t> _deferred_buffers;
+
+  std::map<int, Socket> _sockets;
+  uint32_t _generation;
+
+  // Requests that couldn't be queued, reported on the next call to `wait()`.
+  std::vector<Completion> _failed;
+};
+
+#endif
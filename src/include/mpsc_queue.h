@@ -0,0 +1,101 @@
+#ifndef MPSC_QUEUE_H__
+#define MPSC_QUEUE_H__
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Unbounded lock-free queue with any number of producers and a single
+// consumer.
+//
+// Pushing never blocks (it's a single atomic exchange), so producers are never
+// held up by the consumer.  The queue is a linked list with a dummy node at
+// the tail: the consumer takes the value from the node after the dummy, which
+// then becomes the new dummy.  A pop may miss an item whose push is still in
+// progress, but will see it on a later pop.
+//
+// Items still queued when the queue is destroyed are discarded, so the owner
+// of a queue of pointers must pop and free them first.
+template <class T>
+class MPSCQueue
+{
+public:
+  MPSCQueue() : _head(new Node()), _tail(_head.load()) {}
+
+  ~MPSCQueue()
+  {
+    T value;
+    while (pop(value))
+    {
+    }
+    delete _tail;
+  }
+
+  // Add an item to the queue.  Safe to call from any thread.
+  void push(const T& value)
+  {
+    Node* node = new Node(value);
+    Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Add a number of items to the queue, in order.  The items are linked
+  // together first, so they're added with a single atomic exchange.  Safe to
+  // call from any thread.
+  void push_all(const std::vector<T>& values)
+  {
+    if (values.empty())
+    {
+      return;
+    }
+
+    Node* first = new Node(values[0]);
+    Node* last = first;
+    for (size_t ii = 1; ii < values.size(); ii++)
+    {
+      Node* node = new Node(values[ii]);
+      last->next.store(node, std::memory_order_relaxed);
+      last = node;
+    }
+
+    Node* prev = _head.exchange(last, std::memory_order_acq_rel);
+    prev->next.store(first, std::memory_order_release);
+  }
+
+  // Take the oldest item from the queue, returning false if the queue is
+  // empty.  Must only be called from the consumer thread.
+  bool pop(T& value)
+  {
+    Node* tail = _tail;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == NULL)
+    {
+      return false;
+    }
+
+    value = next->value;
+    _tail = next;
+    delete tail;
+    return true;
+  }
+
+private:
+  struct Node
+  {
+    Node() : value(), next(NULL) {}
+    Node(const T& value) : value(value), next(NULL) {}
+
+    T value;
+    std::atomic<Node*> next;
+  };
+
+  // Producers push at the head and the consumer pops from the tail.
+  std::atomic<Node*> _head;
+  Node* _tail;
+
+  // Not copyable.
+  MPSCQueue(const MPSCQueue&);
+  MPSCQueue& operator=(const MPSCQueue&);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef REPLICA_STAGGER_H__
+#define REPLICA_STAGGER_H__
+
+#include "histogram.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+// Works out how long each replica of a timer waits after the replica before
+// it was due to pop the timer, before popping the timer itself.
+//
+// A replica shouldn't pop a timer until the replica before it has had time to
+// pop it and replicate the result (which moves the timer on to its next pop).
+// Rather than allowing a fixed two seconds for this, the stagger is worked out
+// from how long this node's callbacks are taking to complete (measured from
+// when their timers were due) and how long its replication messages are
+// taking to be delivered: the 99th percentile of each over the last minute
+// or so, doubled, plus a configured margin.  The result is kept within a
+// configured floor and maximum, and is the maximum until enough callbacks and
+// replication messages have been measured.
+//
+// Replicas of a timer use the stagger advertised by the node that last
+// replicated it (see Timer::replica_stagger_ms), rather than their own, so
+// that they agree on the order they pop it in.
+//
+// The measurements may be recorded from any thread.  The stagger is worked
+// out again at most once a second, as measurements come in.
+class ReplicaStagger
+{
+public:
+  ReplicaStagger();
+  ~ReplicaStagger();
+
+  // Record how long after its timer was due a callback completed, and how
+  // long a replication message took to be delivered (both in us).
+  void record_callback(uint64_t us);
+  void record_replication(uint64_t us);
+
+  uint64_t stagger_ms();
+
+private:
+  void maybe_update();
+  void update(uint64_t now_ms);
+
+  static uint64_t monotonic_time_ms();
+
+  // The measurements are kept for two windows: the current one and the one
+  // before it, which is discarded when the current one ends.
+  Histogram _callbacks[2];
+  Histogram _replications[2];
+  std::atomic<int> _current;
+
+  std::atomic<uint64_t> _stagger_ms;
+  std::atomic<uint64_t> _next_update_ms;
+  uint64_t _window_end_ms;
+  pthread_mutex_t _mutex;
+};
+
+extern ReplicaStagger* __replica_stagger;
+
+#endif
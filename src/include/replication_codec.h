@@ -0,0 +1,74 @@
+#ifndef REPLICATION_CODEC_H__
+#define REPLICATION_CODEC_H__
+
+#include "timer.h"
+#include "shared_buffer.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+// The compact binary format timers are replicated between nodes in, in place
+// of the JSON used by clients.
+//
+// A replication message (sent as the body of a `PUT /timers/batch` with the
+// CONTENT_TYPE below) is the bytes "CT" and a version byte (1), followed by
+// the timers, each prefixed with its length.  Each timer is:
+//
+//  * varints: the timer ID, start time (ms since epoch), interval (ms),
+//    repeat-for (ms), sequence number and replica stagger (ms, or 0 if not
+//    known)
+//  * a byte: the callback protocol (0 for HTTP, 1 for TCP, 2 for stream), plus
+//    0x80 for a batched callback
+//  * the callback URL (or address or key) and the opaque data, each as a varint
+//    length followed by the bytes
+//  * a varint count of replicas, then the varint index of each replica in the
+//    message's table of nodes.  A replica whose index is the size of the table
+//    is new to the message, and its address follows (as a length and bytes),
+//    adding it to the table.
+//
+// Integers are unsigned LEB128 varints.  Timers are encoded once (with their
+// replicas' addresses written out in full) when they're replicated, and the
+// addresses are swapped for indices as the encoded timers are written into
+// each message.
+class ReplicationCodec
+{
+public:
+  static const char* const CONTENT_TYPE;
+
+  // Encode a timer, followed by its replicas' addresses.  The length of the
+  // encoding before the replicas is returned in `fields_length`.
+  static void encode_timer(Timer*, std::string& out, size_t& fields_length);
+
+  // Decode a timer encoded by encode_timer, returning NULL if it's invalid.
+  static Timer* decode_timer(const char* data, size_t length);
+
+  // Decode a replication message, adding its timers to the vector.  If the
+  // message is invalid, no timers are added and false is returned.
+  static bool decode(const char* data,
+                     size_t length,
+                     std::vector<Timer*>& timers,
+                     std::string& error);
+
+  // Writes replication messages from encoded timers.  The writer keeps its
+  // buffers between messages, so it doesn't allocate memory once they've
+  // grown to fit.
+  class Writer
+  {
+  public:
+    void start(std::string& out);
+
+    // Add an encoded timer to the message.  The timer must stay valid until
+    // the message is finished.
+    void add(std::string& out, const SharedBuffer& timer, size_t fields_length);
+
+  private:
+    // The addresses in the message's table of nodes, pointing into the
+    // encoded timers.
+    std::vector<std::pair<const char*, size_t>> _nodes;
+    std::string _replicas;
+  };
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef REPLICATION_QUEUE_H__
+#define REPLICATION_QUEUE_H__
+
+#include "timer.h"
+#include "shared_buffer.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// A timer to be replicated to a node: the timer's ID and binary encoding
+// (shared between all the nodes it's replicated to) and when it was queued
+// (monotonic, in us).  The node is implied by the queue the record is in.
+struct ReplicationRecord
+{
+  ReplicationRecord() : id(0), body(), fields_length(0), queued_us(0) {}
+  ReplicationRecord(TimerID id,
+                    const SharedBuffer& body,
+                    size_t fields_length,
+                    uint64_t queued_us) :
+    id(id), body(body), fields_length(fields_length), queued_us(queued_us) {}
+
+  TimerID id;
+  SharedBuffer body;
+  size_t fields_length;
+  uint64_t queued_us;
+};
+
+// The timers waiting to be replicated to a single node, bounded so that a node
+// that is slow or unreachable can't use up memory without limit.
+//
+// When the queue is full, it's first coalesced: each replicated timer carries
+// the whole of the timer, so only the newest record for each timer needs to
+// be kept.  If that doesn't make room, the oldest records are dropped (and
+// counted in the `replication-drops` statistic).  Coalescing is only
+// attempted again once a tenth of the queue has been added since the last
+// attempt, so a full queue of distinct timers isn't searched on every push.
+class ReplicationQueue
+{
+public:
+  ReplicationQueue();
+  ~ReplicationQueue();
+
+  // Add a record to the back of the queue, making room for it if the queue
+  // already holds `max_depth` records.
+  void push(const ReplicationRecord&, size_t max_depth);
+
+  // Put records back at the front of the queue (in order), to be sent again.
+  // These are added even if the queue is full.
+  void push_front(const std::vector<ReplicationRecord>&);
+
+  // Put records that failed to send back at the front of the queue (in
+  // order), to be sent again.  If that overfills the queue, it's coalesced
+  // and the oldest records dropped, as for push.
+  void requeue(const std::vector<ReplicationRecord>&, size_t max_depth);
+
+  // Move up to `count` records from the front of the queue into `batch`.
+  void pop(std::vector<ReplicationRecord>& batch, size_t count);
+
+  // Throw away every record in the queue.
+  void clear();
+
+  bool empty() { return _records.empty(); }
+  size_t size() { return _records.size(); }
+  const ReplicationRecord& front() { return _records.front(); }
+
+  // The number of records removed by coalescing and dropped to make room.
+  uint64_t coalesced() { return _coalesced; }
+  uint64_t dropped() { return _dropped; }
+
+private:
+  void coalesce();
+
+  std::deque<ReplicationRecord> _records;
+  size_t _pushed_since_coalesce;
+  uint64_t _coalesced;
+  uint64_t _dropped;
+};
+
+#endif
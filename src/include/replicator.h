@@ -4,10 +4,61 @@
 #include <curl/curl.h>
 
 #include "timer.h"
-#include "eventq.h"
+#include "mpsc_queue.h"
+#include "replication_codec.h"
+#include "replication_queue.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <map>
+#include <vector>
 
 // This class is used to replicate timers to the specified replicas, using cURL
 // to handle the HTTP construction and sending.
+//
+// Timers are sent in the compact binary format (see ReplicationCodec).  Each
+// timer is encoded once, and the encoding shared between its replicas.  The
+// timer is handed to the worker thread in a single entry, which names the
+// nodes to replicate it to by index (each node's address is given an index the
+// first time it's seen, and keeps it), so the address isn't copied for every
+// timer.
+// Each node has its own bounded queue of timers (see ReplicationQueue), from
+// which batches are sent as a single request once a batch is full or has
+// waited for the configured window.  Each node has a window of requests in
+// flight, one for each of the configured number of kept-alive connections to
+// it, and further batches wait in its queue until a request completes.  So a
+// node that is slow or unreachable fills up its own queue (which coalesces or
+// drops timers once it's full) without holding up replication to other nodes.
+// After a request to a node fails, the next one opens a new connection, so a
+// node that has restarted is reconnected to rather than being sent requests
+// on connections it has dropped.  The timers in a request that got no
+// response, or a 5xx response, go back on the front of the node's queue and
+// are sent again after a backoff that grows while the node keeps failing.
+// The queue stays bounded, so a node that is down for long enough loses its
+// oldest timers rather than holding on to all of them.
+//
+// A node that rejects a binary message as an unsupported media type (415), or
+// that doesn't have the batch endpoint at all (404), is sent JSON instead
+// (including the timers in the rejected message).  In JSON, a batch of one
+// timer is sent as a plain PUT of that timer, and a node that doesn't have the
+// batch endpoint is sent each timer in a PUT of its own.  The node may be
+// upgraded, so
+// binary messages are tried again after a while, or once a request to the
+// node has failed (as the node may have been restarted).
+//
+// The worker thread sleeps in curl_multi_wait until one of its requests'
+// sockets is ready, a batch's window ends or new timers are queued (which
+// wakes it through a pipe), so messages are sent as soon as they're ready and
+// an idle replicator doesn't run at all.
+//
+// The depth and lag of each node's queue are reported in the statistics.  A
+// node that hasn't had timers queued for it for a while (such as one that has
+// left the cluster) is forgotten, and dropped from the statistics, once its
+// queue is empty and its connections have closed.
+//
+// The cURL handles and the buffers the requests are built in are kept for
+// reuse once their requests complete, so sending replication messages doesn't
+// allocate memory once the pools have grown to fit.
 class Replicator
 {
 public:
@@ -20,12 +71,170 @@ public:
   static void* worker_thread_entry_point(void*);
 
 private:
-  CURL* create_curl_handle(const std::string& url,
-                           const std::string& body);
+  typedef ReplicationRecord Record;
+  struct Peer;
+
+  // A replication message: the node it's sent to, its URL and body, the
+  // timers in it (in case they need to be sent again) and when the first of
+  // them was queued so its latency can be measured.  The body must stay valid
+  // until the message has been sent.
+  struct Message
+  {
+    Message() : peer(NULL), url(), batch_body(), binary(false), records(), queued_us(0) {}
+
+    Peer* peer;
+    std::string url;
+    std::string batch_body;
+    bool binary;
+    std::vector<Record> records;
+    uint64_t queued_us;
+  };
+
+  // A node we replicate to: its address, the timers queued for it and the
+  // number of requests to it in flight, and its health: how many connections
+  // are open, how many requests to it have failed in a row and whether the
+  // next request must open a new connection, and when timers from a failed
+  // request can be sent to it again.  Also whether the node is being sent JSON
+  // rather than binary messages (and if so whether it's sent one timer at a
+  // time, and when binary messages are next tried), and when a timer was last
+  // queued for it.
+  struct Peer
+  {
+    Peer(const std::string& host) :
+      host(host),
+      queue(),
+      in_flight(0),
+      connections(0),
+      consecutive_failures(0),
+      reconnect(false),
+      json(false),
+      unbatched(false),
+      binary_retry_us(0),
+      retry_us(0),
+      last_queued_us(0)
+    {}
+
+    std::string host;
+    ReplicationQueue queue;
+    int in_flight;
+    int connections;
+    int consecutive_failures;
+    bool reconnect;
+    bool json;
+    bool unbatched;
+    uint64_t binary_retry_us;
+    uint64_t retry_us;
+    uint64_t last_queued_us;
+  };
+
+  // A timer handed to the worker thread: its record, and the indexes of the
+  // nodes to queue it for.  A timer with more replicas than fit in one entry
+  // is handed over in several.
+  static const uint32_t MAX_PEERS_PER_ENTRY = 4;
+  struct Entry
+  {
+    Entry() : record(), num_peers(0) {}
+
+    Record record;
+    uint32_t num_peers;
+    uint32_t peers[MAX_PEERS_PER_ENTRY];
+  };
+
+  void refresh_config(CURLM*);
+  uint32_t peer_index(const std::string& host);
+  Peer* get_peer(uint32_t index);
+  void queue_entry(const Entry&);
+  void send_ready_batches(CURLM*);
+  void send_batch(Peer*, std::vector<Record>&, CURLM*);
+  void build_binary_message(Message*, std::vector<Record>&);
+  void build_json_message(Message*, std::vector<Record>&);
+  void message_complete(CURL*, CURLcode, Message*);
+
+  CURL* create_curl_handle(Message*, Peer*);
+  static curl_socket_t open_socket(void*, curlsocktype, struct curl_sockaddr*);
+  static int close_socket(void*, curl_socket_t);
+  int wait_timeout_ms();
+  void publish_statistics();
+  void wake();
+
+  static uint64_t now_us();
+
+  // Timers waiting for the worker thread, and the pipe that wakes it when
+  // there are some.  `_wake_pending` is set while there's a byte in the pipe
+  // the worker hasn't read, so a burst of timers only writes to it once.
+  MPSCQueue<Entry> _q;
+  int _wake_fds[2];
+  std::atomic<bool> _wake_pending;
+  std::atomic<bool> _terminate;
 
-  eventq<CURL*> _q;
   pthread_t _worker_thread;
   struct curl_slist* _headers;
+  struct curl_slist* _binary_headers;
+
+  // The index given to each node's address, and the address for each index.
+  // These are shared by every thread that replicates timers, so are protected
+  // by a lock.  A node keeps its index (and the address is kept) even if the
+  // node is forgotten.
+  pthread_mutex_t _peer_index_lock;
+  std::map<std::string, uint32_t> _peer_indexes;
+  std::vector<std::string> _peer_hosts;
+
+  // The nodes we replicate to (by index, NULL if there isn't a node with an
+  // index or it's been forgotten), the total number of timers queued for them
+  // and a buffer to take each batch from a queue in.  Only used on the worker
+  // thread.
+  std::vector<Peer*> _peers;
+  size_t _num_peers;
+  size_t _queued;
+  std::vector<Record> _batch;
+  int _active_handles;
+
+  // The current limits, picked up from the configuration before each batch
+  // of work.  Only used on the worker thread.
+  int _batch_size;
+  int _batch_window_ms;
+  int _connections_per_node;
+  int _max_queued_per_node;
+
+  // When the worker thread next reports the state of the queues.
+  uint64_t _next_publish_us;
+
+  ReplicationCodec::Writer _writer;
+
+  // cURL handles and messages that are free for reuse, up to a limit.  Only
+  // used on the worker thread.
+  std::vector<CURL*> _idle_handles;
+  std::vector<Message*> _idle_messages;
+  static const size_t MAX_IDLE_MESSAGES = 64;
+
+  // How long the worker thread waits with nothing to do.  New timers wake it
+  // straight away, so this only bounds the wait.
+  static const int IDLE_WAIT_MS = 1000;
+
+  // How long a replication request may take before it's abandoned, so that a
+  // node that has stopped responding doesn't hold on to the connections
+  // to it.
+  static const long REQUEST_TIMEOUT_MS = 5000;
+
+  // The number of requests to a node that must fail in a row before it's
+  // reported as failing.
+  static const int PEER_FAILURE_THRESHOLD = 3;
+
+  // How long to wait before sending a node the timers from a failed request
+  // again.  This doubles with each failure in a row, up to the maximum.
+  static const uint64_t RETRY_BACKOFF_US = 100000;
+  static const uint64_t MAX_RETRY_BACKOFF_US = 5 * 1000000ull;
+
+  // How long a node that rejected a binary message is sent JSON for, before
+  // binary messages are tried again.
+  static const uint64_t BINARY_RETRY_INTERVAL_US = 5 * 60 * 1000000ull;
+
+  // How often the state of the queues is reported in the statistics.
+  static const uint64_t PUBLISH_INTERVAL_US = 100000;
+
+  // How long a node can go without timers being queued for it before it's
+  // forgotten.
+  static const uint64_t PEER_IDLE_US = 5 * 60 * 1000000ull;
 };
 
 #endif
@@ -0,0 +1,93 @@
+#ifndef RESOLVER_H__
+#define RESOLVER_H__
+
+#include "cond_var.h"
+
+#include <string>
+#include <map>
+#include <deque>
+#include <utility>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Looks up the addresses of callback destinations on a background thread, so
+// that the threads sending callbacks never wait for DNS.
+//
+// Lookups are answered from a cache.  Looking up a name that isn't cached (or
+// whose address is getting old) queues it to be resolved in the background,
+// and until that finishes any address already cached is used.  Names that
+// fail to resolve are remembered for a few seconds, so that they aren't looked
+// up again for every callback, and names that haven't been looked up for a
+// while are forgotten.
+//
+// Numeric addresses don't need looking up, so are always answered straight
+// away.
+//
+// Safe to use from any thread.
+class Resolver
+{
+public:
+  enum Result
+  {
+    RESOLVED,
+    PENDING,
+    FAILED
+  };
+
+  Resolver();
+  ~Resolver();
+
+  // Look up a host and port.  Returns RESOLVED (filling in the address) if
+  // the address is known, PENDING if it's being looked up or FAILED if the
+  // last attempt to look it up failed.
+  Result lookup(const std::string& host,
+                const std::string& port,
+                struct sockaddr_storage* address,
+                socklen_t* address_len);
+
+  static void* resolver_thread_entry_point(void*);
+
+private:
+  typedef std::pair<std::string, std::string> Key;
+
+  struct Entry
+  {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    uint64_t resolved_ms;
+    uint64_t failed_ms;
+    uint64_t used_ms;
+    bool failed;
+    bool queued;
+  };
+
+  void run();
+  void evict_unused(uint64_t now_ms);
+  static void update(Entry& entry,
+                     bool ok,
+                     const struct sockaddr_storage& address,
+                     socklen_t address_len,
+                     uint64_t now_ms);
+  static bool resolve(const std::string& host,
+                      const std::string& port,
+                      int flags,
+                      struct sockaddr_storage* address,
+                      socklen_t* address_len);
+  static uint64_t monotonic_time_ms();
+
+  std::map<Key, Entry> _cache;
+  std::deque<Key> _queue;
+
+  // Protects the cache and the queue of names to look up.
+  pthread_mutex_t _mutex;
+  CondVar* _cond;
+  bool _terminated;
+  pthread_t _thread;
+
+  // Not copyable.
+  Resolver(const Resolver&);
+  Resolver& operator=(const Resolver&);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef SHARED_BUFFER_H__
+#define SHARED_BUFFER_H__
+
+#include <string>
+#include <memory>
+#include <ostream>
+#include <cstring>
+
+// An immutable, reference-counted string of bytes.  Copies of a buffer share
+// the same bytes, so a buffer can be passed between timers, callbacks and
+// replication requests without copying its contents.
+//
+// A buffer may be a slice of a larger block of storage (such as a timer's
+// opaque data within the JSON it was defined with), in which case it keeps
+// the whole block alive.
+class SharedBuffer
+{
+public:
+  SharedBuffer() :
+    _storage(),
+    _data(""),
+    _length(0)
+  {}
+
+  SharedBuffer(const char* s) :
+    _storage(),
+    _data(""),
+    _length(0)
+  {
+    init(std::string(s));
+  }
+
+  SharedBuffer(const char* data, size_t length) :
+    _storage(),
+    _data(""),
+    _length(0)
+  {
+    init(std::string(data, length));
+  }
+
+  SharedBuffer(const std::string& s) :
+    _storage(),
+    _data(""),
+    _length(0)
+  {
+    init(std::string(s));
+  }
+
+  // Take over the contents of a string without copying them.
+  SharedBuffer(std::string&& s) :
+    _storage(),
+    _data(""),
+    _length(0)
+  {
+    init(std::move(s));
+  }
+
+  // A slice of a block of storage, which must not be changed afterwards.
+  SharedBuffer(const std::shared_ptr<const std::string>& storage,
+               const char* data,
+               size_t length) :
+    _storage(storage),
+    _data(data),
+    _length(length)
+  {}
+
+  const char* data() const { return _data; }
+  size_t length() const { return _length; }
+  size_t size() const { return _length; }
+  bool empty() const { return (_length == 0); }
+
+  // Returns a copy of the contents.
+  std::string str() const { return std::string(_data, _length); }
+
+private:
+  void init(std::string&& s)
+  {
+    if (!s.empty())
+    {
+      std::shared_ptr<const std::string> storage(new std::string(std::move(s)));
+      _storage = storage;
+      _data = storage->data();
+      _length = storage->length();
+    }
+  }
+
+  std::shared_ptr<const std::string> _storage;
+  const char* _data;
+  size_t _length;
+};
+
+inline bool operator==(const SharedBuffer& lhs, const SharedBuffer& rhs)
+{
+  return ((lhs.length() == rhs.length()) &&
+          ((lhs.data() == rhs.data()) ||
+           (memcmp(lhs.data(), rhs.data(), lhs.length()) == 0)));
+}
+
+inline bool operator!=(const SharedBuffer& lhs, const SharedBuffer& rhs)
+{
+  return !(lhs == rhs);
+}
+
+inline std::ostream& operator<<(std::ostream& os, const SharedBuffer& buffer)
+{
+  return os.write(buffer.data(), buffer.length());
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef STATISTICS_H__
+#define STATISTICS_H__
+
+#include "histogram.h"
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <stdint.h>
+
+// Counters and latency histograms tracking the behaviour of the timer service,
+// exposed over HTTP on the /statistics path.  These may be updated from any
+// thread.
+class Statistics
+{
+public:
+  enum Counter
+  {
+    CALLBACK_SUCCESSES,
+    CALLBACK_FAILURES,
+    CALLBACK_DEADLINE_MISSES,
+    CALLBACK_RETRIES,
+    CALLBACK_RETRIES_EXHAUSTED,
+    CALLBACK_CIRCUIT_OPENS,
+    CALLBACK_CIRCUIT_REJECTIONS,
+    CALLBACK_CONNECTIONS_WARMED,
+    CALLBACK_WARM_CONNECTIONS_USED,
+    CALLBACK_IO_SYSCALLS,
+    CALLBACK_RESCHEDULES,
+    CALLBACK_CANCELS,
+    POP_SLICES,
+    POP_DEFERRALS,
+    REPLICATION_FAILURES,
+    REPLICATION_CONNECTIONS_OPENED,
+    REPLICATION_COALESCED,
+    REPLICATION_DROPS,
+    NUM_COUNTERS
+  };
+
+  // Point-in-time values.
+  enum Gauge
+  {
+    POP_BACKLOG,
+    POP_BACKLOG_PEAK,
+    POP_BACKLOG_MAX_LATENESS,
+    REPLICA_STAGGER_MS,
+    NUM_GAUGES
+  };
+
+  // Latencies measured for each timer pop (all in microseconds):
+  //
+  //  * How late the timer was taken from the store, relative to when it was
+  //    due to pop.
+  //  * The delay between taking the timer from the store and starting its
+  //    callback.
+  //  * The round-trip time of the callback.
+  //  * How late the callback started, relative to when the timer was due.
+  enum Latency
+  {
+    POP_LATENESS,
+    DISPATCH_DELAY,
+    CALLBACK_RTT,
+    DISPATCH_LATENESS,
+    NUM_LATENCIES
+  };
+
+  // Latencies are recorded separately for timers of different precision,
+  // matching the timer store's short wheel (intervals under a second), long
+  // wheel (under an hour) and heap.
+  enum PrecisionClass
+  {
+    SHORT_TIMERS,
+    LONG_TIMERS,
+    HEAP_TIMERS,
+    NUM_PRECISION_CLASSES
+  };
+
+  Statistics();
+  ~Statistics();
+
+  void increment(Counter counter, uint64_t count = 1);
+  uint64_t get(Counter counter);
+
+  void set(Gauge gauge, uint64_t value);
+  void update_max(Gauge gauge, uint64_t value);
+  uint64_t get(Gauge gauge);
+
+  void record_latency(Latency latency, PrecisionClass precision, uint64_t us);
+  Histogram* latency(Latency latency, PrecisionClass precision);
+
+  // Returns the precision class for a timer with the given interval.
+  static PrecisionClass precision_class(uint32_t interval_ms);
+
+  // The state of the replication queue to a node, as last reported by one
+  // replicator: the timers queued and in flight, how long the oldest queued
+  // timer has waited and how many have been coalesced or dropped.
+  struct ReplicationPeer
+  {
+    uint64_t queued;
+    uint64_t in_flight;
+    uint64_t lag_ms;
+    uint64_t coalesced;
+    uint64_t dropped;
+  };
+
+  // Report the state of a replicator's queue to a node.  Each replicator
+  // passes itself as the source, and the reports for a node are combined.
+  void set_replication_peer(const std::string& node,
+                            const void* source,
+                            const ReplicationPeer& peer);
+
+  // Forget a replicator's report for a node (or, with no node, all of its
+  // reports).  Nodes with no reports left aren't rendered.
+  void remove_replication_peer(const std::string& node, const void* source);
+  void remove_replication_peers(const void* source);
+
+  // Render the current value of every counter, a summary of each latency
+  // histogram and the state of the replication queues as a JSON object.
+  std::string to_json();
+
+private:
+  std::atomic<uint64_t> _counters[NUM_COUNTERS];
+  std::atomic<uint64_t> _gauges[NUM_GAUGES];
+  Histogram _latencies[NUM_LATENCIES][NUM_PRECISION_CLASSES];
+
+  // The replication queue reports, by node and then by replicator.
+  pthread_mutex_t _peers_lock;
+  std::map<std::string, std::map<const void*, ReplicationPeer>> _peers;
+
+  static const char* const COUNTER_NAMES[NUM_COUNTERS];
+  static const char* const GAUGE_NAMES[NUM_GAUGES];
+  static const char* const LATENCY_NAMES[NUM_LATENCIES];
+  static const char* const PRECISION_CLASS_NAMES[NUM_PRECISION_CLASSES];
+};
+
+extern Statistics* __statistics;
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef STREAM_CALLBACK_H__
+#define STREAM_CALLBACK_H__
+
+#include "callback.h"
+#include "cond_var.h"
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <utility>
+
+// Callback handler that delivers timer pops to consumers that hold a streaming
+// subscription open to this node, rather than this node sending a request to
+// the consumer for each pop.
+//
+// A consumer subscribes for the pops of timers with a given stream key with
+// `GET /subscriptions?key=<key>&window=<n>`.  The response is sent chunked,
+// and carries one JSON object per line for each pop (see api.md).  The window
+// is the consumer's credit: at most that many pops are outstanding on the
+// subscription at once, and further pops wait (until the callback timeout)
+// for earlier ones to be acknowledged.  The consumer acknowledges pops in
+// batches with `POST /acknowledgements`.  Pops for a key are shared between
+// the subscriptions for that key.
+//
+// Subscriptions are written by the HTTP server's event loop, so pops from the
+// timer handler thread are queued for the loop, which is woken through a pipe.
+class StreamCallback : public Callback
+{
+public:
+  StreamCallback(struct event_base*);
+  ~StreamCallback();
+
+  std::string protocol() { return "stream"; };
+  bool perform(std::string, const SharedBuffer&, unsigned int);
+  void perform_all(std::vector<CallbackRequest>&, uint64_t start_deadline_us = 0);
+
+  void handle_subscribe(struct evhttp_request*);
+  void handle_acknowledge(struct evhttp_request*);
+
+  static void subscribe_cb(struct evhttp_request*, void*);
+  static void acknowledge_cb(struct evhttp_request*, void*);
+
+private:
+  // A consumer's subscription, along with the credit it has left and the
+  // buffer its next chunk of pops is built in.
+  struct Subscription
+  {
+    StreamCallback* owner;
+    std::string key;
+    struct evhttp_request* req;
+    struct evbuffer* out;
+    unsigned int credit;
+  };
+
+  void dispatch();
+  void complete(CallbackRequest*, bool);
+  void close(Subscription*);
+  void wake();
+
+  static void wake_cb(evutil_socket_t, short, void*);
+  static void heartbeat_cb(evutil_socket_t, short, void*);
+  static void close_cb(struct evhttp_connection*, void*);
+
+  struct event_base* _base;
+  struct event* _wake_event;
+  struct event* _heartbeat_event;
+  int _wake_fds[2];
+
+  // Protects everything below, which is shared between the timer handler
+  // thread and the event loop.
+  pthread_mutex_t _mutex;
+  CondVar* _cond;
+
+  // The subscriptions for each key, in the order they're offered pops.
+  std::map<std::string, std::list<Subscription*>> _subscriptions;
+
+  // Pops waiting for a subscription with credit, by key.
+  std::map<std::string, std::deque<CallbackRequest*>> _pending;
+
+  // Pops that have been sent and are waiting to be acknowledged, by timer ID,
+  // along with the subscription they were sent on.
+  std::map<TimerID, std::pair<Subscription*, CallbackRequest*>> _awaiting;
+
+  // The pops in the current batch that haven't yet completed.
+  size_t _incomplete;
+};
+
+#endif
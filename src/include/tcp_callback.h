@@ -0,0 +1,122 @@
+#ifndef TCP_CALLBACK_H__
+#define TCP_CALLBACK_H__
+
+#include "callback.h"
+#include "circuit_breaker.h"
+#include "io_engine.h"
+#include "resolver.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// Callback handler that streams timer pops to a consumer over a persistent
+// TCP (HOST:PORT) or Unix domain socket (unix:PATH) connection.
+//
+// Each pop is sent as a length-prefixed frame, and any number of pops may be
+// in flight on a connection at once.  The consumer acknowledges each pop with
+// a frame of its own, in any order.  All integers are big-endian:
+//
+//   Pop:  | length (4) | timer ID (8) | sequence number (4) | opaque data  |
+//   Ack:  | length (4) | timer ID (8) | sequence number (4) | result (1)   |
+//
+// where the length counts the bytes following it and a result of zero means
+// the pop was handled successfully.
+//
+// If a connection fails or a pop isn't acknowledged within the callback
+// timeout, every pop still waiting on that connection fails and the connection
+// is re-opened for the next pops.  As with HTTP callbacks, each consumer has a
+// circuit breaker so a failing consumer doesn't hold up the others.
+//
+// The connections are driven by an I/O engine (see io_engine.h), so that
+// sending a batch of pops and collecting their acknowledgements takes as few
+// system calls as possible.
+class TCPCallback : public Callback
+{
+public:
+  TCPCallback();
+  ~TCPCallback();
+
+  std::string protocol() { return "tcp"; };
+  bool perform(std::string, const SharedBuffer&, unsigned int);
+  void perform_all(std::vector<CallbackRequest>&, uint64_t start_deadline_us = 0);
+  void prepare(const std::vector<Timer*>&);
+
+private:
+  // A piece of the data waiting to be sent on a connection: either a range of
+  // the connection's own buffer, or a pop's opaque data.
+  struct Chunk
+  {
+    bool shared;
+    SharedBuffer body;
+    size_t offset;
+    size_t length;
+  };
+
+  // A connection to a consumer, along with the data waiting to be sent to it,
+  // the data received from it that hasn't yet been parsed and the pops waiting
+  // to be acknowledged (by timer ID and sequence number).  While the
+  // consumer's address is being looked up, the connection can't be opened.
+  //
+  // Frame headers (and small opaque data, which is cheaper to copy than to
+  // send separately) are written to the connection's own buffer, while larger
+  // opaque data is sent straight from the timers' buffers.  The chunks list
+  // the pieces in order, holding on to the opaque data until it has been sent,
+  // and the I/O vector describes them for the send in progress.
+  struct Connection
+  {
+    Connection() :
+      address(),
+      fd(-1),
+      out_data(),
+      out_chunks(),
+      out_iov(),
+      out_iov_index(0),
+      sending(false),
+      resolving(false),
+      in(),
+      awaiting(),
+      active(false),
+      breaker()
+    {}
+
+    std::string address;
+    int fd;
+    std::string out_data;
+    std::vector<Chunk> out_chunks;
+    std::vector<struct iovec> out_iov;
+    size_t out_iov_index;
+    bool sending;
+    bool resolving;
+    std::string in;
+    std::map<std::pair<TimerID, uint32_t>, CallbackRequest*> awaiting;
+    bool active;
+    CircuitBreaker breaker;
+  };
+
+  void refresh_config();
+  Connection* get_connection(const std::string& address);
+  bool open(const std::string& address, Connection*);
+  void close(Connection*);
+  void fail(Connection*, const char* reason);
+  void send(Connection*);
+  void sent(Connection*, size_t length);
+  void handle(const std::vector<IOEngine::Completion>& completions);
+  void connection_failed(Connection*);
+  bool parse(Connection*);
+
+  bool connect_socket(const std::string& address, int* fd, bool* resolving);
+  static void append_frame(Connection*, Timer* timer);
+  static void clear_out(Connection*);
+  static uint64_t monotonic_time_ms();
+
+  IOEngine* _engine;
+  Resolver _resolver;
+  std::map<std::string, Connection> _connections;
+  int _timeout_ms;
+  int _breaker_failures;
+  int _breaker_reset_ms;
+};
+
+#endif
@@ -4,6 +4,9 @@
 #include <vector>
 #include <string>
 
+#include "shared_buffer.h"
+#include "rapidjson/document.h"
+
 typedef uint64_t TimerID;
 
 class Timer
@@ -15,12 +18,21 @@ public:
   // For testing purposes.
   friend class TestTimer;
 
+  // The replication codec creates timers directly.
+  friend class ReplicationCodec;
+
   // Returns the next time to pop in ms after epoch
   uint64_t next_pop_time();
 
   // Construct the URL for this timer given a hostname
   std::string url(std::string);
 
+  // The timer's ID as it appears in its URL (the ID and the replica hash)
+  std::string url_id();
+
+  // Calculate the replica hash (see calculate_replicas)
+  uint64_t replica_hash();
+
   // Convert this timer to JSON to be sent to replicas
   std::string to_json();
 
@@ -45,21 +57,56 @@ public:
   uint32_t sequence_number;
   std::vector<std::string> replicas;
   std::vector<std::string> extra_replicas;
+  std::string callback_protocol;
   std::string callback_url;
-  std::string callback_body;
+  SharedBuffer callback_body;
+  bool callback_batch;
+
+  // How long (in ms) each replica waits after the one before it was due to
+  // pop the timer, as advertised by the node that last replicated it, so that
+  // every replica agrees on the order they pop it in.  Zero if it isn't known,
+  // in which case this node's own stagger is used (see ReplicaStagger).
+  uint32_t replica_stagger_ms;
+
+  // Local retry state for a failed callback.  While a retry is pending the
+  // timer pops at `retry_time` (in ms after epoch) rather than on its
+  // interval.  This is not replicated.
+  uint32_t retry_count;
+  uint64_t retry_time;
+
+  // The timer's position in the timer store bucket holding it, so it can be
+  // removed from the bucket without searching (see TimerStore::Bucket).
+  size_t store_position;
+
+  // The pop time the timer was filed under in the timer store.  The pop time
+  // of a backup replica moves as the replica stagger changes, so the store
+  // looks the timer up by this rather than working out the pop time again.
+  uint64_t store_pop_time;
 
 private:
   unsigned int _replication_factor;
 
+  static Timer* from_json_value(TimerID,
+                                uint64_t,
+                                const std::shared_ptr<std::string>&,
+                                rapidjson::Value&,
+                                std::string&,
+                                bool&);
+
   // Class functions
 public:
   static TimerID generate_timer_id();
   static Timer* create_tombstone(TimerID, uint64_t);
   static Timer* from_json(TimerID, uint64_t, std::string, std::string&, bool&);
+  static bool from_batch_json(std::string, std::vector<Timer*>&, std::string&);
 
   // Class variables
   static uint32_t deployment_id;
   static uint32_t instance_id;
+
+  // The time each replica of a timer waits after the one before it, if the
+  // replica stagger isn't being worked out from measured latency.
+  static const uint64_t DEFAULT_REPLICA_STAGGER_MS = 2000;
 };
 
 #endif
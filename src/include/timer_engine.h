@@ -0,0 +1,69 @@
+#ifndef TIMER_ENGINE_H__
+#define TIMER_ENGINE_H__
+
+#include "timer.h"
+#include "timer_store.h"
+#include "timer_handler.h"
+#include "replicator.h"
+#include "function_callback.h"
+
+#include <string>
+
+// An in-process timer engine, for services that run alongside Chronos and want
+// to set timers without going through the HTTP API.  This is built into
+// libchronos.a (`make lib`) along with the rest of the timer service.
+//
+// Timers can call functions registered with the engine, which are called on
+// the engine's timer handler thread.  These timers are never replicated, as
+// no other node can call the functions.  Timers with HTTP or TCP callbacks can
+// be added too, in which case they're replicated across the cluster exactly
+// as the HTTP API would (if the engine was created with replication enabled).
+//
+// The engine uses the same configuration as the timer service.  If the
+// embedding process hasn't set up `__globals`, `__statistics` and
+// `__replica_stagger` it creates them (from the configuration file), and
+// destroys them with the engine.  The engine leaves the embedding process's
+// logging alone unless it's created with `log_to_file`, in which case it
+// logs to the configured log folder as the timer service does.  As with the
+// timer service, cURL must be initialized before the engine is created.
+class TimerEngine
+{
+public:
+  TimerEngine(bool replicate = false, bool log_to_file = false);
+  ~TimerEngine();
+
+  // Register (or remove) a function that timers can call by name.
+  void register_function(const std::string& name, FunctionCallback::Function function);
+  void unregister_function(const std::string& name);
+
+  // Set a timer that calls the named function, returning its ID.  The timer
+  // pops after `interval_ms` and then every `interval_ms` until `repeat_for_ms`
+  // has passed (so a single-shot timer has the two equal).
+  TimerID add_timer(const std::string& function,
+                    uint32_t interval_ms,
+                    uint32_t repeat_for_ms,
+                    const SharedBuffer& opaque = SharedBuffer());
+
+  // Set a timer built by the caller (e.g. with `Timer::from_json`).  The
+  // engine takes ownership of the timer.
+  void add_timer(Timer* timer);
+
+  // Cancel a timer.  For replicated timers, the replica hash from the timer's
+  // URL identifies the replicas to cancel it on.
+  void delete_timer(TimerID id, uint64_t replica_hash = 0);
+
+  // For testing purposes.
+  friend class TestTimerEngine;
+
+private:
+  bool _replicate;
+  bool _owns_globals;
+  bool _owns_statistics;
+  bool _owns_replica_stagger;
+  TimerStore* _store;
+  Replicator* _replicator;
+  FunctionCallback* _functions;
+  TimerHandler* _handler;
+};
+
+#endif
@@ -10,40 +10,128 @@
 #endif
 
 #include "timer_store.h"
+#include "timer_table.h"
 #include "replicator.h"
 #include "callback.h"
+#include "mpsc_queue.h"
+
+#include <vector>
+#include <map>
 
 class TimerHandler
 {
 public:
   TimerHandler(TimerStore*, Replicator*, Callback*);
+  TimerHandler(TimerStore*, Replicator*, const std::vector<Callback*>&);
   ~TimerHandler();
   void add_timer(Timer*);
+  void add_timers(std::vector<Timer*>&);
   void run();
 
   friend class TestTimerHandler;
+  friend class TestTimerEngine;
 
 private:
-  void pop(std::unordered_set<Timer*>&);
-  void pop(Timer*);
+  // A timer that has been taken from the store and is waiting to be popped,
+  // along with when it was due to pop (wall clock, in ms) and when it was
+  // taken (monotonic, in us).
+  struct BacklogEntry
+  {
+    BacklogEntry(Timer* timer, uint64_t due_ms, uint64_t dequeued_us) :
+      timer(timer), due_ms(due_ms), dequeued_us(dequeued_us) {}
+
+    Timer* timer;
+    uint64_t due_ms;
+    uint64_t dequeued_us;
+
+    // Orders the backlog heap so the earliest due timer is at the top.
+    bool operator<(const BacklogEntry& other) const
+    {
+      return due_ms > other.due_ms;
+    }
+  };
+
+  // Performs one callback handler's share of a slice on a thread of its own,
+  // while the handler thread performs another handler's share, so that a
+  // slow batch for one protocol doesn't hold up the others.
+  struct CallbackWorker
+  {
+    Callback* callback;
+    std::vector<CallbackRequest>* requests;
+    uint64_t start_deadline_us;
+    bool busy;
+    bool terminate;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+  };
+
+  void start();
+  void tick();
+  Callback* callback_for(Timer*);
+  CallbackWorker* worker_for(Callback*);
+  void perform_slice(uint64_t start_deadline_us);
+  void add_new_timers();
+  void queue_timers(std::vector<Timer*>&);
+  void pop_slice();
+  void prepare_upcoming();
+  void apply_response(Timer*, const CallbackRequest&);
+  void callback_complete(Timer*, bool);
   void signal_new_timer(unsigned int);
 
   TimerStore* _store;
   Replicator* _replicator;
-  Callback* _callback;
+
+  // The callback handlers, indexed by the protocol they handle.
+  std::map<std::string, Callback*> _callbacks;
 
   pthread_t _handler_thread;
   volatile bool _terminate;
   volatile unsigned int _nearest_new_timer;
   pthread_mutex_t _mutex;
 
+  // Timers added from other threads, waiting to be put in the store by the
+  // handler thread.
+  MPSCQueue<Timer*> _new_timers;
+
+  // Timers that are due to pop, kept as a heap so the most overdue timers
+  // are popped first.
+  std::vector<BacklogEntry> _backlog;
+
+  // The timer in the backlog for each ID.  A timer that is updated or
+  // deleted while it's in the backlog is dropped from here, so that the
+  // backlog entry for the old version is discarded rather than popped.
+  TimerTable _backlog_ids;
+
+  // The (monotonic) time at which to next look ahead for timers that are
+  // about to pop.
+  uint64_t _next_lookahead_us;
+
+  // Buffers used while taking timers from the store, popping a slice and
+  // looking ahead, split by callback handler where need be.  These are kept
+  // between uses so that, once they've grown to fit, the handler thread
+  // doesn't allocate memory on every tick.
+  std::vector<Timer*> _next_timers;
+  std::map<Callback*, std::vector<CallbackRequest>> _slice_requests;
+  std::map<Callback*, std::vector<BacklogEntry>> _slice_entries;
+  std::vector<CallbackWorker*> _started_workers;
+  std::vector<Timer*> _upcoming;
+  std::map<Callback*, std::vector<Timer*>> _upcoming_by_callback;
+
+  // The number of timers the pop buffers have room for to start with.
+  static const size_t INITIAL_POP_CAPACITY = 1024;
+
 #ifdef UNITTEST
   MockPThreadCondVar* _cond;
 #else
   CondVar* _cond;
 #endif
 
+  // The worker threads, started as they're first needed.
+  std::map<Callback*, CallbackWorker*> _workers;
+
   static void* timer_handler_entry_func(void *);
+  static void* callback_worker_entry_func(void *);
 };
 
 #endif
@@ -2,8 +2,9 @@
 #define TIMER_STORE_H__
 
 #include "timer.h"
+#include "timer_table.h"
 
-#include <unordered_set>
+#include <vector>
 #include <map>
 #include <string>
 
@@ -15,13 +16,20 @@ public:
 
   // Add a timer to the store.
   virtual void add_timer(Timer*);
-  virtual void add_timers(std::unordered_set<Timer*>&);
+  virtual void add_timers(std::vector<Timer*>&);
 
   // Remove a timer by ID from the store.
   virtual void delete_timer(TimerID);
 
-  // Get the next bucket of timers to pop.
-  virtual void get_next_timers(std::unordered_set<Timer*>&);
+  // Get the next bucket of timers to pop, appending them to the given
+  // vector.  Callers should reuse the vector from one call to the next, so
+  // that popping timers doesn't allocate memory once it has grown to fit.
+  virtual void get_next_timers(std::vector<Timer*>&);
+
+  // Get the timers due to pop within the given number of ms, without removing
+  // them from the store.  The timers remain owned by the store, so must not
+  // be used once the store has been modified.
+  virtual void peek_upcoming_timers(uint64_t window_ms, std::vector<Timer*>&);
 
   // Give the UT test fixture access to our member variables
   friend class TestTimerStore;
@@ -31,15 +39,15 @@ private:
   // - A short timer wheel consisting of 100 10ms buckets (1s in total).
   // - A long timer wheel consisting of 3600 1s buckets (1hr in total).
   // - A heap,
-  // - A set of overdue timers.
+  // - A bucket of overdue timers.
   //
   // New timers are placed into on of these structures:
   // - The short wheel if due to pop in the next second.
   // - The long wheel if due to pop in the next hour (but not the next second).
   // - The heap if due to pop >=1hr in the future.
-  // - The overdue set if they should have already popped.
+  // - The overdue bucket if they should have already popped.
   //
-  // Timers in the overdue set are popped whenever `get_next_timers` is called.
+  // Timers in the overdue bucket are popped whenever `get_next_timers` is called.
   //
   // The short wheel ticks forward at the rate of 1 bucket per 10ms. On evey
   // tick the timers in the current bucket are popped. Every time the short
@@ -51,7 +59,7 @@ private:
   //
   // To achieve this the store tracks the time of the next tick to process
   // _tick_timestamp, which is a multiple of 10ms. The wheels are arrays
-  // of sets that store pointers to timer objects. Any timestamp can be mapped
+  // of buckets that store pointers to timer objects. Any timestamp can be mapped
   // to an index into these arrays (using division and modulo arithmetic).
   //
   // When a tick is processed:
@@ -75,12 +83,12 @@ private:
   //   rotation, and both timers get moved into the short wheel, to be popped
   //   at the right time.
   //
-  // This does mean that when removing a timer, the overdue set, both wheels and
+  // This does mean that when removing a timer, the overdue bucket, both wheels and
   // the heap may need to be searched, although the timer is guaranteed to be in
   // only one of them (and the heap is searched last for efficiency).
 
   // A table of all known timers
-  std::map<TimerID, Timer *> _timer_lookup_table;
+  TimerTable _timer_lookup_table;
 
   // Constants controlling the size and resolution of the timer wheels.
   static const int SHORT_WHEEL_RESOLUTION_MS = 10;
@@ -93,8 +101,50 @@ private:
   static const int LONG_WHEEL_PERIOD_MS =
                             (LONG_WHEEL_RESOLUTION_MS * LONG_WHEEL_NUM_BUCKETS);
 
-  // Type of a single timer bucket.
-  typedef std::unordered_set<Timer *> Bucket;
+  // A single timer bucket.  The timers are kept in a vector, and each timer
+  // records its position in the vector so that it can be removed in constant
+  // time (by moving the last timer into its place).  A bucket keeps its
+  // capacity when it's emptied, so once the buckets have grown to fit the
+  // timers passing through them, moving timers between them and popping them
+  // doesn't allocate memory.
+  class Bucket
+  {
+  public:
+    typedef std::vector<Timer*>::iterator iterator;
+
+    void insert(Timer* timer)
+    {
+      timer->store_position = _timers.size();
+      _timers.push_back(timer);
+    }
+
+    // Returns the number of timers removed (zero or one).
+    size_t erase(Timer* timer)
+    {
+      size_t position = timer->store_position;
+      if ((position >= _timers.size()) || (_timers[position] != timer))
+      {
+        return 0;
+      }
+
+      _timers[position] = _timers.back();
+      _timers[position]->store_position = position;
+      _timers.pop_back();
+      return 1;
+    }
+
+    iterator begin() { return _timers.begin(); }
+    iterator end() { return _timers.end(); }
+    bool empty() const { return _timers.empty(); }
+    size_t size() const { return _timers.size(); }
+    void clear() { _timers.clear(); }
+    size_t capacity() const { return _timers.capacity(); }
+    void reserve(size_t capacity) { _timers.reserve(capacity); }
+    void swap(Bucket& other) { _timers.swap(other._timers); }
+
+  private:
+    std::vector<Timer*> _timers;
+  };
 
   // Bucket for timers that are added after they were supposed to pop.
   Bucket _overdue_timers;
@@ -105,6 +155,16 @@ private:
   // The long timer wheel.
   Bucket _long_wheel[LONG_WHEEL_NUM_BUCKETS];
 
+  // The capacity of long wheel buckets that have been emptied, which is handed
+  // on to buckets as they're used for the first time.  As the long wheel
+  // turns, timers move on to buckets that have never been used, so without
+  // this the long wheel would keep allocating memory for an hour.  The spare
+  // buckets are kept large enough for the most timers a long wheel bucket has
+  // held.
+  static const size_t MAX_SPARE_LONG_BUCKETS = 16;
+  std::vector<Bucket> _spare_long_buckets;
+  size_t _long_bucket_capacity;
+
   // Heap of longer-lived timers (> 1hr)
   std::vector<Timer *> _extra_heap;
 
@@ -148,9 +208,9 @@ private:
   // store's consistency.
   void purge_timer_from_wheels(Timer* timer);
 
-  // Pop a single timer bucket into the set.
+  // Pop a single timer bucket, appending its timers to the vector.
   void pop_bucket(TimerStore::Bucket* bucket,
-                  std::unordered_set<Timer*>& set);
+                  std::vector<Timer*>& timers);
 };
 
 #endif
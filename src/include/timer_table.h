@@ -0,0 +1,61 @@
+#ifndef TIMER_TABLE_H__
+#define TIMER_TABLE_H__
+
+#include "timer.h"
+
+#include <vector>
+#include <stddef.h>
+
+// A table of timers, indexed by their IDs, holding at most one timer per ID.
+//
+// This is an open addressing hash table with linear probing, so the timers are
+// kept in a single array rather than a node per timer.  The array doubles in
+// size when it's half full and never shrinks, so once it has grown to fit the
+// timers passing through it, adding and removing timers doesn't allocate
+// memory.  Removing a timer shifts the timers after it back into the gap, so
+// the table never fills up with deleted entries.
+//
+// The table reads the ID of each timer it holds, so timers must be removed from
+// the table before they're destroyed.
+class TimerTable
+{
+public:
+  TimerTable();
+  ~TimerTable();
+
+  // Get the timer with the given ID, or NULL if there isn't one.
+  Timer* find(TimerID id) const;
+
+  // Add a timer, replacing any timer already held with the same ID.
+  void insert(Timer* timer);
+
+  // Remove the timer with the given ID.  Returns false if there isn't one.
+  bool erase(TimerID id);
+
+  // Forget every timer (without destroying them).
+  void clear();
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+  // Iterate over the slots of the table, some of which are empty (NULL).  The
+  // timers must not be added to or removed from the table while iterating.
+  typedef std::vector<Timer*>::const_iterator slot_iterator;
+  slot_iterator slots_begin() const { return _slots.begin(); }
+  slot_iterator slots_end() const { return _slots.end(); }
+
+private:
+  size_t slot_for(TimerID id) const;
+  void grow();
+
+  static size_t hash(TimerID id);
+
+  // The number of slots is always a power of two.
+  static const size_t INITIAL_SLOTS = 1024;
+
+  std::vector<Timer*> _slots;
+  size_t _mask;
+  size_t _size;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include "async_logger.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <algorithm>
+#include <time.h>
+
+// The size of each thread's ring of queued log lines.
+static const size_t RING_SIZE = 256 * 1024;
+
+// Longer lines are truncated.
+static const size_t MAX_LINE_LENGTH = 4096;
+
+// How often the flush thread empties the rings.
+static const int FLUSH_INTERVAL_MS = 10;
+
+static const char* LEVEL_NAMES[] = {"Error", "Warning", "Status", "Info", "Verbose", "Debug"};
+
+static uint64_t monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Copy data in and out of a ring, wrapping round the end of the buffer.
+static void copy_in(char* buffer, size_t position, const void* data, size_t length)
+{
+  size_t offset = position % RING_SIZE;
+  size_t first = std::min(length, RING_SIZE - offset);
+  memcpy(buffer + offset, data, first);
+  memcpy(buffer, (const char*)data + first, length - first);
+}
+
+static void copy_out(const char* buffer, size_t position, void* data, size_t length)
+{
+  size_t offset = position % RING_SIZE;
+  size_t first = std::min(length, RING_SIZE - offset);
+  memcpy(data, buffer + offset, first);
+  memcpy((char*)data + first, buffer, length - first);
+}
+
+/*****************************************************************************/
+/* LogRateLimiter                                                            */
+/*****************************************************************************/
+
+LogRateLimiter::LogRateLimiter(uint64_t interval_ms) :
+  _interval_ms(interval_ms),
+  _next_ms(0),
+  _suppressed(0)
+{
+}
+
+bool LogRateLimiter::allow(uint64_t& suppressed)
+{
+  uint64_t now = monotonic_time_ms();
+  uint64_t next = _next_ms.load(std::memory_order_relaxed);
+  if ((now >= next) &&
+      (_next_ms.compare_exchange_strong(next, now + _interval_ms)))
+  {
+    suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  _suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+/*****************************************************************************/
+/* AsyncLogger                                                               */
+/*****************************************************************************/
+
+std::atomic<AsyncLogger*> AsyncLogger::_instance(NULL);
+std::atomic<uint64_t> AsyncLogger::_next_generation(1);
+__thread AsyncLogger::Ring* AsyncLogger::_thread_ring = NULL;
+__thread uint64_t AsyncLogger::_thread_generation = 0;
+
+AsyncLogger::Ring::Ring() :
+  buffer(new char[RING_SIZE]),
+  head(0),
+  tail(0),
+  dropped(0),
+  released(false)
+{
+}
+
+AsyncLogger::Ring::~Ring()
+{
+  delete[] buffer;
+}
+
+AsyncLogger::AsyncLogger(Logger* logger) :
+  _logger(logger),
+  _rings(),
+  _line(MAX_LINE_LENGTH + 1),
+  _generation(_next_generation++),
+  _terminated(false)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_key_create(&_ring_key, AsyncLogger::release_ring);
+  _cond = new CondVar(&_mutex);
+
+  int thread_rc = pthread_create(&_flush_thread,
+                                 NULL,
+                                 AsyncLogger::flush_thread_entry_point,
+                                 (void*)this);
+  if (thread_rc != 0)
+  {
+    // Without the thread lines are still written whenever flush() is called,
+    // but there's nowhere to report this.
+    _terminated = true;
+  }
+
+  _instance.store(this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  AsyncLogger* self = this;
+  _instance.compare_exchange_strong(self, NULL);
+
+  pthread_mutex_lock(&_mutex);
+  bool running = !_terminated;
+  _terminated = true;
+  _cond->signal();
+  pthread_mutex_unlock(&_mutex);
+
+  if (running)
+  {
+    pthread_join(_flush_thread, NULL);
+  }
+
+  flush();
+
+  // Threads that exit from now on don't touch their rings.
+  pthread_key_delete(_ring_key);
+
+  for (auto it = _rings.begin(); it != _rings.end(); it++)
+  {
+    delete *it;
+  }
+
+  delete _cond;
+  pthread_mutex_destroy(&_mutex);
+  delete _logger;
+}
+
+void AsyncLogger::write(const char* data)
+{
+  enqueue(data, strlen(data));
+}
+
+void AsyncLogger::set_logger(Logger* logger)
+{
+  pthread_mutex_lock(&_mutex);
+  flush_rings();
+  delete _logger;
+  _logger = logger;
+  pthread_mutex_unlock(&_mutex);
+}
+
+void AsyncLogger::flush()
+{
+  pthread_mutex_lock(&_mutex);
+  flush_rings();
+  pthread_mutex_unlock(&_mutex);
+}
+
+void AsyncLogger::flush_on_crash()
+{
+  AsyncLogger* logger = _instance.load();
+  if ((logger != NULL) && (pthread_mutex_trylock(&logger->_mutex) == 0))
+  {
+    logger->flush_rings();
+    pthread_mutex_unlock(&logger->_mutex);
+  }
+}
+
+// Lines are laid out as they are by Log::write, so they look the same in the
+// log file whichever way they were logged.
+void AsyncLogger::log(int level, const char* module, int line_number, const char* fmt, ...)
+{
+  char line[MAX_LINE_LENGTH + 1];
+  const char* file = strrchr(module, '/');
+  file = (file != NULL) ? file + 1 : module;
+
+  int prefix = snprintf(line, sizeof(line), "%s %s:%d: ", LEVEL_NAMES[level], file, line_number);
+  prefix = std::min(std::max(prefix, 0), (int)MAX_LINE_LENGTH - 1);
+
+  va_list args;
+  va_start(args, fmt);
+  int message = vsnprintf(line + prefix, MAX_LINE_LENGTH - prefix, fmt, args);
+  va_end(args);
+  size_t length = prefix + std::min(std::max(message, 0), (int)MAX_LINE_LENGTH - prefix - 1);
+  line[length++] = '\n';
+
+  AsyncLogger* logger = _instance.load(std::memory_order_acquire);
+  if (logger != NULL)
+  {
+    logger->enqueue(line, length);
+  }
+  else
+  {
+    Log::write(level, module, line_number, "%.*s", (int)(length - prefix - 1), line + prefix);
+  }
+}
+
+void* AsyncLogger::flush_thread_entry_point(void* arg)
+{
+  AsyncLogger* logger = (AsyncLogger*)arg;
+  logger->run();
+  return NULL;
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Add a line to the calling thread's ring, or drop it if the ring is full.
+// Each line is queued as its length followed by its contents.
+void AsyncLogger::enqueue(const char* data, size_t length)
+{
+  Ring* ring = thread_ring();
+  uint32_t length32 = std::min(length, MAX_LINE_LENGTH);
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  size_t tail = ring->tail.load(std::memory_order_acquire);
+  if (head - tail + sizeof(length32) + length32 > RING_SIZE)
+  {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  copy_in(ring->buffer, head, &length32, sizeof(length32));
+  copy_in(ring->buffer, head + sizeof(length32), data, length32);
+  ring->head.store(head + sizeof(length32) + length32, std::memory_order_release);
+}
+
+// Get the calling thread's ring, creating it the first time the thread logs.
+// The ring is kept until the thread exits (see release_ring) or the
+// AsyncLogger is destroyed.
+AsyncLogger::Ring* AsyncLogger::thread_ring()
+{
+  if (_thread_generation != _generation)
+  {
+    Ring* ring = new Ring();
+    pthread_mutex_lock(&_mutex);
+    _rings.push_back(ring);
+    pthread_mutex_unlock(&_mutex);
+    pthread_setspecific(_ring_key, ring);
+    _thread_ring = ring;
+    _thread_generation = _generation;
+  }
+  return _thread_ring;
+}
+
+// Called as a thread that has logged exits.  The ring may still have lines
+// queued on it, so it's left for the background thread to free once it's
+// empty.  If the thread logs again while exiting, it gets a new ring.
+void AsyncLogger::release_ring(void* arg)
+{
+  Ring* ring = (Ring*)arg;
+  _thread_ring = NULL;
+  _thread_generation = 0;
+  ring->released.store(true, std::memory_order_release);
+}
+
+void AsyncLogger::run()
+{
+  pthread_mutex_lock(&_mutex);
+  while (!_terminated)
+  {
+    flush_rings();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    _cond->timedwait(&ts);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Write out the lines queued on every ring, and free the rings of threads that
+// have exited once they're empty.  Must be called with the mutex held.
+void AsyncLogger::flush_rings()
+{
+  for (size_t ii = 0; ii < _rings.size(); )
+  {
+    Ring* ring = _rings[ii];
+
+    // Check whether the thread has exited before reading how much it has
+    // queued, so nothing it queued is missed.
+    bool released = ring->released.load(std::memory_order_acquire);
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t head = ring->head.load(std::memory_order_acquire);
+    while (tail != head)
+    {
+      uint32_t length;
+      copy_out(ring->buffer, tail, &length, sizeof(length));
+      copy_out(ring->buffer, tail + sizeof(length), &_line[0], length);
+      _line[length] = '\0';
+      tail += sizeof(length) + length;
+      _logger->write(&_line[0]);
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+    {
+      snprintf(&_line[0], _line.size(),
+               "Warning async_logger.cpp: Dropped %lu log lines as the log file couldn't keep up\n",
+               dropped);
+      _logger->write(&_line[0]);
+    }
+
+    if (released)
+    {
+      delete ring;
+      _rings[ii] = _rings.back();
+      _rings.pop_back();
+    }
+    else
+    {
+      ii++;
+    }
+  }
+}
@@ -0,0 +1,107 @@
+#include "callback.h"
+
+#include <cctype>
+#include <stdint.h>
+
+// The response may be either:
+// {
+//     "cancel": true
+// }
+// or:
+// {
+//     "timing": {
+//         "interval": <seconds>,
+//         "repeat-for": <seconds>
+//     }
+// }
+// where "repeat-for" defaults to the interval (so the timer pops once more).
+// The interval must be non-zero (or the timer would pop continuously), and
+// both must fit in a uint32_t once converted to milliseconds.
+bool CallbackRequest::parse_response(const rapidjson::Value& response)
+{
+  if (!response.IsObject())
+  {
+    return false;
+  }
+
+  if ((response.HasMember("cancel")) &&
+      (response["cancel"].IsBool()) &&
+      (response["cancel"].GetBool()))
+  {
+    cancel = true;
+    return true;
+  }
+
+  if ((!response.HasMember("timing")) ||
+      (!response["timing"].IsObject()))
+  {
+    return false;
+  }
+
+  const rapidjson::Value& timing = response["timing"];
+  if ((!timing.HasMember("interval")) ||
+      (!timing["interval"].IsUint()) ||
+      (timing["interval"].GetUint() == 0) ||
+      (timing["interval"].GetUint() > UINT32_MAX / 1000))
+  {
+    return false;
+  }
+  uint32_t new_interval = timing["interval"].GetUint() * 1000;
+  uint32_t new_repeat_for = new_interval;
+
+  if (timing.HasMember("repeat-for"))
+  {
+    if ((!timing["repeat-for"].IsUint()) ||
+        (timing["repeat-for"].GetUint() > UINT32_MAX / 1000))
+    {
+      return false;
+    }
+    new_repeat_for = timing["repeat-for"].GetUint() * 1000;
+  }
+
+  interval = new_interval;
+  repeat_for = new_repeat_for;
+  reschedule = true;
+  return true;
+}
+
+bool CallbackRequest::parse_response(const char* data, size_t length)
+{
+  // Skip the parse for the common case of a response that isn't JSON.
+  size_t start = 0;
+  while ((start < length) && (isspace(data[start])))
+  {
+    start++;
+  }
+  if ((start == length) || (data[start] != '{'))
+  {
+    return false;
+  }
+
+  std::string json(data + start, length - start);
+  rapidjson::Document doc;
+  doc.Parse<0>(json.c_str());
+  return ((!doc.HasParseError()) && (parse_response(doc)));
+}
+
+void Callback::perform_all(std::vector<CallbackRequest>& requests,
+                           uint64_t start_deadline_us)
+{
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    uint64_t now = CallbackRequest::now_us();
+    if ((start_deadline_us != 0) &&
+        (now > start_deadline_us) &&
+        (it != requests.begin()))
+    {
+      it->deferred = true;
+      continue;
+    }
+
+    it->started_us = now;
+    it->success = perform(it->timer->callback_url,
+                          it->timer->callback_body,
+                          it->timer->sequence_number);
+    it->completed_us = CallbackRequest::now_us();
+  }
+}
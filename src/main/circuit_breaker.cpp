@@ -0,0 +1,74 @@
+#include "circuit_breaker.h"
+
+CircuitBreaker::CircuitBreaker() :
+  _state(CLOSED),
+  _consecutive_failures(0),
+  _open_until_ms(0),
+  _failure_threshold(0),
+  _reset_ms(0)
+{
+}
+
+CircuitBreaker::~CircuitBreaker()
+{
+}
+
+void CircuitBreaker::configure(int failure_threshold, int reset_ms)
+{
+  _failure_threshold = failure_threshold;
+  _reset_ms = reset_ms;
+
+  if (_failure_threshold <= 0)
+  {
+    // The breaker has been disabled, so let everything through.
+    _state = CLOSED;
+    _consecutive_failures = 0;
+  }
+}
+
+bool CircuitBreaker::allow(uint64_t now_ms)
+{
+  switch (_state)
+  {
+  case CLOSED:
+    return true;
+
+  case OPEN:
+    if (now_ms < _open_until_ms)
+    {
+      return false;
+    }
+
+    // The reset period has passed, let a single probe through.
+    _state = HALF_OPEN;
+    return true;
+
+  case HALF_OPEN:
+  default:
+    // Wait for the outcome of the probe.
+    return false;
+  }
+}
+
+void CircuitBreaker::success()
+{
+  _state = CLOSED;
+  _consecutive_failures = 0;
+}
+
+void CircuitBreaker::failure(uint64_t now_ms)
+{
+  if (_failure_threshold <= 0)
+  {
+    return;
+  }
+
+  _consecutive_failures++;
+
+  if ((_state == HALF_OPEN) ||
+      ((_state == CLOSED) && (_consecutive_failures >= _failure_threshold)))
+  {
+    _state = OPEN;
+    _open_until_ms = now_ms + _reset_ms;
+  }
+}
@@ -1,11 +1,15 @@
 #include "controller.h"
 #include "timer.h"
+#include "replication_codec.h"
 #include "globals.h"
+#include "statistics.h"
 #include "log.h"
+#include "async_logger.h"
 
 #include "murmur/MurmurHash3.h"
 
 #include <boost/regex.hpp>
+#include <cstring>
 
 Controller::Controller(Replicator* replicator,
                        TimerHandler* handler) :
@@ -25,6 +29,7 @@ void Controller::handle_request(struct evhttp_request* req)
   // /timers
   // /timers/
   // /timers/<timerid>
+  // /timers/batch
   const char *uri = evhttp_request_get_uri(req);
   struct evhttp_uri* decoded = evhttp_uri_parse(uri);
   if (!decoded)
@@ -56,19 +61,30 @@ void Controller::handle_request(struct evhttp_request* req)
   evhttp_uri_free(decoded);
   decoded = NULL;
 
-  LOG_DEBUG("Request: %s", path.c_str());
+  ASYNC_LOG_DEBUG("Request: %s", path.c_str());
 
   // Also need to check the user has supplied a valid method:
   //
   //  * POST to the collection
   //  * PUT to a specific ID
   //  * DELETE to a specific ID
+  //  * PUT to the batch of replicated timers
   evhttp_cmd_type method = evhttp_request_get_command(req);
 
   boost::smatch matches;
   TimerID timer_id;
   uint64_t replica_hash = 0;
-  if ((path == "/timers") || (path == "/timers/"))
+  if (path == "/timers/batch")
+  {
+    if (method != EVHTTP_REQ_PUT)
+    {
+      send_error(req, HTTP_BADMETHOD, NULL);
+      return;
+    }
+    handle_batch(req);
+    return;
+  }
+  else if ((path == "/timers") || (path == "/timers/"))
   {
     if (method != EVHTTP_REQ_POST)
     {
@@ -109,7 +125,7 @@ void Controller::handle_request(struct evhttp_request* req)
   {
     std::string body = get_req_body(req);
     std::string error_str;
-    timer = Timer::from_json(timer_id, replica_hash, body, error_str, replicated_timer);
+    timer = Timer::from_json(timer_id, replica_hash, std::move(body), error_str, replicated_timer);
     if (!timer)
     {
       send_error(req, HTTP_BADREQUEST, error_str.c_str());
@@ -117,8 +133,8 @@ void Controller::handle_request(struct evhttp_request* req)
     }
   }
 
-  LOG_DEBUG("Accepted timer definition, timer is%s a replica",
-            replicated_timer ? "" : " not");
+  ASYNC_LOG_DEBUG("Accepted timer definition, timer is%s a replica",
+                  replicated_timer ? "" : " not");
 
   // Now we have a valid timer object, reply to the HTTP request.
   evhttp_add_header(evhttp_request_get_output_headers(req),
@@ -155,30 +171,98 @@ void Controller::controller_ping_cb(struct evhttp_request* req, void* controller
   evhttp_send_reply(req, 200, "OK", NULL);
 }
 
+void Controller::controller_statistics_cb(struct evhttp_request* req, void* controller)
+{
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET)
+  {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  std::string body = __statistics->to_json();
+  struct evbuffer* evbuf = evbuffer_new();
+  evbuffer_add(evbuf, body.data(), body.length());
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/json");
+  evhttp_send_reply(req, 200, "OK", evbuf);
+  evbuffer_free(evbuf);
+}
+
 /*****************************************************************************/
 /* PRIVATE FUNCTIONS                                                         */
 /*****************************************************************************/
 
+// Handle a batch of timers replicated from another node.  The timers are
+// stored (or turned into tombstones) just as if they'd been replicated one at a
+// time, but are handed to the timer handler together.
+void Controller::handle_batch(struct evhttp_request* req)
+{
+  // Other nodes send batches in the binary replication format, but older
+  // nodes may send them as JSON.
+  const char* content_type = evhttp_find_header(evhttp_request_get_input_headers(req),
+                                                "Content-Type");
+  std::vector<Timer*> timers;
+  std::string error_str;
+  bool valid;
+
+  if ((content_type != NULL) &&
+      (strcmp(content_type, ReplicationCodec::CONTENT_TYPE) == 0))
+  {
+    std::string body = get_req_body(req);
+    valid = ReplicationCodec::decode(body.data(), body.length(), timers, error_str);
+  }
+  else if ((content_type != NULL) &&
+           (strncmp(content_type, "application/vnd.chronos", 23) == 0))
+  {
+    // A later version of the binary format.
+    send_error(req, 415, "Unsupported replication format");
+    return;
+  }
+  else
+  {
+    valid = Timer::from_batch_json(get_req_body(req), timers, error_str);
+  }
+
+  if (!valid)
+  {
+    send_error(req, HTTP_BADREQUEST, error_str.c_str());
+    return;
+  }
+
+  ASYNC_LOG_DEBUG("Accepted batch of %lu replicated timers", timers.size());
+  evhttp_send_reply(req, 200, "OK", NULL);
+
+  std::string localhost;
+  __globals->get_cluster_local_ip(localhost);
+
+  for (auto it = timers.begin(); it != timers.end(); it++)
+  {
+    if (!(*it)->is_local(localhost))
+    {
+      (*it)->become_tombstone();
+    }
+  }
+
+  _handler->add_timers(timers);
+}
+
 void Controller::send_error(struct evhttp_request* req, int error, const char* reason)
 {
   LOG_ERROR("Rejecting request with %d %s", error, reason);
   evhttp_send_error(req, error, reason);
 }
 
+// Take the request body out of the request in one go.  This is the only copy
+// made of a timer's opaque data, which is parsed out of the body in place.
 std::string Controller::get_req_body(struct evhttp_request* req)
 {
-  struct evbuffer* evbuf;
-  std::string rc;
-  evbuf = evhttp_request_get_input_buffer(req);
-  while (evbuffer_get_length(evbuf))
-  {
-    int nbytes;
-    char* buf[1024];
-    nbytes = evbuffer_remove(evbuf, buf, sizeof(buf));
-    if (nbytes > 0)
-    {
-      rc.append((const char*)buf, (size_t)nbytes);
-    }
+  struct evbuffer* evbuf = evhttp_request_get_input_buffer(req);
+  size_t length = evbuffer_get_length(evbuf);
+  std::string rc(length, '\0');
+  if (length > 0)
+  {
+    int nbytes = evbuffer_remove(evbuf, &rc[0], length);
+    rc.resize((nbytes > 0) ? nbytes : 0);
   }
   return rc;
 }
@@ -0,0 +1,226 @@
+#include "epoll_engine.h"
+#include "statistics.h"
+#include "log.h"
+
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// The number and size of the buffers for received data.  If these run out
+// during a call to `wait()`, the remaining sockets are read on the next call.
+static const size_t NUM_BUFFERS = 64;
+static const size_t BUFFER_SIZE = 16 * 1024;
+
+// The most events to pick up from epoll at once.
+static const int MAX_EVENTS = 64;
+
+EpollEngine::EpollEngine() :
+  _epoll_fd(-1),
+  _sockets(),
+  _queued_sends(),
+  _buffers(NUM_BUFFERS * BUFFER_SIZE),
+  _buffers_used(0)
+{
+}
+
+EpollEngine::~EpollEngine()
+{
+  if (_epoll_fd >= 0)
+  {
+    ::close(_epoll_fd);
+  }
+}
+
+bool EpollEngine::init()
+{
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd < 0)
+  {
+    LOG_ERROR("Failed to create epoll instance: %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void EpollEngine::send(int fd, const struct iovec* iov, int iovcnt, void* context)
+{
+  Socket& socket = _sockets[fd];
+  socket.send_context = context;
+  socket.send_iov = iov;
+  socket.send_iovcnt = iovcnt;
+  socket.sending = true;
+  _queued_sends.push_back(fd);
+}
+
+void EpollEngine::receive(int fd, void* context)
+{
+  Socket& socket = _sockets[fd];
+  socket.receive_context = context;
+  socket.receiving = true;
+  update(fd, socket);
+}
+
+void EpollEngine::cancel(int fd)
+{
+  auto it = _sockets.find(fd);
+  if (it == _sockets.end())
+  {
+    return;
+  }
+
+  if (it->second.events != 0)
+  {
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  _sockets.erase(it);
+}
+
+// Attempt the queued sends straight away, then pick up whatever the sockets
+// are ready for.  The buffers handed out by the previous call are reused.
+void EpollEngine::wait(std::vector<Completion>& completions, int timeout_ms)
+{
+  _buffers_used = 0;
+  size_t initial = completions.size();
+
+  for (auto it = _queued_sends.begin(); it != _queued_sends.end(); it++)
+  {
+    auto socket = _sockets.find(*it);
+    if ((socket != _sockets.end()) &&
+        (socket->second.sending) &&
+        (!try_send(*it, socket->second, completions)))
+    {
+      update(*it, socket->second);
+    }
+  }
+  _queued_sends.clear();
+
+  struct epoll_event events[MAX_EVENTS];
+  int num_events = epoll_wait(_epoll_fd,
+                              events,
+                              MAX_EVENTS,
+                              (completions.size() > initial) ? 0 : timeout_ms);
+  __statistics->increment(Statistics::CALLBACK_IO_SYSCALLS);
+  if ((num_events < 0) && (errno != EINTR))
+  {
+    LOG_ERROR("Failed to wait for socket events: %s", strerror(errno));
+  }
+
+  for (int ii = 0; ii < num_events; ii++)
+  {
+    int fd = events[ii].data.fd;
+    auto it = _sockets.find(fd);
+    if (it == _sockets.end())
+    {
+      continue;
+    }
+
+    Socket& socket = it->second;
+    if ((socket.sending) &&
+        (events[ii].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+        (try_send(fd, socket, completions)))
+    {
+      update(fd, socket);
+    }
+
+    if ((socket.receiving) &&
+        (events[ii].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+    {
+      try_receive(fd, socket, completions);
+    }
+  }
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Attempt the pending send on a socket.  Returns true if the send completed
+// (successfully or not), or false if the socket isn't ready for it yet.
+bool EpollEngine::try_send(int fd, Socket& socket, std::vector<Completion>& completions)
+{
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*)socket.send_iov;
+  msg.msg_iovlen = socket.send_iovcnt;
+  ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  __statistics->increment(Statistics::CALLBACK_IO_SYSCALLS);
+  if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+  {
+    return false;
+  }
+
+  Completion completion = {socket.send_context, true, (rc < 0) ? -errno : rc, NULL};
+  completions.push_back(completion);
+  socket.sending = false;
+  socket.send_iov = NULL;
+  return true;
+}
+
+// Read what's available on a socket into the next free buffer.  Once the
+// socket has closed or failed, it is no longer read.
+void EpollEngine::try_receive(int fd, Socket& socket, std::vector<Completion>& completions)
+{
+  if (_buffers_used == NUM_BUFFERS)
+  {
+    // Out of buffers - the socket is still readable so will be picked up on
+    // the next call.
+    return;
+  }
+
+  char* buffer = &_buffers[_buffers_used * BUFFER_SIZE];
+  ssize_t rc = recv(fd, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+  __statistics->increment(Statistics::CALLBACK_IO_SYSCALLS);
+  if ((rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+  {
+    return;
+  }
+
+  Completion completion = {socket.receive_context, false, (rc < 0) ? -errno : rc, NULL};
+  if (rc > 0)
+  {
+    completion.data = buffer;
+    _buffers_used++;
+  }
+  else
+  {
+    socket.receiving = false;
+    update(fd, socket);
+  }
+  completions.push_back(completion);
+}
+
+// Register the events we're now interested in on a socket with epoll.
+void EpollEngine::update(int fd, Socket& socket)
+{
+  uint32_t events = 0;
+  if (socket.receiving)
+  {
+    events |= EPOLLIN;
+  }
+  if (socket.sending)
+  {
+    events |= EPOLLOUT;
+  }
+
+  if (events == socket.events)
+  {
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+
+  int op = (socket.events == 0) ? EPOLL_CTL_ADD :
+           (events == 0) ? EPOLL_CTL_DEL :
+           EPOLL_CTL_MOD;
+  if (epoll_ctl(_epoll_fd, op, fd, &event) != 0)
+  {
+    LOG_ERROR("Failed to update epoll registration for socket %d: %s", fd, strerror(errno));
+  }
+  __statistics->increment(Statistics::CALLBACK_IO_SYSCALLS);
+  socket.events = events;
+}
@@ -0,0 +1,99 @@
+#include "function_callback.h"
+#include "log.h"
+#include "async_logger.h"
+
+FunctionCallback::FunctionCallback() :
+  _functions()
+{
+  pthread_rwlock_init(&_lock, NULL);
+}
+
+FunctionCallback::~FunctionCallback()
+{
+  pthread_rwlock_destroy(&_lock);
+}
+
+// Call the named function for a single pop.  The function sees a timer ID of
+// zero.
+bool FunctionCallback::perform(std::string name, const SharedBuffer& opaque, unsigned int sequence_number)
+{
+  return call(name, 0, sequence_number, opaque);
+}
+
+// Call the functions for a batch of pops in turn, skipping any that haven't
+// started by the deadline (except the first).
+void FunctionCallback::perform_all(std::vector<CallbackRequest>& requests,
+                                   uint64_t start_deadline_us)
+{
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    uint64_t now = CallbackRequest::now_us();
+    if ((start_deadline_us != 0) &&
+        (now > start_deadline_us) &&
+        (it != requests.begin()))
+    {
+      it->deferred = true;
+      continue;
+    }
+
+    Timer* timer = it->timer;
+    it->started_us = now;
+    it->success = call(timer->callback_url,
+                       timer->id,
+                       timer->sequence_number,
+                       timer->callback_body);
+    it->completed_us = CallbackRequest::now_us();
+  }
+}
+
+void FunctionCallback::register_function(const std::string& name, Function function)
+{
+  pthread_rwlock_wrlock(&_lock);
+  _functions[name] = function;
+  pthread_rwlock_unlock(&_lock);
+}
+
+void FunctionCallback::unregister_function(const std::string& name)
+{
+  pthread_rwlock_wrlock(&_lock);
+  _functions.erase(name);
+  pthread_rwlock_unlock(&_lock);
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Call a function by name.  The function is copied out from under the lock, so
+// that it can (un)register functions itself.  A missing function, or one that
+// throws, counts as a failed callback.
+bool FunctionCallback::call(const std::string& name,
+                            TimerID id,
+                            uint32_t sequence_number,
+                            const SharedBuffer& opaque)
+{
+  Function function;
+  pthread_rwlock_rdlock(&_lock);
+  auto it = _functions.find(name);
+  if (it != _functions.end())
+  {
+    function = it->second;
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  if (!function)
+  {
+    ASYNC_LOG_WARNING_RATE_LIMITED("No function registered for timer callback %s", name.c_str());
+    return false;
+  }
+
+  try
+  {
+    return function(id, sequence_number, opaque);
+  }
+  catch (...)
+  {
+    ASYNC_LOG_WARNING_RATE_LIMITED("Timer callback function %s threw an exception", name.c_str());
+    return false;
+  }
+}
@@ -12,7 +12,9 @@ namespace po = boost::program_options;
 // terminated before main() returns.
 Globals* __globals;
 
-Globals::Globals()
+Globals::Globals(bool manage_logging) :
+  _manage_logging(manage_logging),
+  _logger(NULL)
 {
   pthread_rwlock_init(&_lock, NULL);
   
@@ -22,6 +24,27 @@ Globals::Globals()
     ("http.bind-port", po::value<int>()->default_value(7253), "Port to bind the HTTP server to")
     ("cluster.localhost", po::value<std::string>()->default_value("localhost"), "The address of the local host")
     ("cluster.node", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(1, "localhost"), "HOST"), "The addresses of a node in the cluster")
+    ("callback.max-requests-per-host", po::value<int>()->default_value(16), "Maximum number of callback requests in flight to a single host")
+    ("callback.connection-pool-size", po::value<int>()->default_value(256), "Maximum number of idle callback connections to keep open")
+    ("callback.http2-host", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(), ""), "A callback host (HOST:PORT) to send HTTP/2 callbacks to using prior knowledge")
+    ("callback.http2-upgrade-host", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(), ""), "A callback host (HOST:PORT) to send HTTP/2 callbacks to after an h2c upgrade")
+    ("callback.http2-max-streams-per-host", po::value<int>()->default_value(100), "Maximum number of HTTP/2 callback requests in flight to a single host")
+    ("callback.timeout-ms", po::value<int>()->default_value(2000), "Time allowed for a callback to complete before it is treated as failed")
+    ("callback.max-retries", po::value<int>()->default_value(2), "Number of times to retry a failed callback before giving up on the timer")
+    ("callback.retry-backoff-ms", po::value<int>()->default_value(250), "Delay before the first retry of a failed callback, doubling for each further retry")
+    ("callback.circuit-breaker-failures", po::value<int>()->default_value(5), "Consecutive failures after which callbacks to a host are paused (0 to disable)")
+    ("callback.circuit-breaker-reset-ms", po::value<int>()->default_value(5000), "Time to pause callbacks to a failing host before probing it again")
+    ("callback.tcp-io-engine", po::value<std::string>()->default_value("auto"), "I/O engine for TCP callbacks: io_uring, epoll or auto (io_uring if the kernel supports it, otherwise epoll)")
+    ("pop.max-slice-size", po::value<int>()->default_value(1000), "Maximum number of timers to pop at once before checking for new timers")
+    ("pop.slice-budget-us", po::value<int>()->default_value(50000), "Time allowed for starting the callbacks in a slice of popped timers before checking for new timers (0 for no limit)")
+    ("pop.lookahead-ms", po::value<int>()->default_value(20), "How far ahead to look for timers about to pop, so their callbacks can be prepared in advance (0 to disable)")
+    ("replication.batch-size", po::value<int>()->default_value(100), "Maximum number of timers to replicate to a node in one request (1 to disable batching)")
+    ("replication.batch-window-ms", po::value<int>()->default_value(2), "Time to wait for more timers to replicate to a node before sending a batch")
+    ("replication.connections-per-node", po::value<int>()->default_value(4), "Number of kept-alive connections to each node to send replication requests over")
+    ("replication.max-queued-per-node", po::value<int>()->default_value(10000), "Maximum number of timers waiting to be replicated to a node before older ones are coalesced or dropped")
+    ("replication.stagger-floor-ms", po::value<int>()->default_value(200), "Least time each replica of a timer waits after the one before it before popping the timer")
+    ("replication.stagger-margin-ms", po::value<int>()->default_value(50), "Margin added to the measured callback and replication latency when working out how long each replica of a timer waits after the one before it")
+    ("replication.stagger-max-ms", po::value<int>()->default_value(2000), "Most time each replica of a timer waits after the one before it before popping the timer (and the wait used until latency has been measured)")
     ("logging.folder", po::value<std::string>()->default_value("/var/log/chronos"), "Location to output logs to")
     ("logging.level", po::value<int>()->default_value(2), "Logging level: 1(lowest) - 5(highest)")
     ;
@@ -36,6 +59,10 @@ Globals::~Globals()
 #ifndef UNITTEST
   delete _updater;
 #endif
+  if (_logger != NULL)
+  {
+    _logger->flush();
+  }
   pthread_rwlock_destroy(&_lock);
 }
 
@@ -51,9 +78,23 @@ void Globals::update_config()
 
   lock();
 
-  // Set up logging early so we can log the other settings
-  Log::setLogger(new Logger(conf_map["logging.folder"].as<std::string>(), "chronos"));
-  Log::setLoggingLevel(conf_map["logging.level"].as<int>());
+  // Set up logging early so we can log the other settings.  The log file is
+  // written from a background thread (see async_logger.h), which carries on
+  // across configuration reloads.
+  if (_manage_logging)
+  {
+    Logger* logger = new Logger(conf_map["logging.folder"].as<std::string>(), "chronos");
+    if (_logger == NULL)
+    {
+      _logger = new AsyncLogger(logger);
+      Log::setLogger(_logger);
+    }
+    else
+    {
+      _logger->set_logger(logger);
+    }
+    Log::setLoggingLevel(conf_map["logging.level"].as<int>());
+  }
 
   std::string bind_address = conf_map["http.bind-address"].as<std::string>();
   set_bind_address(bind_address);
@@ -77,6 +118,82 @@ void Globals::update_config()
     cluster_hashes[*it] = generate_hash(*it);
   }
   set_cluster_hashes(cluster_hashes);
+
+  int callback_max_requests_per_host = conf_map["callback.max-requests-per-host"].as<int>();
+  set_callback_max_requests_per_host(callback_max_requests_per_host);
+  LOG_STATUS("Maximum callback requests per host: %d", callback_max_requests_per_host);
+
+  int callback_connection_pool_size = conf_map["callback.connection-pool-size"].as<int>();
+  set_callback_connection_pool_size(callback_connection_pool_size);
+  LOG_STATUS("Callback connection pool size: %d", callback_connection_pool_size);
+
+  std::vector<std::string> callback_http2_hosts = conf_map["callback.http2-host"].as<std::vector<std::string>>();
+  set_callback_http2_hosts(callback_http2_hosts);
+  std::vector<std::string> callback_http2_upgrade_hosts = conf_map["callback.http2-upgrade-host"].as<std::vector<std::string>>();
+  set_callback_http2_upgrade_hosts(callback_http2_upgrade_hosts);
+  LOG_STATUS("HTTP/2 callback hosts:");
+  for (auto it = callback_http2_hosts.begin(); it != callback_http2_hosts.end(); it++)
+  {
+    LOG_STATUS(" - %s (prior knowledge)", it->c_str());
+  }
+  for (auto it = callback_http2_upgrade_hosts.begin(); it != callback_http2_upgrade_hosts.end(); it++)
+  {
+    LOG_STATUS(" - %s (h2c upgrade)", it->c_str());
+  }
+
+  int callback_http2_max_streams_per_host = conf_map["callback.http2-max-streams-per-host"].as<int>();
+  set_callback_http2_max_streams_per_host(callback_http2_max_streams_per_host);
+  LOG_STATUS("Maximum HTTP/2 callback streams per host: %d", callback_http2_max_streams_per_host);
+
+  int callback_timeout_ms = conf_map["callback.timeout-ms"].as<int>();
+  set_callback_timeout_ms(callback_timeout_ms);
+  LOG_STATUS("Callback timeout: %dms", callback_timeout_ms);
+
+  int callback_max_retries = conf_map["callback.max-retries"].as<int>();
+  set_callback_max_retries(callback_max_retries);
+  int callback_retry_backoff_ms = conf_map["callback.retry-backoff-ms"].as<int>();
+  set_callback_retry_backoff_ms(callback_retry_backoff_ms);
+  LOG_STATUS("Callback retries: %d (initial backoff %dms)", callback_max_retries, callback_retry_backoff_ms);
+
+  int callback_circuit_breaker_failures = conf_map["callback.circuit-breaker-failures"].as<int>();
+  set_callback_circuit_breaker_failures(callback_circuit_breaker_failures);
+  int callback_circuit_breaker_reset_ms = conf_map["callback.circuit-breaker-reset-ms"].as<int>();
+  set_callback_circuit_breaker_reset_ms(callback_circuit_breaker_reset_ms);
+  LOG_STATUS("Callback circuit breaker: %d failures (reset after %dms)", callback_circuit_breaker_failures, callback_circuit_breaker_reset_ms);
+
+  std::string callback_tcp_io_engine = conf_map["callback.tcp-io-engine"].as<std::string>();
+  set_callback_tcp_io_engine(callback_tcp_io_engine);
+  LOG_STATUS("TCP callback I/O engine: %s", callback_tcp_io_engine.c_str());
+
+  int pop_max_slice_size = conf_map["pop.max-slice-size"].as<int>();
+  set_pop_max_slice_size(pop_max_slice_size);
+  int pop_slice_budget_us = conf_map["pop.slice-budget-us"].as<int>();
+  set_pop_slice_budget_us(pop_slice_budget_us);
+  LOG_STATUS("Pop slices: up to %d timers (budget %dus)", pop_max_slice_size, pop_slice_budget_us);
+
+  int pop_lookahead_ms = conf_map["pop.lookahead-ms"].as<int>();
+  set_pop_lookahead_ms(pop_lookahead_ms);
+  LOG_STATUS("Pop look-ahead: %dms", pop_lookahead_ms);
+
+  int replication_batch_size = conf_map["replication.batch-size"].as<int>();
+  set_replication_batch_size(replication_batch_size);
+  int replication_batch_window_ms = conf_map["replication.batch-window-ms"].as<int>();
+  set_replication_batch_window_ms(replication_batch_window_ms);
+  LOG_STATUS("Replication batches: up to %d timers (window %dms)", replication_batch_size, replication_batch_window_ms);
+
+  int replication_connections_per_node = conf_map["replication.connections-per-node"].as<int>();
+  set_replication_connections_per_node(replication_connections_per_node);
+  int replication_max_queued_per_node = conf_map["replication.max-queued-per-node"].as<int>();
+  set_replication_max_queued_per_node(replication_max_queued_per_node);
+  LOG_STATUS("Replication connections: %d per node (up to %d timers queued)", replication_connections_per_node, replication_max_queued_per_node);
+
+  int replication_stagger_floor_ms = conf_map["replication.stagger-floor-ms"].as<int>();
+  set_replication_stagger_floor_ms(replication_stagger_floor_ms);
+  int replication_stagger_margin_ms = conf_map["replication.stagger-margin-ms"].as<int>();
+  set_replication_stagger_margin_ms(replication_stagger_margin_ms);
+  int replication_stagger_max_ms = conf_map["replication.stagger-max-ms"].as<int>();
+  set_replication_stagger_max_ms(replication_stagger_max_ms);
+  LOG_STATUS("Replica stagger: %d-%dms (margin %dms)", replication_stagger_floor_ms, replication_stagger_max_ms, replication_stagger_margin_ms);
   unlock();
 }
 
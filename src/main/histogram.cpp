@@ -0,0 +1,118 @@
+#include "histogram.h"
+
+Histogram::Histogram() :
+  _count(0),
+  _sum(0),
+  _max(0)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ii++)
+  {
+    _buckets[ii] = 0;
+  }
+}
+
+Histogram::~Histogram()
+{
+}
+
+void Histogram::record(uint64_t value)
+{
+  _buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+
+  uint64_t max = _max.load(std::memory_order_relaxed);
+  while ((value > max) &&
+         (!_max.compare_exchange_weak(max, value, std::memory_order_relaxed)))
+  {
+  }
+}
+
+void Histogram::reset()
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ii++)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+  _count.store(0, std::memory_order_relaxed);
+  _sum.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count()
+{
+  return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::max()
+{
+  return _max.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::mean()
+{
+  uint64_t count = _count.load(std::memory_order_relaxed);
+  return (count == 0) ? 0 : _sum.load(std::memory_order_relaxed) / count;
+}
+
+uint64_t Histogram::percentile(double percent)
+{
+  uint64_t count = _count.load(std::memory_order_relaxed);
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  // Find the bucket holding the value at the requested rank (rounding the rank
+  // up, so the 100th percentile is the largest value).
+  uint64_t rank = (uint64_t)((percent / 100.0) * count);
+  if (((double)rank < (percent / 100.0) * count) || (rank == 0))
+  {
+    rank++;
+  }
+
+  uint64_t max = _max.load(std::memory_order_relaxed);
+  uint64_t seen = 0;
+  for (int ii = 0; ii < NUM_BUCKETS; ii++)
+  {
+    seen += _buckets[ii].load(std::memory_order_relaxed);
+    if (seen >= rank)
+    {
+      uint64_t value = bucket_highest_value(ii);
+      return (value < max) ? value : max;
+    }
+  }
+
+  return max;
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Values below SUB_BUCKETS each have their own bucket.  Larger values are
+// shifted down until they fit in [SUB_BUCKETS, 2 * SUB_BUCKETS), and the shift
+// and the remaining bits select the bucket.
+int Histogram::bucket_index(uint64_t value)
+{
+  if (value < (uint64_t)SUB_BUCKETS)
+  {
+    return (int)value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  return (shift * SUB_BUCKETS) + (int)(value >> shift);
+}
+
+uint64_t Histogram::bucket_highest_value(int index)
+{
+  if (index < 2 * SUB_BUCKETS)
+  {
+    return (uint64_t)index;
+  }
+
+  int shift = (index / SUB_BUCKETS) - 1;
+  uint64_t mantissa = (index % SUB_BUCKETS) + SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
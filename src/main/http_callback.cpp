@@ -1,36 +1,1036 @@
 #include "http_callback.h"
+#include "globals.h"
+#include "statistics.h"
+#include "log.h"
+#include "async_logger.h"
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 
 #include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <set>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-HTTPCallback::HTTPCallback()
-{
-  _curl = curl_easy_init();
+// The largest batched callback response we'll accept.
+static const size_t MAX_BATCH_RESPONSE_SIZE = 1024 * 1024;
+
+// The largest response to a single callback we'll look at for new timing (see
+// CallbackRequest::parse_response).  Anything bigger isn't a timing update.
+static const size_t MAX_SINGLE_RESPONSE_SIZE = 4096;
+
+// How long to keep a connection opened in advance before giving up on it being
+// used (a callback server may close an idle connection).
+static const uint64_t WARM_SOCKET_MAX_AGE_MS = 2000;
 
-  curl_easy_setopt(_curl, CURLOPT_POST, 1);
-  curl_easy_setopt(_curl, CURLOPT_VERBOSE, 1);
+// How long a destination can go unused before it's forgotten, and how often we
+// look for such destinations.
+static const uint64_t DESTINATION_MAX_IDLE_MS = 5 * 60 * 1000;
+static const uint64_t EVICTION_INTERVAL_MS = 10 * 1000;
+
+HTTPCallback::HTTPCallback() :
+  _multi(curl_multi_init()),
+  _transfers(),
+  _batched(),
+  _destinations(),
+  _resolver(),
+  _http2_hosts(),
+  _http2_upgrade_hosts(),
+  _max_requests_per_host(1),
+  _max_streams_per_host(1),
+  _timeout_ms(0),
+  _breaker_failures(0),
+  _breaker_reset_ms(0),
+  _outstanding(0),
+  _start_deadline_us(0),
+  _next_eviction_ms(0)
+{
+  // Allow HTTP/2 requests to share connections.  This has no effect on
+  // HTTP/1.1 destinations.
+  curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 }
 
 HTTPCallback::~HTTPCallback()
 {
-  curl_easy_cleanup(_curl);
+  // Closing the multi handle closes its connections, which updates the
+  // destinations' connection counts, so do this first.
+  curl_multi_cleanup(_multi);
+
+  for (auto it = _destinations.begin(); it != _destinations.end(); it++)
+  {
+    for (auto jt = it->second.idle_handles.begin();
+         jt != it->second.idle_handles.end();
+         jt++)
+    {
+      curl_easy_cleanup(*jt);
+    }
+    close_warm_sockets(&it->second, false);
+  }
+  _destinations.clear();
 }
 
 // Perform the callback by sending the supplied body to the callback URL.
 //
 // Also specify the sequence number in the headers to allow duplicate detection/handling.
-bool HTTPCallback::perform(std::string url, std::string body, unsigned int sequence_number)
-{
-  curl_easy_setopt(_curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(_curl, CURLOPT_POSTFIELDS, body.c_str());
-  
-  // Include the sequence number header.
-  struct curl_slist* headers = NULL;
-  headers = curl_slist_append(headers, (std::string("X-Sequence-Number: ") +
-                                        std::to_string(sequence_number)).c_str());
-  headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
-  curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, headers);
-
-  CURLcode curl_rc = curl_easy_perform(_curl);
-  curl_slist_free_all(headers);
-  return (curl_rc == CURLE_OK);
+bool HTTPCallback::perform(std::string url, const SharedBuffer& body, unsigned int sequence_number)
+{
+  bool success = false;
+  std::vector<Transfer> transfers(1);
+  transfers[0].url = &url;
+  transfers[0].body = &body;
+  transfers[0].sequence_number = sequence_number;
+  transfers[0].success = &success;
+
+  _start_deadline_us = 0;
+  run(&transfers[0], 1);
+
+  return success;
+}
+
+// Perform a batch of callbacks in parallel, subject to the per-destination
+// limit on requests in flight.
+//
+// Timers that have opted in to batched callbacks are grouped by callback URL
+// and each group is sent as a single request.
+//
+// Requests still queued on their destination when the deadline passes are
+// deferred rather than started.
+void HTTPCallback::perform_all(std::vector<CallbackRequest>& requests,
+                               uint64_t start_deadline_us)
+{
+  // The transfers and the list of batched callbacks are kept from one call
+  // to the next, so that their memory is reused.
+  std::vector<CallbackRequest*>& batched = _batched;
+  batched.clear();
+  size_t num_single = 0;
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    if (it->timer->callback_batch)
+    {
+      batched.push_back(&(*it));
+    }
+    else
+    {
+      num_single++;
+    }
+  }
+
+  // Group the batched callbacks by callback URL.
+  std::sort(batched.begin(), batched.end(), batch_order);
+  size_t num_batches = 0;
+  for (size_t jj = 0; jj < batched.size(); jj++)
+  {
+    if ((jj == 0) ||
+        (batched[jj]->timer->callback_url != batched[jj - 1]->timer->callback_url))
+    {
+      num_batches++;
+    }
+  }
+
+  size_t num_transfers = num_single + num_batches;
+  if (_transfers.size() < num_transfers)
+  {
+    _transfers.resize(num_transfers);
+  }
+
+  size_t ii = 0;
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    if (!it->timer->callback_batch)
+    {
+      Timer* timer = it->timer;
+      Transfer& transfer = _transfers[ii++];
+      transfer.url = &timer->callback_url;
+      transfer.body = &timer->callback_body;
+      transfer.sequence_number = timer->sequence_number;
+      transfer.success = &it->success;
+      transfer.request = &(*it);
+      transfer.batch.clear();
+    }
+  }
+
+  for (size_t first = 0; first < batched.size(); )
+  {
+    size_t last = first + 1;
+    while ((last < batched.size()) &&
+           (batched[last]->timer->callback_url == batched[first]->timer->callback_url))
+    {
+      last++;
+    }
+
+    Transfer& transfer = _transfers[ii++];
+    transfer.batch.assign(batched.begin() + first, batched.begin() + last);
+    transfer.batch_body = build_batch_body(transfer.batch);
+    transfer.url = &transfer.batch.front()->timer->callback_url;
+    transfer.body = &transfer.batch_body;
+    transfer.sequence_number = 0;
+    transfer.success = &transfer.batch_success;
+    transfer.request = NULL;
+    first = last;
+  }
+
+  _start_deadline_us = start_deadline_us;
+  run(_transfers.data(), num_transfers);
+
+  for (ii = 0; ii < num_transfers; ii++)
+  {
+    Transfer& transfer = _transfers[ii];
+    if ((!transfer.batch.empty()) && (!transfer.deferred))
+    {
+      handle_batch_response(&transfer);
+    }
+  }
+}
+
+// Open connections to the destinations of timers that are about to pop, so
+// they're ready when the timers' callbacks are sent.  We want as many
+// connections as there will be requests in flight to each HTTP/1.1
+// destination, but HTTP/2 destinations only need one.
+//
+// Destinations whose circuit is open are left alone, as are destinations we
+// already have enough connections to.  Connections opened earlier that haven't
+// been used are closed once they're too old to rely on, whether or not their
+// destination is still coming up.
+void HTTPCallback::prepare(const std::vector<Timer*>& timers)
+{
+  refresh_config();
+  evict_idle_destinations();
+
+  for (auto it = _destinations.begin(); it != _destinations.end(); it++)
+  {
+    close_warm_sockets(&it->second, true);
+  }
+
+  std::map<std::string, int> requests;
+  std::set<std::string> batch_urls;
+  for (auto it = timers.begin(); it != timers.end(); it++)
+  {
+    Timer* timer = *it;
+    if (timer->is_tombstone())
+    {
+      continue;
+    }
+
+    // Batched timers to the same URL share a single request.
+    if ((timer->callback_batch) &&
+        (!batch_urls.insert(timer->callback_url).second))
+    {
+      continue;
+    }
+
+    requests[destination_key(timer->callback_url)]++;
+  }
+
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    Destination* destination = get_destination(it->first);
+    configure(it->first, destination);
+
+    if (destination->breaker.state() != CircuitBreaker::CLOSED)
+    {
+      continue;
+    }
+
+    int wanted = (destination->http_version == CURL_HTTP_VERSION_1_1) ?
+                 std::min(it->second, destination->max_in_flight) : 1;
+    warm(it->first, destination, wanted);
+  }
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Pick up the current limits (these may be changed by a config reload).
+void HTTPCallback::refresh_config()
+{
+  int connection_pool_size;
+  __globals->get_callback_max_requests_per_host(_max_requests_per_host);
+  __globals->get_callback_connection_pool_size(connection_pool_size);
+  __globals->get_callback_http2_hosts(_http2_hosts);
+  __globals->get_callback_http2_upgrade_hosts(_http2_upgrade_hosts);
+  __globals->get_callback_http2_max_streams_per_host(_max_streams_per_host);
+  __globals->get_callback_timeout_ms(_timeout_ms);
+  __globals->get_callback_circuit_breaker_failures(_breaker_failures);
+  __globals->get_callback_circuit_breaker_reset_ms(_breaker_reset_ms);
+  curl_multi_setopt(_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)_max_requests_per_host);
+  curl_multi_setopt(_multi, CURLMOPT_MAXCONNECTS, (long)connection_pool_size);
+#if LIBCURL_VERSION_NUM >= 0x074300
+  curl_multi_setopt(_multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)_max_streams_per_host);
+#endif
+}
+
+// Find the destination with the given key, creating it if need be, and mark it
+// as used.
+HTTPCallback::Destination* HTTPCallback::get_destination(const std::string& key)
+{
+  Destination* destination = &_destinations[key];
+  destination->used_ms = monotonic_time_ms();
+  return destination;
+}
+
+// Forget the destinations that haven't been used for DESTINATION_MAX_IDLE_MS,
+// so that a stream of one-off callback servers doesn't use up memory without
+// limit.  This is only checked every EVICTION_INTERVAL_MS.
+//
+// cURL holds on to the destination for each connection it has open to it (to
+// pass to close_socket), including idle connections kept for reuse, so a
+// destination is only forgotten once all its connections have been closed.
+// cURL closes connections that have been idle for a couple of minutes.
+void HTTPCallback::evict_idle_destinations()
+{
+  uint64_t now_ms = monotonic_time_ms();
+  if (now_ms < _next_eviction_ms)
+  {
+    return;
+  }
+  _next_eviction_ms = now_ms + EVICTION_INTERVAL_MS;
+
+  auto it = _destinations.begin();
+  while (it != _destinations.end())
+  {
+    Destination* destination = &it->second;
+    if ((now_ms > destination->used_ms + DESTINATION_MAX_IDLE_MS) &&
+        (destination->connections == 0) &&
+        (destination->in_flight == 0) &&
+        (destination->pending.empty()))
+    {
+      ASYNC_LOG_DEBUG("Forgetting idle callback destination %s", it->first.c_str());
+      for (auto jt = destination->idle_handles.begin();
+           jt != destination->idle_handles.end();
+           jt++)
+      {
+        curl_easy_cleanup(*jt);
+      }
+      close_warm_sockets(destination, false);
+      _destinations.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+// Drive the multi handle until every one of the given transfers has completed.
+void HTTPCallback::run(Transfer* transfers, size_t count)
+{
+  refresh_config();
+  evict_idle_destinations();
+
+  for (size_t ii = 0; ii < count; ii++)
+  {
+    submit(&transfers[ii]);
+  }
+
+  while (_outstanding > 0)
+  {
+    int running_handles;
+    curl_multi_perform(_multi, &running_handles);
+
+    int outstanding_messages;
+    CURLMsg* msg;
+    while ((msg = curl_multi_info_read(_multi, &outstanding_messages)) != NULL)
+    {
+      if (msg->msg == CURLMSG_DONE)
+      {
+        // Completing the transfer invalidates `msg`, so pull out what we need
+        // first.
+        CURL* curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        msg = NULL;
+        complete(curl, rc);
+      }
+    }
+
+    if (_outstanding > 0)
+    {
+      curl_multi_wait(_multi, NULL, 0, 100, NULL);
+    }
+  }
+}
+
+// Start the transfer if its destination has a free slot, otherwise queue it
+// until one of the requests ahead of it completes.  If the destination's
+// circuit is open, fail the transfer straight away.
+void HTTPCallback::submit(Transfer* transfer)
+{
+  std::string key = destination_key(*transfer->url);
+  Destination* destination = get_destination(key);
+  configure(key, destination);
+  transfer->destination = destination;
+  transfer->curl = NULL;
+  transfer->headers = NULL;
+  transfer->response.clear();
+  transfer->response_truncated = false;
+  transfer->deferred = false;
+  *transfer->success = false;
+
+  if (!destination->breaker.allow(monotonic_time_ms()))
+  {
+    reject(transfer);
+    return;
+  }
+
+  _outstanding++;
+
+  if (destination->in_flight < destination->max_in_flight)
+  {
+    start(transfer);
+  }
+  else
+  {
+    ASYNC_LOG_DEBUG("Queueing callback to %s behind %d requests in flight",
+                    transfer->url->c_str(),
+                    destination->in_flight);
+    destination->pending.push_back(transfer);
+  }
+}
+
+void HTTPCallback::start(Transfer* transfer)
+{
+  Destination* destination = transfer->destination;
+  destination->in_flight++;
+  timestamp(transfer, &CallbackRequest::started_us);
+  transfer->curl = get_handle(destination);
+
+  if (transfer->batch.empty())
+  {
+    // Include the sequence number header.
+    transfer->headers = curl_slist_append(transfer->headers,
+                                          (std::string("X-Sequence-Number: ") +
+                                           std::to_string(transfer->sequence_number)).c_str());
+    transfer->headers = curl_slist_append(transfer->headers,
+                                          "Content-Type: application/octet-stream");
+  }
+  else
+  {
+    // Batched requests carry the sequence numbers in the body.
+    transfer->headers = curl_slist_append(transfer->headers,
+                                          "Content-Type: application/json");
+  }
+
+  // The body is owned by the caller, who is blocked until the transfer
+  // completes, so there's no need for cURL to take a copy.
+  curl_easy_setopt(transfer->curl, CURLOPT_URL, transfer->url->c_str());
+  curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDS, transfer->body->data());
+  curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE, (long)transfer->body->length());
+  curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+  curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer);
+
+  // Enforce the callback deadline.  The clock starts when the request starts,
+  // not when it was queued behind other requests to the same destination.
+  curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS, (long)_timeout_ms);
+
+  // For HTTP/2 destinations, wait for a stream on an existing connection
+  // rather than opening a new connection for every request.
+  curl_easy_setopt(transfer->curl, CURLOPT_HTTP_VERSION, destination->http_version);
+  curl_easy_setopt(transfer->curl, CURLOPT_PIPEWAIT,
+                   (destination->http_version != CURL_HTTP_VERSION_1_1) ? 1L : 0L);
+
+  curl_multi_add_handle(_multi, transfer->curl);
+}
+
+// Handle a completed transfer, returning its handle to the pool and starting
+// the next request queued on the same destination.
+void HTTPCallback::complete(CURL* curl, CURLcode rc)
+{
+  Transfer* transfer = NULL;
+  curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&transfer);
+  curl_multi_remove_handle(_multi, curl);
+  timestamp(transfer, &CallbackRequest::completed_us);
+
+  // A callback only succeeds if the callback server accepts it with a 2xx.
+  long http_rc = 0;
+  if (rc == CURLE_OK)
+  {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    if ((http_rc / 100) != 2)
+    {
+      ASYNC_LOG_DEBUG("Callback to %s was rejected with %ld",
+                      transfer->url->c_str(),
+                      http_rc);
+    }
+  }
+  else
+  {
+    ASYNC_LOG_DEBUG("Callback to %s failed: %s",
+                    transfer->url->c_str(),
+                    curl_easy_strerror(rc));
+
+    if (rc == CURLE_OPERATION_TIMEDOUT)
+    {
+      __statistics->increment(Statistics::CALLBACK_DEADLINE_MISSES);
+    }
+  }
+  *transfer->success = ((http_rc / 100) == 2);
+
+  // A destination that keeps rejecting callbacks is no more use than one that
+  // can't be reached, so any failure counts against it.
+  Destination* destination = transfer->destination;
+  if (*transfer->success)
+  {
+    destination->breaker.success();
+  }
+  else
+  {
+    bool was_open = (destination->breaker.state() != CircuitBreaker::CLOSED);
+    destination->breaker.failure(monotonic_time_ms());
+    if ((!was_open) && (destination->breaker.state() == CircuitBreaker::OPEN))
+    {
+      LOG_WARNING("Callbacks to %s are failing, pausing callbacks for %dms",
+                  transfer->url->c_str(),
+                  _breaker_reset_ms);
+      __statistics->increment(Statistics::CALLBACK_CIRCUIT_OPENS);
+    }
+  }
+
+  // A successful single callback may carry new timing for the timer.
+  if ((*transfer->success) &&
+      (transfer->request != NULL) &&
+      (!transfer->response.empty()))
+  {
+    transfer->request->parse_response(transfer->response.data(),
+                                      transfer->response.length());
+  }
+
+  curl_slist_free_all(transfer->headers);
+  transfer->headers = NULL;
+  transfer->curl = NULL;
+
+  release_handle(destination, curl);
+  destination->in_flight--;
+  _outstanding--;
+
+  if (destination->breaker.state() != CircuitBreaker::CLOSED)
+  {
+    // The circuit has opened, so there's no point trying the requests that
+    // were queued behind this one.
+    while (!destination->pending.empty())
+    {
+      Transfer* next = destination->pending.front();
+      destination->pending.pop_front();
+      _outstanding--;
+      reject(next);
+    }
+  }
+  else if ((_start_deadline_us != 0) &&
+           (CallbackRequest::now_us() > _start_deadline_us))
+  {
+    // We've run out of time to start requests, so leave the rest queued on
+    // this destination for later.
+    while (!destination->pending.empty())
+    {
+      Transfer* next = destination->pending.front();
+      destination->pending.pop_front();
+      _outstanding--;
+      defer(next);
+    }
+  }
+  else if (!destination->pending.empty())
+  {
+    Transfer* next = destination->pending.front();
+    destination->pending.pop_front();
+    start(next);
+  }
+}
+
+// Fail a transfer without attempting it as its destination's circuit is open.
+void HTTPCallback::reject(Transfer* transfer)
+{
+  ASYNC_LOG_DEBUG("Rejecting callback to %s as the circuit is open",
+                  transfer->url->c_str());
+  *transfer->success = false;
+  __statistics->increment(Statistics::CALLBACK_CIRCUIT_REJECTIONS);
+}
+
+CURL* HTTPCallback::get_handle(Destination* destination)
+{
+  CURL* curl;
+  if (!destination->idle_handles.empty())
+  {
+    curl = destination->idle_handles.back();
+    destination->idle_handles.pop_back();
+  }
+  else
+  {
+    curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &HTTPCallback::write_response);
+
+    // Open sockets through the destination, so that it can hand over any
+    // connections opened in advance and keep track of the connections cURL
+    // has open.
+    curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, &HTTPCallback::open_socket);
+    curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, destination);
+    curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, &HTTPCallback::close_socket);
+    curl_easy_setopt(curl, CURLOPT_CLOSESOCKETDATA, destination);
+    curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, &HTTPCallback::configure_socket);
+    curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, destination);
+  }
+
+  return curl;
+}
+
+// Return a handle to the destination's pool.  We never need more idle handles
+// than the number of requests we'll allow in flight, so free any extras.
+void HTTPCallback::release_handle(Destination* destination, CURL* curl)
+{
+  if ((int)destination->idle_handles.size() < destination->max_in_flight)
+  {
+    destination->idle_handles.push_back(curl);
+  }
+  else
+  {
+    curl_easy_cleanup(curl);
+  }
+}
+
+// Pick the HTTP version for a destination, based on whether it's been
+// configured as an HTTP/2 host.  HTTP/2 destinations multiplex their requests
+// over a few connections so can have many more requests in flight.
+void HTTPCallback::configure(const std::string& key, Destination* destination)
+{
+  destination->breaker.configure(_breaker_failures, _breaker_reset_ms);
+
+  // Compare hosts with their ports filled in, so that a URL relying on the
+  // default port matches a host configured with it, and vice versa.
+  std::string host = host_port(key);
+  auto configured = [&host](const std::string& entry)
+  {
+    return (host_port(entry) == host);
+  };
+
+  if (std::find_if(_http2_hosts.begin(), _http2_hosts.end(), configured) != _http2_hosts.end())
+  {
+    destination->http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+    destination->max_in_flight = _max_streams_per_host;
+  }
+  else if (std::find_if(_http2_upgrade_hosts.begin(),
+                        _http2_upgrade_hosts.end(),
+                        configured) != _http2_upgrade_hosts.end())
+  {
+    destination->http_version = CURL_HTTP_VERSION_2_0;
+    destination->max_in_flight = _max_streams_per_host;
+  }
+  else
+  {
+    destination->http_version = CURL_HTTP_VERSION_1_1;
+    destination->max_in_flight = _max_requests_per_host;
+  }
+}
+
+// Open connections to a destination until it has the number wanted, counting
+// both the connections cURL already has open and those opened in advance.
+// The connections are opened asynchronously, and the destination's address
+// comes from the resolver's cache, so this doesn't block on the callback
+// server or on DNS.
+void HTTPCallback::warm(const std::string& key, Destination* destination, int wanted)
+{
+  int needed = wanted - destination->connections - (int)destination->warm_sockets.size();
+  if ((needed <= 0) || (!resolve(key, destination)))
+  {
+    return;
+  }
+
+  uint64_t now_ms = monotonic_time_ms();
+  for (int ii = 0; ii < needed; ii++)
+  {
+    curl_socket_t fd = socket(destination->address.ss_family,
+                              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              IPPROTO_TCP);
+    if (fd == CURL_SOCKET_BAD)
+    {
+      ASYNC_LOG_DEBUG("Failed to open socket to %s: %s", key.c_str(), strerror(errno));
+      return;
+    }
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if ((connect(fd, (struct sockaddr*)&destination->address, destination->address_len) < 0) &&
+        (errno != EINPROGRESS))
+    {
+      ASYNC_LOG_DEBUG("Failed to connect to %s: %s", key.c_str(), strerror(errno));
+      close(fd);
+      return;
+    }
+
+    WarmSocket warm_socket = {fd, now_ms};
+    destination->warm_sockets.push_back(warm_socket);
+    __statistics->increment(Statistics::CALLBACK_CONNECTIONS_WARMED);
+  }
+
+  ASYNC_LOG_DEBUG("Opening %d connections to %s ahead of callbacks", needed, key.c_str());
+}
+
+// Look up the address of a destination.  Returns false if the address isn't
+// known yet (it's looked up in the background, ready for the next time) or
+// the destination can't be resolved, in which case cURL will report the error
+// when the callbacks are sent.
+bool HTTPCallback::resolve(const std::string& key, Destination* destination)
+{
+  std::string host;
+  std::string port;
+  split_host_port(key, host, port);
+
+  struct sockaddr_storage address;
+  socklen_t address_len = 0;
+  if (_resolver.lookup(host, port, &address, &address_len) != Resolver::RESOLVED)
+  {
+    return false;
+  }
+
+  memcpy(&destination->address, &address, address_len);
+  destination->address_len = address_len;
+  return true;
+}
+
+// Close the connections opened in advance to a destination, or just those
+// that are too old to be relied on.
+void HTTPCallback::close_warm_sockets(Destination* destination, bool stale_only)
+{
+  uint64_t now_ms = monotonic_time_ms();
+  auto it = destination->warm_sockets.begin();
+  while (it != destination->warm_sockets.end())
+  {
+    if ((!stale_only) || (now_ms > it->opened_ms + WARM_SOCKET_MAX_AGE_MS))
+    {
+      close(it->fd);
+      it = destination->warm_sockets.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+// cURL open socket function.  If a connection to the address cURL wants has
+// already been opened (and is still healthy), hand that over, otherwise open
+// a socket as cURL would.
+curl_socket_t HTTPCallback::open_socket(void* clientp,
+                                        curlsocktype purpose,
+                                        struct curl_sockaddr* address)
+{
+  Destination* destination = (Destination*)clientp;
+  curl_socket_t fd = CURL_SOCKET_BAD;
+
+  if ((purpose == CURLSOCKTYPE_IPCXN) &&
+      (address->addrlen == destination->address_len) &&
+      (memcmp(&address->addr, &destination->address, address->addrlen) == 0))
+  {
+    while ((fd == CURL_SOCKET_BAD) && (!destination->warm_sockets.empty()))
+    {
+      curl_socket_t candidate = destination->warm_sockets.front().fd;
+      destination->warm_sockets.erase(destination->warm_sockets.begin());
+
+      // The connection must have been established, and the server mustn't
+      // have sent anything or closed it since.
+      struct pollfd pfd = {candidate, POLLIN | POLLOUT, 0};
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      if ((poll(&pfd, 1, 0) == 1) &&
+          (pfd.revents == POLLOUT) &&
+          (getsockopt(candidate, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0) &&
+          (error == 0))
+      {
+        fd = candidate;
+        destination->handed_over = fd;
+        __statistics->increment(Statistics::CALLBACK_WARM_CONNECTIONS_USED);
+      }
+      else
+      {
+        close(candidate);
+      }
+    }
+  }
+
+  if (fd == CURL_SOCKET_BAD)
+  {
+    fd = socket(address->family, address->socktype, address->protocol);
+  }
+
+  if (fd != CURL_SOCKET_BAD)
+  {
+    destination->connections++;
+  }
+
+  return fd;
+}
+
+// cURL close socket function, keeping count of the destination's connections.
+int HTTPCallback::close_socket(void* clientp, curl_socket_t fd)
+{
+  Destination* destination = (Destination*)clientp;
+  destination->connections--;
+  return close(fd);
+}
+
+// cURL socket options function.  This tells cURL not to connect sockets that
+// were handed over already connected.
+int HTTPCallback::configure_socket(void* clientp, curl_socket_t fd, curlsocktype purpose)
+{
+  Destination* destination = (Destination*)clientp;
+  if (fd == destination->handed_over)
+  {
+    destination->handed_over = CURL_SOCKET_BAD;
+    return CURL_SOCKOPT_ALREADY_CONNECTED;
+  }
+
+  return CURL_SOCKOPT_OK;
+}
+
+// Work out which destination a URL refers to.  This is the scheme, host and
+// port, which is the granularity at which cURL can reuse connections.
+std::string HTTPCallback::destination_key(const std::string& url)
+{
+  size_t host_start = url.find("://");
+  host_start = (host_start == std::string::npos) ? 0 : host_start + 3;
+  size_t host_end = url.find_first_of("/?#", host_start);
+  return url.substr(0, host_end);
+}
+
+// Split a destination key (or a configured HOST:PORT) into its host and port.
+// Any user info is dropped, the brackets are removed from IPv6 addresses and
+// the host is lower-cased.  Without a port, the scheme's default is used, and
+// a host without a scheme is taken to be HTTP.
+void HTTPCallback::split_host_port(const std::string& key,
+                                   std::string& host,
+                                   std::string& port)
+{
+  size_t scheme_end = key.find("://");
+  std::string scheme = (scheme_end == std::string::npos) ? "http" : key.substr(0, scheme_end);
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+  host = (scheme_end == std::string::npos) ? key : key.substr(scheme_end + 3);
+  port = (scheme == "https") ? "443" : "80";
+
+  // Strip any user info, then split off the port, allowing for bracketed
+  // IPv6 addresses.
+  size_t at = host.rfind('@');
+  if (at != std::string::npos)
+  {
+    host = host.substr(at + 1);
+  }
+
+  size_t colon = host.rfind(':');
+  if ((colon != std::string::npos) && (host.find(']', colon) == std::string::npos))
+  {
+    if (colon + 1 < host.length())
+    {
+      port = host.substr(colon + 1);
+    }
+    host = host.substr(0, colon);
+  }
+  if ((host.length() >= 2) && (host[0] == '['))
+  {
+    host = host.substr(1, host.length() - 2);
+  }
+  std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+}
+
+// The host and port of a destination key (or a configured HOST:PORT) in a
+// canonical HOST:PORT form, for comparing the two.
+std::string HTTPCallback::host_port(const std::string& key)
+{
+  std::string host;
+  std::string port;
+  split_host_port(key, host, port);
+  if (host.find(':') != std::string::npos)
+  {
+    host = "[" + host + "]";
+  }
+  return host + ":" + port;
+}
+
+// Skip a transfer as the deadline for starting it has passed.
+void HTTPCallback::defer(Transfer* transfer)
+{
+  *transfer->success = false;
+  transfer->deferred = true;
+  if (transfer->request != NULL)
+  {
+    transfer->request->deferred = true;
+  }
+  for (auto it = transfer->batch.begin(); it != transfer->batch.end(); it++)
+  {
+    (*it)->deferred = true;
+  }
+}
+
+// Record the current time against the timer pops carried by a transfer.
+void HTTPCallback::timestamp(Transfer* transfer, uint64_t CallbackRequest::*field)
+{
+  uint64_t now = CallbackRequest::now_us();
+  if (transfer->request != NULL)
+  {
+    transfer->request->*field = now;
+  }
+  for (auto it = transfer->batch.begin(); it != transfer->batch.end(); it++)
+  {
+    (*it)->*field = now;
+  }
+}
+
+uint64_t HTTPCallback::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Order batched callbacks by callback URL, keeping callbacks to the same URL in
+// the order they were popped (the requests are held in a single vector).
+bool HTTPCallback::batch_order(const CallbackRequest* a, const CallbackRequest* b)
+{
+  int rc = a->timer->callback_url.compare(b->timer->callback_url);
+  return (rc != 0) ? (rc < 0) : (a < b);
+}
+
+// Build the body of a batched callback request.  This takes the form:
+// {
+//     "callbacks": [
+//         {
+//             "id": "<timer ID as 16 hex digits>",
+//             "sequence-number": Int,
+//             "opaque": "string"
+//         },
+//         ...
+//     ]
+// }
+std::string HTTPCallback::build_batch_body(const std::vector<CallbackRequest*>& batch)
+{
+  rapidjson::StringBuffer s;
+  rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+  w.StartObject();
+  w.String("callbacks");
+  w.StartArray();
+  for (auto it = batch.begin(); it != batch.end(); it++)
+  {
+    Timer* timer = (*it)->timer;
+    std::stringstream id;
+    id << std::setfill('0') << std::setw(16) << std::hex << timer->id;
+
+    w.StartObject();
+    w.String("id");
+    w.String(id.str().c_str());
+    w.String("sequence-number");
+    w.Uint(timer->sequence_number);
+    w.String("opaque");
+    w.String(timer->callback_body.data(), timer->callback_body.length());
+    w.EndObject();
+  }
+  w.EndArray();
+  w.EndObject();
+
+  return std::string(s.GetString(), s.Size());
+}
+
+// Mark each callback in a batch as successful if the callback server
+// acknowledged it, picking up any new timing for the acknowledged timers.
+// The response takes the form:
+// {
+//     "acknowledged": [ <comma separated timer IDs> ],
+//     "updates": { <timer ID>: <update>, ... }
+// }
+// where "updates" is optional, and each update is in the format of the
+// response to a single callback (see CallbackRequest::parse_response).
+void HTTPCallback::handle_batch_response(Transfer* transfer)
+{
+  for (auto it = transfer->batch.begin(); it != transfer->batch.end(); it++)
+  {
+    (*it)->success = false;
+  }
+
+  if (!transfer->batch_success)
+  {
+    return;
+  }
+
+  rapidjson::Document doc;
+  doc.Parse<0>(transfer->response.c_str());
+  if ((doc.HasParseError()) ||
+      (!doc.IsObject()) ||
+      (!doc.HasMember("acknowledged")) ||
+      (!doc["acknowledged"].IsArray()))
+  {
+    ASYNC_LOG_WARNING_RATE_LIMITED("Invalid response to batched callback to %s",
+                                   transfer->url->c_str());
+    return;
+  }
+
+  std::set<std::string> acknowledged;
+  rapidjson::Value& ids = doc["acknowledged"];
+  for (auto it = ids.Begin(); it != ids.End(); it++)
+  {
+    if (it->IsString())
+    {
+      acknowledged.insert(std::string(it->GetString(), it->GetStringLength()));
+    }
+  }
+
+  rapidjson::Value* updates = NULL;
+  if ((doc.HasMember("updates")) && (doc["updates"].IsObject()))
+  {
+    updates = &doc["updates"];
+  }
+
+  for (auto it = transfer->batch.begin(); it != transfer->batch.end(); it++)
+  {
+    std::stringstream id;
+    id << std::setfill('0') << std::setw(16) << std::hex << (*it)->timer->id;
+    (*it)->success = (acknowledged.find(id.str()) != acknowledged.end());
+
+    if (((*it)->success) &&
+        (updates != NULL) &&
+        (updates->HasMember(id.str().c_str())))
+    {
+      (*it)->parse_response((*updates)[id.str().c_str()]);
+    }
+  }
+
+  ASYNC_LOG_DEBUG("Batched callback to %s acknowledged %lu of %lu timers",
+                  transfer->url->c_str(),
+                  acknowledged.size(),
+                  transfer->batch.size());
+}
+
+// cURL write function.  We keep the response to batched callbacks so we can
+// tell which timers were acknowledged, and short responses to single
+// callbacks from perform_all in case they carry new timing for the timer.
+// Other responses are discarded.
+size_t HTTPCallback::write_response(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  Transfer* transfer = (Transfer*)userdata;
+  size_t length = size * nmemb;
+
+  if ((!transfer->batch.empty()) &&
+      (transfer->response.length() + length <= MAX_BATCH_RESPONSE_SIZE))
+  {
+    transfer->response.append(ptr, length);
+  }
+  else if ((transfer->request != NULL) && (!transfer->response_truncated))
+  {
+    if (transfer->response.length() + length <= MAX_SINGLE_RESPONSE_SIZE)
+    {
+      transfer->response.append(ptr, length);
+    }
+    else
+    {
+      // Too long to be new timing, so don't bother keeping any of it.
+      transfer->response.clear();
+      transfer->response_truncated = true;
+    }
+  }
+
+  return length;
 }
@@ -0,0 +1,37 @@
+#include "io_engine.h"
+#include "io_uring_engine.h"
+#include "epoll_engine.h"
+#include "log.h"
+
+IOEngine* IOEngine::create(const std::string& type)
+{
+  if ((type == "io_uring") || (type == "auto"))
+  {
+    IOUringEngine* engine = new IOUringEngine();
+    if (engine->init())
+    {
+      return engine;
+    }
+    delete engine;
+
+    if (type == "io_uring")
+    {
+      return NULL;
+    }
+    LOG_INFO("Falling back to epoll for socket I/O");
+  }
+
+  if ((type == "epoll") || (type == "auto"))
+  {
+    EpollEngine* engine = new EpollEngine();
+    if (engine->init())
+    {
+      return engine;
+    }
+    delete engine;
+    return NULL;
+  }
+
+  LOG_ERROR("Unknown I/O engine type: %s", type.c_str());
+  return NULL;
+}
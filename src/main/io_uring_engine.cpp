@@ -0,0 +1,639 @@
+#include "io_uring_engine.h"
+#include "statistics.h"
+#include "log.h"
+
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_IO_URING) && defined(IORING_RECV_MULTISHOT)
+
+// The size of the submission and completion queues.  The completion queue is
+// larger as each multishot receive can complete many times.
+static const unsigned SQ_ENTRIES = 256;
+static const unsigned CQ_ENTRIES = 4096;
+
+// The receive buffers registered with the kernel.  The number of buffers must
+// be a power of two.
+static const uint16_t BUFFER_GROUP = 0;
+static const unsigned NUM_BUFFERS = 128;
+static const size_t BUFFER_SIZE = 16 * 1024;
+
+// Requests are tagged with the socket's generation, its file descriptor and
+// whether the request is a send.  Requests we don't need the results of (such
+// as cancellations) have no tag.
+static const uint64_t NO_TAG = 0;
+
+// How long to wait for the requests on cancelled sockets to complete.  The
+// kernel cancels socket requests straight away, so this is only reached if
+// something has gone badly wrong.
+static const int DRAIN_WAIT_MS = 100;
+static const int DRAIN_ATTEMPTS = 10;
+
+static uint64_t make_tag(int fd, uint32_t generation, bool is_send)
+{
+  return ((uint64_t)generation << 32) | ((uint64_t)fd << 1) | (is_send ? 1 : 0);
+}
+
+IOUringEngine::IOUringEngine() :
+  _ring_fd(-1),
+  _sq_ring(NULL),
+  _sq_ring_size(0),
+  _sq_head(NULL),
+  _sq_tail(NULL),
+  _sq_mask(0),
+  _sq_entries(0),
+  _sqes(NULL),
+  _sqes_size(0),
+  _cq_ring(NULL),
+  _cq_ring_size(0),
+  _cq_head(NULL),
+  _cq_tail(NULL),
+  _cq_mask(0),
+  _cqes(NULL),
+  _buf_ring(NULL),
+  _buf_ring_size(0),
+  _buffers(),
+  _buf_tail(0),
+  _buffers_in_use(),
+  _deferred(),
+  _deferred_buffers(),
+  _sockets(),
+  _generation(0),
+  _failed()
+{
+}
+
+IOUringEngine::~IOUringEngine()
+{
+  if ((_ring_fd >= 0) && (_sqes != NULL) && (!_sockets.empty()))
+  {
+    // Stop everything still running, and wait for it to stop before the
+    // buffers go away.
+    for (auto it = _sockets.begin(); it != _sockets.end(); it++)
+    {
+      it->second.cancelled = true;
+    }
+
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe != NULL)
+    {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+      sqe->user_data = NO_TAG;
+    }
+    drain(-1);
+  }
+
+  if (_buf_ring != NULL)
+  {
+    munmap(_buf_ring, _buf_ring_size);
+  }
+  if (_sqes != NULL)
+  {
+    munmap(_sqes, _sqes_size);
+  }
+  if ((_cq_ring != NULL) && (_cq_ring != _sq_ring))
+  {
+    munmap(_cq_ring, _cq_ring_size);
+  }
+  if (_sq_ring != NULL)
+  {
+    munmap(_sq_ring, _sq_ring_size);
+  }
+  if (_ring_fd >= 0)
+  {
+    ::close(_ring_fd);
+  }
+}
+
+bool IOUringEngine::init()
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+  params.cq_entries = CQ_ENTRIES;
+
+  _ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+  if (_ring_fd < 0)
+  {
+    LOG_INFO("io_uring isn't available: %s", strerror(errno));
+    return false;
+  }
+
+  if ((!(params.features & IORING_FEAT_NODROP)) ||
+      (!(params.features & IORING_FEAT_EXT_ARG)))
+  {
+    LOG_INFO("io_uring doesn't support the required features (0x%x)", params.features);
+    return false;
+  }
+
+  // Map the queues.  On newer kernels the submission and completion queues
+  // share a single mapping.
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if ((single_mmap) && (_cq_ring_size > _sq_ring_size))
+  {
+    _sq_ring_size = _cq_ring_size;
+  }
+
+  void* sq_ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+  {
+    LOG_ERROR("Failed to map io_uring submission queue: %s", strerror(errno));
+    return false;
+  }
+  _sq_ring = sq_ring;
+
+  if (single_mmap)
+  {
+    _cq_ring = _sq_ring;
+  }
+  else
+  {
+    void* cq_ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+    {
+      LOG_ERROR("Failed to map io_uring completion queue: %s", strerror(errno));
+      return false;
+    }
+    _cq_ring = cq_ring;
+  }
+
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    LOG_ERROR("Failed to map io_uring submission entries: %s", strerror(errno));
+    return false;
+  }
+  _sqes = (struct io_uring_sqe*)sqes;
+
+  char* sq = (char*)_sq_ring;
+  _sq_head = (unsigned*)(sq + params.sq_off.head);
+  _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  _sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+  for (unsigned ii = 0; ii < _sq_entries; ii++)
+  {
+    sq_array[ii] = ii;
+  }
+
+  char* cq = (char*)_cq_ring;
+  _cq_head = (unsigned*)(cq + params.cq_off.head);
+  _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  _cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // Register the receive buffers.
+  _buf_ring_size = NUM_BUFFERS * sizeof(struct io_uring_buf);
+  void* buf_ring = mmap(NULL, _buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED)
+  {
+    LOG_ERROR("Failed to allocate io_uring buffer ring: %s", strerror(errno));
+    return false;
+  }
+  _buf_ring = (struct io_uring_buf_ring*)buf_ring;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)_buf_ring;
+  reg.ring_entries = NUM_BUFFERS;
+  reg.bgid = BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+  {
+    LOG_INFO("io_uring doesn't support provided buffer rings: %s", strerror(errno));
+    return false;
+  }
+
+  _buffers.resize(NUM_BUFFERS * BUFFER_SIZE);
+  for (unsigned ii = 0; ii < NUM_BUFFERS; ii++)
+  {
+    recycle_buffer(ii);
+  }
+  publish_buffers();
+
+  return true;
+}
+
+void IOUringEngine::send(int fd, const struct iovec* iov, int iovcnt, void* context)
+{
+  Socket& socket = get_socket(fd);
+  socket.send_context = context;
+  memset(&socket.send_msg, 0, sizeof(socket.send_msg));
+  socket.send_msg.msg_iov = (struct iovec*)iov;
+  socket.send_msg.msg_iovlen = iovcnt;
+
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    Completion completion = {context, true, -EBUSY, NULL};
+    _failed.push_back(completion);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)&socket.send_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = make_tag(fd, socket.generation, true);
+  socket.sending = true;
+}
+
+void IOUringEngine::receive(int fd, void* context)
+{
+  Socket& socket = get_socket(fd);
+  socket.receive_context = context;
+  if (!socket.receiving)
+  {
+    arm_receive(fd, socket);
+  }
+}
+
+// Cancel everything running on the socket, and wait for it to stop.  The
+// kernel holds the socket open until its requests are cancelled, and a send
+// may still be reading the caller's data until it completes.
+void IOUringEngine::cancel(int fd)
+{
+  auto it = _sockets.find(fd);
+  if ((it == _sockets.end()) || (it->second.cancelled))
+  {
+    return;
+  }
+
+  Socket& socket = it->second;
+  socket.cancelled = true;
+  if ((socket.sending) || (socket.receiving))
+  {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe != NULL)
+    {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = fd;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe->user_data = NO_TAG;
+    }
+  }
+  drain(fd);
+}
+
+// Give back the buffers handed out by the previous call, then submit the
+// queued requests and wait for completions in one go.
+void IOUringEngine::wait(std::vector<Completion>& completions, int timeout_ms)
+{
+  for (auto it = _buffers_in_use.begin(); it != _buffers_in_use.end(); it++)
+  {
+    recycle_buffer(*it);
+  }
+  if (!_buffers_in_use.empty())
+  {
+    _buffers_in_use.clear();
+    publish_buffers();
+  }
+  _buffers_in_use.swap(_deferred_buffers);
+
+  completions.insert(completions.end(), _failed.begin(), _failed.end());
+  completions.insert(completions.end(), _deferred.begin(), _deferred.end());
+  bool ready = ((!_failed.empty()) ||
+                (!_deferred.empty()) ||
+                (*_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)));
+  _failed.clear();
+  _deferred.clear();
+
+  if ((!ready) && (timeout_ms > 0))
+  {
+    enter(1, timeout_ms);
+  }
+  else if (*_sq_tail != __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE))
+  {
+    enter(0, 0);
+  }
+
+  reap(completions);
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+IOUringEngine::Socket& IOUringEngine::get_socket(int fd)
+{
+  auto it = _sockets.find(fd);
+  if ((it != _sockets.end()) && (it->second.cancelled))
+  {
+    // The file descriptor has been reused since it was cancelled.  Anything
+    // still to complete for the old socket will be ignored.
+    _sockets.erase(it);
+    it = _sockets.end();
+  }
+
+  if (it == _sockets.end())
+  {
+    Socket socket;
+    memset(&socket, 0, sizeof(socket));
+    socket.generation = ++_generation;
+    it = _sockets.insert(std::make_pair(fd, socket)).first;
+  }
+  return it->second;
+}
+
+// Get the next free submission queue entry, submitting the queue first if
+// it's full.  The entry is submitted on the next call to `enter()`.
+struct io_uring_sqe* IOUringEngine::get_sqe()
+{
+  unsigned tail = *_sq_tail;
+  if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+  {
+    enter(0, 0);
+    if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+    {
+      LOG_ERROR("io_uring submission queue is full");
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe* sqe = &_sqes[tail & _sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// Start a multishot receive on a socket, taking buffers from the registered
+// buffer ring.
+void IOUringEngine::arm_receive(int fd, Socket& socket)
+{
+  struct io_uring_sqe* sqe = get_sqe();
+  if (sqe == NULL)
+  {
+    Completion completion = {socket.receive_context, false, -EBUSY, NULL};
+    _failed.push_back(completion);
+    socket.receiving = false;
+    return;
+  }
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = make_tag(fd, socket.generation, false);
+  socket.receiving = true;
+}
+
+// Add a buffer back onto the buffer ring.  The kernel doesn't see it until
+// the ring's tail is published.  Only the address, length and ID of the entry
+// are written, as the rest of the first entry overlaps the ring's tail.
+//
+// The entries are indexed directly rather than through the header's `bufs`
+// member, which C++ compilers lay out after the (non-zero sized) empty struct
+// the kernel header uses to declare it.
+void IOUringEngine::recycle_buffer(uint16_t buffer_id)
+{
+  struct io_uring_buf* buf = (struct io_uring_buf*)_buf_ring + (_buf_tail & (NUM_BUFFERS - 1));
+  buf->addr = (uint64_t)(uintptr_t)&_buffers[buffer_id * BUFFER_SIZE];
+  buf->len = BUFFER_SIZE;
+  buf->bid = buffer_id;
+  _buf_tail++;
+}
+
+void IOUringEngine::publish_buffers()
+{
+  __atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+}
+
+// Submit the queued requests (including any cancellations) and wait for the
+// requests on the given cancelled socket (or all of them, if `fd` is -1) to
+// complete, then forget the cancelled sockets that have nothing left running.  Anything
+// else that completes in the meantime is saved for the next call to `wait()`,
+// along with the buffers holding its data, which the caller may still be
+// using the previous batch of.
+void IOUringEngine::drain(int fd)
+{
+  for (int attempt = 0; ; attempt++)
+  {
+    bool busy = false;
+    for (auto it = _sockets.begin(); it != _sockets.end(); )
+    {
+      Socket& socket = it->second;
+      if ((socket.cancelled) && (!socket.sending) && (!socket.receiving))
+      {
+        _sockets.erase(it++);
+      }
+      else
+      {
+        busy = (busy || ((socket.cancelled) && ((fd < 0) || (it->first == fd))));
+        it++;
+      }
+    }
+
+    if (!busy)
+    {
+      break;
+    }
+    else if (attempt == DRAIN_ATTEMPTS)
+    {
+      LOG_ERROR("Timed out waiting for io_uring requests to be cancelled");
+      break;
+    }
+
+    size_t buffers_in_use = _buffers_in_use.size();
+    enter(1, DRAIN_WAIT_MS);
+    reap(_deferred);
+    _deferred_buffers.insert(_deferred_buffers.end(),
+                             _buffers_in_use.begin() + buffers_in_use,
+                             _buffers_in_use.end());
+    _buffers_in_use.resize(buffers_in_use);
+  }
+}
+
+// Submit the queued requests, optionally waiting up to `timeout_ms` for at
+// least `min_complete` completions.
+int IOUringEngine::enter(unsigned min_complete, int timeout_ms)
+{
+  unsigned to_submit = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = 0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void* argp = NULL;
+  size_t arg_size = 0;
+
+  if (min_complete > 0)
+  {
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    argp = &arg;
+    arg_size = sizeof(arg);
+  }
+
+  int rc = syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete, flags, argp, arg_size);
+  __statistics->increment(Statistics::CALLBACK_IO_SYSCALLS);
+  if ((rc < 0) && (errno != ETIME) && (errno != EINTR))
+  {
+    LOG_ERROR("Failed to submit io_uring requests: %s", strerror(errno));
+  }
+  return rc;
+}
+
+// Pick up everything on the completion queue.
+void IOUringEngine::reap(std::vector<Completion>& completions)
+{
+  unsigned head = *_cq_head;
+  unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+  bool recycled = false;
+
+  for (; head != tail; head++)
+  {
+    struct io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+    uint64_t tag = cqe->user_data;
+    int result = cqe->res;
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER);
+    bool more = (cqe->flags & IORING_CQE_F_MORE);
+    uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (tag == NO_TAG)
+    {
+      continue;
+    }
+
+    int fd = (tag >> 1) & 0x7fffffff;
+    bool is_send = (tag & 1);
+    auto it = _sockets.find(fd);
+    if ((it == _sockets.end()) || (it->second.generation != (tag >> 32)))
+    {
+      // The socket has been cancelled since this was requested.
+      if (has_buffer)
+      {
+        recycle_buffer(buffer_id);
+        recycled = true;
+      }
+      continue;
+    }
+
+    Socket& socket = it->second;
+    if (is_send)
+    {
+      socket.sending = false;
+      if (!socket.cancelled)
+      {
+        Completion completion = {socket.send_context, true, result, NULL};
+        completions.push_back(completion);
+      }
+      continue;
+    }
+
+    if (socket.cancelled)
+    {
+      // The receive is stopping, and nobody wants what it got.
+      if (has_buffer)
+      {
+        recycle_buffer(buffer_id);
+        recycled = true;
+      }
+      if (!more)
+      {
+        socket.receiving = false;
+      }
+      continue;
+    }
+
+    if (result == -ENOBUFS)
+    {
+      // We've run out of buffers, which stops the receive.  Start it again
+      // (it'll be submitted once the buffers have been given back).
+      arm_receive(fd, socket);
+      continue;
+    }
+
+    Completion completion = {socket.receive_context, false, result, NULL};
+    if ((result > 0) && (has_buffer))
+    {
+      completion.data = &_buffers[buffer_id * BUFFER_SIZE];
+      _buffers_in_use.push_back(buffer_id);
+      if (!more)
+      {
+        arm_receive(fd, socket);
+      }
+    }
+    else
+    {
+      if (has_buffer)
+      {
+        recycle_buffer(buffer_id);
+        recycled = true;
+      }
+      socket.receiving = false;
+    }
+    completions.push_back(completion);
+  }
+
+  __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+  if (recycled)
+  {
+    publish_buffers();
+  }
+}
+
+#else
+
+// Built without io_uring support, so the engine is never available.
+IOUringEngine::IOUringEngine() :
+  _ring_fd(-1),
+  _sq_ring(NULL),
+  _sq_ring_size(0),
+  _sq_head(NULL),
+  _sq_tail(NULL),
+  _sq_mask(0),
+  _sq_entries(0),
+  _sqes(NULL),
+  _sqes_size(0),
+  _cq_ring(NULL),
+  _cq_ring_size(0),
+  _cq_head(NULL),
+  _cq_tail(NULL),
+  _cq_mask(0),
+  _cqes(NULL),
+  _buf_ring(NULL),
+  _buf_ring_size(0),
+  _buffers(),
+  _buf_tail(0),
+  _buffers_in_use(),
+  _deferred(),
+  _deferred_buffers(),
+  _sockets(),
+  _generation(0),
+  _failed()
+{
+}
+
+IOUringEngine::~IOUringEngine() {}
+
+bool IOUringEngine::init()
+{
+  LOG_INFO("Built without io_uring support");
+  return false;
+}
+
+void IOUringEngine::send(int fd, const struct iovec* iov, int iovcnt, void* context) {}
+void IOUringEngine::receive(int fd, void* context) {}
+void IOUringEngine::cancel(int fd) {}
+void IOUringEngine::wait(std::vector<Completion>& completions, int timeout_ms) {}
+
+#endif
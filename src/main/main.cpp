@@ -4,8 +4,12 @@
 #include "replicator.h"
 #include "callback.h"
 #include "http_callback.h"
+#include "tcp_callback.h"
+#include "stream_callback.h"
 #include "controller.h"
 #include "globals.h"
+#include "statistics.h"
+#include "replica_stagger.h"
 
 #include <iostream>
 #include <cassert>
@@ -19,7 +23,9 @@ void exception_handler(int sig)
   signal(SIGABRT, SIG_DFL);
   signal(SIGSEGV, SIG_DFL);
 
-  // Log the signal, along with a backtrace.
+  // Write out anything still waiting to be logged, then log the signal, along
+  // with a backtrace.
+  AsyncLogger::flush_on_crash();
   LOG_BACKTRACE("Signal %d caught", sig);
 
   // Dump a core.
@@ -38,14 +44,8 @@ int main(int argc, char** argv)
   // Initialize the global configuration.
   __globals = new Globals();
   __globals->update_config();
-
-  // Create components
-  TimerStore *store = new TimerStore();
-  Replicator* controller_rep = new Replicator();
-  Replicator* handler_rep = new Replicator();
-  HTTPCallback* callback = new HTTPCallback();
-  TimerHandler* handler = new TimerHandler(store, handler_rep, callback);
-  Controller* controller = new Controller(controller_rep, handler);
+  __statistics = new Statistics();
+  __replica_stagger = new ReplicaStagger();
 
   // Create an event reactor.
   struct event_base* base = event_base_new();
@@ -54,6 +54,18 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  // Create components
+  TimerStore *store = new TimerStore();
+  Replicator* controller_rep = new Replicator();
+  Replicator* handler_rep = new Replicator();
+  StreamCallback* stream_callback = new StreamCallback(base);
+  std::vector<Callback*> callbacks;
+  callbacks.push_back(new HTTPCallback());
+  callbacks.push_back(new TCPCallback());
+  callbacks.push_back(stream_callback);
+  TimerHandler* handler = new TimerHandler(store, handler_rep, callbacks);
+  Controller* controller = new Controller(controller_rep, handler);
+
   // Create an HTTP server instance.
   struct evhttp* http = evhttp_new(base);
   if (!http) {
@@ -64,6 +76,14 @@ int main(int argc, char** argv)
   // Register a callback for the "/ping" path.
   evhttp_set_cb(http, "/ping", Controller::controller_ping_cb, NULL);
 
+  // Register a callback for the "/statistics" path.
+  evhttp_set_cb(http, "/statistics", Controller::controller_statistics_cb, NULL);
+
+  // Register callbacks for consumers subscribing to stream callbacks and
+  // acknowledging the pops they're sent.
+  evhttp_set_cb(http, "/subscriptions", StreamCallback::subscribe_cb, stream_callback);
+  evhttp_set_cb(http, "/acknowledgements", StreamCallback::acknowledge_cb, stream_callback);
+
   // Register a callback for the "/timers" path, we have to do this with the
   // generic callback as libevent doesn't support regex paths.
   evhttp_set_gencb(http, Controller::controller_cb, controller);
@@ -82,6 +102,8 @@ int main(int argc, char** argv)
   //
   // After this point nothing will use __globals so it's safe to delete
   // it here.
+  delete __replica_stagger; __replica_stagger = NULL;
+  delete __statistics; __statistics = NULL;
   delete __globals; __globals = NULL;
   curl_global_cleanup();
 
@@ -0,0 +1,124 @@
+#include "replica_stagger.h"
+#include "globals.h"
+#include "statistics.h"
+#include "async_logger.h"
+
+#include <algorithm>
+#include <time.h>
+
+// The one and only replica stagger object - like the statistics this must be
+// initialized at start of day and destroyed before main() returns.
+ReplicaStagger* __replica_stagger;
+
+// How long each window of measurements lasts, and how often the stagger is
+// worked out.
+static const uint64_t WINDOW_MS = 30 * 1000;
+static const uint64_t UPDATE_INTERVAL_MS = 1000;
+
+// The number of callbacks and replication messages that must be measured
+// before the stagger is based on them.
+static const uint64_t MIN_SAMPLES = 20;
+
+ReplicaStagger::ReplicaStagger() :
+  _current(0),
+  _stagger_ms(0),
+  _next_update_ms(0),
+  _window_end_ms(0)
+{
+  pthread_mutex_init(&_mutex, NULL);
+
+  int max_ms;
+  __globals->get_replication_stagger_max_ms(max_ms);
+  _stagger_ms = max_ms;
+}
+
+ReplicaStagger::~ReplicaStagger()
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+void ReplicaStagger::record_callback(uint64_t us)
+{
+  _callbacks[_current.load(std::memory_order_relaxed)].record(us);
+  maybe_update();
+}
+
+void ReplicaStagger::record_replication(uint64_t us)
+{
+  _replications[_current.load(std::memory_order_relaxed)].record(us);
+  maybe_update();
+}
+
+uint64_t ReplicaStagger::stagger_ms()
+{
+  return _stagger_ms.load(std::memory_order_relaxed);
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Work out the stagger again if it's due, unless another thread is already
+// doing so.
+void ReplicaStagger::maybe_update()
+{
+  uint64_t now_ms = monotonic_time_ms();
+  if ((now_ms >= _next_update_ms.load(std::memory_order_relaxed)) &&
+      (pthread_mutex_trylock(&_mutex) == 0))
+  {
+    if (now_ms >= _next_update_ms.load(std::memory_order_relaxed))
+    {
+      update(now_ms);
+      _next_update_ms.store(now_ms + UPDATE_INTERVAL_MS, std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+}
+
+// Work out the stagger from the measurements in both windows, starting a new
+// window first if the current one has ended.  Must be called with the mutex
+// held.
+void ReplicaStagger::update(uint64_t now_ms)
+{
+  if (now_ms >= _window_end_ms)
+  {
+    int next = 1 - _current.load(std::memory_order_relaxed);
+    _callbacks[next].reset();
+    _replications[next].reset();
+    _current.store(next, std::memory_order_relaxed);
+    _window_end_ms = now_ms + WINDOW_MS;
+  }
+
+  int floor_ms;
+  int max_ms;
+  int margin_ms;
+  __globals->get_replication_stagger_floor_ms(floor_ms);
+  __globals->get_replication_stagger_max_ms(max_ms);
+  __globals->get_replication_stagger_margin_ms(margin_ms);
+
+  uint64_t stagger_ms = max_ms;
+  if ((_callbacks[0].count() + _callbacks[1].count() >= MIN_SAMPLES) &&
+      (_replications[0].count() + _replications[1].count() >= MIN_SAMPLES))
+  {
+    uint64_t callback_us = std::max(_callbacks[0].percentile(99),
+                                    _callbacks[1].percentile(99));
+    uint64_t replication_us = std::max(_replications[0].percentile(99),
+                                       _replications[1].percentile(99));
+    stagger_ms = (((callback_us + replication_us) * 2) + 999) / 1000 + margin_ms;
+    stagger_ms = std::max(std::min(stagger_ms, (uint64_t)max_ms), (uint64_t)floor_ms);
+  }
+
+  if (stagger_ms != _stagger_ms.load(std::memory_order_relaxed))
+  {
+    ASYNC_LOG_DEBUG("Replica stagger is now %lums", stagger_ms);
+  }
+  _stagger_ms.store(stagger_ms, std::memory_order_relaxed);
+  __statistics->set(Statistics::REPLICA_STAGGER_MS, stagger_ms);
+}
+
+uint64_t ReplicaStagger::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
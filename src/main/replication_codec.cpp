@@ -0,0 +1,348 @@
+#include "replication_codec.h"
+
+#include <climits>
+#include <cstring>
+
+const char* const ReplicationCodec::CONTENT_TYPE = "application/vnd.chronos.timers";
+
+// The bytes each replication message starts with.
+static const char MAGIC[] = { 'C', 'T', 1 };
+
+// The callback protocols, indexed by the values they're encoded as.
+static const char* const PROTOCOLS[] = { "http", "tcp", "stream" };
+static const uint8_t NUM_PROTOCOLS = 3;
+static const uint8_t BATCH_FLAG = 0x80;
+
+/*****************************************************************************/
+/* Encoding and decoding helpers                                             */
+/*****************************************************************************/
+
+static void write_varint(std::string& out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out += (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+static void write_bytes(std::string& out, const char* data, size_t length)
+{
+  write_varint(out, length);
+  out.append(data, length);
+}
+
+// Reads values from an encoded buffer, failing (rather than reading past the
+// end) if the buffer is too short.
+struct Reader
+{
+  Reader(const char* data, size_t length) : pos(data), end(data + length) {}
+
+  bool varint(uint64_t& value)
+  {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (pos == end)
+      {
+        return false;
+      }
+
+      uint8_t byte = *pos++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool bytes(const char*& data, size_t& length)
+  {
+    uint64_t value;
+    if ((!varint(value)) || (value > (uint64_t)(end - pos)))
+    {
+      return false;
+    }
+    data = pos;
+    length = value;
+    pos += value;
+    return true;
+  }
+
+  bool byte(uint8_t& value)
+  {
+    if (pos == end)
+    {
+      return false;
+    }
+    value = *pos++;
+    return true;
+  }
+
+  bool done() { return (pos == end); }
+
+  const char* pos;
+  const char* end;
+};
+
+// Decode a timer's fields (everything but its replicas), returning NULL if
+// they're invalid.
+static Timer* decode_fields(Reader& reader)
+{
+  uint64_t id;
+  uint64_t start_time;
+  uint64_t interval;
+  uint64_t repeat_for;
+  uint64_t sequence_number;
+  uint64_t replica_stagger_ms;
+  uint8_t protocol;
+  const char* url;
+  size_t url_length;
+  const char* opaque;
+  size_t opaque_length;
+
+  if ((!reader.varint(id)) ||
+      (!reader.varint(start_time)) ||
+      (!reader.varint(interval)) ||
+      (!reader.varint(repeat_for)) ||
+      (!reader.varint(sequence_number)) ||
+      (!reader.varint(replica_stagger_ms)) ||
+      (!reader.byte(protocol)) ||
+      (!reader.bytes(url, url_length)) ||
+      (!reader.bytes(opaque, opaque_length)) ||
+      (interval > UINT32_MAX) ||
+      (repeat_for > UINT32_MAX) ||
+      (sequence_number > UINT32_MAX) ||
+      (replica_stagger_ms > UINT32_MAX) ||
+      ((protocol & ~BATCH_FLAG) >= NUM_PROTOCOLS))
+  {
+    return NULL;
+  }
+
+  Timer* timer = new Timer(id, interval, repeat_for);
+  timer->start_time = start_time;
+  timer->sequence_number = sequence_number;
+  timer->replica_stagger_ms = replica_stagger_ms;
+  timer->callback_protocol = PROTOCOLS[protocol & ~BATCH_FLAG];
+  timer->callback_batch = ((protocol & BATCH_FLAG) != 0);
+  timer->callback_url.assign(url, url_length);
+  timer->callback_body = SharedBuffer(opaque, opaque_length);
+  return timer;
+}
+
+/*****************************************************************************/
+/* Class functions                                                           */
+/*****************************************************************************/
+
+void ReplicationCodec::encode_timer(Timer* timer, std::string& out, size_t& fields_length)
+{
+  out.clear();
+  write_varint(out, timer->id);
+  write_varint(out, timer->start_time);
+  write_varint(out, timer->interval);
+  write_varint(out, timer->repeat_for);
+  write_varint(out, timer->sequence_number);
+  write_varint(out, timer->replica_stagger_ms);
+
+  uint8_t protocol = 0;
+  for (uint8_t ii = 0; ii < NUM_PROTOCOLS; ii++)
+  {
+    if (timer->callback_protocol == PROTOCOLS[ii])
+    {
+      protocol = ii;
+    }
+  }
+  out += (char)(protocol | (timer->callback_batch ? BATCH_FLAG : 0));
+
+  write_bytes(out, timer->callback_url.data(), timer->callback_url.length());
+  write_bytes(out, timer->callback_body.data(), timer->callback_body.length());
+  fields_length = out.length();
+
+  write_varint(out, timer->replicas.size());
+  for (auto it = timer->replicas.begin(); it != timer->replicas.end(); it++)
+  {
+    write_bytes(out, it->data(), it->length());
+  }
+}
+
+Timer* ReplicationCodec::decode_timer(const char* data, size_t length)
+{
+  Reader reader(data, length);
+  Timer* timer = decode_fields(reader);
+  if (timer == NULL)
+  {
+    return NULL;
+  }
+
+  uint64_t num_replicas;
+  bool valid = reader.varint(num_replicas);
+  for (uint64_t ii = 0; valid && (ii < num_replicas); ii++)
+  {
+    const char* address;
+    size_t address_length;
+    valid = reader.bytes(address, address_length);
+    if (valid)
+    {
+      timer->replicas.push_back(std::string(address, address_length));
+    }
+  }
+
+  if ((!valid) || (!reader.done()))
+  {
+    delete timer;
+    return NULL;
+  }
+
+  timer->_replication_factor = timer->replicas.size();
+  return timer;
+}
+
+bool ReplicationCodec::decode(const char* data,
+                              size_t length,
+                              std::vector<Timer*>& timers,
+                              std::string& error)
+{
+  if ((length < sizeof(MAGIC)) || (memcmp(data, MAGIC, sizeof(MAGIC)) != 0))
+  {
+    error = "Unsupported replication message version";
+    return false;
+  }
+
+  size_t first = timers.size();
+  std::vector<std::string> nodes;
+  Reader message(data + sizeof(MAGIC), length - sizeof(MAGIC));
+
+  bool valid = true;
+
+  while (!message.done())
+  {
+    const char* record;
+    size_t record_length;
+    if (!message.bytes(record, record_length))
+    {
+      error = "Truncated timer in replication message";
+      valid = false;
+      break;
+    }
+
+    Reader reader(record, record_length);
+    Timer* timer = decode_fields(reader);
+    if (timer == NULL)
+    {
+      error = "Invalid timer in replication message";
+      valid = false;
+      break;
+    }
+    timers.push_back(timer);
+
+    uint64_t num_replicas;
+    if ((!reader.varint(num_replicas)) || (num_replicas == 0))
+    {
+      error = "Invalid replicas in replication message";
+      valid = false;
+      break;
+    }
+
+    for (uint64_t ii = 0; ii < num_replicas; ii++)
+    {
+      uint64_t index;
+      if (!reader.varint(index))
+      {
+        break;
+      }
+
+      if (index == nodes.size())
+      {
+        // A node that's new to the message.
+        const char* address;
+        size_t address_length;
+        if (!reader.bytes(address, address_length))
+        {
+          break;
+        }
+        nodes.push_back(std::string(address, address_length));
+      }
+      else if (index > nodes.size())
+      {
+        break;
+      }
+
+      timer->replicas.push_back(nodes[index]);
+    }
+
+    if ((timer->replicas.size() != num_replicas) || (!reader.done()))
+    {
+      error = "Invalid replicas in replication message";
+      valid = false;
+      break;
+    }
+
+    timer->_replication_factor = num_replicas;
+  }
+
+  if (!valid)
+  {
+    // Gave up on the message part way through.
+    for (size_t ii = first; ii < timers.size(); ii++)
+    {
+      delete timers[ii];
+    }
+    timers.resize(first);
+    return false;
+  }
+
+  return true;
+}
+
+/*****************************************************************************/
+/* Writer                                                                    */
+/*****************************************************************************/
+
+void ReplicationCodec::Writer::start(std::string& out)
+{
+  out.assign(MAGIC, sizeof(MAGIC));
+  _nodes.clear();
+}
+
+void ReplicationCodec::Writer::add(std::string& out,
+                                   const SharedBuffer& timer,
+                                   size_t fields_length)
+{
+  // Swap the replicas' addresses for their indices in the table of nodes,
+  // adding any that aren't yet in the table.
+  Reader reader(timer.data() + fields_length, timer.length() - fields_length);
+  _replicas.clear();
+
+  uint64_t num_replicas = 0;
+  reader.varint(num_replicas);
+  write_varint(_replicas, num_replicas);
+
+  for (uint64_t ii = 0; ii < num_replicas; ii++)
+  {
+    const char* address = NULL;
+    size_t address_length = 0;
+    reader.bytes(address, address_length);
+
+    size_t index = 0;
+    while ((index < _nodes.size()) &&
+           ((_nodes[index].second != address_length) ||
+            (memcmp(_nodes[index].first, address, address_length) != 0)))
+    {
+      index++;
+    }
+
+    write_varint(_replicas, index);
+    if (index == _nodes.size())
+    {
+      write_bytes(_replicas, address, address_length);
+      _nodes.push_back(std::make_pair(address, address_length));
+    }
+  }
+
+  write_varint(out, fields_length + _replicas.length());
+  out.append(timer.data(), fields_length);
+  out.append(_replicas);
+}
@@ -0,0 +1,97 @@
+#include "replication_queue.h"
+#include "statistics.h"
+
+#include <unordered_set>
+
+ReplicationQueue::ReplicationQueue() :
+  _records(),
+  _pushed_since_coalesce(0),
+  _coalesced(0),
+  _dropped(0)
+{
+}
+
+ReplicationQueue::~ReplicationQueue()
+{
+}
+
+void ReplicationQueue::push(const ReplicationRecord& record, size_t max_depth)
+{
+  if ((_records.size() >= max_depth) &&
+      (_pushed_since_coalesce > max_depth / 10))
+  {
+    coalesce();
+  }
+
+  while ((!_records.empty()) && (_records.size() >= max_depth))
+  {
+    _records.pop_front();
+    _dropped++;
+    __statistics->increment(Statistics::REPLICATION_DROPS);
+  }
+
+  _records.push_back(record);
+  _pushed_since_coalesce++;
+}
+
+void ReplicationQueue::push_front(const std::vector<ReplicationRecord>& records)
+{
+  _records.insert(_records.begin(), records.begin(), records.end());
+}
+
+void ReplicationQueue::requeue(const std::vector<ReplicationRecord>& records,
+                               size_t max_depth)
+{
+  _records.insert(_records.begin(), records.begin(), records.end());
+
+  if (_records.size() > max_depth)
+  {
+    coalesce();
+  }
+
+  while (_records.size() > max_depth)
+  {
+    _records.pop_front();
+    _dropped++;
+    __statistics->increment(Statistics::REPLICATION_DROPS);
+  }
+}
+
+void ReplicationQueue::pop(std::vector<ReplicationRecord>& batch, size_t count)
+{
+  while ((count > 0) && (!_records.empty()))
+  {
+    batch.push_back(_records.front());
+    _records.pop_front();
+    count--;
+  }
+}
+
+void ReplicationQueue::clear()
+{
+  _records.clear();
+  _pushed_since_coalesce = 0;
+}
+
+// Remove every record that a later record for the same timer supersedes,
+// keeping the rest in order.
+void ReplicationQueue::coalesce()
+{
+  std::unordered_set<TimerID> newest;
+  std::deque<ReplicationRecord> kept;
+
+  for (auto it = _records.rbegin(); it != _records.rend(); it++)
+  {
+    if (newest.insert(it->id).second)
+    {
+      kept.push_front(*it);
+    }
+  }
+
+  size_t removed = _records.size() - kept.size();
+  _coalesced += removed;
+  __statistics->increment(Statistics::REPLICATION_COALESCED, removed);
+
+  _records.swap(kept);
+  _pushed_since_coalesce = 0;
+}
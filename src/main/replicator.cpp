@@ -1,11 +1,57 @@
 #include "replicator.h"
 #include "globals.h"
+#include "replica_stagger.h"
+#include "statistics.h"
+#include "log.h"
+#include "async_logger.h"
 
+#include <algorithm>
 #include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <pthread.h>
+#include <time.h>
 
-Replicator::Replicator() : _q(), _headers(NULL)
+Replicator::Replicator() :
+  _q(),
+  _wake_pending(false),
+  _terminate(false),
+  _headers(NULL),
+  _binary_headers(NULL),
+  _peer_indexes(),
+  _peer_hosts(),
+  _peers(),
+  _num_peers(0),
+  _queued(0),
+  _batch(),
+  _active_handles(0),
+  _batch_size(1),
+  _batch_window_ms(0),
+  _connections_per_node(1),
+  _max_queued_per_node(1),
+  _next_publish_us(0),
+  _writer(),
+  _idle_handles(),
+  _idle_messages()
 {
+  pthread_mutex_init(&_peer_index_lock, NULL);
+
+  // Set up content type header descriptors to use for our requests.
+  _headers = curl_slist_append(_headers, "Content-Type: application/json");
+  _binary_headers = curl_slist_append(_binary_headers,
+                                      (std::string("Content-Type: ") + ReplicationCodec::CONTENT_TYPE).c_str());
+
+  if (pipe2(_wake_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+  {
+    // The worker thread will still pick up new timers, but only when it next
+    // checks the queue.
+    LOG_ERROR("Failed to create pipe for replicator: %d", errno);
+    _wake_fds[0] = -1;
+    _wake_fds[1] = -1;
+  }
+
   int thread_rc = pthread_create(&_worker_thread,
                                  NULL,
                                  Replicator::worker_thread_entry_point,
@@ -14,16 +60,29 @@ Replicator::Replicator() : _q(), _headers(NULL)
   {
     LOG_ERROR("Failed to start replicator thread: %s", strerror(thread_rc));
   }
-
-  // Set up a content type header descriptor to use for our requests.
-  _headers = curl_slist_append(_headers, "Content-Type: application/json");
 }
 
 Replicator::~Replicator()
 {
-  _q.terminate();
+  _terminate = true;
+  wake();
   pthread_join(_worker_thread, NULL);
+  __statistics->remove_replication_peers(this);
+
+  if (_wake_fds[0] >= 0)
+  {
+    close(_wake_fds[0]);
+    close(_wake_fds[1]);
+  }
   curl_slist_free_all(_headers);
+  curl_slist_free_all(_binary_headers);
+
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    delete *it;
+  }
+  _peers.clear();
+  pthread_mutex_destroy(&_peer_index_lock);
 }
 
 /*****************************************************************************/
@@ -41,101 +100,155 @@ void* Replicator::worker_thread_entry_point(void* arg)
 /* Public API functions.                                                     */
 /*****************************************************************************/
 
-// Handle the replication of the given timer to its replicas.
+// Handle the replication of the given timer to its replicas.  The timer is
+// encoded once, and the encoding shared between the requests to each replica.
+// This node's replica stagger is advertised with the timer, so the replicas
+// all wait the same time for each other.
 void Replicator::replicate(Timer* timer)
 {
-  std::string localhost;
+  static thread_local std::string localhost;
   __globals->get_cluster_local_ip(localhost);
 
-  for (auto it = timer->replicas.begin(); it != timer->replicas.end(); it++)
+  if (__replica_stagger != NULL)
   {
-    if (*it == localhost)
-    {
-      continue;
-    }
+    timer->replica_stagger_ms = __replica_stagger->stagger_ms();
+  }
 
-    std::string url = timer->url(*it);
-    std::string body = timer->to_json();
+  std::string encoded;
+  size_t fields_length;
+  ReplicationCodec::encode_timer(timer, encoded, fields_length);
 
-    CURL* curl = create_curl_handle(url, body);
-    _q.push(curl);
-  }
+  Entry entry;
+  entry.record = Record(timer->id, SharedBuffer(std::move(encoded)), fields_length, now_us());
 
-  for (auto it = timer->extra_replicas.begin(); it != timer->extra_replicas.end(); it++)
+  const std::vector<std::string>* replica_lists[] = {&timer->replicas,
+                                                     &timer->extra_replicas};
+  for (int ii = 0; ii < 2; ii++)
   {
-    if (*it == localhost)
+    const std::vector<std::string>& replicas = *replica_lists[ii];
+    for (auto it = replicas.begin(); it != replicas.end(); it++)
     {
-      continue;
-    }
+      if (*it == localhost)
+      {
+        continue;
+      }
 
-    std::string url = timer->url(*it);
-    std::string body = timer->to_json();
+      entry.peers[entry.num_peers++] = peer_index(*it);
+      if (entry.num_peers == MAX_PEERS_PER_ENTRY)
+      {
+        _q.push(entry);
+        entry.num_peers = 0;
+      }
+    }
+  }
 
-    CURL* curl = create_curl_handle(url, body);
-    _q.push(curl);
+  if (entry.num_peers > 0)
+  {
+    _q.push(entry);
   }
+
+  wake();
 }
 
-// The replication worker thread.  This loops, receiving cURL handles off a queue
-// and managing them in parallel.
+// The replication worker thread.  This loops, receiving timers to replicate
+// off a queue, queuing them for each node, and sending batches from the
+// queues and managing the requests that send them in parallel.  Between times
+// it sleeps until there's something for it to do.
 void Replicator::run()
 {
-  CURL* new_handle = NULL;
+  Entry new_entry;
   CURLM* multi_handle = curl_multi_init();
-  int active_handles = 0;
 
-  while(_q.pop(new_handle, 10))
+  while (!_terminate)
   {
-    if (new_handle != NULL)
-    {
-      LOG_DEBUG("Sending replication message");
-      curl_multi_add_handle(multi_handle, new_handle);
+    refresh_config(multi_handle);
 
-      // Since we added a handle to the multi handle, expect there to
-      // be an extra handle in the count.
-      active_handles++;
-      new_handle = NULL;
+    while (_q.pop(new_entry))
+    {
+      queue_entry(new_entry);
     }
+    new_entry.record.body = SharedBuffer();
+
+    send_ready_batches(multi_handle);
 
     // Check for progress on any of our replication messages.  Compare
     // active_handles on either side of this call to see if some messages
     // are done.
-    int old_active_handles = active_handles;
-    curl_multi_perform(multi_handle, &active_handles);
+    int old_active_handles = _active_handles;
+    curl_multi_perform(multi_handle, &_active_handles);
 
-    if (old_active_handles != active_handles)
+    if (old_active_handles != _active_handles)
     {
       int outstanding_messages = 0;
       for(CURLMsg* msg = curl_multi_info_read(multi_handle, &outstanding_messages);
           msg != NULL;
           msg = curl_multi_info_read(multi_handle, &outstanding_messages))
       {
-        // Found a completed request, log and cleanup.
-        if (msg->data.result != CURLE_OK)
-        {
-          LOG_ERROR("Replication failed: %s", curl_easy_strerror(msg->data.result));
-        }
-        else
-        {
-          LOG_DEBUG("Replication successful");
-        }
-
-        // We're about to invalidate the data `msg` points to so remember the
-        // important bit and NULL `msg` now.
+        // Found a completed request.  We're about to invalidate the data
+        // `msg` points to so remember the important bits and NULL `msg` now.
         CURL* old_handle = msg->easy_handle;
+        CURLcode result = msg->data.result;
         msg = NULL;
 
-        std::string const * body_copy = NULL;
-        curl_easy_getinfo(old_handle, CURLINFO_PRIVATE, body_copy);
-        delete body_copy;
-
+        Message* message = NULL;
+        curl_easy_getinfo(old_handle, CURLINFO_PRIVATE, &message);
         curl_multi_remove_handle(multi_handle, old_handle);
-        curl_easy_cleanup(old_handle);
+        message_complete(old_handle, result, message);
       }
+
+      // Requests have completed, so there may be room to send more.
+      send_ready_batches(multi_handle);
+    }
+
+    publish_statistics();
+
+    // Sleep until a request's socket is ready, cURL has a timeout to handle,
+    // the next batch is due to be sent or we're woken for new timers.
+    // Clearing `_wake_pending` once the pipe has been emptied (and before
+    // checking the queue again) means a timer queued after that writes to
+    // the pipe again, so it can't be missed.
+    struct curl_waitfd wake_fd;
+    wake_fd.fd = _wake_fds[0];
+    wake_fd.events = CURL_WAIT_POLLIN;
+    wake_fd.revents = 0;
+    curl_multi_wait(multi_handle,
+                    (_wake_fds[0] >= 0) ? &wake_fd : NULL,
+                    (_wake_fds[0] >= 0) ? 1 : 0,
+                    wait_timeout_ms(),
+                    NULL);
+
+    if (wake_fd.revents != 0)
+    {
+      char bytes[64];
+      while (read(_wake_fds[0], bytes, sizeof(bytes)) > 0)
+      {
+      }
+      _wake_pending = false;
+    }
+  }
+
+  // Received terminate signal, throw away any timers that haven't been sent
+  // and shut down.
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    if (*it != NULL)
+    {
+      (*it)->queue.clear();
     }
   }
 
-  // Received terminate signal, shut down.
+  for (auto it = _idle_handles.begin(); it != _idle_handles.end(); it++)
+  {
+    curl_easy_cleanup(*it);
+  }
+  _idle_handles.clear();
+
+  for (auto it = _idle_messages.begin(); it != _idle_messages.end(); it++)
+  {
+    delete *it;
+  }
+  _idle_messages.clear();
+
   curl_multi_cleanup(multi_handle);
   pthread_exit(NULL);
 }
@@ -144,31 +257,534 @@ void Replicator::run()
 /* Private functions.                                                        */
 /*****************************************************************************/
 
-CURL* Replicator::create_curl_handle(const std::string& url,
-                                     const std::string& body)
+// Get the index for a node's address, giving it the next index if it hasn't
+// been seen before.  Safe to call from any thread.
+uint32_t Replicator::peer_index(const std::string& host)
+{
+  pthread_mutex_lock(&_peer_index_lock);
+  uint32_t index;
+  auto it = _peer_indexes.find(host);
+  if (it != _peer_indexes.end())
+  {
+    index = it->second;
+  }
+  else
+  {
+    index = _peer_hosts.size();
+    _peer_indexes[host] = index;
+    _peer_hosts.push_back(host);
+  }
+  pthread_mutex_unlock(&_peer_index_lock);
+  return index;
+}
+
+// Get the node with the given index, setting it up if it's new (or has been
+// forgotten).
+Replicator::Peer* Replicator::get_peer(uint32_t index)
+{
+  if (index >= _peers.size())
+  {
+    _peers.resize(index + 1, NULL);
+  }
+
+  if (_peers[index] == NULL)
+  {
+    pthread_mutex_lock(&_peer_index_lock);
+    std::string host = _peer_hosts[index];
+    pthread_mutex_unlock(&_peer_index_lock);
+
+    _peers[index] = new Peer(host);
+    _num_peers++;
+  }
+
+  return _peers[index];
+}
+
+// Add a timer to the queue for each of its nodes.
+void Replicator::queue_entry(const Entry& entry)
+{
+  for (uint32_t ii = 0; ii < entry.num_peers; ii++)
+  {
+    Peer* peer = get_peer(entry.peers[ii]);
+    size_t old_size = peer->queue.size();
+    peer->queue.push(entry.record, _max_queued_per_node);
+    peer->last_queued_us = entry.record.queued_us;
+    _queued = _queued + peer->queue.size() - old_size;
+  }
+}
+
+// Send batches from each node's queue while the node has room for more
+// requests in flight.  A batch is sent once it's full, or once the oldest
+// timer in it has waited for the batch window.  Nodes without the batch
+// endpoint are sent each timer as soon as there's room, and nodes backing off
+// after a failure are sent nothing.
+void Replicator::send_ready_batches(CURLM* multi_handle)
+{
+  if (_queued == 0)
+  {
+    return;
+  }
+
+  uint64_t now = now_us();
+
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    Peer* peer = *it;
+    if (peer == NULL)
+    {
+      continue;
+    }
+
+    if (now < peer->retry_us)
+    {
+      continue;
+    }
+
+    int batch_size = peer->unbatched ? 1 : _batch_size;
+    while ((!peer->queue.empty()) &&
+           (peer->in_flight < _connections_per_node) &&
+           (((int)peer->queue.size() >= batch_size) ||
+            (now >= peer->queue.front().queued_us + ((uint64_t)_batch_window_ms * 1000))))
+    {
+      peer->queue.pop(_batch, batch_size);
+      _queued -= _batch.size();
+      send_batch(peer, _batch, multi_handle);
+    }
+  }
+}
+
+// Send a batch of timers to their node.  The timers move into the message, and
+// the batch is left empty.  The message and its cURL handle are taken from the
+// pools if there are any.
+void Replicator::send_batch(Peer* peer, std::vector<Record>& batch, CURLM* multi_handle)
+{
+  Message* message;
+  if (!_idle_messages.empty())
+  {
+    message = _idle_messages.back();
+    _idle_messages.pop_back();
+  }
+  else
+  {
+    message = new Message();
+  }
+
+  int bind_port;
+  __globals->get_bind_port(bind_port);
+  char port[16];
+  snprintf(port, sizeof(port), "%d", bind_port);
+
+  message->peer = peer;
+  message->url.clear();
+  message->url += "http://";
+  message->url += peer->host;
+  message->url += ":";
+  message->url += port;
+  message->url += "/timers/";
+  message->queued_us = batch.front().queued_us;
+
+  if ((peer->json) && (message->queued_us >= peer->binary_retry_us))
+  {
+    ASYNC_LOG_DEBUG("Trying binary replication messages to %s again",
+                    peer->host.c_str());
+    peer->json = false;
+    peer->unbatched = false;
+  }
+
+  message->binary = !peer->json;
+  if (message->binary)
+  {
+    build_binary_message(message, batch);
+  }
+  else
+  {
+    build_json_message(message, batch);
+  }
+
+  ASYNC_LOG_DEBUG("Sending replication message with %lu timers to %s (%d connections open)",
+                  batch.size(),
+                  peer->host.c_str(),
+                  peer->connections);
+  CURL* curl = create_curl_handle(message, peer);
+  curl_multi_add_handle(multi_handle, curl);
+
+  // Since we added a handle to the multi handle, expect there to be an extra
+  // handle in the count.
+  _active_handles++;
+  peer->in_flight++;
+
+  // Keep the timers with the message, swapping in the message's old (empty)
+  // vector so the batch keeps a buffer to fill.
+  message->records.swap(batch);
+  batch.clear();
+}
+
+void Replicator::build_binary_message(Message* message, std::vector<Record>& batch)
+{
+  message->url += "batch";
+
+  _writer.start(message->batch_body);
+  for (auto it = batch.begin(); it != batch.end(); it++)
+  {
+    _writer.add(message->batch_body, it->body, it->fields_length);
+  }
+}
+
+// Build a JSON message for a node that doesn't accept binary messages.  A
+// single timer is sent on its own, otherwise the timers' JSON is gathered into
+// one body.
+void Replicator::build_json_message(Message* message, std::vector<Record>& batch)
 {
-  CURL* curl = curl_easy_init();
-  std::string const * body_copy = new std::string(body.c_str());
+  std::string& body = message->batch_body;
+  body.clear();
 
-  // Tell cURL to perform a POST but to call it a PUT, this allows
-  // us to easily pass a JSON body as a string.
-  //
-  // http://curl.haxx.se/mail/lib-2009-11/0001.html
-  curl_easy_setopt(curl, CURLOPT_POST, 1);
-  curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+  if (batch.size() > 1)
+  {
+    message->url += "batch";
+    body += "{\"timers\":[";
+  }
+
+  for (auto it = batch.begin(); it != batch.end(); it++)
+  {
+    Timer* timer = ReplicationCodec::decode_timer(it->body.data(), it->body.length());
+
+    if (batch.size() == 1)
+    {
+      message->url += timer->url_id();
+      body += timer->to_json();
+    }
+    else
+    {
+      if (it != batch.begin())
+      {
+        body += ",";
+      }
+      body += "{\"id\":\"";
+      body += timer->url_id();
+      body += "\",\"timer\":";
+      body += timer->to_json();
+      body += "}";
+    }
+
+    delete timer;
+  }
+
+  if (batch.size() > 1)
+  {
+    body += "]}";
+  }
+}
+
+// Handle a completed message, tracking the health of the node it was sent to.
+// Only a 2xx response counts as success: any other response, or no response
+// at all, is a failure.  The timers in a message that got no response or a
+// 5xx response are queued to be sent again after a backoff.  The exception is
+// a node that doesn't accept binary messages or batches, whose timers are
+// queued to be sent to it again straight away as JSON (or singly).  The message's cURL handle and buffers are then returned to
+// the pools.
+void Replicator::message_complete(CURL* curl, CURLcode result, Message* message)
+{
+  Peer* peer = message->peer;
+  const std::string& host = peer->host;
+  peer->in_flight--;
+
+  long http_code = 0;
+  if (result == CURLE_OK)
+  {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  }
+
+  if ((result == CURLE_OK) &&
+      (message->binary) &&
+      ((http_code == 404) || (http_code == 415)))
+  {
+    ASYNC_LOG_WARNING("Node %s rejected a binary replication message (%ld), sending JSON instead",
+                      host.c_str(),
+                      http_code);
+    peer->json = true;
+    peer->binary_retry_us = now_us() + BINARY_RETRY_INTERVAL_US;
+    peer->queue.push_front(message->records);
+    _queued += message->records.size();
+  }
+  else if ((result == CURLE_OK) &&
+           (!message->binary) &&
+           (message->records.size() > 1) &&
+           (http_code == 404))
+  {
+    // The node doesn't have the batch endpoint, so send it the timers one at
+    // a time.
+    ASYNC_LOG_WARNING("Node %s rejected a batch of replicated timers (%ld), sending them singly instead",
+                      host.c_str(),
+                      http_code);
+    peer->unbatched = true;
+    peer->queue.push_front(message->records);
+    _queued += message->records.size();
+  }
+  else if ((result != CURLE_OK) || (http_code < 200) || (http_code >= 300))
+  {
+    if (result != CURLE_OK)
+    {
+      // Don't trust the connections to the node until a new one has been
+      // opened, as the node may have restarted - possibly on a version that
+      // accepts binary messages.
+      LOG_ERROR("Replication to %s failed: %s", host.c_str(), curl_easy_strerror(result));
+      peer->reconnect = true;
+      peer->json = false;
+      peer->unbatched = false;
+    }
+    else
+    {
+      LOG_ERROR("Replication to %s failed: HTTP %ld", host.c_str(), http_code);
+    }
+    __statistics->increment(Statistics::REPLICATION_FAILURES);
+
+    if (++peer->consecutive_failures == PEER_FAILURE_THRESHOLD)
+    {
+      LOG_WARNING("Node %s is failing, %d replication requests have failed in a row",
+                  host.c_str(),
+                  peer->consecutive_failures);
+    }
+
+    if ((result != CURLE_OK) || (http_code >= 500))
+    {
+      // The node may recover, so send it the timers again once it has had a
+      // chance to.  A node that rejected the request outright would only
+      // reject it again.
+      uint64_t backoff_us = RETRY_BACKOFF_US << std::min(peer->consecutive_failures - 1, 6);
+      if (backoff_us > MAX_RETRY_BACKOFF_US)
+      {
+        backoff_us = MAX_RETRY_BACKOFF_US;
+      }
+      peer->retry_us = now_us() + backoff_us;
+
+      size_t old_size = peer->queue.size();
+      peer->queue.requeue(message->records, _max_queued_per_node);
+      _queued = _queued + peer->queue.size() - old_size;
+    }
+  }
+  else
+  {
+    if (peer->consecutive_failures >= PEER_FAILURE_THRESHOLD)
+    {
+      LOG_STATUS("Node %s is accepting replication requests again", host.c_str());
+    }
+    peer->consecutive_failures = 0;
 
-  // Set up the content type (as POSTFIELDS doesn't)
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, _headers);
+    // The time taken to deliver the message (including the time it spent
+    // queued) tells the replica stagger how long other replicas must wait
+    // for it.
+    ASYNC_LOG_DEBUG("Replication successful");
+    if (__replica_stagger != NULL)
+    {
+      __replica_stagger->record_replication(now_us() - message->queued_us);
+    }
+  }
+
+  message->records.clear();
+
+  if (_idle_messages.size() < MAX_IDLE_MESSAGES)
+  {
+    _idle_handles.push_back(curl);
+    _idle_messages.push_back(message);
+  }
+  else
+  {
+    curl_easy_cleanup(curl);
+    delete message;
+  }
+}
+
+// Set up a cURL handle (from the pool if there is one) to send a message to a
+// node.  A handle from the pool is reused as it is, as every option that
+// differs between messages is set again.
+CURL* Replicator::create_curl_handle(Message* message, Peer* peer)
+{
+  CURL* curl;
+  if (!_idle_handles.empty())
+  {
+    curl = _idle_handles.back();
+    _idle_handles.pop_back();
+  }
+  else
+  {
+    curl = curl_easy_init();
 
-  // The customized bits of this request.
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body_copy->data());
-  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, body.length());
+    // Tell cURL to perform a POST but to call it a PUT, this allows
+    // us to easily pass a body as a string.
+    //
+    // http://curl.haxx.se/mail/lib-2009-11/0001.html
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, REQUEST_TIMEOUT_MS);
 
-  // Save off the body. This is needed as otherwise the body string can be
-  // destroyed before the curl message has been sent, meaning the message
-  // is invalid.
-  curl_easy_setopt(curl, CURLOPT_PRIVATE, body_copy);
+    // Probe idle connections, so that a connection to a node that has gone
+    // away is noticed and closed rather than kept for the next request.
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 5L);
+
+    curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, &Replicator::open_socket);
+    curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, &Replicator::close_socket);
+  }
+
+  // The customized bits of this request, including the content type (as
+  // POSTFIELDS doesn't set it).
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, message->binary ? _binary_headers : _headers);
+  curl_easy_setopt(curl, CURLOPT_URL, message->url.c_str());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, message->batch_body.data());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)message->batch_body.length());
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, message);
+  curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, peer);
+  curl_easy_setopt(curl, CURLOPT_CLOSESOCKETDATA, peer);
+  curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, peer->reconnect ? 1L : 0L);
+  peer->reconnect = false;
 
   return curl;
 }
+
+// Pick up the current limits (these may be changed by a config reload).  The
+// window of requests in flight to each node matches the number of connections
+// kept to it, so a request normally has a connection to itself.
+void Replicator::refresh_config(CURLM* multi_handle)
+{
+  __globals->get_replication_batch_size(_batch_size);
+  __globals->get_replication_batch_window_ms(_batch_window_ms);
+  __globals->get_replication_connections_per_node(_connections_per_node);
+  __globals->get_replication_max_queued_per_node(_max_queued_per_node);
+
+  _batch_size = std::max(_batch_size, 1);
+  _connections_per_node = std::max(_connections_per_node, 1);
+  _max_queued_per_node = std::max(_max_queued_per_node, 1);
+
+  curl_multi_setopt(multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS, (long)_connections_per_node);
+  curl_multi_setopt(multi_handle,
+                    CURLMOPT_MAXCONNECTS,
+                    (long)(_connections_per_node * std::max(_num_peers, (size_t)1)));
+}
+
+// cURL open socket function, keeping count of the connections to each node.
+curl_socket_t Replicator::open_socket(void* clientp,
+                                      curlsocktype purpose,
+                                      struct curl_sockaddr* address)
+{
+  Peer* peer = (Peer*)clientp;
+  curl_socket_t fd = socket(address->family, address->socktype, address->protocol);
+
+  if (fd != CURL_SOCKET_BAD)
+  {
+    peer->connections++;
+    __statistics->increment(Statistics::REPLICATION_CONNECTIONS_OPENED);
+  }
+
+  return fd;
+}
+
+// cURL close socket function, keeping count of the connections to each node.
+int Replicator::close_socket(void* clientp, curl_socket_t fd)
+{
+  Peer* peer = (Peer*)clientp;
+  peer->connections--;
+  return close(fd);
+}
+
+// How long the worker thread can sleep before the oldest waiting batch is due
+// to be sent (or its node's backoff ends).  Batches for a node with no room for more requests in flight
+// wait for a request to complete instead.
+int Replicator::wait_timeout_ms()
+{
+  if (_wake_fds[0] < 0)
+  {
+    // Nothing will wake the thread for new timers, so check for them often.
+    return 10;
+  }
+
+  if (_queued == 0)
+  {
+    return IDLE_WAIT_MS;
+  }
+
+  uint64_t now = now_us();
+  uint64_t timeout_us = (uint64_t)IDLE_WAIT_MS * 1000;
+
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    Peer* peer = *it;
+    if ((peer != NULL) &&
+        (!peer->queue.empty()) &&
+        (peer->in_flight < _connections_per_node))
+    {
+      uint64_t due_us = std::max(peer->queue.front().queued_us + ((uint64_t)_batch_window_ms * 1000),
+                                 peer->retry_us);
+      timeout_us = std::min(timeout_us, (due_us > now) ? due_us - now : 0);
+    }
+  }
+
+  // Round up, so the batch is due by the time the thread wakes.
+  return (timeout_us + 999) / 1000;
+}
+
+// Report the depth and lag of each node's queue, at most every
+// PUBLISH_INTERVAL_US.  Nodes that have had nothing queued for them for
+// PEER_IDLE_US are dropped from the statistics, and forgotten once their
+// connections have closed (as cURL passes the node to the close socket
+// function).
+void Replicator::publish_statistics()
+{
+  uint64_t now = now_us();
+  if (now < _next_publish_us)
+  {
+    return;
+  }
+  _next_publish_us = now + PUBLISH_INTERVAL_US;
+
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    Peer* peer = *it;
+    if (peer == NULL)
+    {
+      continue;
+    }
+
+    if ((peer->queue.empty()) &&
+        (peer->in_flight == 0) &&
+        (now >= peer->last_queued_us + PEER_IDLE_US))
+    {
+      __statistics->remove_replication_peer(peer->host, this);
+      if (peer->connections == 0)
+      {
+        ASYNC_LOG_DEBUG("Forgetting idle replication peer %s", peer->host.c_str());
+        delete peer;
+        *it = NULL;
+        _num_peers--;
+      }
+      continue;
+    }
+
+    Statistics::ReplicationPeer stats;
+    stats.queued = peer->queue.size();
+    stats.in_flight = peer->in_flight;
+    stats.lag_ms = peer->queue.empty() ? 0 : (now - peer->queue.front().queued_us) / 1000;
+    stats.coalesced = peer->queue.coalesced();
+    stats.dropped = peer->queue.dropped();
+    __statistics->set_replication_peer(peer->host, this, stats);
+  }
+}
+
+// Wake the worker thread, unless it's already been woken and hasn't yet
+// looked for new timers.
+void Replicator::wake()
+{
+  if ((_wake_fds[1] >= 0) && (!_wake_pending.exchange(true)))
+  {
+    char byte = 0;
+    ssize_t rc = write(_wake_fds[1], &byte, 1);
+    (void)rc;
+  }
+}
+
+uint64_t Replicator::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -0,0 +1,247 @@
+#include "resolver.h"
+#include "log.h"
+#include "async_logger.h"
+
+#include <cstring>
+#include <time.h>
+#include <netdb.h>
+
+// How long an address is used for before it's looked up again, how long a
+// failed lookup is remembered for, and how long a name can go unused before
+// it's forgotten.
+static const uint64_t ADDRESS_CACHE_MS = 60000;
+static const uint64_t FAILURE_CACHE_MS = 5000;
+static const uint64_t MAX_UNUSED_MS = 5 * 60000;
+
+Resolver::Resolver() :
+  _cache(),
+  _queue(),
+  _terminated(false)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  _cond = new CondVar(&_mutex);
+
+  int thread_rc = pthread_create(&_thread,
+                                 NULL,
+                                 Resolver::resolver_thread_entry_point,
+                                 (void*)this);
+  if (thread_rc != 0)
+  {
+    // Without the thread, names are looked up by the threads that want them.
+    LOG_ERROR("Failed to start resolver thread: %s", strerror(thread_rc));
+    _terminated = true;
+  }
+}
+
+Resolver::~Resolver()
+{
+  pthread_mutex_lock(&_mutex);
+  bool running = !_terminated;
+  _terminated = true;
+  _cond->signal();
+  pthread_mutex_unlock(&_mutex);
+
+  if (running)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  delete _cond;
+  pthread_mutex_destroy(&_mutex);
+}
+
+void* Resolver::resolver_thread_entry_point(void* resolver)
+{
+  ((Resolver*)resolver)->run();
+  return NULL;
+}
+
+Resolver::Result Resolver::lookup(const std::string& host,
+                                  const std::string& port,
+                                  struct sockaddr_storage* address,
+                                  socklen_t* address_len)
+{
+  if (resolve(host, port, AI_NUMERICHOST | AI_NUMERICSERV, address, address_len))
+  {
+    return RESOLVED;
+  }
+
+  uint64_t now_ms = monotonic_time_ms();
+  pthread_mutex_lock(&_mutex);
+
+  Key key(host, port);
+  auto it = _cache.find(key);
+  if (it == _cache.end())
+  {
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    it = _cache.insert(std::make_pair(key, entry)).first;
+  }
+
+  Entry& entry = it->second;
+  entry.used_ms = now_ms;
+
+  bool fresh = ((entry.address_len != 0) &&
+                (now_ms < entry.resolved_ms + ADDRESS_CACHE_MS));
+  bool recently_failed = ((entry.failed) &&
+                          (now_ms < entry.failed_ms + FAILURE_CACHE_MS));
+  if ((!fresh) && (!recently_failed) && (!entry.queued))
+  {
+    if (_terminated)
+    {
+      // There's no resolver thread, so look the name up here.
+      struct sockaddr_storage resolved;
+      socklen_t resolved_len = 0;
+      pthread_mutex_unlock(&_mutex);
+      bool ok = resolve(host, port, 0, &resolved, &resolved_len);
+      pthread_mutex_lock(&_mutex);
+      update(entry, ok, resolved, resolved_len, now_ms);
+    }
+    else
+    {
+      entry.queued = true;
+      _queue.push_back(key);
+      _cond->signal();
+    }
+  }
+
+  // Use the address we have, even if it's old, rather than waiting for it to
+  // be looked up again.
+  Result rc;
+  if (entry.address_len != 0)
+  {
+    memcpy(address, &entry.address, entry.address_len);
+    *address_len = entry.address_len;
+    rc = RESOLVED;
+  }
+  else
+  {
+    rc = entry.failed ? FAILED : PENDING;
+  }
+
+  pthread_mutex_unlock(&_mutex);
+  return rc;
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Look up the names queued by `lookup()` one at a time, forgetting names that
+// haven't been used for a while in between.
+void Resolver::run()
+{
+  pthread_mutex_lock(&_mutex);
+
+  while (!_terminated)
+  {
+    if (_queue.empty())
+    {
+      evict_unused(monotonic_time_ms());
+
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ts.tv_sec += ADDRESS_CACHE_MS / 1000;
+      _cond->timedwait(&ts);
+      continue;
+    }
+
+    Key key = _queue.front();
+    _queue.pop_front();
+    pthread_mutex_unlock(&_mutex);
+
+    struct sockaddr_storage resolved;
+    socklen_t resolved_len = 0;
+    bool ok = resolve(key.first, key.second, 0, &resolved, &resolved_len);
+    uint64_t now_ms = monotonic_time_ms();
+
+    pthread_mutex_lock(&_mutex);
+    auto it = _cache.find(key);
+    if (it != _cache.end())
+    {
+      it->second.queued = false;
+      update(it->second, ok, resolved, resolved_len, now_ms);
+    }
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Forget the names that haven't been looked up recently.  Must be called with
+// the mutex held.
+void Resolver::evict_unused(uint64_t now_ms)
+{
+  auto it = _cache.begin();
+  while (it != _cache.end())
+  {
+    if ((!it->second.queued) && (now_ms > it->second.used_ms + MAX_UNUSED_MS))
+    {
+      _cache.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+// Record the result of looking up a name.  If the lookup failed, we keep any
+// address we already had, but don't try again for a while.  Must be called
+// with the mutex held.
+void Resolver::update(Entry& entry,
+                      bool ok,
+                      const struct sockaddr_storage& address,
+                      socklen_t address_len,
+                      uint64_t now_ms)
+{
+  if (ok)
+  {
+    memcpy(&entry.address, &address, address_len);
+    entry.address_len = address_len;
+    entry.resolved_ms = now_ms;
+    entry.failed = false;
+  }
+  else
+  {
+    entry.failed = true;
+    entry.failed_ms = now_ms;
+  }
+}
+
+// Look up the first address for a host and port.  With AI_NUMERICHOST, this
+// only parses numeric addresses, and never blocks.
+bool Resolver::resolve(const std::string& host,
+                       const std::string& port,
+                       int flags,
+                       struct sockaddr_storage* address,
+                       socklen_t* address_len)
+{
+  struct addrinfo hints;
+  struct addrinfo* result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+
+  int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if ((rc != 0) || (result == NULL))
+  {
+    if ((rc != 0) && (!(flags & AI_NUMERICHOST)))
+    {
+      ASYNC_LOG_DEBUG("Failed to resolve %s: %s", host.c_str(), gai_strerror(rc));
+    }
+    return false;
+  }
+
+  memcpy(address, result->ai_addr, result->ai_addrlen);
+  *address_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+uint64_t Resolver::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,270 @@
+#include "statistics.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+#include <algorithm>
+
+// The one and only statistics object - like the globals this must be
+// initialized at start of day and destroyed before main() returns.
+Statistics* __statistics;
+
+const char* const Statistics::COUNTER_NAMES[NUM_COUNTERS] =
+{
+  "callback-successes",
+  "callback-failures",
+  "callback-deadline-misses",
+  "callback-retries",
+  "callback-retries-exhausted",
+  "callback-circuit-opens",
+  "callback-circuit-rejections",
+  "callback-connections-warmed",
+  "callback-warm-connections-used",
+  "callback-io-syscalls",
+  "callback-reschedules",
+  "callback-cancels",
+  "pop-slices",
+  "pop-deferrals",
+  "replication-failures",
+  "replication-connections-opened",
+  "replication-coalesced",
+  "replication-drops"
+};
+
+const char* const Statistics::GAUGE_NAMES[NUM_GAUGES] =
+{
+  "pop-backlog",
+  "pop-backlog-peak",
+  "pop-backlog-max-lateness-us",
+  "replica-stagger-ms"
+};
+
+const char* const Statistics::LATENCY_NAMES[NUM_LATENCIES] =
+{
+  "pop-lateness",
+  "dispatch-delay",
+  "callback-rtt",
+  "dispatch-lateness"
+};
+
+const char* const Statistics::PRECISION_CLASS_NAMES[NUM_PRECISION_CLASSES] =
+{
+  "short",
+  "long",
+  "heap"
+};
+
+Statistics::Statistics()
+{
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    _counters[ii] = 0;
+  }
+  for (int ii = 0; ii < NUM_GAUGES; ii++)
+  {
+    _gauges[ii] = 0;
+  }
+  pthread_mutex_init(&_peers_lock, NULL);
+}
+
+Statistics::~Statistics()
+{
+  pthread_mutex_destroy(&_peers_lock);
+}
+
+void Statistics::increment(Counter counter, uint64_t count)
+{
+  _counters[counter].fetch_add(count, std::memory_order_relaxed);
+}
+
+uint64_t Statistics::get(Counter counter)
+{
+  return _counters[counter].load(std::memory_order_relaxed);
+}
+
+void Statistics::set(Gauge gauge, uint64_t value)
+{
+  _gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void Statistics::update_max(Gauge gauge, uint64_t value)
+{
+  uint64_t max = _gauges[gauge].load(std::memory_order_relaxed);
+  while ((value > max) &&
+         (!_gauges[gauge].compare_exchange_weak(max, value, std::memory_order_relaxed)))
+  {
+  }
+}
+
+uint64_t Statistics::get(Gauge gauge)
+{
+  return _gauges[gauge].load(std::memory_order_relaxed);
+}
+
+void Statistics::record_latency(Latency latency, PrecisionClass precision, uint64_t us)
+{
+  _latencies[latency][precision].record(us);
+}
+
+Histogram* Statistics::latency(Latency latency, PrecisionClass precision)
+{
+  return &_latencies[latency][precision];
+}
+
+void Statistics::set_replication_peer(const std::string& node,
+                                      const void* source,
+                                      const ReplicationPeer& peer)
+{
+  pthread_mutex_lock(&_peers_lock);
+  _peers[node][source] = peer;
+  pthread_mutex_unlock(&_peers_lock);
+}
+
+void Statistics::remove_replication_peer(const std::string& node, const void* source)
+{
+  pthread_mutex_lock(&_peers_lock);
+  auto it = _peers.find(node);
+  if (it != _peers.end())
+  {
+    it->second.erase(source);
+    if (it->second.empty())
+    {
+      _peers.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&_peers_lock);
+}
+
+void Statistics::remove_replication_peers(const void* source)
+{
+  pthread_mutex_lock(&_peers_lock);
+  auto it = _peers.begin();
+  while (it != _peers.end())
+  {
+    it->second.erase(source);
+    if (it->second.empty())
+    {
+      _peers.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+  pthread_mutex_unlock(&_peers_lock);
+}
+
+Statistics::PrecisionClass Statistics::precision_class(uint32_t interval_ms)
+{
+  if (interval_ms < 1000)
+  {
+    return SHORT_TIMERS;
+  }
+  else if (interval_ms < 60 * 60 * 1000)
+  {
+    return LONG_TIMERS;
+  }
+  else
+  {
+    return HEAP_TIMERS;
+  }
+}
+
+// The statistics take the form:
+//
+// {
+//     "<counter>": Int,
+//     ...
+//     "<gauge>": Int,
+//     ...
+//     "latency": {
+//         "<latency>": {
+//             "<precision class>": {
+//                 "count": Int, "mean": Int, "p50": Int, "p90": Int,
+//                 "p99": Int, "p999": Int, "max": Int
+//             },
+//             ...
+//         },
+//         ...
+//     },
+//     "replication-peers": {
+//         "<node>": {
+//             "queued": Int, "in-flight": Int, "lag-ms": Int,
+//             "coalesced": Int, "dropped": Int
+//         },
+//         ...
+//     }
+// }
+//
+// The lag is the longest that a timer queued for the node has waited.
+std::string Statistics::to_json()
+{
+  rapidjson::StringBuffer s;
+  rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+  w.StartObject();
+  for (int ii = 0; ii < NUM_COUNTERS; ii++)
+  {
+    w.String(COUNTER_NAMES[ii]);
+    w.Uint64(get((Counter)ii));
+  }
+  for (int ii = 0; ii < NUM_GAUGES; ii++)
+  {
+    w.String(GAUGE_NAMES[ii]);
+    w.Uint64(get((Gauge)ii));
+  }
+
+  w.String("latency");
+  w.StartObject();
+  for (int ii = 0; ii < NUM_LATENCIES; ii++)
+  {
+    w.String(LATENCY_NAMES[ii]);
+    w.StartObject();
+    for (int jj = 0; jj < NUM_PRECISION_CLASSES; jj++)
+    {
+      Histogram& h = _latencies[ii][jj];
+      w.String(PRECISION_CLASS_NAMES[jj]);
+      w.StartObject();
+      w.String("count"); w.Uint64(h.count());
+      w.String("mean"); w.Uint64(h.mean());
+      w.String("p50"); w.Uint64(h.percentile(50));
+      w.String("p90"); w.Uint64(h.percentile(90));
+      w.String("p99"); w.Uint64(h.percentile(99));
+      w.String("p999"); w.Uint64(h.percentile(99.9));
+      w.String("max"); w.Uint64(h.max());
+      w.EndObject();
+    }
+    w.EndObject();
+  }
+  w.EndObject();
+
+  w.String("replication-peers");
+  w.StartObject();
+  pthread_mutex_lock(&_peers_lock);
+  for (auto it = _peers.begin(); it != _peers.end(); it++)
+  {
+    ReplicationPeer total = {0, 0, 0, 0, 0};
+    for (auto jt = it->second.begin(); jt != it->second.end(); jt++)
+    {
+      total.queued += jt->second.queued;
+      total.in_flight += jt->second.in_flight;
+      total.lag_ms = std::max(total.lag_ms, jt->second.lag_ms);
+      total.coalesced += jt->second.coalesced;
+      total.dropped += jt->second.dropped;
+    }
+
+    w.String(it->first.c_str(), it->first.length());
+    w.StartObject();
+    w.String("queued"); w.Uint64(total.queued);
+    w.String("in-flight"); w.Uint64(total.in_flight);
+    w.String("lag-ms"); w.Uint64(total.lag_ms);
+    w.String("coalesced"); w.Uint64(total.coalesced);
+    w.String("dropped"); w.Uint64(total.dropped);
+    w.EndObject();
+  }
+  pthread_mutex_unlock(&_peers_lock);
+  w.EndObject();
+
+  w.EndObject();
+
+  return std::string(s.GetString(), s.Size());
+}
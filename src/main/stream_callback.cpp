@@ -0,0 +1,543 @@
+#include "stream_callback.h"
+#include "globals.h"
+#include "statistics.h"
+#include "log.h"
+#include "async_logger.h"
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include <event2/keyvalq_struct.h>
+
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+// The window a subscription gets if it doesn't ask for one, and the largest
+// window it can ask for.
+static const unsigned int DEFAULT_WINDOW = 100;
+static const unsigned int MAX_WINDOW = 10000;
+
+// How often an empty line is sent on idle subscriptions, so that neither end
+// (nor anything in between) closes them.
+static const int HEARTBEAT_INTERVAL_S = 10;
+
+// Timer IDs are sent to consumers as 16 hex digits.
+static std::string timer_id_str(TimerID id)
+{
+  std::stringstream ss;
+  ss << std::setfill('0') << std::setw(16) << std::hex << id;
+  return ss.str();
+}
+
+static bool parse_timer_id(const rapidjson::Value& value, TimerID& id)
+{
+  if (!value.IsString())
+  {
+    return false;
+  }
+
+  char* end;
+  errno = 0;
+  id = strtoull(value.GetString(), &end, 16);
+  return ((errno == 0) && (end != value.GetString()) && (*end == '\0'));
+}
+
+StreamCallback::StreamCallback(struct event_base* base) :
+  _base(base),
+  _wake_event(NULL),
+  _heartbeat_event(NULL),
+  _subscriptions(),
+  _pending(),
+  _awaiting(),
+  _incomplete(0)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  _cond = new CondVar(&_mutex);
+
+  if (pipe2(_wake_fds, O_NONBLOCK | O_CLOEXEC) == 0)
+  {
+    _wake_event = event_new(_base, _wake_fds[0], EV_READ | EV_PERSIST, wake_cb, this);
+    event_add(_wake_event, NULL);
+  }
+  else
+  {
+    // Pops will still be delivered to new subscriptions and as pops are
+    // acknowledged, but not as soon as they're due.
+    LOG_ERROR("Failed to create pipe for stream callbacks: %d", errno);
+    _wake_fds[0] = -1;
+    _wake_fds[1] = -1;
+  }
+
+  struct timeval heartbeat_interval = {HEARTBEAT_INTERVAL_S, 0};
+  _heartbeat_event = event_new(_base, -1, EV_PERSIST, heartbeat_cb, this);
+  event_add(_heartbeat_event, &heartbeat_interval);
+}
+
+StreamCallback::~StreamCallback()
+{
+  if (_wake_event != NULL)
+  {
+    event_free(_wake_event);
+    ::close(_wake_fds[0]);
+    ::close(_wake_fds[1]);
+  }
+  event_free(_heartbeat_event);
+
+  // The subscriptions' requests belong to the HTTP server, which closes them
+  // when it's freed, so just make sure we don't hear about it.
+  for (auto it = _subscriptions.begin(); it != _subscriptions.end(); it++)
+  {
+    for (auto jt = it->second.begin(); jt != it->second.end(); jt++)
+    {
+      evhttp_connection_set_closecb(evhttp_request_get_connection((*jt)->req), NULL, NULL);
+      evbuffer_free((*jt)->out);
+      delete *jt;
+    }
+  }
+
+  delete _cond;
+  pthread_mutex_destroy(&_mutex);
+}
+
+// Perform a single callback, delivering the opaque data to a subscription for
+// the given key.  The consumer only sees the sequence number (the timer ID is
+// zero).
+bool StreamCallback::perform(std::string key, const SharedBuffer& body, unsigned int sequence_number)
+{
+  Timer timer(0, 0, 0);
+  timer.callback_url = key;
+  timer.callback_body = body;
+  timer.sequence_number = sequence_number;
+
+  std::vector<CallbackRequest> requests(1, CallbackRequest(&timer));
+  perform_all(requests);
+  return requests[0].success;
+}
+
+// Queue a batch of pops for the event loop to send to their subscriptions,
+// then wait for them all to be acknowledged (or for the callback timeout).
+// Pops for keys with no subscriptions fail straight away.  None are ever
+// deferred, as queueing a pop costs next to nothing.
+void StreamCallback::perform_all(std::vector<CallbackRequest>& requests,
+                                 uint64_t start_deadline_us)
+{
+  int timeout_ms;
+  __globals->get_callback_timeout_ms(timeout_ms);
+
+  pthread_mutex_lock(&_mutex);
+
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    it->success = false;
+
+    auto subscriptions = _subscriptions.find(it->timer->callback_url);
+    if (subscriptions == _subscriptions.end())
+    {
+      ASYNC_LOG_DEBUG("No subscriptions for stream %s",
+                      it->timer->callback_url.c_str());
+      continue;
+    }
+
+    _pending[it->timer->callback_url].push_back(&(*it));
+    _incomplete++;
+  }
+
+  if (_incomplete > 0)
+  {
+    wake();
+
+    // Work out when to give up on the pops, as a monotonic time (to match the
+    // condition variable's clock).
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+    while ((_incomplete > 0) && (_cond->timedwait(&ts) != ETIMEDOUT))
+    {
+    }
+
+    if (_incomplete > 0)
+    {
+      // Withdraw the pops that are still outstanding.  Pops that were sent no
+      // longer count against their subscription's window, and any late
+      // acknowledgements for them are ignored.
+      ASYNC_LOG_WARNING_RATE_LIMITED("%lu stream callbacks timed out", _incomplete);
+      __statistics->increment(Statistics::CALLBACK_DEADLINE_MISSES, _incomplete);
+
+      for (auto it = _awaiting.begin(); it != _awaiting.end(); it++)
+      {
+        it->second.first->credit++;
+        complete(it->second.second, false);
+      }
+      _awaiting.clear();
+
+      for (auto it = _pending.begin(); it != _pending.end(); it++)
+      {
+        for (auto jt = it->second.begin(); jt != it->second.end(); jt++)
+        {
+          complete(*jt, false);
+        }
+      }
+      _pending.clear();
+    }
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Start a subscription.  The request is answered with the start of a chunked
+// response that stays open for as long as the consumer wants pops.
+void StreamCallback::handle_subscribe(struct evhttp_request* req)
+{
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET)
+  {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  struct evkeyvalq params;
+  const char* query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  if ((query == NULL) || (evhttp_parse_query_str(query, &params) != 0))
+  {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Missing key");
+    return;
+  }
+
+  const char* key = evhttp_find_header(&params, "key");
+  const char* window_str = evhttp_find_header(&params, "window");
+  unsigned long window = DEFAULT_WINDOW;
+  char* end = NULL;
+  if (window_str != NULL)
+  {
+    window = strtoul(window_str, &end, 10);
+  }
+
+  if ((key == NULL) || (*key == '\0'))
+  {
+    evhttp_clear_headers(&params);
+    evhttp_send_error(req, HTTP_BADREQUEST, "Missing key");
+    return;
+  }
+
+  if ((window_str != NULL) &&
+      ((*end != '\0') || (window == 0) || (window > MAX_WINDOW)))
+  {
+    evhttp_clear_headers(&params);
+    evhttp_send_error(req, HTTP_BADREQUEST, "Invalid window");
+    return;
+  }
+
+  Subscription* subscription = new Subscription();
+  subscription->owner = this;
+  subscription->key = key;
+  subscription->req = req;
+  subscription->out = evbuffer_new();
+  subscription->credit = window;
+  evhttp_clear_headers(&params);
+
+  ASYNC_LOG_INFO("New subscription for stream %s with window %lu",
+                 subscription->key.c_str(),
+                 window);
+
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/x-ndjson");
+  evhttp_send_reply_start(req, HTTP_OK, "OK");
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                close_cb,
+                                subscription);
+
+  pthread_mutex_lock(&_mutex);
+  _subscriptions[subscription->key].push_back(subscription);
+  dispatch();
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Handle a batch of acknowledgements.  The body takes the form:
+// {
+//     "acknowledged": [ <comma separated timer IDs> ],
+//     "rejected": [ <comma separated timer IDs> ],
+//     "updates": { <timer ID>: <update>, ... }
+// }
+// where "rejected" and "updates" are optional, and each update is in the
+// format of the response to a single callback (see
+// CallbackRequest::parse_response).  Each acknowledged or rejected pop gives
+// its subscription back a credit.
+void StreamCallback::handle_acknowledge(struct evhttp_request* req)
+{
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST)
+  {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  struct evbuffer* evbuf = evhttp_request_get_input_buffer(req);
+  size_t length = evbuffer_get_length(evbuf);
+  std::string body((const char*)evbuffer_pullup(evbuf, length), length);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(body.c_str());
+  if ((doc.HasParseError()) ||
+      (!doc.IsObject()) ||
+      (!doc.HasMember("acknowledged")) ||
+      (!doc["acknowledged"].IsArray()) ||
+      ((doc.HasMember("rejected")) && (!doc["rejected"].IsArray())))
+  {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Invalid acknowledgements");
+    return;
+  }
+
+  rapidjson::Value* updates = NULL;
+  if ((doc.HasMember("updates")) && (doc["updates"].IsObject()))
+  {
+    updates = &doc["updates"];
+  }
+
+  pthread_mutex_lock(&_mutex);
+
+  const char* lists[] = {"acknowledged", "rejected"};
+  for (int ii = 0; ii < 2; ii++)
+  {
+    if (!doc.HasMember(lists[ii]))
+    {
+      continue;
+    }
+
+    bool success = (ii == 0);
+    rapidjson::Value& ids = doc[lists[ii]];
+    for (auto it = ids.Begin(); it != ids.End(); it++)
+    {
+      TimerID id;
+      auto awaiting = _awaiting.end();
+      if (parse_timer_id(*it, id))
+      {
+        awaiting = _awaiting.find(id);
+      }
+
+      if (awaiting == _awaiting.end())
+      {
+        // The pop has already timed out, or was never sent.
+        continue;
+      }
+
+      Subscription* subscription = awaiting->second.first;
+      CallbackRequest* request = awaiting->second.second;
+      _awaiting.erase(awaiting);
+      subscription->credit++;
+
+      if ((success) &&
+          (updates != NULL) &&
+          (updates->HasMember(it->GetString())))
+      {
+        request->parse_response((*updates)[it->GetString()]);
+      }
+      complete(request, success);
+    }
+  }
+
+  dispatch();
+  pthread_mutex_unlock(&_mutex);
+
+  evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+void StreamCallback::subscribe_cb(struct evhttp_request* req, void* stream_callback)
+{
+  ((StreamCallback*)stream_callback)->handle_subscribe(req);
+}
+
+void StreamCallback::acknowledge_cb(struct evhttp_request* req, void* stream_callback)
+{
+  ((StreamCallback*)stream_callback)->handle_acknowledge(req);
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Send as many pending pops as the subscriptions have credit for, sharing the
+// pops for each key between its subscriptions in turn.  Each pop is sent as a
+// line of JSON:
+//
+//   {"id": "<timer ID as 16 hex digits>", "sequence-number": Int, "opaque": "string"}
+//
+// and all the pops for a subscription are sent as a single chunk.  Pops for
+// keys that no longer have any subscriptions fail.  Must be called on the
+// event loop with the mutex held.
+void StreamCallback::dispatch()
+{
+  std::vector<Subscription*> written;
+  uint64_t now_us = CallbackRequest::now_us();
+
+  for (auto it = _pending.begin(); it != _pending.end(); )
+  {
+    std::deque<CallbackRequest*>& pops = it->second;
+    auto subscriptions = _subscriptions.find(it->first);
+
+    if (subscriptions == _subscriptions.end())
+    {
+      for (auto jt = pops.begin(); jt != pops.end(); jt++)
+      {
+        complete(*jt, false);
+      }
+      pops.clear();
+    }
+    else
+    {
+      std::list<Subscription*>& subs = subscriptions->second;
+      size_t without_credit = 0;
+      while ((!pops.empty()) && (without_credit < subs.size()))
+      {
+        Subscription* subscription = subs.front();
+        subs.splice(subs.end(), subs, subs.begin());
+        if (subscription->credit == 0)
+        {
+          without_credit++;
+          continue;
+        }
+        without_credit = 0;
+
+        CallbackRequest* request = pops.front();
+        pops.pop_front();
+        Timer* timer = request->timer;
+
+        rapidjson::StringBuffer s;
+        rapidjson::Writer<rapidjson::StringBuffer> w(s);
+        w.StartObject();
+        w.String("id");
+        w.String(timer_id_str(timer->id).c_str());
+        w.String("sequence-number");
+        w.Uint(timer->sequence_number);
+        w.String("opaque");
+        w.String(timer->callback_body.data(), timer->callback_body.length());
+        w.EndObject();
+
+        if (evbuffer_get_length(subscription->out) == 0)
+        {
+          written.push_back(subscription);
+        }
+        evbuffer_add(subscription->out, s.GetString(), s.Size());
+        evbuffer_add(subscription->out, "\n", 1);
+
+        subscription->credit--;
+        request->started_us = now_us;
+        _awaiting[timer->id] = std::make_pair(subscription, request);
+      }
+    }
+
+    if (pops.empty())
+    {
+      _pending.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  for (auto it = written.begin(); it != written.end(); it++)
+  {
+    evhttp_send_reply_chunk((*it)->req, (*it)->out);
+  }
+}
+
+// Mark a pop as completed.  Must be called with the mutex held.
+void StreamCallback::complete(CallbackRequest* request, bool success)
+{
+  request->success = success;
+  request->completed_us = CallbackRequest::now_us();
+  _incomplete--;
+  if (_incomplete == 0)
+  {
+    _cond->signal();
+  }
+}
+
+// Tidy up after a consumer closes its subscription.  The pops waiting on it
+// fail, and it's offered no more.  Must be called with the mutex held.
+void StreamCallback::close(Subscription* subscription)
+{
+  ASYNC_LOG_INFO("Subscription for stream %s closed", subscription->key.c_str());
+
+  for (auto it = _awaiting.begin(); it != _awaiting.end(); )
+  {
+    if (it->second.first == subscription)
+    {
+      complete(it->second.second, false);
+      _awaiting.erase(it++);
+    }
+    else
+    {
+      it++;
+    }
+  }
+
+  std::list<Subscription*>& subs = _subscriptions[subscription->key];
+  subs.remove(subscription);
+  if (subs.empty())
+  {
+    _subscriptions.erase(subscription->key);
+  }
+
+  evbuffer_free(subscription->out);
+  delete subscription;
+}
+
+// Wake the event loop to send newly queued pops.  The pipe only needs to hold
+// one byte for the loop to wake, so a full pipe is fine.
+void StreamCallback::wake()
+{
+  if (_wake_fds[1] >= 0)
+  {
+    char byte = 0;
+    ssize_t rc = write(_wake_fds[1], &byte, 1);
+    (void)rc;
+  }
+}
+
+void StreamCallback::wake_cb(evutil_socket_t fd, short events, void* stream_callback)
+{
+  StreamCallback* self = (StreamCallback*)stream_callback;
+  char bytes[64];
+  while (read(fd, bytes, sizeof(bytes)) > 0)
+  {
+  }
+
+  pthread_mutex_lock(&self->_mutex);
+  self->dispatch();
+  pthread_mutex_unlock(&self->_mutex);
+}
+
+void StreamCallback::heartbeat_cb(evutil_socket_t fd, short events, void* stream_callback)
+{
+  StreamCallback* self = (StreamCallback*)stream_callback;
+
+  pthread_mutex_lock(&self->_mutex);
+  for (auto it = self->_subscriptions.begin(); it != self->_subscriptions.end(); it++)
+  {
+    for (auto jt = it->second.begin(); jt != it->second.end(); jt++)
+    {
+      evbuffer_add((*jt)->out, "\n", 1);
+      evhttp_send_reply_chunk((*jt)->req, (*jt)->out);
+    }
+  }
+  pthread_mutex_unlock(&self->_mutex);
+}
+
+void StreamCallback::close_cb(struct evhttp_connection* connection, void* subscription)
+{
+  StreamCallback* self = ((Subscription*)subscription)->owner;
+
+  pthread_mutex_lock(&self->_mutex);
+  self->close((Subscription*)subscription);
+  pthread_mutex_unlock(&self->_mutex);
+}
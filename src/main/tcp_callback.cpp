@@ -0,0 +1,609 @@
+#include "tcp_callback.h"
+#include "globals.h"
+#include "statistics.h"
+#include "log.h"
+#include "async_logger.h"
+
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// The size of the fixed part of pop and acknowledgement frames (after the
+// length), and the largest acknowledgement we'll accept.
+static const size_t POP_HEADER_SIZE = 12;
+static const size_t ACK_SIZE = 13;
+static const size_t MAX_ACK_SIZE = 64 * 1024;
+
+// Opaque data at least this big is sent from the timer's own buffer, rather
+// than being copied in with the frame header.
+static const size_t MIN_GATHERED_BODY_SIZE = 1024;
+
+TCPCallback::TCPCallback() :
+  _engine(NULL),
+  _resolver(),
+  _connections(),
+  _timeout_ms(0),
+  _breaker_failures(0),
+  _breaker_reset_ms(0)
+{
+  std::string engine_type;
+  __globals->get_callback_tcp_io_engine(engine_type);
+  _engine = IOEngine::create(engine_type);
+  if (_engine == NULL)
+  {
+    LOG_ERROR("Couldn't create %s I/O engine for TCP callbacks, using epoll",
+              engine_type.c_str());
+    _engine = IOEngine::create("epoll");
+  }
+
+  if (_engine != NULL)
+  {
+    LOG_STATUS("TCP callbacks using %s", _engine->name());
+  }
+  else
+  {
+    // We can't do any socket I/O, so every TCP callback fails.
+    LOG_ERROR("Couldn't create epoll I/O engine, TCP callbacks will fail");
+  }
+}
+
+TCPCallback::~TCPCallback()
+{
+  for (auto it = _connections.begin(); it != _connections.end(); it++)
+  {
+    close(&it->second);
+  }
+  _connections.clear();
+  delete _engine; _engine = NULL;
+}
+
+// Perform a single callback, streaming the opaque data to the consumer at the
+// given address.  The consumer only sees the sequence number (the timer ID is
+// zero).
+bool TCPCallback::perform(std::string address, const SharedBuffer& body, unsigned int sequence_number)
+{
+  Timer timer(0, 0, 0);
+  timer.callback_url = address;
+  timer.callback_body = body;
+  timer.sequence_number = sequence_number;
+
+  std::vector<CallbackRequest> requests(1, CallbackRequest(&timer));
+  perform_all(requests);
+  return requests[0].success;
+}
+
+// Stream a batch of pops to their consumers, then wait for them all to be
+// acknowledged (or for the callback timeout).  Every pop is sent straight
+// away, so none are ever deferred.
+void TCPCallback::perform_all(std::vector<CallbackRequest>& requests,
+                              uint64_t start_deadline_us)
+{
+  refresh_config();
+
+  if (_engine == NULL)
+  {
+    for (auto it = requests.begin(); it != requests.end(); it++)
+    {
+      it->success = false;
+    }
+    return;
+  }
+
+  // Pick up anything that's happened on the connections since the last batch,
+  // so that we don't lose a batch of pops to a connection the consumer has
+  // already closed.
+  std::vector<IOEngine::Completion> completions;
+  _engine->wait(completions, 0);
+  handle(completions);
+
+  uint64_t now_ms = monotonic_time_ms();
+  std::vector<Connection*> active;
+
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    Timer* timer = it->timer;
+    it->success = false;
+
+    Connection* connection = get_connection(timer->callback_url);
+    if (!connection->breaker.allow(now_ms))
+    {
+      ASYNC_LOG_DEBUG("Rejecting callback to %s as the circuit is open",
+                      timer->callback_url.c_str());
+      __statistics->increment(Statistics::CALLBACK_CIRCUIT_REJECTIONS);
+      continue;
+    }
+
+    if ((connection->fd < 0) && (!open(timer->callback_url, connection)))
+    {
+      if (connection->resolving)
+      {
+        // The consumer's address hasn't been looked up yet.  That's no
+        // reflection on the consumer, so the pop just fails for now.
+        ASYNC_LOG_DEBUG("Failing callback to %s while its address is looked up",
+                        timer->callback_url.c_str());
+        continue;
+      }
+      fail(connection, "couldn't connect");
+      continue;
+    }
+
+    // Nothing can still be being sent on the connection, as every pop from
+    // the last batch has been acknowledged or failed (closing the connection).
+    append_frame(connection, timer);
+    it->started_us = CallbackRequest::now_us();
+    connection->awaiting[std::make_pair(timer->id, timer->sequence_number)] = &(*it);
+    if (!connection->active)
+    {
+      connection->active = true;
+      active.push_back(connection);
+    }
+  }
+
+  for (auto it = active.begin(); it != active.end(); it++)
+  {
+    send(*it);
+  }
+
+  uint64_t deadline_ms = now_ms + _timeout_ms;
+  while (true)
+  {
+    bool waiting = false;
+    for (auto it = active.begin(); it != active.end(); it++)
+    {
+      waiting = waiting || (((*it)->fd >= 0) && (!(*it)->awaiting.empty()));
+    }
+
+    if (!waiting)
+    {
+      break;
+    }
+
+    now_ms = monotonic_time_ms();
+    if (now_ms >= deadline_ms)
+    {
+      for (auto it = active.begin(); it != active.end(); it++)
+      {
+        if (((*it)->fd >= 0) && (!(*it)->awaiting.empty()))
+        {
+          __statistics->increment(Statistics::CALLBACK_DEADLINE_MISSES,
+                                  (*it)->awaiting.size());
+          fail(*it, "timed out");
+        }
+      }
+      break;
+    }
+
+    completions.clear();
+    _engine->wait(completions, deadline_ms - now_ms);
+    handle(completions);
+  }
+
+  for (auto it = active.begin(); it != active.end(); it++)
+  {
+    (*it)->active = false;
+  }
+}
+
+// Open connections to the consumers of timers that are about to pop, so the
+// pops can be sent as soon as they're due.
+void TCPCallback::prepare(const std::vector<Timer*>& timers)
+{
+  refresh_config();
+
+  if (_engine == NULL)
+  {
+    return;
+  }
+
+  for (auto it = timers.begin(); it != timers.end(); it++)
+  {
+    if ((*it)->is_tombstone())
+    {
+      continue;
+    }
+
+    Connection* connection = get_connection((*it)->callback_url);
+    if ((connection->fd < 0) &&
+        (connection->breaker.state() == CircuitBreaker::CLOSED))
+    {
+      open((*it)->callback_url, connection);
+    }
+  }
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Pick up the current limits (these may be changed by a config reload).
+void TCPCallback::refresh_config()
+{
+  __globals->get_callback_timeout_ms(_timeout_ms);
+  __globals->get_callback_circuit_breaker_failures(_breaker_failures);
+  __globals->get_callback_circuit_breaker_reset_ms(_breaker_reset_ms);
+}
+
+TCPCallback::Connection* TCPCallback::get_connection(const std::string& address)
+{
+  Connection* connection = &_connections[address];
+  connection->address = address;
+  connection->breaker.configure(_breaker_failures, _breaker_reset_ms);
+  return connection;
+}
+
+// Open a connection and start receiving on it straight away, so we hear about
+// the consumer closing it even while it's idle.
+bool TCPCallback::open(const std::string& address, Connection* connection)
+{
+  close(connection);
+  if (!connect_socket(address, &connection->fd, &connection->resolving))
+  {
+    return false;
+  }
+  _engine->receive(connection->fd, connection);
+  return true;
+}
+
+// Cancelling the socket's I/O waits for the engine to finish with the data
+// being sent, so it's safe to free it straight afterwards.
+void TCPCallback::close(Connection* connection)
+{
+  if (connection->fd >= 0)
+  {
+    _engine->cancel(connection->fd);
+    ::close(connection->fd);
+  }
+  connection->fd = -1;
+  clear_out(connection);
+  connection->sending = false;
+  connection->in.clear();
+}
+
+// Fail every pop waiting on a connection and close it, recording the failure
+// against the consumer.
+void TCPCallback::fail(Connection* connection, const char* reason)
+{
+  ASYNC_LOG_DEBUG("Callbacks to %s failed (%s), failing %lu pops",
+                  connection->address.c_str(),
+                  reason,
+                  connection->awaiting.size());
+
+  uint64_t now_us = CallbackRequest::now_us();
+  for (auto it = connection->awaiting.begin(); it != connection->awaiting.end(); it++)
+  {
+    it->second->success = false;
+    it->second->completed_us = now_us;
+  }
+  connection->awaiting.clear();
+  close(connection);
+
+  bool was_open = (connection->breaker.state() != CircuitBreaker::CLOSED);
+  connection->breaker.failure(monotonic_time_ms());
+  if ((!was_open) && (connection->breaker.state() == CircuitBreaker::OPEN))
+  {
+    LOG_WARNING("Callbacks to %s are failing, pausing callbacks for %dms",
+                connection->address.c_str(),
+                _breaker_reset_ms);
+    __statistics->increment(Statistics::CALLBACK_CIRCUIT_OPENS);
+  }
+}
+
+// Start sending whatever is waiting to be sent on a connection, unless a send
+// is already in progress.
+void TCPCallback::send(Connection* connection)
+{
+  if (connection->sending)
+  {
+    return;
+  }
+
+  if (connection->out_iov.empty())
+  {
+    for (auto it = connection->out_chunks.begin(); it != connection->out_chunks.end(); it++)
+    {
+      struct iovec iov;
+      iov.iov_base = (void*)(it->shared ? it->body.data() :
+                                          connection->out_data.data() + it->offset);
+      iov.iov_len = it->length;
+      connection->out_iov.push_back(iov);
+    }
+  }
+
+  size_t remaining = connection->out_iov.size() - connection->out_iov_index;
+  if (remaining > 0)
+  {
+    _engine->send(connection->fd,
+                  &connection->out_iov[connection->out_iov_index],
+                  std::min(remaining, (size_t)IOV_MAX),
+                  connection);
+    connection->sending = true;
+  }
+}
+
+// Move past the data that's been sent on a connection, and send the rest.
+void TCPCallback::sent(Connection* connection, size_t length)
+{
+  while ((length > 0) && (connection->out_iov_index < connection->out_iov.size()))
+  {
+    struct iovec& iov = connection->out_iov[connection->out_iov_index];
+    if (length >= iov.iov_len)
+    {
+      length -= iov.iov_len;
+      connection->out_iov_index++;
+    }
+    else
+    {
+      iov.iov_base = (char*)iov.iov_base + length;
+      iov.iov_len -= length;
+      length = 0;
+    }
+  }
+
+  if (connection->out_iov_index < connection->out_iov.size())
+  {
+    send(connection);
+  }
+  else
+  {
+    clear_out(connection);
+  }
+}
+
+// Handle a batch of completed sends and receives.
+void TCPCallback::handle(const std::vector<IOEngine::Completion>& completions)
+{
+  for (auto it = completions.begin(); it != completions.end(); it++)
+  {
+    Connection* connection = (Connection*)it->context;
+    if (connection->fd < 0)
+    {
+      // The connection has already been closed.
+      continue;
+    }
+
+    if (it->is_send)
+    {
+      connection->sending = false;
+      if (it->result < 0)
+      {
+        connection_failed(connection);
+        continue;
+      }
+
+      sent(connection, it->result);
+    }
+    else if (it->result > 0)
+    {
+      connection->in.append(it->data, it->result);
+      if (!parse(connection))
+      {
+        connection_failed(connection);
+      }
+    }
+    else
+    {
+      connection_failed(connection);
+    }
+  }
+}
+
+// Handle a connection failing or being closed by the consumer.  That's only
+// a failure if there are pops still waiting to be acknowledged.
+void TCPCallback::connection_failed(Connection* connection)
+{
+  if (connection->awaiting.empty())
+  {
+    ASYNC_LOG_DEBUG("Connection to %s was closed", connection->address.c_str());
+    close(connection);
+  }
+  else
+  {
+    fail(connection, "connection failed");
+  }
+}
+
+// Handle any complete acknowledgements received on a connection.  Returns
+// false if the consumer sent something invalid.
+bool TCPCallback::parse(Connection* connection)
+{
+  uint64_t now_us = CallbackRequest::now_us();
+  const unsigned char* data = (const unsigned char*)connection->in.data();
+  size_t available = connection->in.length();
+  size_t offset = 0;
+
+  while (available - offset >= 4)
+  {
+    const unsigned char* p = data + offset;
+    uint32_t length = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                      ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    if ((length < ACK_SIZE) || (length > MAX_ACK_SIZE))
+    {
+      ASYNC_LOG_WARNING_RATE_LIMITED("Invalid acknowledgement from callback consumer (length %u)", length);
+      return false;
+    }
+
+    if (available - offset - 4 < length)
+    {
+      break;
+    }
+
+    p += 4;
+    TimerID id = 0;
+    for (int ii = 0; ii < 8; ii++)
+    {
+      id = (id << 8) | p[ii];
+    }
+    uint32_t sequence_number = ((uint32_t)p[8] << 24) | ((uint32_t)p[9] << 16) |
+                               ((uint32_t)p[10] << 8) | (uint32_t)p[11];
+    bool success = (p[12] == 0);
+    offset += 4 + length;
+
+    auto it = connection->awaiting.find(std::make_pair(id, sequence_number));
+    if (it != connection->awaiting.end())
+    {
+      it->second->success = success;
+      it->second->completed_us = now_us;
+      if ((success) && (length > ACK_SIZE))
+      {
+        // The rest of the acknowledgement is new timing for the timer.
+        it->second->parse_response((const char*)p + ACK_SIZE, length - ACK_SIZE);
+      }
+      connection->awaiting.erase(it);
+
+      // Any acknowledgement at all shows the consumer is up.
+      connection->breaker.success();
+    }
+  }
+
+  connection->in.erase(0, offset);
+  return true;
+}
+
+// Open a non-blocking connection to a consumer, either over TCP (HOST:PORT)
+// or a Unix domain socket (unix:PATH).  The connection may still be being
+// established when this returns.
+bool TCPCallback::connect_socket(const std::string& address, int* fd, bool* resolving)
+{
+  *fd = -1;
+  *resolving = false;
+
+  struct sockaddr_storage addr;
+  socklen_t addr_len = 0;
+  memset(&addr, 0, sizeof(addr));
+
+  if (address.compare(0, 5, "unix:") == 0)
+  {
+    std::string path = address.substr(5);
+    struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+    if (path.length() >= sizeof(un->sun_path))
+    {
+      LOG_WARNING("Callback socket path too long: %s", path.c_str());
+      return false;
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path.c_str(), path.length() + 1);
+    addr_len = sizeof(struct sockaddr_un);
+  }
+  else
+  {
+    // Split off the port, allowing for bracketed IPv6 addresses.
+    size_t colon = address.rfind(':');
+    if ((colon == std::string::npos) || (address.find(']', colon) != std::string::npos))
+    {
+      LOG_WARNING("Callback address has no port: %s", address.c_str());
+      return false;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if ((host.length() >= 2) && (host[0] == '['))
+    {
+      host = host.substr(1, host.length() - 2);
+    }
+
+    // Names are looked up in the background, so we never wait for DNS.
+    Resolver::Result rc = _resolver.lookup(host, port, &addr, &addr_len);
+    if (rc != Resolver::RESOLVED)
+    {
+      ASYNC_LOG_DEBUG("%s callback address %s",
+                      (rc == Resolver::PENDING) ? "Still resolving" : "Failed to resolve",
+                      address.c_str());
+      *resolving = (rc == Resolver::PENDING);
+      return false;
+    }
+  }
+
+  int sock = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    LOG_ERROR("Failed to create callback socket: %s", strerror(errno));
+    return false;
+  }
+
+  if (addr.ss_family != AF_UNIX)
+  {
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  }
+
+  if ((connect(sock, (struct sockaddr*)&addr, addr_len) != 0) &&
+      (errno != EINPROGRESS))
+  {
+    ASYNC_LOG_DEBUG("Failed to connect to %s: %s", address.c_str(), strerror(errno));
+    ::close(sock);
+    return false;
+  }
+
+  *fd = sock;
+  return true;
+}
+
+// Append the frame for a timer pop to the data waiting to be sent.
+void TCPCallback::append_frame(Connection* connection, Timer* timer)
+{
+  const SharedBuffer& body = timer->callback_body;
+  uint32_t length = POP_HEADER_SIZE + body.length();
+  unsigned char header[4 + POP_HEADER_SIZE];
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    header[ii] = (length >> (24 - 8 * ii)) & 0xff;
+  }
+  for (int ii = 0; ii < 8; ii++)
+  {
+    header[4 + ii] = (timer->id >> (56 - 8 * ii)) & 0xff;
+  }
+  for (int ii = 0; ii < 4; ii++)
+  {
+    header[12 + ii] = (timer->sequence_number >> (24 - 8 * ii)) & 0xff;
+  }
+
+  size_t offset = connection->out_data.length();
+  connection->out_data.append((const char*)header, sizeof(header));
+  bool gather = (body.length() >= MIN_GATHERED_BODY_SIZE);
+  if (!gather)
+  {
+    connection->out_data.append(body.data(), body.length());
+  }
+
+  // Extend the last chunk if it's already a range of our own buffer.
+  size_t added = connection->out_data.length() - offset;
+  if ((!connection->out_chunks.empty()) && (!connection->out_chunks.back().shared))
+  {
+    connection->out_chunks.back().length += added;
+  }
+  else
+  {
+    Chunk chunk = {false, SharedBuffer(), offset, added};
+    connection->out_chunks.push_back(chunk);
+  }
+
+  if (gather)
+  {
+    Chunk chunk = {true, body, 0, body.length()};
+    connection->out_chunks.push_back(chunk);
+  }
+}
+
+// Forget the data waiting to be sent on a connection (keeping hold of the
+// memory for the next batch).
+void TCPCallback::clear_out(Connection* connection)
+{
+  connection->out_data.clear();
+  connection->out_chunks.clear();
+  connection->out_iov.clear();
+  connection->out_iov_index = 0;
+}
+
+uint64_t TCPCallback::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -1,11 +1,13 @@
 #include "timer.h"
 #include "globals.h"
+#include "replica_stagger.h"
 #include "murmur/MurmurHash3.h"
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "utils.h"
 #include "log.h"
+#include "async_logger.h"
 
 #include <iostream>
 #include <sstream>
@@ -13,6 +15,8 @@
 #include <boost/format.hpp>
 #include <map>
 #include <atomic>
+#include <algorithm>
+#include <cctype>
 
 Timer::Timer(TimerID id, uint32_t interval, uint32_t repeat_for) :
   id(id),
@@ -20,8 +24,15 @@ Timer::Timer(TimerID id, uint32_t interval, uint32_t repeat_for) :
   repeat_for(repeat_for),
   sequence_number(0),
   replicas(std::vector<std::string>()),
+  callback_protocol("http"),
   callback_url(""),
-  callback_body(""),
+  callback_body(),
+  callback_batch(false),
+  replica_stagger_ms(0),
+  retry_count(0),
+  retry_time(0),
+  store_position(0),
+  store_pop_time(0),
   _replication_factor(0)
 {
   struct timespec ts;
@@ -36,7 +47,16 @@ Timer::~Timer()
 // Returns the next pop time in ms.
 uint64_t Timer::next_pop_time()
 {
-  std::string localhost;
+  // A timer waiting to retry its callback pops at the retry time, regardless
+  // of its position in the replica list.
+  if (retry_time != 0)
+  {
+    return retry_time;
+  }
+
+  // The string is kept between calls, so that (once it has grown to fit)
+  // copying the local IP into it doesn't allocate memory.
+  static thread_local std::string localhost;
   int replica_index = 0;
   __globals->get_cluster_local_ip(localhost);
 
@@ -48,7 +68,24 @@ uint64_t Timer::next_pop_time()
     }
   }
 
-  return start_time + ((sequence_number + 1) * interval) + (replica_index * 2 * 1000);
+  // Each replica waits for the one before it to pop the timer and replicate
+  // the result, for the time advertised with the timer or, failing that, a
+  // time based on the latency this node has measured (see ReplicaStagger).
+  uint64_t stagger_ms = 0;
+  if (replica_index > 0)
+  {
+    if (replica_stagger_ms != 0)
+    {
+      stagger_ms = replica_stagger_ms;
+    }
+    else
+    {
+      stagger_ms = (__replica_stagger != NULL) ? __replica_stagger->stagger_ms() :
+                                                 DEFAULT_REPLICA_STAGGER_MS;
+    }
+  }
+
+  return start_time + ((sequence_number + 1) * interval) + (replica_index * stagger_ms);
 }
 
 // Create the timer's URL from a given hostname
@@ -59,21 +96,39 @@ std::string Timer::url(std::string host)
   int bind_port;
   __globals->get_bind_port(bind_port);
 
-  // Here (and below) we render the timer ID (and replica hash) as 0-padded
-  // hex strings so we can parse it back out later easily.
-  ss << "http://" << host << ":" << bind_port << "/timers/";
-  ss << std::setfill('0') << std::setw(16) << std::hex << id;
-  uint64_t hash = 0;
-  std::map<std::string, uint64_t> cluster_hashes;
+  ss << "http://" << host << ":" << bind_port << "/timers/" << url_id();
+  return ss.str();
+}
+
+// Create the timer's ID as it appears in its URL
+std::string Timer::url_id()
+{
+  // Here we render the timer ID (and replica hash) as 0-padded hex strings so
+  // we can parse it back out later easily.
+  char buffer[33];
+  snprintf(buffer, sizeof(buffer), "%016lx%016lx", id, replica_hash());
+  return std::string(buffer, 32);
+}
+
+// Calculate the replica hash for the timer, which is the bloom filter of the
+// hashes of its replicas.
+uint64_t Timer::replica_hash()
+{
+  // The map is kept between calls, so that (once it has grown to fit) copying
+  // the cluster's hashes into it reuses its nodes rather than allocating.
+  static thread_local std::map<std::string, uint64_t> cluster_hashes;
   __globals->get_cluster_hashes(cluster_hashes);
+
+  uint64_t hash = 0;
   for (auto it = replicas.begin(); it != replicas.end(); it++)
   {
-    hash |= cluster_hashes[*it];
+    auto cluster_hash = cluster_hashes.find(*it);
+    if (cluster_hash != cluster_hashes.end())
+    {
+      hash |= cluster_hash->second;
+    }
   }
-  ss << std::setfill('0') << std::setw(16) << std::hex << hash;
-
-
-  return ss.str();
+  return hash;
 }
 
 // Render the timer as JSON to be used in an HTTP request body.
@@ -88,53 +143,94 @@ std::string Timer::url(std::string host)
 //     "callback": {
 //         "http": {
 //             "uri": "string",
-//             "opaque": "string"
+//             "opaque": "string",
+//             "batch": Bool (only present if true)
 //         }
 //     },
 //     "reliability": {
 //         "replicas": [
 //             <comma separated "string"s>
-//         ]
+//         ],
+//         "replica-stagger-ms": Int (only present if known, and only read
+//                                    along with the replicas)
 //     }
 // }
+//
+// Timers with TCP callbacks have a "tcp" callback block instead, holding the
+// "address" and "opaque" data, and timers delivered to stream subscribers have
+// a "stream" block holding the "key" and "opaque" data.
+//
+// The JSON is written straight out (rather than building a document first),
+// into a buffer that is kept between calls, so the only memory allocated is
+// for the returned string.
 std::string Timer::to_json()
 {
-  rapidjson::Document doc;
-  doc.SetObject();
-
-  rapidjson::Value timing(rapidjson::kObjectType);
-  timing.AddMember("start-time", start_time, doc.GetAllocator());
-  timing.AddMember("sequence-number", sequence_number, doc.GetAllocator());
-  timing.AddMember("interval", interval/1000, doc.GetAllocator());
-  timing.AddMember("repeat-for", repeat_for/1000, doc.GetAllocator());
-
-  rapidjson::Value http(rapidjson::kObjectType);
-  http.AddMember("uri", callback_url.c_str(), doc.GetAllocator());
-  http.AddMember("opaque", callback_body.c_str(), doc.GetAllocator());
-
-  rapidjson::Value callback(rapidjson::kObjectType);
-  callback.AddMember("http", http, doc.GetAllocator());
+  static thread_local rapidjson::StringBuffer s;
+  static thread_local rapidjson::Writer<rapidjson::StringBuffer> w(s);
+  s.Clear();
+
+  w.StartObject();
+
+  w.String("timing");
+  w.StartObject();
+  w.String("start-time").Uint64(start_time);
+  w.String("sequence-number").Uint(sequence_number);
+  w.String("interval").Uint(interval/1000);
+  w.String("repeat-for").Uint(repeat_for/1000);
+  w.EndObject();
+
+  w.String("callback");
+  w.StartObject();
+  if (callback_protocol == "tcp")
+  {
+    w.String("tcp");
+    w.StartObject();
+    w.String("address").String(callback_url.data(), callback_url.length());
+    w.String("opaque").String(callback_body.data(), callback_body.length());
+    w.EndObject();
+  }
+  else if (callback_protocol == "stream")
+  {
+    w.String("stream");
+    w.StartObject();
+    w.String("key").String(callback_url.data(), callback_url.length());
+    w.String("opaque").String(callback_body.data(), callback_body.length());
+    w.EndObject();
+  }
+  else
+  {
+    w.String("http");
+    w.StartObject();
+    w.String("uri").String(callback_url.data(), callback_url.length());
+    w.String("opaque").String(callback_body.data(), callback_body.length());
+    if (callback_batch)
+    {
+      w.String("batch").Bool(true);
+    }
+    w.EndObject();
+  }
+  w.EndObject();
 
-  rapidjson::Value replicas_array(rapidjson::kArrayType);
+  w.String("reliability");
+  w.StartObject();
+  w.String("replicas");
+  w.StartArray();
   for (auto it = replicas.begin(); it != replicas.end(); it++)
   {
-    replicas_array.PushBack((*it).c_str(), doc.GetAllocator());
+    w.String(it->data(), it->length());
   }
+  w.EndArray();
+  if (replica_stagger_ms != 0)
+  {
+    w.String("replica-stagger-ms").Uint(replica_stagger_ms);
+  }
+  w.EndObject();
 
-  rapidjson::Value reliability(rapidjson::kObjectType);
-  reliability.AddMember("replicas", replicas_array, doc.GetAllocator());
-
-  // Create the document.
-  doc.AddMember("timing", timing, doc.GetAllocator());
-  doc.AddMember("callback", callback, doc.GetAllocator());
-  doc.AddMember("reliability", reliability, doc.GetAllocator());
+  w.EndObject();
 
-  rapidjson::StringBuffer s;
-  rapidjson::Writer<rapidjson::StringBuffer> w(s);
-  doc.Accept(w);
-  std::string body = s.GetString();
+  std::string body(s.GetString(), s.Size());
 
-  LOG_DEBUG("Built replication body: %s", body.c_str());
+  ASYNC_LOG_DEBUG("Built replication body: %s", body.c_str());
 
   return body;
 }
@@ -146,13 +242,13 @@ bool Timer::is_local(std::string host)
 
 bool Timer::is_tombstone()
 {
-  return ((callback_url == "") && (callback_body == ""));
+  return ((callback_url == "") && (callback_body.empty()));
 }
 
 void Timer::become_tombstone()
 {
   callback_url = "";
-  callback_body = "";
+  callback_body = SharedBuffer();
 
   // Since we're not bringing the start-time forward we have to extend the
   // repeat-for to ensure the tombstone gets added to the replica's store.
@@ -228,10 +324,13 @@ void Timer::calculate_replicas(uint64_t replica_hash)
     }
   }
 
-  LOG_DEBUG("Replicas calculated:");
-  for (auto it = replicas.begin(); it != replicas.end(); it++)
+  if (Log::loggingLevel >= Log::DEBUG_LEVEL)
   {
-    LOG_DEBUG(" - %s", it->c_str());
+    ASYNC_LOG_DEBUG("Replicas calculated:");
+    for (auto it = replicas.begin(); it != replicas.end(); it++)
+    {
+      ASYNC_LOG_DEBUG(" - %s", it->c_str());
+    }
   }
 }
 
@@ -283,6 +382,11 @@ Timer* Timer::create_tombstone(TimerID id, uint64_t replica_hash)
     JSON_PARSE_ERROR((NODE_NAME " should be an 64bit integer"));              \
 }
 
+#define JSON_ASSERT_BOOL(NODE, NODE_NAME) {                                   \
+  if (!(NODE).IsBool())                                                       \
+    JSON_PARSE_ERROR((NODE_NAME " should be a boolean"));                     \
+}
+
 #define JSON_ASSERT_STRING(NODE, NODE_NAME) {                                 \
   if (!(NODE).IsString())                                                     \
     JSON_PARSE_ERROR((NODE_NAME " should be a string"));                      \
@@ -298,6 +402,21 @@ Timer* Timer::create_tombstone(TimerID id, uint64_t replica_hash)
     JSON_PARSE_ERROR(("Couldn't find '" ELEM "' in '" NODE_NAME "'"));        \
 }
 
+// Get a timer's opaque data from the JSON it was defined with (which has been
+// parsed in place).  If the opaque data makes up most of the JSON it's shared
+// with it, rather than copied, otherwise it's copied so that the JSON can be
+// freed.
+static SharedBuffer opaque_data(const std::shared_ptr<std::string>& storage,
+                                const rapidjson::Value& opaque)
+{
+  size_t length = opaque.GetStringLength();
+  if (length * 2 >= storage->length())
+  {
+    return SharedBuffer(storage, opaque.GetString(), length);
+  }
+  return SharedBuffer(opaque.GetString(), length);
+}
+
 // Create a Timer object from the JSON representation.
 //
 // @param id - The unique identity for the timer (see generate_timer_id() above).
@@ -308,13 +427,125 @@ Timer* Timer::create_tombstone(TimerID id, uint64_t replica_hash)
 Timer* Timer::from_json(TimerID id, uint64_t replica_hash, std::string json, std::string& error, bool& replicated)
 {
   Timer* timer = NULL;
+
+  // Parse the JSON in place, so that the opaque data can be taken straight
+  // from it.  This modifies the JSON, so it isn't included in parse errors.
+  std::shared_ptr<std::string> storage(new std::string(std::move(json)));
   rapidjson::Document doc;
-  doc.Parse<0>(json.c_str());
+  doc.ParseInsitu<0>(&(*storage)[0]);
   if (doc.HasParseError())
   {
-    JSON_PARSE_ERROR(boost::str(boost::format("Failed to parse JSON body, offset: %lu - %s. JSON is: %s") % doc.GetErrorOffset() % doc.GetParseError() % json));
+    JSON_PARSE_ERROR(boost::str(boost::format("Failed to parse JSON body, offset: %lu - %s") % doc.GetErrorOffset() % doc.GetParseError()));
   }
 
+  return from_json_value(id, replica_hash, storage, doc, error, replicated);
+}
+
+// Create the Timer objects from a batch of replicated timers.  The JSON takes
+// the form:
+// {
+//     "timers": [
+//         {
+//             "id": "string" (the timer's ID as it appears in its URL),
+//             "timer": { <the timer's JSON, as above> }
+//         },
+//         ...
+//     ]
+// }
+//
+// Every timer in the batch must specify its replicas.  If any timer is
+// invalid, none of the timers are created and false is returned.
+//
+// @param json - The JSON representation of the batch.
+// @param timers - The timers are added to this.
+// @param error - This will be populated with a descriptive error string if required.
+bool Timer::from_batch_json(std::string json, std::vector<Timer*>& timers, std::string& error)
+{
+  Timer* timer = NULL;
+  size_t first = timers.size();
+
+  std::shared_ptr<std::string> storage(new std::string(std::move(json)));
+  rapidjson::Document doc;
+  doc.ParseInsitu<0>(&(*storage)[0]);
+  if (doc.HasParseError())
+  {
+    error = boost::str(boost::format("Failed to parse JSON body, offset: %lu - %s") % doc.GetErrorOffset() % doc.GetParseError());
+    return false;
+  }
+
+  if ((!doc.IsObject()) || (!doc.HasMember("timers")) || (!doc["timers"].IsArray()))
+  {
+    error = "Couldn't find the 'timers' array in the JSON";
+    return false;
+  }
+
+  rapidjson::Value& records = doc["timers"];
+  rapidjson::Value::ValueIterator it;
+  for (it = records.Begin(); it != records.End(); it++)
+  {
+    if ((!it->IsObject()) ||
+        (!it->HasMember("id")) ||
+        (!(*it)["id"].IsString()) ||
+        ((*it)["id"].GetStringLength() != 32) ||
+        (!std::all_of((*it)["id"].GetString(), (*it)["id"].GetString() + 32, ::isxdigit)))
+    {
+      error = "Each timer in the batch should have a 32 digit hex 'id'";
+      break;
+    }
+
+    if ((!it->HasMember("timer")) || (!(*it)["timer"].IsObject()))
+    {
+      error = "Each timer in the batch should have a 'timer' object";
+      break;
+    }
+
+    std::string url_id((*it)["id"].GetString(), 32);
+    TimerID id = std::stoull(url_id.substr(0, 16), NULL, 16);
+    uint64_t replica_hash = std::stoull(url_id.substr(16), NULL, 16);
+
+    bool replicated;
+    timer = from_json_value(id, replica_hash, storage, (*it)["timer"], error, replicated);
+    if (timer == NULL)
+    {
+      break;
+    }
+
+    if (!replicated)
+    {
+      error = "Each timer in the batch should specify its replicas";
+      delete timer;
+      break;
+    }
+
+    timers.push_back(timer);
+    timer = NULL;
+  }
+
+  if (it != records.End())
+  {
+    // Gave up on the batch part way through.
+    for (size_t ii = first; ii < timers.size(); ii++)
+    {
+      delete timers[ii];
+    }
+    timers.resize(first);
+    return false;
+  }
+
+  return true;
+}
+
+// Create a Timer object from a JSON object, which has been parsed in place
+// from the given storage.
+Timer* Timer::from_json_value(TimerID id,
+                              uint64_t replica_hash,
+                              const std::shared_ptr<std::string>& storage,
+                              rapidjson::Value& doc,
+                              std::string& error,
+                              bool& replicated)
+{
+  Timer* timer = NULL;
+
   if (!doc.HasMember("timing"))
     JSON_PARSE_ERROR(("Couldn't find the 'timing' node in the JSON"));
   if (!doc.HasMember("callback"))
@@ -354,22 +585,72 @@ Timer* Timer::from_json(TimerID id, uint64_t replica_hash, std::string json, std
   rapidjson::Value& callback = doc["callback"];
 
   JSON_ASSERT_OBJECT(callback, "callback");
-  JSON_ASSERT_CONTAINS(callback, "callback", "http");
 
-  rapidjson::Value& http = callback["http"];
+  if (callback.HasMember("tcp"))
+  {
+    // The callback is streamed over a TCP or Unix domain socket connection.
+    rapidjson::Value& tcp = callback["tcp"];
+
+    JSON_ASSERT_OBJECT(tcp, "tcp");
+    JSON_ASSERT_CONTAINS(tcp, "tcp", "address");
+    JSON_ASSERT_CONTAINS(tcp, "tcp", "opaque");
+
+    rapidjson::Value& address = tcp["address"];
+    rapidjson::Value& opaque = tcp["opaque"];
 
-  JSON_ASSERT_OBJECT(http, "http");
-  JSON_ASSERT_CONTAINS(http, "http", "uri");
-  JSON_ASSERT_CONTAINS(http, "http", "opaque");
+    JSON_ASSERT_STRING(address, "address");
+    JSON_ASSERT_STRING(opaque, "opaque");
 
-  rapidjson::Value& uri = http["uri"];
-  rapidjson::Value& opaque = http["opaque"];
+    timer->callback_protocol = "tcp";
+    timer->callback_url = std::string(address.GetString(), address.GetStringLength());
+    timer->callback_body = opaque_data(storage, opaque);
+  }
+  else if (callback.HasMember("stream"))
+  {
+    // The callback is delivered to a consumer subscribed for the key.
+    rapidjson::Value& stream = callback["stream"];
 
-  JSON_ASSERT_STRING(uri, "uri");
-  JSON_ASSERT_STRING(opaque, "opaque");
+    JSON_ASSERT_OBJECT(stream, "stream");
+    JSON_ASSERT_CONTAINS(stream, "stream", "key");
+    JSON_ASSERT_CONTAINS(stream, "stream", "opaque");
 
-  timer->callback_url = std::string(uri.GetString(), uri.GetStringLength());
-  timer->callback_body = std::string(opaque.GetString(), opaque.GetStringLength());
+    rapidjson::Value& key = stream["key"];
+    rapidjson::Value& opaque = stream["opaque"];
+
+    JSON_ASSERT_STRING(key, "key");
+    JSON_ASSERT_STRING(opaque, "opaque");
+
+    timer->callback_protocol = "stream";
+    timer->callback_url = std::string(key.GetString(), key.GetStringLength());
+    timer->callback_body = opaque_data(storage, opaque);
+  }
+  else
+  {
+    JSON_ASSERT_CONTAINS(callback, "callback", "http");
+
+    rapidjson::Value& http = callback["http"];
+
+    JSON_ASSERT_OBJECT(http, "http");
+    JSON_ASSERT_CONTAINS(http, "http", "uri");
+    JSON_ASSERT_CONTAINS(http, "http", "opaque");
+
+    rapidjson::Value& uri = http["uri"];
+    rapidjson::Value& opaque = http["opaque"];
+
+    JSON_ASSERT_STRING(uri, "uri");
+    JSON_ASSERT_STRING(opaque, "opaque");
+
+    timer->callback_url = std::string(uri.GetString(), uri.GetStringLength());
+    timer->callback_body = opaque_data(storage, opaque);
+
+    if (http.HasMember("batch"))
+    {
+      // The client has opted in (or out) of batched callbacks.
+      rapidjson::Value& batch = http["batch"];
+      JSON_ASSERT_BOOL(batch, "batch");
+      timer->callback_batch = batch.GetBool();
+    }
+  }
 
   // Parse out the 'reliability' block
   rapidjson::Value& reliability = doc["reliability"];
@@ -394,6 +675,25 @@ Timer* Timer::from_json(TimerID id, uint64_t replica_hash, std::string json, std
         JSON_ASSERT_STRING(*it, "replica address");
         timer->replicas.push_back(std::string(it->GetString(), it->GetStringLength()));
       }
+
+      // The stagger advertised by the replicating node is only taken from
+      // replication messages (clients can't choose how long the replicas
+      // wait), and is kept within this node's configured bounds.
+      if (reliability.HasMember("replica-stagger-ms"))
+      {
+        rapidjson::Value& replica_stagger_ms = reliability["replica-stagger-ms"];
+        JSON_ASSERT_INTEGER(replica_stagger_ms, "replica-stagger-ms");
+        if (replica_stagger_ms.GetInt() < 0)
+        {
+          JSON_PARSE_ERROR("replica-stagger-ms must not be negative");
+        }
+
+        int floor_ms;
+        int max_ms;
+        __globals->get_replication_stagger_floor_ms(floor_ms);
+        __globals->get_replication_stagger_max_ms(max_ms);
+        timer->replica_stagger_ms = std::max(std::min(replica_stagger_ms.GetInt(), max_ms), floor_ms);
+      }
     }
     else
     {
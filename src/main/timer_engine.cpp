@@ -0,0 +1,130 @@
+#include "timer_engine.h"
+#include "http_callback.h"
+#include "tcp_callback.h"
+#include "globals.h"
+#include "statistics.h"
+#include "replica_stagger.h"
+#include "log.h"
+
+TimerEngine::TimerEngine(bool replicate, bool log_to_file) :
+  _replicate(replicate),
+  _owns_globals(false),
+  _owns_statistics(false),
+  _owns_replica_stagger(false)
+{
+  if (__globals == NULL)
+  {
+    __globals = new Globals(log_to_file);
+    __globals->update_config();
+    _owns_globals = true;
+  }
+
+  if (__statistics == NULL)
+  {
+    __statistics = new Statistics();
+    _owns_statistics = true;
+  }
+
+  if (__replica_stagger == NULL)
+  {
+    __replica_stagger = new ReplicaStagger();
+    _owns_replica_stagger = true;
+  }
+
+  // The timer handler owns the callbacks and the replicator (which is only
+  // needed if the engine replicates), but we keep hold of them so functions
+  // can be registered and timers replicated as they're added.
+  _functions = new FunctionCallback();
+  std::vector<Callback*> callbacks;
+  callbacks.push_back(_functions);
+  callbacks.push_back(new HTTPCallback());
+  callbacks.push_back(new TCPCallback());
+
+  _store = new TimerStore();
+  _replicator = _replicate ? new Replicator() : NULL;
+  _handler = new TimerHandler(_store, _replicator, callbacks);
+}
+
+TimerEngine::~TimerEngine()
+{
+  delete _handler; _handler = NULL;
+  _replicator = NULL;
+  delete _store; _store = NULL;
+  _functions = NULL;
+
+  if (_owns_replica_stagger)
+  {
+    delete __replica_stagger; __replica_stagger = NULL;
+  }
+
+  if (_owns_statistics)
+  {
+    delete __statistics; __statistics = NULL;
+  }
+
+  if (_owns_globals)
+  {
+    delete __globals; __globals = NULL;
+  }
+}
+
+void TimerEngine::register_function(const std::string& name,
+                                    FunctionCallback::Function function)
+{
+  _functions->register_function(name, function);
+}
+
+void TimerEngine::unregister_function(const std::string& name)
+{
+  _functions->unregister_function(name);
+}
+
+TimerID TimerEngine::add_timer(const std::string& function,
+                               uint32_t interval_ms,
+                               uint32_t repeat_for_ms,
+                               const SharedBuffer& opaque)
+{
+  Timer* timer = new Timer(Timer::generate_timer_id(), interval_ms, repeat_for_ms);
+  timer->callback_protocol = "function";
+  timer->callback_url = function;
+  timer->callback_body = opaque;
+
+  // Only this node can call the function, so it's the only replica.
+  std::string localhost;
+  __globals->get_cluster_local_ip(localhost);
+  timer->replicas.push_back(localhost);
+
+  TimerID id = timer->id;
+  _handler->add_timer(timer);
+  return id;
+}
+
+// Add a timer, as the controller does for a timer set over the HTTP API.
+void TimerEngine::add_timer(Timer* timer)
+{
+  std::string localhost;
+  __globals->get_cluster_local_ip(localhost);
+
+  if (_replicate)
+  {
+    _replicator->replicate(timer);
+
+    // If the timer doesn't belong to this node, we only keep a tombstone.
+    if (!timer->is_local(localhost))
+    {
+      timer->become_tombstone();
+    }
+  }
+  else
+  {
+    timer->replicas.assign(1, localhost);
+    timer->extra_replicas.clear();
+  }
+
+  _handler->add_timer(timer);
+}
+
+void TimerEngine::delete_timer(TimerID id, uint64_t replica_hash)
+{
+  add_timer(Timer::create_tombstone(id, replica_hash));
+}
@@ -1,9 +1,14 @@
 #include <time.h>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 #include "timer_handler.h"
+#include "globals.h"
+#include "statistics.h"
+#include "replica_stagger.h"
 #include "log.h"
+#include "async_logger.h"
 
 void* TimerHandler::timer_handler_entry_func(void* arg)
 {
@@ -11,16 +16,78 @@ void* TimerHandler::timer_handler_entry_func(void* arg)
   return NULL;
 }
 
+// Perform each share of a slice handed to the worker, until told to stop.
+void* TimerHandler::callback_worker_entry_func(void* arg)
+{
+  CallbackWorker* worker = (CallbackWorker*)arg;
+  pthread_mutex_lock(&worker->mutex);
+
+  while (true)
+  {
+    while ((!worker->busy) && (!worker->terminate))
+    {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+
+    if (worker->terminate)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+    worker->callback->perform_all(*worker->requests, worker->start_deadline_us);
+    pthread_mutex_lock(&worker->mutex);
+
+    worker->busy = false;
+    pthread_cond_broadcast(&worker->cond);
+  }
+
+  pthread_mutex_unlock(&worker->mutex);
+  return NULL;
+}
+
 TimerHandler::TimerHandler(TimerStore* store,
                            Replicator* replicator,
                            Callback* callback) :
                            _store(store),
                            _replicator(replicator),
-                           _callback(callback),
+                           _callbacks(),
                            _terminate(false),
-                           _nearest_new_timer(-1)
+                           _nearest_new_timer(-1),
+                           _next_lookahead_us(0),
+                           _workers()
+{
+  _callbacks[callback->protocol()] = callback;
+  start();
+}
+
+// Create a timer handler that routes each timer's callback to the handler for
+// its callback protocol.  The timer handler takes ownership of the callback
+// handlers.
+TimerHandler::TimerHandler(TimerStore* store,
+                           Replicator* replicator,
+                           const std::vector<Callback*>& callbacks) :
+                           _store(store),
+                           _replicator(replicator),
+                           _callbacks(),
+                           _terminate(false),
+                           _nearest_new_timer(-1),
+                           _next_lookahead_us(0),
+                           _workers()
+{
+  for (auto it = callbacks.begin(); it != callbacks.end(); it++)
+  {
+    _callbacks[(*it)->protocol()] = *it;
+  }
+  start();
+}
+
+// Start the timer handling thread.
+void TimerHandler::start()
 {
   pthread_mutex_init(&_mutex, NULL);
+  _next_timers.reserve(INITIAL_POP_CAPACITY);
+  _backlog.reserve(INITIAL_POP_CAPACITY);
 
 #ifdef UNITTEST
   _cond = new MockPThreadCondVar(&_mutex);
@@ -50,21 +117,59 @@ TimerHandler::~TimerHandler()
     pthread_join(_handler_thread, NULL);
   }
 
+  // The handler thread hands the timers it finds queued as it exits to the
+  // store, but timers may be queued after that, and nothing else will take
+  // them.
+  Timer* timer;
+  while (_new_timers.pop(timer))
+  {
+    delete timer;
+  }
+
   delete _cond;
   _cond = NULL;
 
   pthread_mutex_destroy(&_mutex);
 
+  for (auto it = _workers.begin(); it != _workers.end(); it++)
+  {
+    CallbackWorker* worker = it->second;
+    pthread_mutex_lock(&worker->mutex);
+    worker->terminate = true;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, NULL);
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    delete worker;
+  }
+  _workers.clear();
+
   delete _replicator;
-  delete _callback;
+
+  for (auto it = _callbacks.begin(); it != _callbacks.end(); it++)
+  {
+    delete it->second;
+  }
+  _callbacks.clear();
 }
 
+// Queue a timer to be added to the store.  This never blocks on the handler
+// thread, which picks up new timers between ticks.
 void TimerHandler::add_timer(Timer* timer)
 {
-  LOG_DEBUG("Adding timer:  %lu", timer->id);
-  pthread_mutex_lock(&_mutex);
-  _store->add_timer(timer);
-  pthread_mutex_unlock(&_mutex);
+  ASYNC_LOG_DEBUG("Adding timer:  %lu", timer->id);
+  _new_timers.push(timer);
+}
+
+// Queue a number of timers to be added to the store in one go, emptying the
+// passed in vector.
+void TimerHandler::add_timers(std::vector<Timer*>& timers)
+{
+  ASYNC_LOG_DEBUG("Adding %lu timers", timers.size());
+  _new_timers.push_all(timers);
+  timers.clear();
 }
 
 // The core function in the timer handler, basic principle is to loop around repeatedly
@@ -73,22 +178,23 @@ void TimerHandler::add_timer(Timer* timer)
 // If there are no timers in the store at all, we wait forever for one to be added (or
 // until we're terminated).  If we are woken while waiting for one set of timers to
 // pop, check the timer store to make sure we're holding the nearest timers.
+//
+// Timers taken from the store join a backlog, which is popped in bounded slices.
+// New timers are added to the store and the store is ticked between slices, so a
+// large number of timers popping at once can't hold up the rest of the system.
+//
+// Between ticks we also look a little way ahead in the store, so the callback
+// handler can get ready for the timers that are about to pop.
 void TimerHandler::run() {
-  std::unordered_set<Timer*> next_timers;
-  std::unordered_set<Timer*>::iterator sample_timer;
-
   pthread_mutex_lock(&_mutex);
 
-  _store->get_next_timers(next_timers);
+  add_new_timers();
+  _store->get_next_timers(_next_timers);
+  queue_timers(_next_timers);
 
   while (!_terminate)
   {
-    if (!next_timers.empty())
-    {
-      LOG_DEBUG("Have a timer to pop");
-      pop(next_timers);
-    }
-    else
+    if (_backlog.empty())
     {
       struct timespec next_pop;
       clock_gettime(CLOCK_MONOTONIC, &next_pop);
@@ -112,14 +218,20 @@ void TimerHandler::run() {
       }
     }
 
-    _store->get_next_timers(next_timers);
+    tick();
   }
 
-  for (auto it = next_timers.begin(); it != next_timers.end(); it++)
+  // Hand any timers added since the last tick to the store, which will
+  // destroy them.
+  add_new_timers();
+
+  _backlog_ids.clear();
+  for (auto it = _backlog.begin(); it != _backlog.end(); it++)
   {
-    delete *it;
+    delete it->timer;
   }
-  next_timers.clear();
+  _backlog.clear();
+  __statistics->set(Statistics::POP_BACKLOG, 0);
 
   pthread_mutex_unlock(&_mutex);
 }
@@ -128,48 +240,492 @@ void TimerHandler::run() {
 /* PRIVATE FUNCTIONS                                                         */
 /*****************************************************************************/
 
-// Pop a set of timers, this function takes ownership of the timers and
-// thus empties the passed in set.
-void TimerHandler::pop(std::unordered_set<Timer*>& timers)
+// Pop the next slice of timers (if any are waiting), then take any new timers
+// and the timers now due from the store.  Must be called on the handler thread
+// (or with the mutex held while the handler thread is waiting).
+//
+// The buffers used along the way are kept from one tick to the next, so once
+// they've grown to fit, ticking doesn't allocate memory (other than within the
+// callback handlers).
+void TimerHandler::tick()
+{
+  if (!_backlog.empty())
+  {
+    ASYNC_LOG_DEBUG("Have %lu timers to pop", _backlog.size());
+    pop_slice();
+  }
+
+  add_new_timers();
+  _store->get_next_timers(_next_timers);
+  queue_timers(_next_timers);
+  prepare_upcoming();
+}
+
+// Move any timers queued by add_timer into the store.  Must be called on the
+// handler thread.
+//
+// A timer waiting in the backlog has already left the store, so the store
+// can't tell that a new version replaces it.  If the new version takes
+// precedence (using the same rules as the store), the backlogged version is
+// discarded when it reaches the front of the backlog.  Otherwise the new
+// version is out of date, and is dropped here.
+void TimerHandler::add_new_timers()
 {
+  Timer* timer;
+  while (_new_timers.pop(timer))
+  {
+    Timer* backlogged = _backlog_ids.find(timer->id);
+    if (backlogged != NULL)
+    {
+      if ((timer->start_time < backlogged->start_time) ||
+          ((timer->start_time == backlogged->start_time) &&
+           (timer->sequence_number < backlogged->sequence_number)))
+      {
+        delete timer;
+        continue;
+      }
+
+      ASYNC_LOG_DEBUG("Timer %lu replaced while waiting to pop", timer->id);
+      _backlog_ids.erase(timer->id);
+    }
+
+    _store->add_timer(timer);
+  }
+}
+
+// Move the timers taken from the store into the backlog, emptying the passed
+// in vector (which keeps its capacity for the next tick).
+void TimerHandler::queue_timers(std::vector<Timer*>& timers)
+{
+  if (timers.empty())
+  {
+    return;
+  }
+
+  // Timers' pop times are in wall clock time, but latencies within the
+  // handler are measured on the monotonic clock.
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t now_wall_us = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  uint64_t now_us = CallbackRequest::now_us();
+
   for (auto it = timers.begin(); it != timers.end(); it++)
   {
-    pop(*it);
+    Timer* timer = *it;
+    uint64_t due_ms = timer->next_pop_time();
+
+    if (!timer->is_tombstone())
+    {
+      uint64_t due_us = due_ms * 1000;
+      __statistics->record_latency(Statistics::POP_LATENESS,
+                                   Statistics::precision_class(timer->interval),
+                                   (now_wall_us > due_us) ? (now_wall_us - due_us) : 0);
+    }
+
+    _backlog.push_back(BacklogEntry(timer, due_ms, now_us));
+    std::push_heap(_backlog.begin(), _backlog.end());
+    _backlog_ids.insert(timer);
   }
   timers.clear();
+
+  __statistics->set(Statistics::POP_BACKLOG, _backlog.size());
+  __statistics->update_max(Statistics::POP_BACKLOG_PEAK, _backlog.size());
 }
 
-// Pop a specific timer, if required pass the timer on to the replication layer to
-// reset the timer for another pop, otherwise destroy the timer record.
-void TimerHandler::pop(Timer* timer)
+// Tell the callback handler about the timers due to pop within the configured
+// look-ahead window, so that it can prepare for them (e.g. by opening
+// connections) before they pop.  This is done at most once per tick of the
+// store, as the upcoming timers don't change much in between.
+void TimerHandler::prepare_upcoming()
 {
-  // Tombstones are reaped when they pop.
-  if (timer->is_tombstone())
+  int lookahead_ms;
+  __globals->get_pop_lookahead_ms(lookahead_ms);
+
+  if (lookahead_ms <= 0)
+  {
+    return;
+  }
+
+  uint64_t now_us = CallbackRequest::now_us();
+  if (now_us < _next_lookahead_us)
   {
-    delete timer;
     return;
   }
+  _next_lookahead_us = now_us + 10 * 1000;
+
+  // As with popping, the vectors are kept from one look-ahead to the next.
+  std::vector<Timer*>& upcoming = _upcoming;
+  std::map<Callback*, std::vector<Timer*>>& by_callback = _upcoming_by_callback;
+  upcoming.clear();
+  for (auto it = by_callback.begin(); it != by_callback.end(); it++)
+  {
+    it->second.clear();
+  }
+
+  _store->peek_upcoming_timers(lookahead_ms, upcoming);
+
+  for (auto it = upcoming.begin(); it != upcoming.end(); it++)
+  {
+    Callback* callback = callback_for(*it);
+    if (callback != NULL)
+    {
+      by_callback[callback].push_back(*it);
+    }
+  }
 
-  timer->sequence_number++;
-  bool success = _callback->perform(timer->callback_url,
-                                    timer->callback_body,
-                                    timer->sequence_number);
+  for (auto it = by_callback.begin(); it != by_callback.end(); it++)
+  {
+    if (!it->second.empty())
+    {
+      it->first->prepare(it->second);
+    }
+  }
+}
+
+// Find the callback handler for a timer's callback protocol, or NULL if there
+// isn't one.
+Callback* TimerHandler::callback_for(Timer* timer)
+{
+  auto it = _callbacks.find(timer->callback_protocol);
+  return (it != _callbacks.end()) ? it->second : NULL;
+}
+
+// Pop the next slice of timers from the backlog, earliest due first.
+//
+// The callbacks for the slice are handed to the callback handler for their
+// protocol in one go, so that it can perform them in parallel, and the
+// handlers for different protocols run at the same time (see perform_slice).
+// Slices are limited to a maximum number of timers and a time budget for
+// starting their callbacks.  Any callbacks that weren't started within the
+// budget go back in the backlog for the next slice.
+void TimerHandler::pop_slice()
+{
+  int max_slice_size;
+  int slice_budget_us;
+  __globals->get_pop_max_slice_size(max_slice_size);
+  __globals->get_pop_slice_budget_us(slice_budget_us);
+
+  size_t slice_size = std::min(_backlog.size(), (size_t)std::max(max_slice_size, 1));
+
+  // Note the wall clock time against the monotonic clock, so we can work out
+  // how late each callback starts.
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t now_wall_us = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  uint64_t now_us = CallbackRequest::now_us();
+
+  uint64_t oldest_due_us = _backlog.front().due_ms * 1000;
+  __statistics->set(Statistics::POP_BACKLOG_MAX_LATENESS,
+                    (now_wall_us > oldest_due_us) ? (now_wall_us - oldest_due_us) : 0);
+
+  // Split the slice by callback handler, as each handler performs its own
+  // callbacks.  The per-handler vectors are kept from one slice to the next,
+  // so that their memory is reused.
+  std::map<Callback*, std::vector<CallbackRequest>>& requests = _slice_requests;
+  std::map<Callback*, std::vector<BacklogEntry>>& entries = _slice_entries;
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    it->second.clear();
+    entries[it->first].clear();
+  }
+
+  for (size_t ii = 0; ii < slice_size; ii++)
+  {
+    std::pop_heap(_backlog.begin(), _backlog.end());
+    BacklogEntry entry = _backlog.back();
+    _backlog.pop_back();
+    Timer* timer = entry.timer;
+
+    // Drop the timer if it's been replaced since it joined the backlog.
+    if (_backlog_ids.find(timer->id) != timer)
+    {
+      delete timer;
+      continue;
+    }
+    _backlog_ids.erase(timer->id);
+
+    // Tombstones are reaped when they pop.
+    if (timer->is_tombstone())
+    {
+      delete timer;
+      continue;
+    }
+
+    timer->sequence_number++;
+
+    Callback* callback = callback_for(timer);
+    if (callback == NULL)
+    {
+      LOG_ERROR("No callback handler for protocol %s (timer %lu)",
+                timer->callback_protocol.c_str(),
+                timer->id);
+      callback_complete(timer, false);
+      continue;
+    }
+
+    requests[callback].push_back(CallbackRequest(timer));
+    requests[callback].back().dequeued_us = entry.dequeued_us;
+    entries[callback].push_back(entry);
+  }
+
+  __statistics->increment(Statistics::POP_SLICES);
+
+  uint64_t start_deadline_us = 0;
+  if (slice_budget_us > 0)
+  {
+    start_deadline_us = now_us + slice_budget_us;
+  }
+
+  perform_slice(start_deadline_us);
+
+  size_t deferred = 0;
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    std::vector<BacklogEntry>& callback_entries = entries[it->first];
+
+    for (size_t ii = 0; ii < it->second.size(); ii++)
+    {
+      CallbackRequest& request = it->second[ii];
+
+      if (request.deferred)
+      {
+        // Return the timer to the backlog, where it keeps its place.
+        request.timer->sequence_number--;
+        _backlog.push_back(callback_entries[ii]);
+        std::push_heap(_backlog.begin(), _backlog.end());
+        _backlog_ids.insert(request.timer);
+        deferred++;
+        continue;
+      }
+
+      if (request.started_us != 0)
+      {
+        Statistics::PrecisionClass precision =
+                                   Statistics::precision_class(request.timer->interval);
+        uint64_t started_wall_us = now_wall_us + (request.started_us - now_us);
+        uint64_t due_us = callback_entries[ii].due_ms * 1000;
+        __statistics->record_latency(Statistics::DISPATCH_DELAY,
+                                     precision,
+                                     request.started_us - request.dequeued_us);
+        __statistics->record_latency(Statistics::DISPATCH_LATENESS,
+                                     precision,
+                                     (started_wall_us > due_us) ? (started_wall_us - due_us) : 0);
+        __statistics->record_latency(Statistics::CALLBACK_RTT,
+                                     precision,
+                                     request.completed_us - request.started_us);
+
+        // The other replicas must wait for the callback to complete, so tell
+        // the replica stagger how late it completed.
+        if (__replica_stagger != NULL)
+        {
+          uint64_t completed_wall_us = started_wall_us + (request.completed_us - request.started_us);
+          __replica_stagger->record_callback((completed_wall_us > due_us) ? (completed_wall_us - due_us) : 0);
+        }
+      }
+
+      if (request.success)
+      {
+        apply_response(request.timer, request);
+      }
+      callback_complete(request.timer, request.success);
+    }
+  }
+
+  if (deferred > 0)
+  {
+    ASYNC_LOG_DEBUG("Deferred %lu callbacks to the next slice", deferred);
+    __statistics->increment(Statistics::POP_DEFERRALS, deferred);
+  }
+  __statistics->set(Statistics::POP_BACKLOG, _backlog.size());
+}
+
+// Hand each callback handler its share of the slice.  One handler performs its
+// callbacks on the handler thread while the others run on worker threads of
+// their own, and this returns once they've all finished.  If a worker can't
+// be started, its handler's callbacks are performed on the handler thread
+// instead.
+void TimerHandler::perform_slice(uint64_t start_deadline_us)
+{
+  std::map<Callback*, std::vector<CallbackRequest>>& requests = _slice_requests;
+  std::vector<CallbackRequest>* inline_requests = NULL;
+  Callback* inline_callback = NULL;
+  std::vector<CallbackWorker*>& started = _started_workers;
+  started.clear();
+
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    if (it->second.empty())
+    {
+      continue;
+    }
+
+    if (inline_callback == NULL)
+    {
+      inline_callback = it->first;
+      inline_requests = &it->second;
+      continue;
+    }
+
+    CallbackWorker* worker = worker_for(it->first);
+    if (worker == NULL)
+    {
+      it->first->perform_all(it->second, start_deadline_us);
+      continue;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->requests = &it->second;
+    worker->start_deadline_us = start_deadline_us;
+    worker->busy = true;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    started.push_back(worker);
+  }
+
+  if (inline_callback != NULL)
+  {
+    inline_callback->perform_all(*inline_requests, start_deadline_us);
+  }
+
+  for (auto it = started.begin(); it != started.end(); it++)
+  {
+    CallbackWorker* worker = *it;
+    pthread_mutex_lock(&worker->mutex);
+    while (worker->busy)
+    {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+  }
+}
+
+// Get the worker thread for a callback handler, starting it if this is the
+// first time it's needed.  Returns NULL if the thread can't be started.
+TimerHandler::CallbackWorker* TimerHandler::worker_for(Callback* callback)
+{
+  auto it = _workers.find(callback);
+  if (it != _workers.end())
+  {
+    return it->second;
+  }
+
+  CallbackWorker* worker = new CallbackWorker();
+  worker->callback = callback;
+  worker->requests = NULL;
+  worker->start_deadline_us = 0;
+  worker->busy = false;
+  worker->terminate = false;
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->cond, NULL);
+
+  int rc = pthread_create(&worker->thread,
+                          NULL,
+                          &callback_worker_entry_func,
+                          (void*)worker);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to start callback worker thread: %s", strerror(rc));
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    delete worker;
+    return NULL;
+  }
+
+  _workers[callback] = worker;
+  return worker;
+}
+
+// Apply a cancel or new timing from the response to a timer's callback, in
+// place of the consumer updating the timer with a separate request.  A
+// rescheduled timer starts again from now, just as if it had been replaced
+// with a PUT, and is replicated along with the pop.
+void TimerHandler::apply_response(Timer* timer, const CallbackRequest& request)
+{
+  if (request.cancel)
+  {
+    __statistics->increment(Statistics::CALLBACK_CANCELS);
+    timer->become_tombstone();
+  }
+  else if (request.reschedule)
+  {
+    __statistics->increment(Statistics::CALLBACK_RESCHEDULES);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timer->start_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+    timer->interval = request.interval;
+    timer->repeat_for = request.repeat_for;
+
+    // The sequence number is incremented when the timer next pops.
+    timer->sequence_number = 0;
+  }
+}
+
+// Handle the result of a timer's callback, if required pass the timer on to
+// the replication layer to reset the timer for another pop, otherwise destroy
+// the timer record.
+//
+// A failed callback is retried (with exponential backoff) by putting the timer
+// back into the store to pop again at the retry time, up to a configured
+// number of attempts.  Retries are not replicated, as the replicas will pop
+// the timer themselves if this node never manages to.
+void TimerHandler::callback_complete(Timer* timer, bool success)
+{
   if (success)
   {
+    __statistics->increment(Statistics::CALLBACK_SUCCESSES);
+    timer->retry_count = 0;
+    timer->retry_time = 0;
+
     // Check if the next pop occurs before the repeat-for interval and,
     // if not, convert to a tombstone to indicate the timer is dead.
     if ((timer->sequence_number + 1) * timer->interval > timer->repeat_for)
     {
       timer->become_tombstone();
     }
-    _replicator->replicate(timer);
+    // Handlers that don't replicate (such as an embedded engine's) have no
+    // replicator.
+    if (_replicator != NULL)
+    {
+      _replicator->replicate(timer);
+    }
     _store->add_timer(timer);
     timer = NULL; // We relinquish control of the timer when we give
                   // it to the store.
+    return;
+  }
+
+  __statistics->increment(Statistics::CALLBACK_FAILURES);
+
+  int max_retries;
+  int retry_backoff_ms;
+  __globals->get_callback_max_retries(max_retries);
+  __globals->get_callback_retry_backoff_ms(retry_backoff_ms);
+
+  if (timer->retry_count < (uint32_t)max_retries)
+  {
+    // Undo the increment from the pop so the retry carries the same sequence
+    // number as the failed attempt.
+    uint64_t backoff_ms = (uint64_t)retry_backoff_ms << timer->retry_count;
+    timer->retry_count++;
+    timer->sequence_number--;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timer->retry_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + backoff_ms;
+
+    ASYNC_LOG_INFO("Failed to process callback for %lu, retry %u in %lums",
+                   timer->id, timer->retry_count, backoff_ms);
+    __statistics->increment(Statistics::CALLBACK_RETRIES);
+    _store->add_timer(timer);
+    timer = NULL;
   }
   else
   {
-    LOG_WARNING("Failed to process callback for %lu", timer->id);
+    ASYNC_LOG_WARNING_RATE_LIMITED("Failed to process callback for %lu", timer->id);
+    if (max_retries > 0)
+    {
+      __statistics->increment(Statistics::CALLBACK_RETRIES_EXHAUSTED);
+    }
     delete timer;
   }
 }
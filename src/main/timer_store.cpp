@@ -1,5 +1,6 @@
 #include "timer_store.h"
 #include "log.h"
+#include "async_logger.h"
 #include <algorithm>
 #include <string.h>
 #include <assert.h>
@@ -13,26 +14,29 @@
                       "Seq:      %u\n"                                         \
                       "URL:      %s\n"                                         \
                       "Body:\n"                                                \
-                      "%s"
+                      "%.*s"
 #define TIMER_LOG_PARAMS(T) (T)->id,                                           \
                             (T)->start_time,                                   \
                             (T)->interval,                                     \
                             (T)->repeat_for,                                   \
                             (T)->sequence_number,                              \
                             (T)->callback_url.c_str(),                         \
-                            (T)->callback_body.c_str()
+                            (int)(T)->callback_body.length(),                  \
+                            (T)->callback_body.data()
 
-TimerStore::TimerStore()
+TimerStore::TimerStore() :
+  _long_bucket_capacity(0)
 {
   _tick_timestamp = to_short_wheel_resolution(wall_time_ms());
+  _spare_long_buckets.reserve(MAX_SPARE_LONG_BUCKETS);
 }
 
 TimerStore::~TimerStore()
 {
   // Delete the timers in the lookup table as they will never pop now.
-  for (auto it = _timer_lookup_table.begin(); it != _timer_lookup_table.end(); it++)
+  for (auto it = _timer_lookup_table.slots_begin(); it != _timer_lookup_table.slots_end(); it++)
   {
-    delete it->second;
+    delete *it;
   }
   _timer_lookup_table.clear();
   for (int ii = 0; ii < SHORT_WHEEL_NUM_BUCKETS; ii ++)
@@ -52,10 +56,9 @@ TimerStore::~TimerStore()
 void TimerStore::add_timer(Timer* t)
 {
   // First check if this timer already exists.
-  auto map_it = _timer_lookup_table.find(t->id);
-  if (map_it != _timer_lookup_table.end())
+  Timer* existing = _timer_lookup_table.find(t->id);
+  if (existing != NULL)
   {
-    Timer* existing = map_it->second;
 
     // Compare timers for precedence, start-time then sequence-number.
     if ((t->start_time < existing->start_time) ||
@@ -89,6 +92,7 @@ void TimerStore::add_timer(Timer* t)
   // timer must actually go in to the long wheel.  The same logic applies for
   // the 1s buckets (where timers due to pop in >=1hr need to go into the heap).
   uint64_t next_pop_time = t->next_pop_time();
+  t->store_pop_time = next_pop_time;
   Bucket* bucket;
 
   if (next_pop_time < _tick_timestamp)
@@ -100,10 +104,10 @@ void TimerStore::add_timer(Timer* t)
     // what bucket to look in when deleting timers, and this is derived from
     // the pop time. So if we put the timer in the wrong bucket we can't find
     // it to delete it.
-    LOG_WARNING("Modifying timer after pop time (current time is %lu). "
-                "Window condition detected.\n" TIMER_LOG_FMT,
-                _tick_timestamp,
-                TIMER_LOG_PARAMS(t));
+    ASYNC_LOG_WARNING_RATE_LIMITED("Modifying timer after pop time (current time is %lu). "
+                                   "Window condition detected.\n" TIMER_LOG_FMT,
+                                   _tick_timestamp,
+                                   TIMER_LOG_PARAMS(t));
     _overdue_timers.insert(t);
   }
   else if (to_short_wheel_resolution(next_pop_time) <
@@ -117,42 +121,62 @@ void TimerStore::add_timer(Timer* t)
            to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS))
   {
     bucket = long_wheel_bucket(next_pop_time);
+    if (bucket->capacity() == 0)
+    {
+      // The bucket is being used for the first time, so give it the capacity
+      // of one that's been emptied.
+      if (!_spare_long_buckets.empty())
+      {
+        bucket->swap(_spare_long_buckets.back());
+        _spare_long_buckets.pop_back();
+      }
+      bucket->reserve(_long_bucket_capacity);
+    }
     bucket->insert(t);
+
+    if (bucket->capacity() > _long_bucket_capacity)
+    {
+      // Grow the spare buckets to match, so the next bucket to be used has
+      // room for as many timers.
+      _long_bucket_capacity = bucket->capacity();
+      for (auto it = _spare_long_buckets.begin(); it != _spare_long_buckets.end(); it++)
+      {
+        it->reserve(_long_bucket_capacity);
+      }
+    }
   }
   else
   {
     // Timer is too far in the future to be handled by the wheels, put it in
     // the extra heap.
-    LOG_WARNING("Adding timer to extra heap, consider re-building with a larger "
-                "LONG_WHEEL_NUM_BUCKETS constant");
+    ASYNC_LOG_WARNING_RATE_LIMITED("Adding timer to extra heap, consider re-building with a larger "
+                                   "LONG_WHEEL_NUM_BUCKETS constant");
     _extra_heap.push_back(t);
     std::push_heap(_extra_heap.begin(), _extra_heap.end());
   }
 
   // Finally, add the timer to the lookup table.
-  _timer_lookup_table.insert(std::pair<TimerID, Timer*>(t->id, t));
+  _timer_lookup_table.insert(t);
 }
 
 // Add a collection of timers to the data store.  The collection is emptied by
 // this operation, since the timers are now owned by the store.
-void TimerStore::add_timers(std::unordered_set<Timer*>& set)
+void TimerStore::add_timers(std::vector<Timer*>& timers)
 {
-  for (auto it = set.begin(); it != set.end(); it++)
+  for (auto it = timers.begin(); it != timers.end(); it++)
   {
     add_timer(*it);
   }
-  set.clear();
+  timers.clear();
 }
 
 // Delete a timer from the store by ID.
 void TimerStore::delete_timer(TimerID id)
 {
-  std::map<TimerID, Timer*>::iterator it;
-  it = _timer_lookup_table.find(id);
-  if (it != _timer_lookup_table.end())
+  Timer* timer = _timer_lookup_table.find(id);
+  if (timer != NULL)
   {
     // The timer is still present in the store, delete it.
-    Timer* timer = it->second;
     Bucket* bucket;
     size_t num_erased;
 
@@ -205,16 +229,16 @@ void TimerStore::delete_timer(TimerID id)
   }
 }
 
-// Retrieve the set of timers to pop.  The timers returned are disowned by the
-// store and must be freed by the caller or returned to the store through
+// Retrieve the timers to pop.  The timers returned are disowned by the store
+// and must be freed by the caller or returned to the store through
 // `add_timer()`.
 //
-// If the returned set is empty, there are no timers in the store and the caller
-// will try again later (after a signal that a new timer has been added).
-void TimerStore::get_next_timers(std::unordered_set<Timer*>& set)
+// If no timers are returned, there are no timers due and the caller will try
+// again later (after a signal that a new timer has been added).
+void TimerStore::get_next_timers(std::vector<Timer*>& timers)
 {
   // Always pop the overdue timers, even if we're not processing any ticks.
-  pop_bucket(&_overdue_timers, set);
+  pop_bucket(&_overdue_timers, timers);
 
   // Now process the required number of ticks. Integer division does the
   // necessary rounding for us.
@@ -226,7 +250,7 @@ void TimerStore::get_next_timers(std::unordered_set<Timer*>& set)
   {
     // Pop all timers in the current bucket.
     Bucket* bucket = short_wheel_bucket(_tick_timestamp);
-    pop_bucket(bucket, set);
+    pop_bucket(bucket, timers);
 
     // Get ready for the next tick - advance the tick time, and refill the
     // timer wheels.
@@ -235,6 +259,36 @@ void TimerStore::get_next_timers(std::unordered_set<Timer*>& set)
   }
 }
 
+// Find the timers due to pop within the given window, by looking in the short
+// wheel buckets that will pop in that time (and the overdue timers, which will
+// pop next).  If the window extends past the next one second boundary, timers
+// due after it may still be in the long wheel, so look there too.
+void TimerStore::peek_upcoming_timers(uint64_t window_ms, std::vector<Timer*>& timers)
+{
+  timers.insert(timers.end(), _overdue_timers.begin(), _overdue_timers.end());
+
+  uint64_t window_end = _tick_timestamp + std::min(window_ms, (uint64_t)SHORT_WHEEL_PERIOD_MS);
+
+  for (uint64_t tick = _tick_timestamp; tick < window_end; tick += SHORT_WHEEL_RESOLUTION_MS)
+  {
+    Bucket* bucket = short_wheel_bucket(tick);
+    timers.insert(timers.end(), bucket->begin(), bucket->end());
+  }
+
+  uint64_t next_refill = to_long_wheel_resolution(_tick_timestamp) + LONG_WHEEL_RESOLUTION_MS;
+  if (next_refill < window_end)
+  {
+    Bucket* bucket = long_wheel_bucket(next_refill);
+    for (auto it = bucket->begin(); it != bucket->end(); it++)
+    {
+      if ((*it)->store_pop_time < window_end)
+      {
+        timers.push_back(*it);
+      }
+    }
+  }
+}
+
 /*****************************************************************************/
 /* Private functions.                                                        */
 /*****************************************************************************/
@@ -271,12 +325,12 @@ uint64_t TimerStore::to_long_wheel_resolution(uint64_t t)
 
 TimerStore::Bucket* TimerStore::short_wheel_bucket(Timer* timer)
 {
-  return short_wheel_bucket(timer->next_pop_time());
+  return short_wheel_bucket(timer->store_pop_time);
 }
 
 TimerStore::Bucket* TimerStore::long_wheel_bucket(Timer* timer)
 {
-  return long_wheel_bucket(timer->next_pop_time());
+  return long_wheel_bucket(timer->store_pop_time);
 }
 
 TimerStore::Bucket* TimerStore::short_wheel_bucket(uint64_t t)
@@ -292,12 +346,12 @@ TimerStore::Bucket* TimerStore::long_wheel_bucket(uint64_t t)
 }
 
 void TimerStore::pop_bucket(TimerStore::Bucket* bucket,
-                            std::unordered_set<Timer*>& set)
+                            std::vector<Timer*>& timers)
 {
   for(auto it = bucket->begin(); it != bucket->end(); it++)
   {
     _timer_lookup_table.erase((*it)->id);
-    set.insert(*it);
+    timers.push_back(*it);
   }
   bucket->clear();
 }
@@ -330,7 +384,7 @@ void TimerStore::refill_long_wheel()
     Timer* timer = _extra_heap.back();
 
     while ((timer != NULL) &&
-           (timer->next_pop_time() < _tick_timestamp + LONG_WHEEL_PERIOD_MS))
+           (timer->store_pop_time < _tick_timestamp + LONG_WHEEL_PERIOD_MS))
     {
       // Remove timer from heap
       _extra_heap.pop_back();
@@ -370,6 +424,13 @@ void TimerStore::refill_short_wheel()
   }
 
   long_bucket->clear();
+  if ((long_bucket->capacity() > 0) &&
+      (_spare_long_buckets.size() < MAX_SPARE_LONG_BUCKETS))
+  {
+    _spare_long_buckets.push_back(Bucket());
+    _spare_long_buckets.back().swap(*long_bucket);
+    _spare_long_buckets.back().reserve(_long_bucket_capacity);
+  }
 }
 
 // Remove the timer from all the timer buckets.  This is a fallback that is only
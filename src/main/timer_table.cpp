@@ -0,0 +1,115 @@
+#include "timer_table.h"
+
+#include <algorithm>
+
+TimerTable::TimerTable() :
+  _slots(INITIAL_SLOTS, NULL),
+  _mask(INITIAL_SLOTS - 1),
+  _size(0)
+{
+}
+
+TimerTable::~TimerTable()
+{
+}
+
+Timer* TimerTable::find(TimerID id) const
+{
+  return _slots[slot_for(id)];
+}
+
+void TimerTable::insert(Timer* timer)
+{
+  size_t slot = slot_for(timer->id);
+  if (_slots[slot] == NULL)
+  {
+    _size++;
+  }
+  _slots[slot] = timer;
+
+  if (_size * 2 > _slots.size())
+  {
+    grow();
+  }
+}
+
+// Remove a timer, then move back any timers after it (in the same run of
+// occupied slots) that would otherwise no longer be found, as probing for them
+// would stop at the gap.
+bool TimerTable::erase(TimerID id)
+{
+  size_t gap = slot_for(id);
+  if (_slots[gap] == NULL)
+  {
+    return false;
+  }
+
+  _slots[gap] = NULL;
+  _size--;
+
+  for (size_t slot = (gap + 1) & _mask; _slots[slot] != NULL; slot = (slot + 1) & _mask)
+  {
+    // The timer can move to the gap if its home slot isn't cyclically between
+    // the gap and where it is now.
+    size_t home = hash(_slots[slot]->id) & _mask;
+    if (((slot - home) & _mask) >= ((slot - gap) & _mask))
+    {
+      _slots[gap] = _slots[slot];
+      _slots[slot] = NULL;
+      gap = slot;
+    }
+  }
+
+  return true;
+}
+
+void TimerTable::clear()
+{
+  std::fill(_slots.begin(), _slots.end(), (Timer*)NULL);
+  _size = 0;
+}
+
+/*****************************************************************************/
+/* PRIVATE FUNCTIONS                                                         */
+/*****************************************************************************/
+
+// Find the slot holding the timer with the given ID, or the empty slot where it
+// would go.  As the table is never more than half full, there's always an
+// empty slot.
+size_t TimerTable::slot_for(TimerID id) const
+{
+  size_t slot = hash(id) & _mask;
+  while ((_slots[slot] != NULL) && (_slots[slot]->id != id))
+  {
+    slot = (slot + 1) & _mask;
+  }
+  return slot;
+}
+
+void TimerTable::grow()
+{
+  std::vector<Timer*> old_slots(_slots.size() * 2, NULL);
+  old_slots.swap(_slots);
+  _mask = _slots.size() - 1;
+
+  for (auto it = old_slots.begin(); it != old_slots.end(); it++)
+  {
+    if (*it != NULL)
+    {
+      _slots[slot_for((*it)->id)] = *it;
+    }
+  }
+}
+
+// Mix the bits of the ID (the finalizer from MurmurHash3), as timer IDs are
+// often sequential and only the low bits pick the slot.
+size_t TimerTable::hash(TimerID id)
+{
+  uint64_t h = id;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (size_t)h;
+}
@@ -0,0 +1,50 @@
+#include "allocation_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+// The allocations made by each thread, and how many AllocationCounters are
+// counting them.
+static __thread size_t thread_allocations = 0;
+static __thread int thread_counters = 0;
+
+void* operator new(size_t size)
+{
+  if (thread_counters > 0)
+  {
+    thread_allocations++;
+  }
+
+  void* ptr = malloc((size > 0) ? size : 1);
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+  free(ptr);
+}
+
+AllocationCounter::AllocationCounter() :
+  _start(thread_allocations)
+{
+  thread_counters++;
+}
+
+AllocationCounter::~AllocationCounter()
+{
+  thread_counters--;
+}
+
+size_t AllocationCounter::count()
+{
+  return thread_allocations - _start;
+}
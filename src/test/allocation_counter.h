@@ -0,0 +1,20 @@
+#ifndef ALLOCATION_COUNTER_H__
+#define ALLOCATION_COUNTER_H__
+
+#include <cstddef>
+
+// Counts the memory allocations (through operator new) made by the current
+// thread while it exists, so tests can check a code path doesn't allocate.
+class AllocationCounter
+{
+public:
+  AllocationCounter();
+  ~AllocationCounter();
+
+  size_t count();
+
+private:
+  size_t _start;
+};
+
+#endif
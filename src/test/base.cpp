@@ -1,5 +1,7 @@
 #include "base.h"
 #include "globals.h"
+#include "statistics.h"
+#include "replica_stagger.h"
 
 #include <gtest/gtest.h>
 
@@ -23,11 +25,46 @@ void Base::SetUp()
   __globals->set_cluster_hashes(cluster_hashes);
   int bind_port = 9999;
   __globals->set_bind_port(bind_port);
+  int callback_timeout_ms = 100;
+  __globals->set_callback_timeout_ms(callback_timeout_ms);
+  int max_retries = 2;
+  __globals->set_callback_max_retries(max_retries);
+  int retry_backoff_ms = 250;
+  __globals->set_callback_retry_backoff_ms(retry_backoff_ms);
+  std::string tcp_io_engine = "auto";
+  __globals->set_callback_tcp_io_engine(tcp_io_engine);
+  int max_slice_size = 1000;
+  __globals->set_pop_max_slice_size(max_slice_size);
+  int slice_budget_us = 0;
+  __globals->set_pop_slice_budget_us(slice_budget_us);
+  int lookahead_ms = 0;
+  __globals->set_pop_lookahead_ms(lookahead_ms);
+  int batch_size = 100;
+  __globals->set_replication_batch_size(batch_size);
+  int batch_window_ms = 2;
+  __globals->set_replication_batch_window_ms(batch_window_ms);
+  int connections_per_node = 4;
+  __globals->set_replication_connections_per_node(connections_per_node);
+  int max_queued_per_node = 10000;
+  __globals->set_replication_max_queued_per_node(max_queued_per_node);
+  int stagger_floor_ms = 200;
+  __globals->set_replication_stagger_floor_ms(stagger_floor_ms);
+  int stagger_margin_ms = 50;
+  __globals->set_replication_stagger_margin_ms(stagger_margin_ms);
+  int stagger_max_ms = 2000;
+  __globals->set_replication_stagger_max_ms(stagger_max_ms);
   __globals->unlock();
+
+  __statistics = new Statistics();
+  __replica_stagger = new ReplicaStagger();
 }
 
 void Base::TearDown()
 {
+  delete __replica_stagger;
+  __replica_stagger = NULL;
+  delete __statistics;
+  __statistics = NULL;
   delete __globals;
   __globals = NULL;
 }
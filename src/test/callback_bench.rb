@@ -0,0 +1,100 @@
+# Benchmark for callback delivery, comparing HTTP callbacks (through cURL)
+# with TCP callbacks (through the io_uring or epoll I/O engine).
+#
+# Sets a storm of timers that all pop at the same moment (they share a start
+# time, so make sure they can all be set within STORM_DELAY) with the given
+# callback, waits for them all to be delivered and reports the delivery rate,
+# the callback latencies and the cost of delivery per pop.  The callback is
+# either an HTTP URL (point it at a sink such as h2c_server.rb) or a TCP
+# consumer address (HOST:PORT or unix:PATH, served by tcp_consumer.rb).
+#
+# The TCP callback I/O engine is chosen by the callback.tcp-io-engine option,
+# so restart the node with each engine to compare them.  Restart it between
+# runs anyway, as the latency statistics cover everything since start of day.
+#
+# For the TCP engines, the system calls made per pop are counted by the node
+# itself.  cURL's system calls aren't counted, so to compare the paths fairly
+# give the node's PID and the benchmark also reports the node's context
+# switches per pop (or run the node under `strace -c -f` for exact counts).
+#
+# Usage: ruby callback_bench.rb <chronos host:port> <callback> [timers] [pid]
+
+require "net/http"
+require "json"
+
+CHRONOS = ARGV[0] || "127.0.0.1:7253"
+CALLBACK = ARGV[1] || "http://127.0.0.1:1234/callback"
+STORM_SIZE = (ARGV[2] || 20000).to_i
+PID = ARGV[3]
+STORM_DELAY = 10
+
+host, port = CHRONOS.split(":")
+port = port.to_i
+
+callback = if CALLBACK.start_with?("http")
+             { http: { uri: CALLBACK, opaque: "callback benchmark" } }
+           else
+             { tcp: { address: CALLBACK, opaque: "callback benchmark" } }
+           end
+start_time = (Time.now.to_f * 1000).to_i
+body = JSON.generate(timing: { interval: STORM_DELAY,
+                               "repeat-for" => STORM_DELAY,
+                               "start-time" => start_time },
+                     callback: callback,
+                     reliability: { "replication-factor" => 1 })
+
+def statistics(http)
+  JSON.parse(http.get("/statistics").body)
+end
+
+def context_switches
+  return 0 unless PID
+  Dir.glob("/proc/#{PID}/task/*/status").sum do |status|
+    File.read(status).scan(/ctxt_switches:\s+(\d+)/).sum { |m| m[0].to_i }
+  rescue Errno::ENOENT
+    0
+  end
+end
+
+Net::HTTP.start(host, port) do |http|
+  before = statistics(http)
+  puts "Setting #{STORM_SIZE} timers to pop together in #{STORM_DELAY}s"
+  STORM_SIZE.times do
+    req = Net::HTTP::Post.new("/timers")
+    req.body = body
+    http.request(req)
+  end
+
+  # Wait for the first pop, then time how long the storm takes to deliver.
+  done = lambda do |stats|
+    stats["callback-successes"] + stats["callback-failures"] -
+      before["callback-successes"] - before["callback-failures"]
+  end
+  sleep 0.001 while done.call(stats = statistics(http)).zero?
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  start_stats = stats
+  start_switches = context_switches
+
+  delivered = 0
+  deadline = start + 60
+  while delivered < STORM_SIZE && Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    sleep 0.01
+    delivered = done.call(stats = statistics(http))
+  end
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  switches = context_switches - start_switches
+
+  pops = done.call(stats) - done.call(start_stats)
+  syscalls = stats["callback-io-syscalls"] - start_stats["callback-io-syscalls"]
+  failures = stats["callback-failures"] - before["callback-failures"]
+  rtt = stats["latency"]["callback-rtt"]["long"]
+  lateness = stats["latency"]["dispatch-lateness"]["long"]
+
+  puts format("Delivered %d pops (%d failed) in %.2fs: %.0f pops/s",
+              delivered, failures, elapsed, pops / elapsed)
+  puts format("Callback RTT: p50 %dus  p99 %dus  max %dus", rtt["p50"], rtt["p99"], rtt["max"])
+  puts format("Dispatch lateness: p50 %dus  p99 %dus  max %dus",
+              lateness["p50"], lateness["p99"], lateness["max"])
+  puts format("Engine system calls: %.3f per pop", syscalls.to_f / pops) if syscalls > 0
+  puts format("Context switches: %.3f per pop", switches.to_f / pops) if PID
+end
@@ -0,0 +1,183 @@
+# Callback sink for benchmarking HTTP/1.1 against HTTP/2 callback delivery.
+#
+# Accepts callbacks over HTTP/1.1 (with keep-alive), h2c with prior knowledge
+# and h2c via an HTTP/1.1 upgrade, all on the same port, and answers every
+# request with an empty 200.  Once a second it prints the number of callbacks
+# received over each protocol, so the throughput of the two callback paths can
+# be compared without any external services.
+#
+# To benchmark, point a batch of timers at http://<sink>:<port>/callback, then
+# repeat with the sink listed as a `callback.http2-host` in chronos.conf.
+#
+# Only the framing needed to receive callbacks is implemented - request headers
+# are never decoded.  Usage: ruby h2c_server.rb [port]
+
+require "socket"
+
+PORT = (ARGV[0] || 1234).to_i
+
+PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+FRAME_DATA = 0x0
+FRAME_HEADERS = 0x1
+FRAME_SETTINGS = 0x4
+FRAME_PING = 0x6
+FRAME_GOAWAY = 0x7
+FRAME_WINDOW_UPDATE = 0x8
+
+FLAG_END_STREAM = 0x1
+FLAG_ACK = 0x1
+FLAG_END_HEADERS = 0x4
+
+# ":status: 200" is entry 8 in the HPACK static table.
+STATUS_200 = [0x88].pack("C")
+
+SETTINGS_MAX_CONCURRENT_STREAMS = 0x3
+SETTINGS_INITIAL_WINDOW_SIZE = 0x4
+MAX_WINDOW = 0x7fffffff
+CONNECTION_WINDOW = 0x40000000
+
+$counts = { "HTTP/1.1" => 0, "HTTP/2" => 0 }
+$lock = Mutex.new
+
+def count(protocol)
+  $lock.synchronize { $counts[protocol] += 1 }
+end
+
+def frame(type, flags, stream_id, payload = "")
+  [payload.bytesize >> 16, payload.bytesize & 0xffff, type, flags, stream_id].pack("CnCCN") + payload
+end
+
+def read_http1_request(sock)
+  request_line = sock.gets("\r\n")
+  return nil if request_line.nil?
+
+  headers = {}
+  while (line = sock.gets("\r\n")) && line != "\r\n"
+    name, value = line.split(":", 2)
+    headers[name.strip.downcase] = value.strip
+  end
+  sock.read(headers["content-length"].to_i) if headers["content-length"]
+  headers
+end
+
+def serve_http1(sock, first_bytes)
+  sock = PrefixedSocket.new(first_bytes, sock)
+  while (headers = read_http1_request(sock))
+    count("HTTP/1.1")
+    if headers["upgrade"].to_s.downcase == "h2c"
+      sock.write("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n")
+
+      # The upgraded request becomes stream 1, so answer it over HTTP/2 once
+      # the client has sent its connection preface.
+      sock.write(settings_frame)
+      sock.write(frame(FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, 1, STATUS_200))
+      preface = sock.read(PREFACE.bytesize)
+      return if preface != PREFACE
+      serve_http2(sock, false)
+      return
+    end
+    sock.write("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+  end
+end
+
+def settings_frame
+  frame(FRAME_SETTINGS, 0, 0, [SETTINGS_MAX_CONCURRENT_STREAMS, 10000,
+                               SETTINGS_INITIAL_WINDOW_SIZE, MAX_WINDOW].pack("nNnN"))
+end
+
+def serve_http2(sock, send_settings = true)
+  sock.write(settings_frame) if send_settings
+
+  # Open up the connection-level receive window too.  This is topped up as
+  # data arrives, so must leave room below the maximum window size.
+  sock.write(frame(FRAME_WINDOW_UPDATE, 0, 0, [CONNECTION_WINDOW].pack("N")))
+
+  loop do
+    header = sock.read(9)
+    return if header.nil? || header.bytesize < 9
+
+    len_hi, len_lo, type, flags, stream_id = header.unpack("CnCCN")
+    length = (len_hi << 16) | len_lo
+    stream_id &= 0x7fffffff
+    payload = length > 0 ? sock.read(length) : ""
+
+    case type
+    when FRAME_SETTINGS
+      sock.write(frame(FRAME_SETTINGS, FLAG_ACK, 0)) if (flags & FLAG_ACK) == 0
+    when FRAME_PING
+      sock.write(frame(FRAME_PING, FLAG_ACK, 0, payload)) if (flags & FLAG_ACK) == 0
+    when FRAME_DATA
+      if length > 0
+        increment = [length].pack("N")
+        sock.write(frame(FRAME_WINDOW_UPDATE, 0, 0, increment))
+        sock.write(frame(FRAME_WINDOW_UPDATE, 0, stream_id, increment)) if (flags & FLAG_END_STREAM) == 0
+      end
+    when FRAME_GOAWAY
+      return
+    end
+
+    if (type == FRAME_HEADERS || type == FRAME_DATA) && (flags & FLAG_END_STREAM) != 0
+      count("HTTP/2")
+      sock.write(frame(FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, stream_id, STATUS_200))
+    end
+  end
+end
+
+# Replays the bytes read while sniffing the protocol before reading on from the
+# socket itself.
+class PrefixedSocket
+  def initialize(prefix, sock)
+    @buffer = prefix.dup
+    @sock = sock
+  end
+
+  def gets(separator)
+    until (index = @buffer.index(separator))
+      data = @sock.readpartial(4096) rescue nil
+      return nil if data.nil?
+      @buffer << data
+    end
+    @buffer.slice!(0, index + separator.bytesize)
+  end
+
+  def read(length)
+    while @buffer.bytesize < length
+      data = @sock.readpartial(4096) rescue nil
+      return nil if data.nil?
+      @buffer << data
+    end
+    @buffer.slice!(0, length)
+  end
+
+  def write(data)
+    @sock.write(data)
+  end
+end
+
+Thread.new do
+  loop do
+    sleep 1
+    counts = $lock.synchronize { c = $counts.dup; $counts.each_key { |k| $counts[k] = 0 }; c }
+    puts counts.map { |protocol, n| "#{protocol}: #{n}/s" }.join(", ")
+    STDOUT.flush
+  end
+end
+
+server = TCPServer.new(PORT)
+loop do
+  Thread.start(server.accept) do |sock|
+    begin
+      sock.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+      first_bytes = sock.read(PREFACE.bytesize) || ""
+      if first_bytes == PREFACE
+        serve_http2(PrefixedSocket.new("", sock))
+      else
+        serve_http1(sock, first_bytes)
+      end
+    rescue IOError, SystemCallError
+    ensure
+      sock.close rescue nil
+    end
+  end
+end
@@ -0,0 +1,78 @@
+# Benchmark for the rate at which a Chronos node accepts new timers while it
+# is busy popping others.
+#
+# First sets a storm of timers that all pop at the same moment, then, while
+# they are popping, sets new (long) timers from several connections as fast as
+# possible, reporting the request rate and latency each second.  Point the
+# storm's callbacks at a sink such as h2c_server.rb (optionally started with a
+# delay to slow the callbacks down).
+#
+# Usage: ruby ingest_bench.rb <chronos host:port> <callback url> [storm size] [clients] [seconds]
+
+require "net/http"
+require "json"
+
+CHRONOS = ARGV[0] || "127.0.0.1:7253"
+CALLBACK = ARGV[1] || "http://127.0.0.1:1234/callback"
+STORM_SIZE = (ARGV[2] || 10000).to_i
+CLIENTS = (ARGV[3] || 4).to_i
+DURATION = (ARGV[4] || 10).to_i
+STORM_DELAY = 2
+
+host, port = CHRONOS.split(":")
+port = port.to_i
+
+def timer_body(interval, repeat_for)
+  JSON.generate(timing: { interval: interval, "repeat-for" => repeat_for },
+                callback: { http: { uri: CALLBACK, opaque: "ingest benchmark" } },
+                reliability: { "replication-factor" => 1 })
+end
+
+# Set up the storm.  Timers are set with the same interval as quickly as
+# possible, so pop within a short window of each other.
+puts "Setting #{STORM_SIZE} timers to pop in #{STORM_DELAY}s"
+Net::HTTP.start(host, port) do |http|
+  STORM_SIZE.times do
+    req = Net::HTTP::Post.new("/timers")
+    req.body = timer_body(STORM_DELAY, STORM_DELAY)
+    http.request(req)
+  end
+end
+
+# Now measure how fast new timers can be set while the storm pops.
+lock = Mutex.new
+count = 0
+latencies = []
+stop = false
+
+threads = (1..CLIENTS).map do
+  Thread.new do
+    Net::HTTP.start(host, port) do |http|
+      until stop
+        req = Net::HTTP::Post.new("/timers")
+        req.body = timer_body(3600, 3600)
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        http.request(req)
+        latency = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        lock.synchronize { count += 1; latencies << latency }
+      end
+    end
+  end
+end
+
+total = 0
+DURATION.times do |second|
+  sleep 1
+  sample = lock.synchronize { c = count; l = latencies; count = 0; latencies = []; [c, l] }
+  n, l = sample
+  total += n
+  l.sort!
+  p50 = l.empty? ? 0 : l[l.size / 2] * 1000
+  p99 = l.empty? ? 0 : l[(l.size * 99) / 100] * 1000
+  max = l.empty? ? 0 : l.last * 1000
+  puts format("%3ds: %6d timers/s  p50 %.2fms  p99 %.2fms  max %.2fms", second + 1, n, p50, p99, max)
+end
+
+stop = true
+threads.each(&:join)
+puts format("Average: %.0f timers/s", total.to_f / DURATION)
@@ -9,7 +9,8 @@ class MockCallback : public Callback
 {
 public:
   MOCK_METHOD0(protocol, std::string());
-  MOCK_METHOD3(perform, bool(std::string, std::string, unsigned int));
+  MOCK_METHOD3(perform, bool(std::string, const SharedBuffer&, unsigned int));
+  MOCK_METHOD1(prepare, void(const std::vector<Timer*>&));
 };
 
 #endif
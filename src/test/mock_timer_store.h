@@ -9,9 +9,10 @@ class MockTimerStore : public TimerStore
 {
 public:
   MOCK_METHOD1(add_timer, void(Timer*));
-  MOCK_METHOD1(add_timers, void(std::unordered_set<Timer*>&));
+  MOCK_METHOD1(add_timers, void(std::vector<Timer*>&));
   MOCK_METHOD1(delete_timer, void(TimerID));
-  MOCK_METHOD1(get_next_timers, void(std::unordered_set<Timer*>&));
+  MOCK_METHOD1(get_next_timers, void(std::vector<Timer*>&));
+  MOCK_METHOD2(peek_upcoming_timers, void(uint64_t, std::vector<Timer*>&));
 };
 
 #endif
@@ -0,0 +1,65 @@
+# Consumer for benchmarking TCP callback delivery.
+#
+# Listens for pops on a TCP port or a Unix domain socket, acknowledges every
+# pop as successful and, once a second, prints the number of pops received.
+# Acknowledgements are written as soon as the pops are read, without waiting
+# for the next pop, as the timer service streams pops without waiting for
+# acknowledgements.
+#
+# To benchmark, point a batch of timers at the consumer with a callback block
+# of the form {"tcp": {"address": "<host>:<port>", "opaque": "..."}} (or
+# "unix:<path>" for a Unix domain socket).
+#
+# Usage: ruby tcp_consumer.rb <port | unix:path>
+
+require "socket"
+
+LISTEN = ARGV[0] || "5555"
+
+$count = 0
+$lock = Mutex.new
+
+def serve(sock)
+  buffer = "".b
+  loop do
+    data = sock.readpartial(65536)
+    buffer << data
+    acks = "".b
+    pops = 0
+    while buffer.bytesize >= 4
+      length = buffer.unpack1("N")
+      break if buffer.bytesize < 4 + length
+
+      # Echo the timer ID and sequence number back with a successful result.
+      acks << [13].pack("N") << buffer.byteslice(4, 12) << "\x00"
+      buffer = buffer.byteslice(4 + length, buffer.bytesize - 4 - length)
+      pops += 1
+    end
+    sock.write(acks) unless acks.empty?
+    $lock.synchronize { $count += pops }
+  end
+rescue EOFError, IOError, SystemCallError
+ensure
+  sock.close rescue nil
+end
+
+Thread.new do
+  loop do
+    sleep 1
+    count = $lock.synchronize { c = $count; $count = 0; c }
+    puts "#{count} pops/s"
+    STDOUT.flush
+  end
+end
+
+if LISTEN.start_with?("unix:")
+  path = LISTEN.sub("unix:", "")
+  File.unlink(path) if File.exist?(path)
+  server = UNIXServer.new(path)
+else
+  server = TCPServer.new(LISTEN.to_i)
+end
+
+loop do
+  Thread.start(server.accept) { |sock| serve(sock) }
+end
@@ -0,0 +1,248 @@
+#include "async_logger.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// Logger that records the lines written to it, optionally holding up the
+// AsyncLogger's flush thread until the test lets it carry on.
+class RecordingLogger : public Logger
+{
+public:
+  RecordingLogger() : blocked(false)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&gate, NULL);
+  }
+
+  ~RecordingLogger()
+  {
+    pthread_mutex_destroy(&gate);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void write(const char* data)
+  {
+    blocked = true;
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+    blocked = false;
+
+    pthread_mutex_lock(&mutex);
+    lines.push_back(data);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  std::vector<std::string> get_lines()
+  {
+    pthread_mutex_lock(&mutex);
+    std::vector<std::string> copy = lines;
+    pthread_mutex_unlock(&mutex);
+    return copy;
+  }
+
+  pthread_mutex_t mutex;
+  pthread_mutex_t gate;
+  volatile bool blocked;
+  std::vector<std::string> lines;
+};
+
+class TestAsyncLogger : public Base
+{
+protected:
+  static const int NUM_THREADS = 4;
+  static const int LINES_PER_THREAD = 2000;
+
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    recorder = new RecordingLogger();
+    logger = new AsyncLogger(recorder);
+  }
+
+  virtual void TearDown()
+  {
+    delete logger;
+    Base::TearDown();
+  }
+
+  static void* thread_entry_func(void* arg)
+  {
+    long id = (long)arg;
+    for (int ii = 0; ii < LINES_PER_THREAD; ii++)
+    {
+      AsyncLogger::log(Log::DEBUG_LEVEL, __FILE__, __LINE__, "thread %ld line %d", id, ii);
+    }
+    return NULL;
+  }
+
+  size_t num_rings()
+  {
+    return logger->_rings.size();
+  }
+
+  RecordingLogger* recorder;
+  AsyncLogger* logger;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestAsyncLogger, LinesFormatted)
+{
+  AsyncLogger::log(Log::WARNING_LEVEL, "src/main/timer_store.cpp", 42, "Timer %d", 7);
+  logger->flush();
+
+  std::vector<std::string> lines = recorder->get_lines();
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_EQ("Warning timer_store.cpp:42: Timer 7\n", lines[0]);
+}
+
+TEST_F(TestAsyncLogger, LinesFromLogWrite)
+{
+  // Lines already formatted by Log::write are passed through unchanged.
+  logger->write("Status main.cpp:1: Starting\n");
+  logger->flush();
+
+  std::vector<std::string> lines = recorder->get_lines();
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_EQ("Status main.cpp:1: Starting\n", lines[0]);
+}
+
+TEST_F(TestAsyncLogger, LinesFromEachThreadInOrder)
+{
+  pthread_t threads[NUM_THREADS];
+  for (long ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, thread_entry_func, (void*)ii);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+  logger->flush();
+
+  std::vector<std::string> lines = recorder->get_lines();
+  ASSERT_EQ((size_t)(NUM_THREADS * LINES_PER_THREAD), lines.size());
+
+  int next[NUM_THREADS] = {0};
+  for (auto it = lines.begin(); it != lines.end(); it++)
+  {
+    long id;
+    int line;
+    ASSERT_EQ(2, sscanf(it->c_str(), "Debug test_async_logger.cpp:%*d: thread %ld line %d", &id, &line)) << *it;
+    EXPECT_EQ(next[id], line);
+    next[id] = line + 1;
+  }
+}
+
+TEST_F(TestAsyncLogger, RingsFreedWhenThreadsExit)
+{
+  AsyncLogger::log(Log::DEBUG_LEVEL, __FILE__, __LINE__, "main thread");
+
+  pthread_t threads[NUM_THREADS];
+  for (long ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_create(&threads[ii], NULL, thread_entry_func, (void*)ii);
+  }
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  // The exited threads' lines are still written, and then their rings are
+  // freed, leaving only this thread's.
+  logger->flush();
+  EXPECT_EQ((size_t)(NUM_THREADS * LINES_PER_THREAD + 1), recorder->get_lines().size());
+  EXPECT_EQ(1u, num_rings());
+}
+
+TEST_F(TestAsyncLogger, LinesDroppedWhenFull)
+{
+  // Get the flush thread stuck writing a line, then log far more than fits in
+  // the ring.
+  AsyncLogger::log(Log::DEBUG_LEVEL, __FILE__, __LINE__, "first");
+  logger->flush();
+  pthread_mutex_lock(&recorder->gate);
+  AsyncLogger::log(Log::DEBUG_LEVEL, __FILE__, __LINE__, "second");
+  for (int ii = 0; (ii < 100) && (!recorder->blocked); ii++)
+  {
+    usleep(10000);
+  }
+  ASSERT_TRUE(recorder->blocked);
+
+  const int num_lines = 20000;
+  std::string padding(100, 'x');
+  for (int ii = 0; ii < num_lines; ii++)
+  {
+    AsyncLogger::log(Log::DEBUG_LEVEL, __FILE__, __LINE__, "%s", padding.c_str());
+  }
+  pthread_mutex_unlock(&recorder->gate);
+  logger->flush();
+
+  // Every line is either written or counted as dropped.
+  std::vector<std::string> lines = recorder->get_lines();
+  unsigned long dropped = 0;
+  size_t written = 0;
+  for (auto it = lines.begin(); it != lines.end(); it++)
+  {
+    if (sscanf(it->c_str(), "Warning async_logger.cpp: Dropped %lu", &dropped) != 1)
+    {
+      written++;
+    }
+  }
+  EXPECT_GT(dropped, 0u);
+  EXPECT_EQ((size_t)num_lines + 2, written + dropped);
+}
+
+TEST_F(TestAsyncLogger, DisabledLevelNotEvaluated)
+{
+  int calls = 0;
+  Log::setLoggingLevel(Log::WARNING_LEVEL);
+  ASYNC_LOG_DEBUG("%d", ++calls);
+  ASYNC_LOG_WARNING("%d", ++calls);
+  Log::setLoggingLevel(Log::DEBUG_LEVEL);
+  logger->flush();
+
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(1u, recorder->get_lines().size());
+}
+
+TEST_F(TestAsyncLogger, WarningsRateLimited)
+{
+  for (int ii = 0; ii < 5; ii++)
+  {
+    ASYNC_LOG_WARNING_RATE_LIMITED("Repeated warning %d", ii);
+  }
+  logger->flush();
+
+  std::vector<std::string> lines = recorder->get_lines();
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_NE(std::string::npos, lines[0].find("Repeated warning 0"));
+}
+
+TEST_F(TestAsyncLogger, RateLimiterCountsSuppressed)
+{
+  LogRateLimiter limiter(50);
+  uint64_t suppressed;
+  EXPECT_TRUE(limiter.allow(suppressed));
+  EXPECT_EQ(0u, suppressed);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(limiter.allow(suppressed));
+  }
+
+  usleep(60000);
+  EXPECT_TRUE(limiter.allow(suppressed));
+  EXPECT_EQ(3u, suppressed);
+}
@@ -0,0 +1,97 @@
+#include "callback.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <cstring>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestCallbackRequest : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    timer = default_timer(1);
+    request = new CallbackRequest(timer);
+  }
+
+  virtual void TearDown()
+  {
+    delete request;
+    delete timer;
+    Base::TearDown();
+  }
+
+  bool parse(const char* response)
+  {
+    return request->parse_response(response, strlen(response));
+  }
+
+  Timer* timer;
+  CallbackRequest* request;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestCallbackRequest, NewTiming)
+{
+  EXPECT_TRUE(parse("{\"timing\": {\"interval\": 5, \"repeat-for\": 30}}"));
+  EXPECT_TRUE(request->reschedule);
+  EXPECT_FALSE(request->cancel);
+  EXPECT_EQ(5000u, request->interval);
+  EXPECT_EQ(30000u, request->repeat_for);
+}
+
+TEST_F(TestCallbackRequest, NewTimingPopsOnce)
+{
+  // Without a repeat-for, the timer pops once more.
+  EXPECT_TRUE(parse("  {\"timing\": {\"interval\": 5}}"));
+  EXPECT_TRUE(request->reschedule);
+  EXPECT_EQ(5000u, request->interval);
+  EXPECT_EQ(5000u, request->repeat_for);
+}
+
+TEST_F(TestCallbackRequest, LargestTiming)
+{
+  // The largest interval that fits in a uint32_t in milliseconds.
+  EXPECT_TRUE(parse("{\"timing\": {\"interval\": 4294967, \"repeat-for\": 4294967}}"));
+  EXPECT_EQ(4294967000u, request->interval);
+  EXPECT_EQ(4294967000u, request->repeat_for);
+}
+
+TEST_F(TestCallbackRequest, Cancel)
+{
+  EXPECT_TRUE(parse("{\"cancel\": true}"));
+  EXPECT_TRUE(request->cancel);
+  EXPECT_FALSE(request->reschedule);
+}
+
+TEST_F(TestCallbackRequest, OtherResponsesIgnored)
+{
+  std::vector<std::string> responses;
+  responses.push_back("");
+  responses.push_back("OK");
+  responses.push_back("{\"status\": \"ok\"}");
+  responses.push_back("{\"cancel\": false}");
+  responses.push_back("{\"timing\": {\"interval\": \"5\"}}");
+  responses.push_back("{\"timing\": {\"interval\": -5}}");
+  responses.push_back("{\"timing\": {\"repeat-for\": 5}}");
+  responses.push_back("{\"timing\": {\"interval\": 5, \"repeat-for\": true}}");
+  responses.push_back("{\"timing\": {\"interval\": 5");
+  responses.push_back("{\"timing\": {\"interval\": 0}}");
+  responses.push_back("{\"timing\": {\"interval\": 4294968}}");
+  responses.push_back("{\"timing\": {\"interval\": 5, \"repeat-for\": 4294968}}");
+
+  for (auto it = responses.begin(); it != responses.end(); it++)
+  {
+    EXPECT_FALSE(parse(it->c_str())) << *it;
+    EXPECT_FALSE(request->reschedule) << *it;
+    EXPECT_FALSE(request->cancel) << *it;
+  }
+}
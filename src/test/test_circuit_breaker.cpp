@@ -0,0 +1,90 @@
+#include "circuit_breaker.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestCircuitBreaker : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    cb = new CircuitBreaker();
+    cb->configure(3, 1000);
+  }
+
+  virtual void TearDown()
+  {
+    delete cb;
+    Base::TearDown();
+  }
+
+  CircuitBreaker* cb;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestCircuitBreaker, OpensAfterConsecutiveFailures)
+{
+  EXPECT_EQ(CircuitBreaker::CLOSED, cb->state());
+
+  cb->failure(0);
+  cb->failure(0);
+  EXPECT_TRUE(cb->allow(0));
+
+  // A success resets the count.
+  cb->success();
+  cb->failure(0);
+  cb->failure(0);
+  EXPECT_EQ(CircuitBreaker::CLOSED, cb->state());
+
+  cb->failure(0);
+  EXPECT_EQ(CircuitBreaker::OPEN, cb->state());
+  EXPECT_FALSE(cb->allow(999));
+}
+
+TEST_F(TestCircuitBreaker, ProbeClosesCircuit)
+{
+  cb->failure(0);
+  cb->failure(0);
+  cb->failure(0);
+
+  // Only one probe is allowed through once the reset period has passed.
+  EXPECT_TRUE(cb->allow(1000));
+  EXPECT_EQ(CircuitBreaker::HALF_OPEN, cb->state());
+  EXPECT_FALSE(cb->allow(1000));
+
+  cb->success();
+  EXPECT_EQ(CircuitBreaker::CLOSED, cb->state());
+  EXPECT_TRUE(cb->allow(1000));
+}
+
+TEST_F(TestCircuitBreaker, FailedProbeReopensCircuit)
+{
+  cb->failure(0);
+  cb->failure(0);
+  cb->failure(0);
+
+  EXPECT_TRUE(cb->allow(1500));
+  cb->failure(1500);
+  EXPECT_EQ(CircuitBreaker::OPEN, cb->state());
+  EXPECT_FALSE(cb->allow(2000));
+  EXPECT_TRUE(cb->allow(2500));
+}
+
+TEST_F(TestCircuitBreaker, Disabled)
+{
+  cb->configure(0, 1000);
+  for (int ii = 0; ii < 10; ii++)
+  {
+    cb->failure(0);
+  }
+  EXPECT_EQ(CircuitBreaker::CLOSED, cb->state());
+  EXPECT_TRUE(cb->allow(0));
+}
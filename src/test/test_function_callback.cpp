@@ -0,0 +1,123 @@
+#include "function_callback.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestFunctionCallback : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    callback = new FunctionCallback();
+
+    for (int ii = 0; ii < 2; ii++)
+    {
+      timers[ii] = default_timer(ii + 1);
+      timers[ii]->callback_protocol = "function";
+      timers[ii]->callback_url = "record";
+      timers[ii]->callback_body = "opaque " + std::to_string(ii + 1);
+      timers[ii]->sequence_number = ii + 5;
+    }
+  }
+
+  virtual void TearDown()
+  {
+    delete timers[0];
+    delete timers[1];
+    delete callback;
+    Base::TearDown();
+  }
+
+  FunctionCallback* callback;
+  Timer* timers[2];
+};
+
+// Records the pops it's called for.
+struct Recorder
+{
+  std::vector<TimerID> ids;
+  std::vector<uint32_t> sequence_numbers;
+  std::vector<std::string> opaques;
+
+  bool operator()(TimerID id, uint32_t sequence_number, const SharedBuffer& opaque)
+  {
+    ids.push_back(id);
+    sequence_numbers.push_back(sequence_number);
+    opaques.push_back(opaque.str());
+    return (id != 2);
+  }
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestFunctionCallback, CallRegisteredFunction)
+{
+  Recorder recorder;
+  callback->register_function("record", std::ref(recorder));
+
+  std::vector<CallbackRequest> requests;
+  requests.push_back(CallbackRequest(timers[0]));
+  requests.push_back(CallbackRequest(timers[1]));
+  callback->perform_all(requests);
+
+  // The function is passed each timer's details, and its return value is the
+  // result of the callback.
+  ASSERT_EQ(2u, recorder.ids.size());
+  EXPECT_EQ(1u, recorder.ids[0]);
+  EXPECT_EQ(5u, recorder.sequence_numbers[0]);
+  EXPECT_EQ("opaque 1", recorder.opaques[0]);
+  EXPECT_EQ(2u, recorder.ids[1]);
+  EXPECT_TRUE(requests[0].success);
+  EXPECT_FALSE(requests[1].success);
+  EXPECT_NE(0u, requests[0].started_us);
+}
+
+TEST_F(TestFunctionCallback, PerformSingleCallback)
+{
+  Recorder recorder;
+  callback->register_function("record", std::ref(recorder));
+
+  EXPECT_TRUE(callback->perform("record", "single", 3));
+  ASSERT_EQ(1u, recorder.ids.size());
+  EXPECT_EQ(0u, recorder.ids[0]);
+  EXPECT_EQ(3u, recorder.sequence_numbers[0]);
+  EXPECT_EQ("single", recorder.opaques[0]);
+}
+
+TEST_F(TestFunctionCallback, MissingFunction)
+{
+  Recorder recorder;
+  callback->register_function("record", std::ref(recorder));
+  callback->unregister_function("record");
+
+  std::vector<CallbackRequest> requests;
+  requests.push_back(CallbackRequest(timers[0]));
+  callback->perform_all(requests);
+
+  EXPECT_FALSE(requests[0].success);
+  EXPECT_EQ(0u, recorder.ids.size());
+}
+
+TEST_F(TestFunctionCallback, FunctionThrows)
+{
+  callback->register_function("record",
+                              [](TimerID, uint32_t, const SharedBuffer&) -> bool
+                              {
+                                throw std::runtime_error("failed");
+                              });
+
+  std::vector<CallbackRequest> requests;
+  requests.push_back(CallbackRequest(timers[0]));
+  callback->perform_all(requests);
+
+  EXPECT_FALSE(requests[0].success);
+}
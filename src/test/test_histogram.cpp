@@ -0,0 +1,113 @@
+#include "histogram.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestHistogram : public Base
+{
+protected:
+  static void* record_entry_func(void* arg)
+  {
+    Histogram* histogram = (Histogram*)arg;
+    for (uint64_t ii = 1; ii <= 10000; ii++)
+    {
+      histogram->record(ii);
+    }
+    return NULL;
+  }
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestHistogram, Empty)
+{
+  Histogram h;
+  EXPECT_EQ(0u, h.count());
+  EXPECT_EQ(0u, h.max());
+  EXPECT_EQ(0u, h.mean());
+  EXPECT_EQ(0u, h.percentile(99));
+}
+
+TEST_F(TestHistogram, Reset)
+{
+  Histogram h;
+  h.record(5);
+  h.record(500000);
+  h.reset();
+  EXPECT_EQ(0u, h.count());
+  EXPECT_EQ(0u, h.max());
+  EXPECT_EQ(0u, h.percentile(99));
+
+  h.record(7);
+  EXPECT_EQ(1u, h.count());
+  EXPECT_EQ(7u, h.max());
+}
+
+TEST_F(TestHistogram, SmallValuesAreExact)
+{
+  Histogram h;
+  for (uint64_t ii = 0; ii < 32; ii++)
+  {
+    h.record(ii);
+  }
+
+  EXPECT_EQ(32u, h.count());
+  EXPECT_EQ(31u, h.max());
+  EXPECT_EQ(15u, h.mean());
+  EXPECT_EQ(15u, h.percentile(50));
+  EXPECT_EQ(31u, h.percentile(100));
+}
+
+TEST_F(TestHistogram, LargeValuesWithinResolution)
+{
+  Histogram h;
+  for (uint64_t ii = 1; ii <= 1000000; ii++)
+  {
+    h.record(ii);
+  }
+
+  // Each percentile is accurate to within one bucket (1/16th).
+  uint64_t p50 = h.percentile(50);
+  EXPECT_GE(p50, 500000u);
+  EXPECT_LE(p50, 500000u + (500000u / 16));
+
+  uint64_t p99 = h.percentile(99);
+  EXPECT_GE(p99, 990000u);
+  EXPECT_LE(p99, 990000u + (990000u / 16));
+
+  EXPECT_EQ(1000000u, h.percentile(100));
+  EXPECT_EQ(1000000u, h.max());
+}
+
+TEST_F(TestHistogram, HugeValues)
+{
+  Histogram h;
+  h.record(UINT64_MAX);
+  EXPECT_EQ(UINT64_MAX, h.max());
+  EXPECT_EQ(UINT64_MAX, h.percentile(50));
+}
+
+TEST_F(TestHistogram, ConcurrentRecording)
+{
+  Histogram h;
+  pthread_t threads[4];
+  for (int ii = 0; ii < 4; ii++)
+  {
+    pthread_create(&threads[ii], NULL, &record_entry_func, &h);
+  }
+  for (int ii = 0; ii < 4; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  EXPECT_EQ(40000u, h.count());
+  EXPECT_EQ(10000u, h.max());
+  EXPECT_EQ(5000u, h.mean());
+}
@@ -0,0 +1,425 @@
+#include "http_callback.h"
+#include "timer_helper.h"
+#include "statistics.h"
+#include "globals.h"
+#include "base.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*****************************************************************************/
+/* Test server                                                               */
+/*****************************************************************************/
+
+// A callback server listening on the loopback interface, that answers each
+// request with the configured status (200 by default) after the configured
+// delay.  It counts the connections
+// made to it and the requests it receives, and tracks the most requests it
+// has been handling at once.
+class TestServer
+{
+public:
+  TestServer() :
+    status(200),
+    delay_ms(0),
+    connections(0),
+    requests(0),
+    concurrent(0),
+    max_concurrent(0),
+    stopping(false)
+  {
+    pthread_mutex_init(&mutex, NULL);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(listen_fd, 16);
+
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+    url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/callback";
+
+    pthread_create(&thread, NULL, &TestServer::run, this);
+  }
+
+  ~TestServer()
+  {
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(listen_fd);
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    for (auto it = sessions.begin(); it != sessions.end(); it++)
+    {
+      shutdown(it->first, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (auto it = sessions.begin(); it != sessions.end(); it++)
+    {
+      pthread_join(it->second, NULL);
+      close(it->first);
+    }
+    pthread_mutex_destroy(&mutex);
+  }
+
+  std::string url;
+  std::atomic<int> status;
+  std::atomic<int> delay_ms;
+  std::atomic<int> connections;
+  std::atomic<int> requests;
+  std::atomic<int> concurrent;
+  std::atomic<int> max_concurrent;
+
+private:
+  typedef std::pair<TestServer*, int> SessionArgs;
+
+  static void* run(void* arg)
+  {
+    TestServer* server = (TestServer*)arg;
+    int fd;
+    while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0)
+    {
+      server->connections++;
+      pthread_mutex_lock(&server->mutex);
+      if (server->stopping)
+      {
+        close(fd);
+      }
+      else
+      {
+        pthread_t session;
+        pthread_create(&session, NULL, &TestServer::serve_entry, new SessionArgs(server, fd));
+        server->sessions.push_back(std::make_pair(fd, session));
+      }
+      pthread_mutex_unlock(&server->mutex);
+    }
+    return NULL;
+  }
+
+  static void* serve_entry(void* arg)
+  {
+    SessionArgs* args = (SessionArgs*)arg;
+    args->first->serve(args->second);
+    delete args;
+    return NULL;
+  }
+
+  // Answer the requests on a connection until it's closed.
+  void serve(int fd)
+  {
+    std::string buffer;
+    while (true)
+    {
+      size_t header_end;
+      while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+      {
+        if (!read_more(fd, buffer))
+        {
+          return;
+        }
+      }
+
+      size_t length = 0;
+      size_t header = buffer.find("Content-Length: ");
+      if ((header != std::string::npos) && (header < header_end))
+      {
+        length = atoi(buffer.c_str() + header + 16);
+      }
+      buffer.erase(0, header_end + 4);
+      while (buffer.length() < length)
+      {
+        if (!read_more(fd, buffer))
+        {
+          return;
+        }
+      }
+      buffer.erase(0, length);
+
+      requests++;
+      int now_concurrent = ++concurrent;
+      int old_max = max_concurrent;
+      while ((now_concurrent > old_max) &&
+             (!max_concurrent.compare_exchange_weak(old_max, now_concurrent)))
+      {
+      }
+
+      usleep(delay_ms * 1000);
+      concurrent--;
+
+      std::string response = "HTTP/1.1 " + std::to_string(status.load()) +
+                             " Status\r\nContent-Length: 0\r\n\r\n";
+      if (write(fd, response.data(), response.length()) != (ssize_t)response.length())
+      {
+        return;
+      }
+    }
+  }
+
+  static bool read_more(int fd, std::string& buffer)
+  {
+    char chunk[4096];
+    ssize_t rc = read(fd, chunk, sizeof(chunk));
+    if (rc <= 0)
+    {
+      return false;
+    }
+    buffer.append(chunk, rc);
+    return true;
+  }
+
+  int listen_fd;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  bool stopping;
+  std::vector<std::pair<int, pthread_t>> sessions;
+};
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestHTTPCallback : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+
+    __globals->lock();
+    int max_requests_per_host = 2;
+    __globals->set_callback_max_requests_per_host(max_requests_per_host);
+    int connection_pool_size = 16;
+    __globals->set_callback_connection_pool_size(connection_pool_size);
+    int max_streams_per_host = 10;
+    __globals->set_callback_http2_max_streams_per_host(max_streams_per_host);
+    int timeout_ms = 2000;
+    __globals->set_callback_timeout_ms(timeout_ms);
+    int breaker_failures = 5;
+    __globals->set_callback_circuit_breaker_failures(breaker_failures);
+    int breaker_reset_ms = 1000;
+    __globals->set_callback_circuit_breaker_reset_ms(breaker_reset_ms);
+    __globals->unlock();
+
+    server = new TestServer();
+    callback = new HTTPCallback();
+  }
+
+  virtual void TearDown()
+  {
+    delete callback;
+    delete server;
+    for (auto it = timers.begin(); it != timers.end(); it++)
+    {
+      delete *it;
+    }
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Build a number of callback requests for timers with the given URL.
+  std::vector<CallbackRequest> build_requests(int count, const std::string& url)
+  {
+    std::vector<CallbackRequest> requests;
+    for (int ii = 0; ii < count; ii++)
+    {
+      Timer* timer = default_timer(timers.size() + 1);
+      timer->callback_url = url;
+      timers.push_back(timer);
+      requests.push_back(CallbackRequest(timer));
+    }
+    return requests;
+  }
+
+  size_t num_destinations() { return callback->_destinations.size(); }
+
+  // Configure a destination for the given URL, returning the HTTP version and
+  // the number of requests it can have in flight.
+  std::pair<long, int> configure(const std::string& url)
+  {
+    HTTPCallback::Destination destination;
+    callback->refresh_config();
+    callback->configure(HTTPCallback::destination_key(url), &destination);
+    return std::make_pair(destination.http_version, destination.max_in_flight);
+  }
+
+  void set_http2_hosts(std::vector<std::string> hosts,
+                       std::vector<std::string> upgrade_hosts)
+  {
+    __globals->lock();
+    __globals->set_callback_http2_hosts(hosts);
+    __globals->set_callback_http2_upgrade_hosts(upgrade_hosts);
+    __globals->unlock();
+  }
+
+  TestServer* server;
+  HTTPCallback* callback;
+  std::vector<Timer*> timers;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestHTTPCallback, ConnectionReused)
+{
+  for (int ii = 0; ii < 5; ii++)
+  {
+    EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), ii));
+  }
+  EXPECT_EQ(5, server->requests.load());
+  EXPECT_EQ(1, server->connections.load());
+}
+
+TEST_F(TestHTTPCallback, InFlightLimitedPerDestination)
+{
+  // Only two requests are sent to the server at once, over two connections,
+  // with the rest queued until they complete.
+  server->delay_ms = 50;
+  std::vector<CallbackRequest> requests = build_requests(6, server->url);
+  callback->perform_all(requests);
+
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    EXPECT_TRUE(it->success);
+    EXPECT_FALSE(it->deferred);
+  }
+  EXPECT_EQ(6, server->requests.load());
+  EXPECT_EQ(2, server->max_concurrent.load());
+  EXPECT_EQ(2, server->connections.load());
+
+  // The connections are kept for the next pop.
+  requests = build_requests(2, server->url);
+  callback->perform_all(requests);
+  EXPECT_EQ(8, server->requests.load());
+  EXPECT_EQ(2, server->connections.load());
+}
+
+TEST_F(TestHTTPCallback, QueuedRequestsDeferredAfterDeadline)
+{
+  // The requests in flight complete after the deadline for starting requests
+  // has passed, so the requests queued behind them are deferred.
+  server->delay_ms = 100;
+  std::vector<CallbackRequest> requests = build_requests(5, server->url);
+  callback->perform_all(requests, CallbackRequest::now_us() + 50000);
+
+  EXPECT_EQ(2, server->requests.load());
+  int deferred = 0;
+  for (auto it = requests.begin(); it != requests.end(); it++)
+  {
+    EXPECT_EQ(!it->deferred, it->success);
+    deferred += it->deferred ? 1 : 0;
+  }
+  EXPECT_EQ(3, deferred);
+}
+
+TEST_F(TestHTTPCallback, IdleDestinationsForgotten)
+{
+  // Nothing is listening on the server's port once the server has gone, so
+  // there are no connections to that destination.
+  std::string old_url = server->url;
+  delete server;
+  server = new TestServer();
+  EXPECT_FALSE(callback->perform(old_url, SharedBuffer("stuff"), 0));
+
+  // The live server keeps its connection open.
+  EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), 0));
+  EXPECT_EQ(2u, num_destinations());
+
+  // Once the destinations have been idle for a while, the one without
+  // connections is forgotten, but the other is kept as cURL still has a
+  // connection to it.
+  cwtest_advance_time_ms(10 * 60 * 1000);
+  std::vector<CallbackRequest> requests;
+  callback->perform_all(requests);
+  EXPECT_EQ(1u, num_destinations());
+
+  // The destination that was kept still works, and the forgotten one is set
+  // up again when it's next used.
+  EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), 1));
+  EXPECT_FALSE(callback->perform(old_url, SharedBuffer("stuff"), 1));
+  EXPECT_EQ(2u, num_destinations());
+}
+
+TEST_F(TestHTTPCallback, HTTP2HostsMatchDefaultPorts)
+{
+  set_http2_hosts({"example.com:80", "h2.example.com", "[::1]:80"},
+                  {"secure.example.com:443"});
+
+  // A URL without a port matches a host configured with the scheme's default
+  // port, and a host configured without a port is taken to be on port 80.
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, 10),
+            configure("http://example.com/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, 10),
+            configure("http://example.com:80/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, 10),
+            configure("http://user@Example.COM/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, 10),
+            configure("http://h2.example.com:80/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, 10),
+            configure("http://[::1]/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_2_0, 10),
+            configure("https://secure.example.com/callback"));
+
+  // Other ports on the same hosts are still sent HTTP/1.1.
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_1_1, 2),
+            configure("http://example.com:8080/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_1_1, 2),
+            configure("https://example.com/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_1_1, 2),
+            configure("http://secure.example.com/callback"));
+  EXPECT_EQ(std::make_pair((long)CURL_HTTP_VERSION_1_1, 2),
+            configure("http://[::2]/callback"));
+}
+
+TEST_F(TestHTTPCallback, OnlySuccessfulResponsesSucceed)
+{
+  // The callback server is reachable, but rejects the callbacks.
+  server->status = 503;
+  EXPECT_FALSE(callback->perform(server->url, SharedBuffer("stuff"), 0));
+  std::vector<CallbackRequest> requests = build_requests(2, server->url);
+  callback->perform_all(requests);
+  EXPECT_FALSE(requests[0].success);
+  EXPECT_FALSE(requests[1].success);
+
+  server->status = 204;
+  EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), 1));
+  requests = build_requests(2, server->url);
+  callback->perform_all(requests);
+  EXPECT_TRUE(requests[0].success);
+  EXPECT_TRUE(requests[1].success);
+}
+
+TEST_F(TestHTTPCallback, RejectedCallbacksOpenCircuit)
+{
+  // The callback server rejects enough callbacks in a row to open the
+  // circuit, after which callbacks fail without being sent.
+  server->status = 500;
+  for (int ii = 0; ii < 5; ii++)
+  {
+    EXPECT_FALSE(callback->perform(server->url, SharedBuffer("stuff"), ii));
+  }
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_CIRCUIT_OPENS));
+  EXPECT_FALSE(callback->perform(server->url, SharedBuffer("stuff"), 5));
+  EXPECT_EQ(5, server->requests.load());
+
+  // Once the circuit has been open for the reset period, a successful probe
+  // closes it again.
+  server->status = 200;
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), 6));
+  EXPECT_TRUE(callback->perform(server->url, SharedBuffer("stuff"), 7));
+  EXPECT_EQ(7, server->requests.load());
+}
@@ -0,0 +1,252 @@
+#include "io_engine.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// Runs each test against each type of engine.  epoll is always available,
+// but the io_uring tests are skipped if the kernel doesn't support it.
+class TestIOEngine : public Base, public ::testing::WithParamInterface<std::string>
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    engine = IOEngine::create(GetParam());
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+
+    if ((engine == NULL) && (GetParam() != "epoll"))
+    {
+      GTEST_SKIP() << GetParam() << " isn't supported here";
+    }
+    ASSERT_TRUE(engine != NULL);
+  }
+
+  virtual void TearDown()
+  {
+    if (engine != NULL)
+    {
+      engine->cancel(fds[0]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    delete engine;
+    Base::TearDown();
+  }
+
+  // Wait until there are the given number of completions, or for up to a
+  // second.
+  void wait_for(size_t count)
+  {
+    for (int ii = 0; (ii < 100) && (completions.size() < count); ii++)
+    {
+      engine->wait(completions, 10);
+    }
+  }
+
+  // Send a string, which must outlive the send.
+  void send(int fd, const char* data, struct iovec* iov, void* context)
+  {
+    iov->iov_base = (void*)data;
+    iov->iov_len = strlen(data);
+    engine->send(fd, iov, 1, context);
+  }
+
+  IOEngine* engine;
+  int fds[2];
+  struct iovec iov;
+  std::vector<IOEngine::Completion> completions;
+  int context;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_P(TestIOEngine, SendAndReceive)
+{
+  EXPECT_STREQ(GetParam().c_str(), engine->name());
+
+  engine->receive(fds[0], &context);
+  send(fds[0], "hello", &iov, &context);
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_TRUE(completions[0].is_send);
+  EXPECT_EQ(5, completions[0].result);
+  EXPECT_EQ(&context, completions[0].context);
+
+  char buffer[16];
+  ASSERT_EQ(5, read(fds[1], buffer, sizeof(buffer)));
+  EXPECT_EQ("hello", std::string(buffer, 5));
+
+  completions.clear();
+  ASSERT_EQ(5, write(fds[1], "world", 5));
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_FALSE(completions[0].is_send);
+  ASSERT_EQ(5, completions[0].result);
+  EXPECT_EQ("world", std::string(completions[0].data, 5));
+
+  // The receive keeps going without being restarted.
+  completions.clear();
+  ASSERT_EQ(4, write(fds[1], "more", 4));
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_EQ("more", std::string(completions[0].data, completions[0].result));
+}
+
+TEST_P(TestIOEngine, SendGathered)
+{
+  // A send gathers the data from all the buffers, in order.
+  const char* pieces[] = {"one ", "two ", "three"};
+  struct iovec iovs[3];
+  for (int ii = 0; ii < 3; ii++)
+  {
+    iovs[ii].iov_base = (void*)pieces[ii];
+    iovs[ii].iov_len = strlen(pieces[ii]);
+  }
+  engine->send(fds[0], iovs, 3, &context);
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_EQ(13, completions[0].result);
+
+  char buffer[16];
+  ASSERT_EQ(13, read(fds[1], buffer, sizeof(buffer)));
+  EXPECT_EQ("one two three", std::string(buffer, 13));
+}
+
+TEST_P(TestIOEngine, ReceiveClosed)
+{
+  engine->receive(fds[0], &context);
+  shutdown(fds[1], SHUT_WR);
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_FALSE(completions[0].is_send);
+  EXPECT_EQ(0, completions[0].result);
+}
+
+TEST_P(TestIOEngine, SendFails)
+{
+  close(fds[1]);
+  fds[1] = socket(AF_UNIX, SOCK_STREAM, 0);
+  send(fds[0], "hello", &iov, &context);
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_TRUE(completions[0].is_send);
+  EXPECT_EQ(-EPIPE, completions[0].result);
+}
+
+TEST_P(TestIOEngine, CancelStopsCompletions)
+{
+  engine->receive(fds[0], &context);
+  engine->cancel(fds[0]);
+  ASSERT_EQ(5, write(fds[1], "hello", 5));
+  engine->wait(completions, 50);
+  EXPECT_TRUE(completions.empty());
+}
+
+TEST_P(TestIOEngine, CancelWithSendInFlight)
+{
+  // Fill up the socket, then start a send that can't make progress as the
+  // other end isn't reading.
+  char buffer[64 * 1024];
+  memset(buffer, 'a', sizeof(buffer));
+  while (write(fds[0], buffer, sizeof(buffer)) > 0)
+  {
+  }
+
+  std::string data(sizeof(buffer), 'a');
+  iov.iov_base = (void*)data.data();
+  iov.iov_len = data.size();
+  engine->send(fds[0], &iov, 1, &context);
+  engine->wait(completions, 10);
+  ASSERT_TRUE(completions.empty());
+
+  // Once cancelled, the engine has finished with the data, so changes to it
+  // are never sent.
+  engine->cancel(fds[0]);
+  data.assign(data.size(), 'b');
+  shutdown(fds[0], SHUT_WR);
+
+  ssize_t received;
+  while ((received = read(fds[1], buffer, sizeof(buffer))) > 0)
+  {
+    EXPECT_EQ(std::string::npos, std::string(buffer, received).find('b'));
+  }
+
+  engine->wait(completions, 10);
+  EXPECT_TRUE(completions.empty());
+}
+
+TEST_P(TestIOEngine, CancelKeepsOtherCompletions)
+{
+  // Data arrives on another socket while one is being cancelled.  It's
+  // still reported by the next wait.
+  int others[2];
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, others);
+  engine->receive(others[0], &others);
+  engine->receive(fds[0], &context);
+  engine->wait(completions, 0);
+  ASSERT_EQ(5, write(others[1], "hello", 5));
+
+  engine->cancel(fds[0]);
+  wait_for(1);
+  ASSERT_EQ(1u, completions.size());
+  EXPECT_EQ(&others, completions[0].context);
+  EXPECT_EQ("hello", std::string(completions[0].data, completions[0].result));
+
+  engine->cancel(others[0]);
+  close(others[0]);
+  close(others[1]);
+}
+
+TEST_P(TestIOEngine, ManySockets)
+{
+  // Send on a batch of sockets at once.  The sends are all picked up by a
+  // single wait.
+  const int num_sockets = 20;
+  int pairs[num_sockets][2];
+  struct iovec iovs[num_sockets];
+  for (int ii = 0; ii < num_sockets; ii++)
+  {
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pairs[ii]);
+    engine->receive(pairs[ii][0], &pairs[ii]);
+    send(pairs[ii][0], "ping", &iovs[ii], &pairs[ii]);
+  }
+
+  wait_for(num_sockets);
+  ASSERT_EQ((size_t)num_sockets, completions.size());
+  for (int ii = 0; ii < num_sockets; ii++)
+  {
+    EXPECT_TRUE(completions[ii].is_send);
+    EXPECT_EQ(4, completions[ii].result);
+    ASSERT_EQ(4, write(pairs[ii][1], "pong", 4));
+  }
+
+  completions.clear();
+  wait_for(num_sockets);
+  ASSERT_EQ((size_t)num_sockets, completions.size());
+  for (int ii = 0; ii < num_sockets; ii++)
+  {
+    EXPECT_FALSE(completions[ii].is_send);
+    EXPECT_EQ("pong", std::string(completions[ii].data, completions[ii].result));
+  }
+
+  for (int ii = 0; ii < num_sockets; ii++)
+  {
+    engine->cancel(pairs[ii][0]);
+    close(pairs[ii][0]);
+    close(pairs[ii][1]);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Engines,
+                        TestIOEngine,
+                        ::testing::Values("epoll", "io_uring"));
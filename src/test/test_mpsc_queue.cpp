@@ -0,0 +1,126 @@
+#include "mpsc_queue.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <vector>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestMPSCQueue : public Base
+{
+protected:
+  static const int NUM_PRODUCERS = 4;
+  static const int ITEMS_PER_PRODUCER = 10000;
+
+  struct Producer
+  {
+    MPSCQueue<int>* queue;
+    int id;
+  };
+
+  static void* producer_entry_func(void* arg)
+  {
+    Producer* producer = (Producer*)arg;
+    for (int ii = 0; ii < ITEMS_PER_PRODUCER; ii++)
+    {
+      producer->queue->push((producer->id * ITEMS_PER_PRODUCER) + ii);
+    }
+    return NULL;
+  }
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestMPSCQueue, FIFO)
+{
+  MPSCQueue<int> queue;
+  int value;
+
+  EXPECT_FALSE(queue.pop(value));
+
+  queue.push(1);
+  queue.push(2);
+  EXPECT_TRUE(queue.pop(value));
+  EXPECT_EQ(1, value);
+
+  queue.push(3);
+  EXPECT_TRUE(queue.pop(value));
+  EXPECT_EQ(2, value);
+  EXPECT_TRUE(queue.pop(value));
+  EXPECT_EQ(3, value);
+  EXPECT_FALSE(queue.pop(value));
+}
+
+TEST_F(TestMPSCQueue, PushAll)
+{
+  MPSCQueue<int> queue;
+  int value;
+
+  std::vector<int> values;
+  queue.push_all(values);
+  EXPECT_FALSE(queue.pop(value));
+
+  queue.push(1);
+  values.push_back(2);
+  values.push_back(3);
+  queue.push_all(values);
+  queue.push(4);
+
+  for (int ii = 1; ii <= 4; ii++)
+  {
+    EXPECT_TRUE(queue.pop(value));
+    EXPECT_EQ(ii, value);
+  }
+  EXPECT_FALSE(queue.pop(value));
+}
+
+TEST_F(TestMPSCQueue, DestroyNonEmpty)
+{
+  // Should not leak the queued items' nodes.
+  MPSCQueue<int> queue;
+  queue.push(1);
+  queue.push(2);
+}
+
+TEST_F(TestMPSCQueue, MultipleProducers)
+{
+  MPSCQueue<int> queue;
+  pthread_t threads[NUM_PRODUCERS];
+  Producer producers[NUM_PRODUCERS];
+
+  for (int ii = 0; ii < NUM_PRODUCERS; ii++)
+  {
+    producers[ii].queue = &queue;
+    producers[ii].id = ii;
+    pthread_create(&threads[ii], NULL, &producer_entry_func, &producers[ii]);
+  }
+
+  // Consume concurrently with the producers.  Every item must arrive exactly
+  // once, and each producer's items must arrive in the order they were pushed.
+  std::vector<int> next_expected(NUM_PRODUCERS, 0);
+  int received = 0;
+  while (received < NUM_PRODUCERS * ITEMS_PER_PRODUCER)
+  {
+    int value;
+    if (queue.pop(value))
+    {
+      int producer = value / ITEMS_PER_PRODUCER;
+      EXPECT_EQ(next_expected[producer], value % ITEMS_PER_PRODUCER);
+      next_expected[producer]++;
+      received++;
+    }
+  }
+
+  for (int ii = 0; ii < NUM_PRODUCERS; ii++)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  int value;
+  EXPECT_FALSE(queue.pop(value));
+}
@@ -0,0 +1,123 @@
+#include "replica_stagger.h"
+#include "timer.h"
+#include "statistics.h"
+#include "globals.h"
+#include "base.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestReplicaStagger : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+  }
+
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Record a number of callback and replication latencies (in ms), then let
+  // the stagger be worked out again.
+  void record(int count, uint64_t callback_ms, uint64_t replication_ms)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      __replica_stagger->record_callback(callback_ms * 1000);
+      __replica_stagger->record_replication(replication_ms * 1000);
+    }
+    cwtest_advance_time_ms(1000);
+    __replica_stagger->record_callback(callback_ms * 1000);
+  }
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestReplicaStagger, MaxWithoutEnoughSamples)
+{
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+  record(5, 1, 1);
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+  EXPECT_EQ(2000u, __statistics->get(Statistics::REPLICA_STAGGER_MS));
+}
+
+TEST_F(TestReplicaStagger, BasedOnMeasuredLatency)
+{
+  // Twice the sum of the latencies, plus the margin.
+  record(100, 200, 100);
+  EXPECT_NEAR(650, (int)__replica_stagger->stagger_ms(), 20);
+  EXPECT_EQ(__replica_stagger->stagger_ms(), __statistics->get(Statistics::REPLICA_STAGGER_MS));
+}
+
+TEST_F(TestReplicaStagger, KeptWithinFloorAndMax)
+{
+  record(100, 10, 5);
+  EXPECT_EQ(200u, __replica_stagger->stagger_ms());
+
+  record(100, 3000, 5);
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+
+  int floor_ms = 100;
+  __globals->set_replication_stagger_floor_ms(floor_ms);
+  int max_ms = 1000;
+  __globals->set_replication_stagger_max_ms(max_ms);
+  record(1, 3000, 5);
+  EXPECT_EQ(1000u, __replica_stagger->stagger_ms());
+}
+
+TEST_F(TestReplicaStagger, OldLatenciesForgotten)
+{
+  // A spike of latency holds the stagger up until the window after the one it
+  // was measured in has ended.
+  record(100, 10, 5);
+  record(5, 1000, 5);
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+
+  cwtest_advance_time_ms(30 * 1000);
+  record(100, 10, 5);
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+
+  cwtest_advance_time_ms(30 * 1000);
+  record(100, 10, 5);
+  EXPECT_EQ(200u, __replica_stagger->stagger_ms());
+}
+
+TEST_F(TestReplicaStagger, ShrinksWithDefaultConfig)
+{
+  // With the default callback and replication configuration, the stagger
+  // starts at the configured maximum.
+  int timeout_ms = 2000;
+  __globals->set_callback_timeout_ms(timeout_ms);
+  int max_retries = 2;
+  __globals->set_callback_max_retries(max_retries);
+  int retry_backoff_ms = 250;
+  __globals->set_callback_retry_backoff_ms(retry_backoff_ms);
+  delete __replica_stagger;
+  __replica_stagger = new ReplicaStagger();
+  EXPECT_EQ(2000u, __replica_stagger->stagger_ms());
+
+  // Once low latencies are measured it comes down, however long the callback
+  // timeout and retries could take.
+  record(100, 100, 50);
+  EXPECT_NEAR(350, (int)__replica_stagger->stagger_ms(), 10);
+  EXPECT_GT(2000u, __replica_stagger->stagger_ms());
+
+  // A backup replica pops the timer after the shorter stagger.
+  Timer* timer = new Timer(1, 100, 100);
+  timer->start_time = 1000000;
+  timer->replicas.push_back("10.0.0.2");
+  timer->replicas.push_back("10.0.0.1");
+  EXPECT_EQ(1000100 + __replica_stagger->stagger_ms(), timer->next_pop_time());
+  delete timer;
+}
@@ -0,0 +1,190 @@
+#include "replication_codec.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestReplicationCodec : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    t1 = default_timer(1);
+    t1->replicas.push_back("10.0.0.2");
+    t2 = default_timer(0x123456789abcdef0);
+    t2->replicas = std::vector<std::string>(1, "10.0.0.2");
+    t2->replicas.push_back("10.0.0.3");
+  }
+
+  virtual void TearDown()
+  {
+    delete t1;
+    delete t2;
+    for (auto it = timers.begin(); it != timers.end(); it++)
+    {
+      delete *it;
+    }
+    Base::TearDown();
+  }
+
+  // Build a replication message holding the given timers.
+  std::string message(const std::vector<Timer*>& message_timers)
+  {
+    ReplicationCodec::Writer writer;
+    std::vector<SharedBuffer> encoded;
+    std::vector<size_t> fields_lengths;
+    for (auto it = message_timers.begin(); it != message_timers.end(); it++)
+    {
+      std::string out;
+      size_t fields_length;
+      ReplicationCodec::encode_timer(*it, out, fields_length);
+      encoded.push_back(SharedBuffer(std::move(out)));
+      fields_lengths.push_back(fields_length);
+    }
+
+    std::string out;
+    writer.start(out);
+    for (size_t ii = 0; ii < encoded.size(); ii++)
+    {
+      writer.add(out, encoded[ii], fields_lengths[ii]);
+    }
+    return out;
+  }
+
+  Timer* round_trip(Timer* timer)
+  {
+    std::string out;
+    size_t fields_length;
+    ReplicationCodec::encode_timer(timer, out, fields_length);
+    return ReplicationCodec::decode_timer(out.data(), out.length());
+  }
+
+  void expect_same(Timer* expected, Timer* actual)
+  {
+    ASSERT_TRUE(actual != NULL);
+    EXPECT_EQ(expected->id, actual->id);
+    EXPECT_EQ(expected->start_time, actual->start_time);
+    EXPECT_EQ(expected->interval, actual->interval);
+    EXPECT_EQ(expected->repeat_for, actual->repeat_for);
+    EXPECT_EQ(expected->sequence_number, actual->sequence_number);
+    EXPECT_EQ(expected->replica_stagger_ms, actual->replica_stagger_ms);
+    EXPECT_EQ(expected->callback_protocol, actual->callback_protocol);
+    EXPECT_EQ(expected->callback_url, actual->callback_url);
+    EXPECT_EQ(expected->callback_body, actual->callback_body);
+    EXPECT_EQ(expected->callback_batch, actual->callback_batch);
+    EXPECT_EQ(expected->replicas, actual->replicas);
+  }
+
+  Timer* t1;
+  Timer* t2;
+  std::vector<Timer*> timers;
+};
+
+/*****************************************************************************/
+/* Class function tests                                                      */
+/*****************************************************************************/
+
+TEST_F(TestReplicationCodec, EncodeDecodeTimer)
+{
+  t1->start_time = 1400000000123;
+  t1->interval = 1500;
+  t1->repeat_for = 4294967295u;
+  t1->sequence_number = 300;
+  t1->replica_stagger_ms = 6810;
+  timers.push_back(round_trip(t1));
+  expect_same(t1, timers.back());
+
+  t2->callback_protocol = "tcp";
+  t2->callback_body = std::string("binary\0data", 11);
+  timers.push_back(round_trip(t2));
+  expect_same(t2, timers.back());
+
+  t2->callback_protocol = "stream";
+  timers.push_back(round_trip(t2));
+  expect_same(t2, timers.back());
+
+  t2->callback_protocol = "http";
+  t2->callback_batch = true;
+  timers.push_back(round_trip(t2));
+  expect_same(t2, timers.back());
+}
+
+TEST_F(TestReplicationCodec, DecodeMessage)
+{
+  std::vector<Timer*> message_timers;
+  message_timers.push_back(t1);
+  message_timers.push_back(t2);
+  std::string body = message(message_timers);
+
+  // The replicas' addresses are only written out once in the message.
+  EXPECT_EQ(body.find("10.0.0.2"), body.rfind("10.0.0.2"));
+
+  std::string error;
+  EXPECT_TRUE(ReplicationCodec::decode(body.data(), body.length(), timers, error)) << error;
+  ASSERT_EQ(2u, timers.size());
+  expect_same(t1, timers[0]);
+  expect_same(t2, timers[1]);
+
+  // An empty message is fine too.
+  body = message(std::vector<Timer*>());
+  std::vector<Timer*> no_timers;
+  EXPECT_TRUE(ReplicationCodec::decode(body.data(), body.length(), no_timers, error));
+  EXPECT_TRUE(no_timers.empty());
+}
+
+TEST_F(TestReplicationCodec, SmallerThanJSON)
+{
+  std::vector<Timer*> message_timers(1, t2);
+  std::string body = message(message_timers);
+  std::string json = "{\"timers\":[{\"id\":\"" + t2->url_id() + "\",\"timer\":" + t2->to_json() + "}]}";
+  EXPECT_LT(body.length() * 2, json.length());
+}
+
+TEST_F(TestReplicationCodec, DecodeMessageFailures)
+{
+  std::vector<Timer*> message_timers;
+  message_timers.push_back(t1);
+  message_timers.push_back(t2);
+  std::string valid = message(message_timers);
+
+  std::vector<std::string> failing_test_data;
+  failing_test_data.push_back("");
+  failing_test_data.push_back("{\"timers\": []}");
+  failing_test_data.push_back("CT" + std::string(1, 2) + valid.substr(3));
+  failing_test_data.push_back(valid.substr(0, 10));
+  for (size_t length = valid.length() - 10; length < valid.length(); length++)
+  {
+    failing_test_data.push_back(valid.substr(0, length));
+  }
+
+  // A timer with a replica index that isn't in the table yet.
+  std::string bad_index = valid;
+  bad_index[bad_index.find("10.0.0.1") - 2] = 1;
+  failing_test_data.push_back(bad_index);
+
+  // A timer with an unknown callback protocol.  The protocol follows the
+  // magic, the timer's length, its ID (1 byte), start time (3 bytes),
+  // interval, repeat-for, sequence number and replica stagger.
+  std::string bad_protocol = valid;
+  size_t protocol = 3 + 1 + 8;
+  ASSERT_EQ(0, bad_protocol[protocol]);
+  bad_protocol[protocol] = 3;
+  failing_test_data.push_back(bad_protocol);
+
+  // A timer with no replicas.
+  t1->replicas.clear();
+  failing_test_data.push_back(message(message_timers));
+
+  for (auto it = failing_test_data.begin(); it != failing_test_data.end(); it++)
+  {
+    std::string error;
+    EXPECT_FALSE(ReplicationCodec::decode(it->data(), it->length(), timers, error)) << *it;
+    EXPECT_NE("", error);
+    EXPECT_TRUE(timers.empty());
+  }
+}
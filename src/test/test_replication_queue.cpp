@@ -0,0 +1,166 @@
+#include "replication_queue.h"
+#include "statistics.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestReplicationQueue : public Base
+{
+protected:
+  static ReplicationRecord record(TimerID id, uint64_t queued_us)
+  {
+    return ReplicationRecord(id, SharedBuffer("timer"), 5, queued_us);
+  }
+
+  // The IDs of the records in the queue, in order, emptying the queue.
+  std::vector<TimerID> ids()
+  {
+    std::vector<ReplicationRecord> records;
+    queue.pop(records, queue.size());
+    std::vector<TimerID> rc;
+    for (auto it = records.begin(); it != records.end(); it++)
+    {
+      rc.push_back(it->id);
+    }
+    return rc;
+  }
+
+  ReplicationQueue queue;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestReplicationQueue, PushAndPop)
+{
+  for (TimerID id = 1; id <= 5; id++)
+  {
+    queue.push(record(id, id * 1000), 10);
+  }
+  EXPECT_EQ(5u, queue.size());
+  EXPECT_EQ(1000u, queue.front().queued_us);
+
+  // Records are taken in batches from the front.
+  std::vector<ReplicationRecord> batch;
+  queue.pop(batch, 3);
+  ASSERT_EQ(3u, batch.size());
+  EXPECT_EQ(1u, batch[0].id);
+  EXPECT_EQ(3u, batch[2].id);
+  EXPECT_EQ(2u, queue.size());
+
+  // Records put back go in front of the rest, even if the queue is full.
+  queue.push_front(batch);
+  EXPECT_EQ(std::vector<TimerID>({1, 2, 3, 4, 5}), ids());
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST_F(TestReplicationQueue, Clear)
+{
+  for (TimerID id = 1; id <= 5; id++)
+  {
+    queue.push(record(id, id * 1000), 10);
+  }
+  queue.clear();
+  EXPECT_TRUE(queue.empty());
+
+  queue.push(record(6, 6000), 10);
+  EXPECT_EQ(std::vector<TimerID>({6}), ids());
+}
+
+TEST_F(TestReplicationQueue, CoalescesWhenFull)
+{
+  // Two timers are updated repeatedly, along with a third.
+  for (int ii = 0; ii < 5; ii++)
+  {
+    queue.push(record(1, ii), 10);
+    queue.push(record(2, ii), 10);
+  }
+  EXPECT_EQ(10u, queue.size());
+  queue.push(record(3, 5), 10);
+
+  // Only the newest record for each timer is kept, in order.
+  EXPECT_EQ(8u, queue.coalesced());
+  EXPECT_EQ(0u, queue.dropped());
+  EXPECT_EQ(8u, __statistics->get(Statistics::REPLICATION_COALESCED));
+  ASSERT_EQ(3u, queue.size());
+  EXPECT_EQ(4u, queue.front().queued_us);
+  EXPECT_EQ(std::vector<TimerID>({1, 2, 3}), ids());
+}
+
+TEST_F(TestReplicationQueue, DropsOldestWhenFull)
+{
+  for (TimerID id = 1; id <= 15; id++)
+  {
+    queue.push(record(id, 0), 10);
+  }
+
+  // Nothing could be coalesced, so the oldest records were dropped.
+  EXPECT_EQ(0u, queue.coalesced());
+  EXPECT_EQ(5u, queue.dropped());
+  EXPECT_EQ(5u, __statistics->get(Statistics::REPLICATION_DROPS));
+  EXPECT_EQ(std::vector<TimerID>({6, 7, 8, 9, 10, 11, 12, 13, 14, 15}), ids());
+}
+
+TEST_F(TestReplicationQueue, CoalescesAgainOnlyAfterMoreRecords)
+{
+  for (TimerID id = 1; id <= 9; id++)
+  {
+    queue.push(record(id, 0), 10);
+  }
+  queue.push(record(5, 0), 10);
+
+  // Coalescing the full queue makes room.
+  queue.push(record(11, 0), 10);
+  EXPECT_EQ(1u, queue.coalesced());
+  EXPECT_EQ(0u, queue.dropped());
+
+  // Coalescing isn't tried again until another tenth of the queue has been
+  // pushed, so this drops the oldest record even though coalescing would
+  // have made room.
+  queue.push(record(5, 0), 10);
+  EXPECT_EQ(1u, queue.coalesced());
+  EXPECT_EQ(1u, queue.dropped());
+
+  queue.push(record(12, 0), 10);
+  EXPECT_EQ(2u, queue.coalesced());
+  EXPECT_EQ(1u, queue.dropped());
+  EXPECT_EQ(std::vector<TimerID>({2, 3, 4, 6, 7, 8, 9, 11, 5, 12}), ids());
+}
+
+TEST_F(TestReplicationQueue, RequeueKeepsWithinBound)
+{
+  for (TimerID id = 1; id <= 8; id++)
+  {
+    queue.push(record(id, 0), 10);
+  }
+  std::vector<ReplicationRecord> batch;
+  queue.pop(batch, 4);
+
+  // While the batch is being sent, timer 3 is updated.
+  queue.push(record(9, 0), 10);
+  queue.push(record(10, 0), 10);
+  queue.push(record(3, 0), 10);
+
+  // The batch fails and goes back in front, which overfills the queue, so
+  // the old record for timer 3 is coalesced away.
+  queue.requeue(batch, 10);
+  EXPECT_EQ(1u, queue.coalesced());
+  EXPECT_EQ(0u, queue.dropped());
+  EXPECT_EQ(std::vector<TimerID>({1, 2, 4, 5, 6, 7, 8, 9, 10, 3}), ids());
+
+  // With nothing to coalesce, the oldest records are dropped instead.
+  for (TimerID id = 11; id <= 20; id++)
+  {
+    queue.push(record(id, 0), 10);
+  }
+  batch.clear();
+  queue.pop(batch, 2);
+  queue.requeue(batch, 9);
+  EXPECT_EQ(1u, queue.dropped());
+  EXPECT_EQ(std::vector<TimerID>({12, 13, 14, 15, 16, 17, 18, 19, 20}), ids());
+}
@@ -0,0 +1,622 @@
+#include "replicator.h"
+#include "replication_codec.h"
+#include "statistics.h"
+#include "globals.h"
+#include "base.h"
+
+#include "rapidjson/document.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstring>
+#include <set>
+#include <pthread.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*****************************************************************************/
+/* Test node                                                                 */
+/*****************************************************************************/
+
+// A node to replicate to, listening on a loopback address.  It keeps the
+// requests it receives, and answers each with the status chosen by
+// `respond()` - or closes the connection without answering, or never answers
+// at all (as a node that has stalled).
+class TestNode
+{
+public:
+  struct Request
+  {
+    std::string path;
+    std::string content_type;
+    std::string body;
+  };
+
+  static const int CLOSE = 0;
+  static const int STALL = -1;
+
+  TestNode(const std::string& address, int port) :
+    status(200),
+    binary_status(0),
+    json_batch_status(0),
+    listen_fd(-1),
+    stopping(false)
+  {
+    pthread_mutex_init(&mutex, NULL);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address.c_str(), &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(fd, 16) != 0))
+    {
+      close(fd);
+      return;
+    }
+
+    listen_fd = fd;
+    pthread_create(&thread, NULL, &TestNode::run, this);
+  }
+
+  ~TestNode()
+  {
+    if (listen_fd >= 0)
+    {
+      shutdown(listen_fd, SHUT_RDWR);
+      pthread_join(thread, NULL);
+      close(listen_fd);
+    }
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    for (auto it = connections.begin(); it != connections.end(); it++)
+    {
+      shutdown(it->first, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (auto it = connections.begin(); it != connections.end(); it++)
+    {
+      pthread_join(it->second, NULL);
+      close(it->first);
+    }
+    pthread_mutex_destroy(&mutex);
+  }
+
+  bool listening() { return (listen_fd >= 0); }
+
+  // The port the node is listening on.
+  int port()
+  {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+    return ntohs(addr.sin_port);
+  }
+
+  std::vector<Request> get_received()
+  {
+    pthread_mutex_lock(&mutex);
+    std::vector<Request> copy = received;
+    pthread_mutex_unlock(&mutex);
+    return copy;
+  }
+
+  // Wait (for up to five seconds) for the node to have received a number of
+  // requests.
+  std::vector<Request> wait_for_requests(size_t count)
+  {
+    for (int ii = 0; (ii < 500) && (get_received().size() < count); ii++)
+    {
+      usleep(10000);
+    }
+    return get_received();
+  }
+
+  // The status to answer requests with, unless they're binary messages or
+  // JSON batches and a status is set for those.
+  std::atomic<int> status;
+  std::atomic<int> binary_status;
+  std::atomic<int> json_batch_status;
+
+private:
+  int respond(const Request& request)
+  {
+    if ((binary_status != 0) &&
+        (request.content_type == ReplicationCodec::CONTENT_TYPE))
+    {
+      return binary_status;
+    }
+    if ((json_batch_status != 0) &&
+        (request.content_type == "application/json") &&
+        (request.path == "/timers/batch"))
+    {
+      return json_batch_status;
+    }
+    return status;
+  }
+
+  static void* run(void* arg)
+  {
+    TestNode* node = (TestNode*)arg;
+    int fd;
+    while ((fd = accept(node->listen_fd, NULL, NULL)) >= 0)
+    {
+      pthread_mutex_lock(&node->mutex);
+      if (node->stopping)
+      {
+        close(fd);
+      }
+      else
+      {
+        ConnectionArgs* args = new ConnectionArgs(node, fd);
+        pthread_t thread;
+        pthread_create(&thread, NULL, &TestNode::serve_entry, args);
+        node->connections.push_back(std::make_pair(fd, thread));
+      }
+      pthread_mutex_unlock(&node->mutex);
+    }
+    return NULL;
+  }
+
+  typedef std::pair<TestNode*, int> ConnectionArgs;
+
+  static void* serve_entry(void* arg)
+  {
+    ConnectionArgs* args = (ConnectionArgs*)arg;
+    args->first->serve(args->second);
+    delete args;
+    return NULL;
+  }
+
+  // Read HTTP requests from a connection until it's closed, answering each
+  // with the status chosen for it.
+  void serve(int fd)
+  {
+    std::string buffer;
+    while (true)
+    {
+      size_t header_end;
+      while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+      {
+        if (!read_more(fd, buffer))
+        {
+          return;
+        }
+      }
+
+      Request request;
+      std::string headers = buffer.substr(0, header_end + 2);
+      buffer.erase(0, header_end + 4);
+      size_t path_start = headers.find(' ') + 1;
+      request.path = headers.substr(path_start, headers.find(' ', path_start) - path_start);
+      request.content_type = header(headers, "Content-Type");
+      size_t length = atoi(header(headers, "Content-Length").c_str());
+
+      if (header(headers, "Expect") == "100-continue")
+      {
+        std::string cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (write(fd, cont.data(), cont.length()) != (ssize_t)cont.length())
+        {
+          return;
+        }
+      }
+
+      while (buffer.length() < length)
+      {
+        if (!read_more(fd, buffer))
+        {
+          return;
+        }
+      }
+      request.body = buffer.substr(0, length);
+      buffer.erase(0, length);
+
+      int rc = respond(request);
+      pthread_mutex_lock(&mutex);
+      received.push_back(request);
+      pthread_mutex_unlock(&mutex);
+
+      if (rc == CLOSE)
+      {
+        // The socket is closed when the node is destroyed.
+        shutdown(fd, SHUT_RDWR);
+        return;
+      }
+      else if (rc == STALL)
+      {
+        continue;
+      }
+
+      std::string response = "HTTP/1.1 " + std::to_string(rc) + " Test\r\n"
+                             "Content-Length: 0\r\n\r\n";
+      if (write(fd, response.data(), response.length()) != (ssize_t)response.length())
+      {
+        return;
+      }
+    }
+  }
+
+  static bool read_more(int fd, std::string& buffer)
+  {
+    char chunk[4096];
+    ssize_t rc = read(fd, chunk, sizeof(chunk));
+    if (rc <= 0)
+    {
+      return false;
+    }
+    buffer.append(chunk, rc);
+    return true;
+  }
+
+  static std::string header(const std::string& headers, const std::string& name)
+  {
+    size_t pos = 0;
+    while ((pos = headers.find("\r\n", pos)) != std::string::npos)
+    {
+      pos += 2;
+      if ((strncasecmp(headers.c_str() + pos, name.c_str(), name.length()) == 0) &&
+          (headers[pos + name.length()] == ':'))
+      {
+        size_t start = headers.find_first_not_of(' ', pos + name.length() + 1);
+        return headers.substr(start, headers.find("\r\n", start) - start);
+      }
+    }
+    return "";
+  }
+
+  int listen_fd;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  bool stopping;
+  std::vector<std::pair<int, pthread_t>> connections;
+  std::vector<Request> received;
+};
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestReplicator : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+
+    // The node listens on any free port, which the replicator sends to as
+    // the bind port.
+    node = new TestNode("127.0.0.1", 0);
+    ASSERT_TRUE(node->listening());
+    int port = node->port();
+    __globals->set_bind_port(port);
+
+    replicator = new Replicator();
+  }
+
+  virtual void TearDown()
+  {
+    delete replicator;
+    delete node;
+    for (auto it = timers.begin(); it != timers.end(); it++)
+    {
+      delete *it;
+    }
+    Base::TearDown();
+  }
+
+  // Replicate a timer to this node (10.0.0.1, which is skipped) and the
+  // test node, and optionally another node.
+  Timer* replicate(TimerID id, const std::string& other_node = "")
+  {
+    Timer* timer = new Timer(id, 100, 100);
+    timer->start_time = 1000000;
+    timer->callback_url = "http://localhost:80/callback";
+    timer->callback_body = "stuff";
+    timer->replicas.push_back("10.0.0.1");
+    timer->replicas.push_back("127.0.0.1");
+    if (!other_node.empty())
+    {
+      timer->replicas.push_back(other_node);
+    }
+    timers.push_back(timer);
+    replicator->replicate(timer);
+    return timer;
+  }
+
+  // Wait (for up to five seconds) for a number of replication requests to
+  // have failed.
+  bool wait_for_failures(uint64_t count)
+  {
+    for (int ii = 0; ii < 500; ii++)
+    {
+      if (__statistics->get(Statistics::REPLICATION_FAILURES) >= count)
+      {
+        return true;
+      }
+      usleep(10000);
+    }
+    return false;
+  }
+
+  // Get a node's replication queue statistics, as rendered by the
+  // statistics, or an empty object if there aren't any.
+  rapidjson::Value& peer_statistics(rapidjson::Document& doc, const char* node)
+  {
+    static rapidjson::Value empty(rapidjson::kObjectType);
+    doc.Parse<0>(__statistics->to_json().c_str());
+    rapidjson::Value& peers = doc["replication-peers"];
+    return peers.HasMember(node) ? peers[node] : empty;
+  }
+
+  TestNode* node;
+  Replicator* replicator;
+  std::vector<Timer*> timers;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestReplicator, BinaryBatch)
+{
+  replicate(1);
+  std::vector<TestNode::Request> requests = node->wait_for_requests(1);
+  ASSERT_EQ(1u, requests.size());
+  EXPECT_EQ("/timers/batch", requests[0].path);
+  EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests[0].content_type);
+
+  std::vector<Timer*> received;
+  std::string error;
+  ASSERT_TRUE(ReplicationCodec::decode(requests[0].body.data(),
+                                       requests[0].body.length(),
+                                       received,
+                                       error)) << error;
+  ASSERT_EQ(1u, received.size());
+  EXPECT_EQ(1u, received[0]->id);
+  delete received[0];
+}
+
+TEST_F(TestReplicator, UnsupportedBinarySentAsJSON)
+{
+  // The node doesn't support binary messages, so the timer is sent again as
+  // JSON, as are later timers.
+  node->binary_status = 415;
+  Timer* timer = replicate(1);
+  std::vector<TestNode::Request> requests = node->wait_for_requests(2);
+  ASSERT_EQ(2u, requests.size());
+  EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests[0].content_type);
+  EXPECT_EQ("application/json", requests[1].content_type);
+  EXPECT_EQ("/timers/" + timer->url_id(), requests[1].path);
+
+  replicate(2);
+  requests = node->wait_for_requests(3);
+  ASSERT_EQ(3u, requests.size());
+  EXPECT_EQ("application/json", requests[2].content_type);
+}
+
+TEST_F(TestReplicator, BadRequestDoesntSwitchToJSON)
+{
+  // A bad request doesn't mean the node doesn't support binary messages.
+  node->status = 400;
+  replicate(1);
+  ASSERT_EQ(1u, node->wait_for_requests(1).size());
+
+  replicate(2);
+  std::vector<TestNode::Request> requests = node->wait_for_requests(2);
+  ASSERT_EQ(2u, requests.size());
+  EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests[1].content_type);
+
+  // The node would only reject the timers again, so they aren't resent.
+  usleep(300000);
+  EXPECT_EQ(2u, node->get_received().size());
+}
+
+TEST_F(TestReplicator, BinaryTriedAgainAfterFailure)
+{
+  node->binary_status = 404;
+  replicate(1);
+  ASSERT_EQ(2u, node->wait_for_requests(2).size());
+
+  // The node goes away, so may come back on a version that supports binary
+  // messages.
+  node->status = TestNode::CLOSE;
+  replicate(2);
+  ASSERT_TRUE(wait_for_failures(1));
+  node->status = 200;
+  node->binary_status = 0;
+  size_t count = node->get_received().size();
+  replicate(3);
+  std::vector<TestNode::Request> requests = node->wait_for_requests(count + 1);
+  ASSERT_EQ(count + 1, requests.size());
+  EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests.back().content_type);
+}
+
+TEST_F(TestReplicator, BatchNotFoundSentSingly)
+{
+  // The node has neither the binary format nor the batch endpoint, so the
+  // timers are sent one at a time.
+  node->binary_status = 404;
+  node->json_batch_status = 404;
+  int batch_window_ms = 100;
+  __globals->set_replication_batch_window_ms(batch_window_ms);
+
+  std::set<std::string> expected;
+  for (TimerID id = 1; id <= 3; id++)
+  {
+    expected.insert("/timers/" + replicate(id)->url_id());
+  }
+
+  std::vector<TestNode::Request> requests = node->wait_for_requests(5);
+  ASSERT_EQ(5u, requests.size());
+  EXPECT_EQ("/timers/batch", requests[0].path);
+  EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests[0].content_type);
+  EXPECT_EQ("/timers/batch", requests[1].path);
+  EXPECT_EQ("application/json", requests[1].content_type);
+
+  std::set<std::string> received;
+  for (size_t ii = 2; ii < requests.size(); ii++)
+  {
+    EXPECT_EQ("application/json", requests[ii].content_type);
+    received.insert(requests[ii].path);
+  }
+  EXPECT_EQ(expected, received);
+}
+
+TEST_F(TestReplicator, ErrorResponseIsFailure)
+{
+  // A server error means the timers weren't replicated, so counts as a
+  // failure, and the timer is sent again (backing off in between) for as
+  // long as the node keeps failing.
+  node->status = 500;
+  replicate(1);
+  ASSERT_TRUE(wait_for_failures(3));
+
+  // The node keeps being sent binary messages.
+  std::vector<TestNode::Request> requests = node->get_received();
+  ASSERT_LE(3u, requests.size());
+  for (size_t ii = 0; ii < 3; ii++)
+  {
+    EXPECT_EQ(ReplicationCodec::CONTENT_TYPE, requests[ii].content_type);
+    EXPECT_EQ(requests[0].body, requests[ii].body);
+  }
+}
+
+TEST_F(TestReplicator, TimerSentAgainAfterFailure)
+{
+  // The node drops the first request, but the timer isn't lost: it's sent
+  // again once the node has had a chance to recover.
+  node->status = TestNode::CLOSE;
+  replicate(1);
+  ASSERT_TRUE(wait_for_failures(1));
+  node->status = 200;
+
+  std::vector<TestNode::Request> requests = node->wait_for_requests(2);
+  ASSERT_EQ(2u, requests.size());
+
+  std::vector<Timer*> received;
+  std::string error;
+  ASSERT_TRUE(ReplicationCodec::decode(requests[1].body.data(),
+                                       requests[1].body.length(),
+                                       received,
+                                       error)) << error;
+  ASSERT_EQ(1u, received.size());
+  EXPECT_EQ(1u, received[0]->id);
+  delete received[0];
+
+  // The node is healthy again, so nothing more is sent.
+  usleep(300000);
+  EXPECT_EQ(2u, node->get_received().size());
+  EXPECT_EQ(1u, __statistics->get(Statistics::REPLICATION_FAILURES));
+}
+
+TEST_F(TestReplicator, StalledNodeDoesntHoldUpOthers)
+{
+  // A second node, on another loopback address, never answers.
+  TestNode stalled("127.0.0.2", node->port());
+  if (!stalled.listening())
+  {
+    GTEST_SKIP() << "Can't listen on 127.0.0.2";
+  }
+  stalled.status = TestNode::STALL;
+
+  int batch_size = 1;
+  __globals->set_replication_batch_size(batch_size);
+  int connections_per_node = 2;
+  __globals->set_replication_connections_per_node(connections_per_node);
+
+  for (TimerID id = 1; id <= 50; id++)
+  {
+    replicate(id, "127.0.0.2");
+  }
+
+  // Every timer reaches the healthy node, while the stalled node only has a
+  // window of requests in flight, and the rest of its timers wait in its
+  // queue.
+  EXPECT_EQ(50u, node->wait_for_requests(50).size());
+  EXPECT_EQ(2u, stalled.wait_for_requests(2).size());
+  usleep(200000);
+  EXPECT_EQ(2u, stalled.get_received().size());
+
+  rapidjson::Document doc;
+  rapidjson::Value& stats = peer_statistics(doc, "127.0.0.2");
+  ASSERT_TRUE(stats.HasMember("in-flight"));
+  EXPECT_EQ(2, stats["in-flight"].GetInt());
+  EXPECT_EQ(48, stats["queued"].GetInt());
+
+  rapidjson::Value& healthy_stats = peer_statistics(doc, "127.0.0.1");
+  ASSERT_TRUE(healthy_stats.HasMember("queued"));
+  EXPECT_EQ(0, healthy_stats["queued"].GetInt());
+
+  // The stalled node must be destroyed after the replicator.
+  delete replicator;
+  replicator = NULL;
+}
+
+TEST_F(TestReplicator, ManyReplicasAllReached)
+{
+  // More nodes than fit in one entry on the way to the worker thread, on
+  // further loopback addresses.
+  std::vector<TestNode*> others;
+  for (int ii = 2; ii <= 6; ii++)
+  {
+    TestNode* other = new TestNode("127.0.0." + std::to_string(ii), node->port());
+    others.push_back(other);
+    if (!other->listening())
+    {
+      for (auto it = others.begin(); it != others.end(); it++)
+      {
+        delete *it;
+      }
+      GTEST_SKIP() << "Can't listen on 127.0.0." << ii;
+    }
+  }
+
+  Timer* timer = new Timer(1, 100, 100);
+  timer->start_time = 1000000;
+  timer->callback_url = "http://localhost:80/callback";
+  timer->replicas.push_back("10.0.0.1");
+  timer->replicas.push_back("127.0.0.1");
+  for (int ii = 2; ii <= 6; ii++)
+  {
+    timer->extra_replicas.push_back("127.0.0." + std::to_string(ii));
+  }
+  timers.push_back(timer);
+  replicator->replicate(timer);
+
+  EXPECT_EQ(1u, node->wait_for_requests(1).size());
+  for (auto it = others.begin(); it != others.end(); it++)
+  {
+    EXPECT_EQ(1u, (*it)->wait_for_requests(1).size());
+  }
+
+  delete replicator;
+  replicator = NULL;
+  for (auto it = others.begin(); it != others.end(); it++)
+  {
+    delete *it;
+  }
+}
+
+TEST_F(TestReplicator, StatisticsRemovedWithReplicator)
+{
+  replicate(1);
+  ASSERT_EQ(1u, node->wait_for_requests(1).size());
+  usleep(200000);
+
+  rapidjson::Document doc;
+  EXPECT_TRUE(peer_statistics(doc, "127.0.0.1").HasMember("queued"));
+
+  delete replicator;
+  replicator = NULL;
+  EXPECT_FALSE(peer_statistics(doc, "127.0.0.1").HasMember("queued"));
+}
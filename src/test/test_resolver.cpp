@@ -0,0 +1,107 @@
+#include "resolver.h"
+#include "base.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestResolver : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    resolver = new Resolver();
+    memset(&address, 0, sizeof(address));
+    address_len = 0;
+  }
+
+  virtual void TearDown()
+  {
+    delete resolver;
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // Look up a name until the background lookup finishes, or for up to five
+  // seconds.
+  Resolver::Result wait_for(const std::string& host, const std::string& port)
+  {
+    Resolver::Result rc = Resolver::PENDING;
+    for (int ii = 0; (ii < 500) && (rc == Resolver::PENDING); ii++)
+    {
+      rc = resolver->lookup(host, port, &address, &address_len);
+      if (rc == Resolver::PENDING)
+      {
+        usleep(10000);
+      }
+    }
+    return rc;
+  }
+
+  std::string ipv4_address()
+  {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&address;
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin->sin_addr, buffer, sizeof(buffer));
+    return std::string(buffer) + ":" + std::to_string(ntohs(sin->sin_port));
+  }
+
+  Resolver* resolver;
+  struct sockaddr_storage address;
+  socklen_t address_len;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestResolver, NumericAddress)
+{
+  // Numeric addresses are answered straight away.
+  EXPECT_EQ(Resolver::RESOLVED, resolver->lookup("10.1.2.3", "7253", &address, &address_len));
+  EXPECT_EQ(sizeof(struct sockaddr_in), address_len);
+  EXPECT_EQ("10.1.2.3:7253", ipv4_address());
+
+  EXPECT_EQ(Resolver::RESOLVED, resolver->lookup("::1", "80", &address, &address_len));
+  EXPECT_EQ(AF_INET6, address.ss_family);
+}
+
+TEST_F(TestResolver, NameLookedUpInBackground)
+{
+  // The first lookup of a name doesn't wait for it to be resolved.
+  EXPECT_EQ(Resolver::PENDING, resolver->lookup("localhost", "80", &address, &address_len));
+  ASSERT_EQ(Resolver::RESOLVED, wait_for("localhost", "80"));
+  EXPECT_EQ(AF_INET, address.ss_family);
+  EXPECT_EQ("127.0.0.1:80", ipv4_address());
+
+  // The address is cached for each port separately.
+  EXPECT_EQ(Resolver::PENDING, resolver->lookup("localhost", "81", &address, &address_len));
+}
+
+TEST_F(TestResolver, OldAddressUsedWhileRefreshing)
+{
+  ASSERT_EQ(Resolver::RESOLVED, wait_for("localhost", "80"));
+
+  // Once the address is old it's looked up again, but the old address is
+  // still used in the meantime.
+  cwtest_advance_time_ms(120 * 1000);
+  memset(&address, 0, sizeof(address));
+  EXPECT_EQ(Resolver::RESOLVED, resolver->lookup("localhost", "80", &address, &address_len));
+  EXPECT_EQ("127.0.0.1:80", ipv4_address());
+}
+
+TEST_F(TestResolver, FailedLookup)
+{
+  EXPECT_EQ(Resolver::FAILED, wait_for("", "80"));
+
+  // The failure is remembered, rather than the name being looked up again.
+  EXPECT_EQ(Resolver::FAILED, resolver->lookup("", "80", &address, &address_len));
+}
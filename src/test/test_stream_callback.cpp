@@ -0,0 +1,320 @@
+#include "stream_callback.h"
+#include "timer_helper.h"
+#include "statistics.h"
+#include "globals.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// Runs an HTTP server with a stream callback on the test thread's event loop,
+// and performs callbacks on a separate thread (as the timer handler would).
+// Consumers are plain sockets driven by the test.
+class TestStreamCallback : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+
+    int timeout_ms = 2000;
+    __globals->set_callback_timeout_ms(timeout_ms);
+
+    base = event_base_new();
+    http = evhttp_new(base);
+    struct evhttp_bound_socket* socket = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname(evhttp_bound_socket_get_fd(socket), (struct sockaddr*)&addr, &addr_len);
+    port = ntohs(addr.sin_port);
+
+    callback = new StreamCallback(base);
+    evhttp_set_cb(http, "/subscriptions", StreamCallback::subscribe_cb, callback);
+    evhttp_set_cb(http, "/acknowledgements", StreamCallback::acknowledge_cb, callback);
+
+    for (int ii = 0; ii < 3; ii++)
+    {
+      timers[ii] = default_timer(ii + 1);
+      timers[ii]->callback_protocol = "stream";
+      timers[ii]->callback_url = "consumers";
+      timers[ii]->callback_body = "pop " + std::to_string(ii + 1);
+      timers[ii]->sequence_number = 1;
+      requests.push_back(CallbackRequest(timers[ii]));
+    }
+    done = false;
+  }
+
+  virtual void TearDown()
+  {
+    evhttp_free(http);
+    delete callback;
+    event_base_free(base);
+
+    for (int ii = 0; ii < 3; ii++)
+    {
+      delete timers[ii];
+    }
+    Base::TearDown();
+  }
+
+  // Perform the callbacks on another thread.
+  void start_callbacks()
+  {
+    pthread_create(&thread, NULL, &TestStreamCallback::perform_all, this);
+  }
+
+  static void* perform_all(void* arg)
+  {
+    TestStreamCallback* test = (TestStreamCallback*)arg;
+    test->callback->perform_all(test->requests);
+    test->done = true;
+    return NULL;
+  }
+
+  // Run the event loop until the callbacks complete (or the callback timeout
+  // passes), then wait for the thread.
+  void finish_callbacks()
+  {
+    run_until([this]() { return (bool)done; });
+    pthread_join(thread, NULL);
+  }
+
+  void run_until(std::function<bool()> condition)
+  {
+    for (int ii = 0; (ii < 1000) && (!condition()); ii++)
+    {
+      event_base_loop(base, EVLOOP_NONBLOCK);
+      usleep(1000);
+    }
+    event_base_loop(base, EVLOOP_NONBLOCK);
+  }
+
+  int connect_to_server()
+  {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+  }
+
+  void send_request(int fd, const std::string& request)
+  {
+    EXPECT_EQ((ssize_t)request.length(), write(fd, request.data(), request.length()));
+  }
+
+  // Subscribe for pops, and wait for the subscription to start.
+  int subscribe(const std::string& query)
+  {
+    int fd = connect_to_server();
+    send_request(fd, "GET /subscriptions?" + query + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    std::string response;
+    run_until([&]() { return read_from(fd, response).find("\r\n\r\n") != std::string::npos; });
+    status = response.substr(0, response.find("\r\n"));
+    return fd;
+  }
+
+  // Get the IDs of the pops that have arrived on a subscription.
+  std::vector<std::string> received(int fd, std::string& data, size_t count)
+  {
+    run_until([&]() { return ids_in(read_from(fd, data)).size() >= count; });
+    return ids_in(data);
+  }
+
+  std::string acknowledge(const std::string& body)
+  {
+    int fd = connect_to_server();
+    send_request(fd,
+                 "POST /acknowledgements HTTP/1.1\r\nHost: localhost\r\n"
+                 "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body);
+    std::string response;
+    run_until([&]() { return read_from(fd, response).find("\r\n\r\n") != std::string::npos; });
+    close(fd);
+    return response.substr(0, response.find("\r\n"));
+  }
+
+  static std::string& read_from(int fd, std::string& data)
+  {
+    char buffer[4096];
+    ssize_t rc;
+    while ((rc = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+      data.append(buffer, rc);
+    }
+    return data;
+  }
+
+  static std::vector<std::string> ids_in(const std::string& data)
+  {
+    std::vector<std::string> ids;
+    const std::string marker = "{\"id\":\"";
+    for (size_t pos = data.find(marker); pos != std::string::npos; pos = data.find(marker, pos + 1))
+    {
+      ids.push_back(data.substr(pos + marker.length(), 16));
+    }
+    return ids;
+  }
+
+  struct event_base* base;
+  struct evhttp* http;
+  int port;
+  StreamCallback* callback;
+  Timer* timers[3];
+  std::vector<CallbackRequest> requests;
+  pthread_t thread;
+  volatile bool done;
+  std::string status;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestStreamCallback, PopsDeliveredAndAcknowledged)
+{
+  int fd = subscribe("key=consumers");
+  EXPECT_EQ("HTTP/1.1 200 OK", status);
+  start_callbacks();
+
+  std::string data;
+  std::vector<std::string> ids = received(fd, data, 3);
+  ASSERT_EQ(3u, ids.size());
+  EXPECT_EQ("0000000000000001", ids[0]);
+  EXPECT_NE(std::string::npos, data.find("{\"id\":\"0000000000000001\",\"sequence-number\":1,\"opaque\":\"pop 1\"}\n"));
+
+  // The pops are acknowledged in one batch, and one of them gets new timing.
+  EXPECT_EQ("HTTP/1.1 200 OK",
+            acknowledge("{\"acknowledged\": [\"0000000000000001\", \"0000000000000002\", \"0000000000000003\"],"
+                        " \"updates\": {\"0000000000000002\": {\"timing\": {\"interval\": 5}}}}"));
+  finish_callbacks();
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(requests[ii].success) << ii;
+    EXPECT_NE(0u, requests[ii].completed_us) << ii;
+  }
+  EXPECT_TRUE(requests[1].reschedule);
+  EXPECT_EQ(5000u, requests[1].interval);
+  close(fd);
+}
+
+TEST_F(TestStreamCallback, WindowLimitsOutstandingPops)
+{
+  int fd = subscribe("key=consumers&window=2");
+  start_callbacks();
+
+  // Only two pops are sent until one is acknowledged.
+  std::string data;
+  EXPECT_EQ(2u, received(fd, data, 3).size());
+
+  acknowledge("{\"acknowledged\": [\"0000000000000001\"]}");
+  EXPECT_EQ(3u, received(fd, data, 3).size());
+
+  acknowledge("{\"acknowledged\": [\"0000000000000002\", \"0000000000000003\"]}");
+  finish_callbacks();
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(requests[ii].success) << ii;
+  }
+  close(fd);
+}
+
+TEST_F(TestStreamCallback, PopsSharedBetweenSubscriptions)
+{
+  int fd1 = subscribe("key=consumers&window=1");
+  int fd2 = subscribe("key=consumers&window=2");
+  start_callbacks();
+
+  std::string data1;
+  std::string data2;
+  EXPECT_EQ(1u, received(fd1, data1, 1).size());
+  EXPECT_EQ(2u, received(fd2, data2, 2).size());
+
+  acknowledge("{\"acknowledged\": [\"0000000000000001\", \"0000000000000002\", \"0000000000000003\"]}");
+  finish_callbacks();
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(requests[ii].success) << ii;
+  }
+  close(fd1);
+  close(fd2);
+}
+
+TEST_F(TestStreamCallback, RejectedAndUnacknowledgedPopsFail)
+{
+  int fd = subscribe("key=consumers");
+  start_callbacks();
+
+  std::string data;
+  EXPECT_EQ(3u, received(fd, data, 3).size());
+
+  // The third pop is never acknowledged, so fails at the callback timeout.
+  acknowledge("{\"acknowledged\": [\"0000000000000001\"], \"rejected\": [\"0000000000000002\"]}");
+  finish_callbacks();
+
+  EXPECT_TRUE(requests[0].success);
+  EXPECT_FALSE(requests[1].success);
+  EXPECT_FALSE(requests[2].success);
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_DEADLINE_MISSES));
+  close(fd);
+}
+
+TEST_F(TestStreamCallback, PopsFailWhenSubscriptionCloses)
+{
+  int fd = subscribe("key=consumers");
+  start_callbacks();
+
+  std::string data;
+  EXPECT_EQ(3u, received(fd, data, 3).size());
+  close(fd);
+  finish_callbacks();
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(requests[ii].success) << ii;
+  }
+  EXPECT_EQ(0u, __statistics->get(Statistics::CALLBACK_DEADLINE_MISSES));
+}
+
+TEST_F(TestStreamCallback, NoSubscriptions)
+{
+  // Pops for a key with no subscriptions fail straight away.
+  int fd = subscribe("key=others");
+  callback->perform_all(requests);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(requests[ii].success) << ii;
+  }
+  EXPECT_EQ(0u, __statistics->get(Statistics::CALLBACK_DEADLINE_MISSES));
+  close(fd);
+}
+
+TEST_F(TestStreamCallback, InvalidRequests)
+{
+  int fd = subscribe("window=5");
+  EXPECT_EQ("HTTP/1.1 400 Missing key", status);
+  close(fd);
+
+  fd = subscribe("key=consumers&window=0");
+  EXPECT_EQ("HTTP/1.1 400 Invalid window", status);
+  close(fd);
+
+  EXPECT_EQ("HTTP/1.1 400 Invalid acknowledgements", acknowledge("[\"0000000000000001\"]"));
+}
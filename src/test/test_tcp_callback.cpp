@@ -0,0 +1,359 @@
+#include "tcp_callback.h"
+#include "timer_helper.h"
+#include "statistics.h"
+#include "globals.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*****************************************************************************/
+/* Test consumer                                                             */
+/*****************************************************************************/
+
+// A consumer listening on a Unix domain socket, that acknowledges each pop it
+// receives with the configured result and update (unless told not to
+// acknowledge pops at all), optionally closing each connection after a number
+// of pops.
+class TestConsumer
+{
+public:
+  TestConsumer(const std::string& path) :
+    path(path),
+    result(0),
+    update(),
+    acknowledge(true),
+    close_after(0),
+    connections(0)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    unlink(path.c_str());
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(listen_fd, 5);
+    pthread_create(&thread, NULL, &TestConsumer::run, this);
+  }
+
+  ~TestConsumer()
+  {
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(listen_fd);
+    unlink(path.c_str());
+    pthread_mutex_destroy(&mutex);
+  }
+
+  std::vector<std::string> get_received()
+  {
+    pthread_mutex_lock(&mutex);
+    std::vector<std::string> copy = received;
+    pthread_mutex_unlock(&mutex);
+    return copy;
+  }
+
+  std::string path;
+  unsigned char result;
+  std::string update;
+  bool acknowledge;
+  int close_after;
+  int connections;
+
+private:
+  static bool read_fully(int fd, unsigned char* buffer, size_t length)
+  {
+    size_t offset = 0;
+    while (offset < length)
+    {
+      ssize_t rc = read(fd, buffer + offset, length - offset);
+      if (rc <= 0)
+      {
+        return false;
+      }
+      offset += rc;
+    }
+    return true;
+  }
+
+  static void* run(void* arg)
+  {
+    TestConsumer* consumer = (TestConsumer*)arg;
+    int fd;
+    while ((fd = accept(consumer->listen_fd, NULL, NULL)) >= 0)
+    {
+      consumer->connections++;
+      consumer->serve(fd);
+      close(fd);
+    }
+    return NULL;
+  }
+
+  void serve(int fd)
+  {
+    int pops = 0;
+    unsigned char header[16];
+    while (read_fully(fd, header, sizeof(header)))
+    {
+      uint32_t length = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+      std::string body(length - 12, '\0');
+      if ((!body.empty()) && (!read_fully(fd, (unsigned char*)&body[0], body.length())))
+      {
+        return;
+      }
+
+      pthread_mutex_lock(&mutex);
+      received.push_back(body);
+      pthread_mutex_unlock(&mutex);
+
+      if (acknowledge)
+      {
+        // The acknowledgement echoes the timer ID and sequence number.
+        std::string ack(17, '\0');
+        ack[3] = 13 + update.length();
+        memcpy(&ack[4], header + 4, 12);
+        ack[16] = result;
+        ack += update;
+        if (write(fd, ack.data(), ack.length()) != (ssize_t)ack.length())
+        {
+          return;
+        }
+      }
+
+      if ((close_after > 0) && (++pops == close_after))
+      {
+        return;
+      }
+    }
+  }
+
+  int listen_fd;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  std::vector<std::string> received;
+};
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// Runs each test with each type of I/O engine.
+class TestTCPCallback : public Base, public ::testing::WithParamInterface<std::string>
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+
+    int timeout_ms = 1000;
+    __globals->set_callback_timeout_ms(timeout_ms);
+    int breaker_failures = 0;
+    __globals->set_callback_circuit_breaker_failures(breaker_failures);
+    std::string io_engine = GetParam();
+    __globals->set_callback_tcp_io_engine(io_engine);
+
+    path = "/tmp/chronos_test_" + std::to_string(getpid()) + ".sock";
+    address = "unix:" + path;
+    consumer = new TestConsumer(path);
+    callback = new TCPCallback();
+
+    for (int ii = 0; ii < 3; ii++)
+    {
+      timers[ii] = default_timer(ii + 1);
+      timers[ii]->callback_protocol = "tcp";
+      timers[ii]->callback_url = address;
+      timers[ii]->callback_body = "pop " + std::to_string(ii + 1);
+      timers[ii]->sequence_number = 1;
+    }
+  }
+
+  virtual void TearDown()
+  {
+    for (int ii = 0; ii < 3; ii++)
+    {
+      delete timers[ii];
+    }
+    delete callback;
+    delete consumer;
+    Base::TearDown();
+  }
+
+  std::vector<CallbackRequest> requests()
+  {
+    std::vector<CallbackRequest> requests;
+    for (int ii = 0; ii < 3; ii++)
+    {
+      requests.push_back(CallbackRequest(timers[ii]));
+    }
+    return requests;
+  }
+
+  std::string path;
+  std::string address;
+  TestConsumer* consumer;
+  TCPCallback* callback;
+  Timer* timers[3];
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_P(TestTCPCallback, PopsAcknowledged)
+{
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(reqs[ii].success);
+    EXPECT_FALSE(reqs[ii].deferred);
+    EXPECT_NE(0u, reqs[ii].started_us);
+    EXPECT_GE(reqs[ii].completed_us, reqs[ii].started_us);
+  }
+
+  std::vector<std::string> received = consumer->get_received();
+  ASSERT_EQ(3u, received.size());
+  EXPECT_EQ("pop 1", received[0]);
+  EXPECT_EQ("pop 3", received[2]);
+
+  // The connection is kept open for the next pops.
+  reqs = requests();
+  callback->perform_all(reqs);
+  EXPECT_TRUE(reqs[0].success);
+  EXPECT_EQ(1, consumer->connections);
+}
+
+TEST_P(TestTCPCallback, PerformSingleCallback)
+{
+  EXPECT_TRUE(callback->perform(address, "single", 1));
+  ASSERT_EQ(1u, consumer->get_received().size());
+  EXPECT_EQ("single", consumer->get_received()[0]);
+}
+
+TEST_P(TestTCPCallback, LargeOpaqueData)
+{
+  // Large opaque data is sent from the timers' own buffers, between the frames
+  // that are copied.
+  std::string large(64 * 1024, 'x');
+  timers[1]->callback_body = large;
+
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(reqs[ii].success);
+  }
+
+  std::vector<std::string> received = consumer->get_received();
+  ASSERT_EQ(3u, received.size());
+  EXPECT_EQ("pop 1", received[0]);
+  EXPECT_EQ(large, received[1]);
+  EXPECT_EQ("pop 3", received[2]);
+}
+
+TEST_P(TestTCPCallback, AcknowledgementsWithNewTiming)
+{
+  consumer->update = "{\"timing\": {\"interval\": 5}}";
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(reqs[ii].success);
+    EXPECT_TRUE(reqs[ii].reschedule);
+    EXPECT_EQ(5000u, reqs[ii].interval);
+  }
+}
+
+TEST_P(TestTCPCallback, PopsRejected)
+{
+  consumer->result = 1;
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(reqs[ii].success);
+  }
+}
+
+TEST_P(TestTCPCallback, NoConsumer)
+{
+  for (int ii = 0; ii < 3; ii++)
+  {
+    timers[ii]->callback_url = "unix:/tmp/chronos_test_no_such.sock";
+  }
+
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(reqs[ii].success);
+  }
+}
+
+TEST_P(TestTCPCallback, AddressBeingResolved)
+{
+  int breaker_failures = 1;
+  __globals->set_callback_circuit_breaker_failures(breaker_failures);
+  timers[0]->callback_url = "localhost:1";
+
+  // The name is looked up in the background, so the pop fails straight away
+  // without counting against the consumer.
+  std::vector<CallbackRequest> reqs(1, CallbackRequest(timers[0]));
+  callback->perform_all(reqs);
+  EXPECT_FALSE(reqs[0].success);
+  EXPECT_EQ(0u, __statistics->get(Statistics::CALLBACK_CIRCUIT_OPENS));
+}
+
+TEST_P(TestTCPCallback, PopsNotAcknowledged)
+{
+  int timeout_ms = 50;
+  __globals->set_callback_timeout_ms(timeout_ms);
+  consumer->acknowledge = false;
+
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_FALSE(reqs[ii].success);
+  }
+  EXPECT_EQ(3u, __statistics->get(Statistics::CALLBACK_DEADLINE_MISSES));
+}
+
+TEST_P(TestTCPCallback, ReconnectAfterConsumerCloses)
+{
+  // The consumer closes the connection after the first batch of pops, so the
+  // next batch goes over a new connection.
+  consumer->close_after = 3;
+
+  std::vector<CallbackRequest> reqs = requests();
+  callback->perform_all(reqs);
+  EXPECT_TRUE(reqs[2].success);
+
+  // Give the consumer a moment to close the connection.
+  usleep(10000);
+
+  reqs = requests();
+  callback->perform_all(reqs);
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(reqs[ii].success);
+  }
+  EXPECT_EQ(2, consumer->connections);
+}
+
+INSTANTIATE_TEST_CASE_P(Engines,
+                        TestTCPCallback,
+                        ::testing::Values("epoll", "io_uring"));
@@ -1,6 +1,7 @@
 #include "timer.h"
 #include "globals.h"
 #include "base.h"
+#include "allocation_counter.h"
 
 #include <gtest/gtest.h>
 #include <map>
@@ -83,10 +84,20 @@ TEST_F(TestTimer, FromJSONTests)
       "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": [] }}, \"reliability\": []}");
   failing_test_data.push_back(
       "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": []}");
+  failing_test_data.push_back(
+      "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\", \"batch\": \"yes\" }}}");
+  failing_test_data.push_back(
+      "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"tcp\": { \"opaque\": \"stuff\" }}}");
+  failing_test_data.push_back(
+      "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"tcp\": { \"address\": 1234, \"opaque\": \"stuff\" }}}");
+  failing_test_data.push_back(
+      "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"stream\": { \"opaque\": \"stuff\" }}}");
   failing_test_data.push_back(
       "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replication-factor\": \"hello\" }}");
   failing_test_data.push_back(
       "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [] }}");
+  failing_test_data.push_back(
+      "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [ \"10.0.0.1\" ], \"replica-stagger-ms\": -1 }}");
 
   // Reliability can be ignored by the client to use default replication.
   std::string default_repl_factor = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}}";
@@ -97,6 +108,15 @@ TEST_F(TestTimer, FromJSONTests)
   // Or you can pass a custom replication factor.
   std::string custom_repl_factor = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replication-factor\": 3 }}";
 
+  // Clients can opt in to batched callbacks.
+  std::string batched = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\", \"batch\": true }}}";
+
+  // Clients can ask for callbacks over a TCP or Unix domain socket.
+  std::string tcp_callback = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"tcp\": { \"address\": \"unix:/var/run/consumer.sock\", \"opaque\": \"stuff\" }}}";
+
+  // Or for callbacks to be delivered to consumers subscribed for a key.
+  std::string stream_callback = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"stream\": { \"key\": \"consumers\", \"opaque\": \"stuff\" }}}";
+
   // Or you can pass specific replicas to use.
   std::string specific_replicas = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [ \"10.0.0.1\", \"10.0.0.2\" ] }}";
 
@@ -120,6 +140,8 @@ TEST_F(TestTimer, FromJSONTests)
   EXPECT_FALSE(replicated);
   EXPECT_EQ(2, get_replication_factor(timer));
   EXPECT_EQ(2, timer->replicas.size());
+  EXPECT_FALSE(timer->callback_batch);
+  EXPECT_EQ("http", timer->callback_protocol);
   delete timer;
   timer = Timer::from_json(1, 0, default_repl_factor2, err, replicated);
   EXPECT_NE((void*)NULL, timer);
@@ -153,6 +175,44 @@ TEST_F(TestTimer, FromJSONTests)
   EXPECT_EQ(3, get_replication_factor(timer));
   delete timer;
 
+  // Batched callbacks are picked up from the callback block.
+  timer = Timer::from_json(1, 0, batched, err, replicated);
+  EXPECT_NE((void*)NULL, timer);
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(timer->callback_batch);
+  delete timer;
+
+  // TCP callbacks are picked up from their own callback block.
+  timer = Timer::from_json(1, 0, tcp_callback, err, replicated);
+  EXPECT_NE((void*)NULL, timer);
+  EXPECT_EQ("", err);
+  EXPECT_EQ("tcp", timer->callback_protocol);
+  EXPECT_EQ("unix:/var/run/consumer.sock", timer->callback_url);
+  EXPECT_EQ("stuff", timer->callback_body);
+  delete timer;
+
+  // As are stream callbacks.
+  timer = Timer::from_json(1, 0, stream_callback, err, replicated);
+  EXPECT_NE((void*)NULL, timer);
+  EXPECT_EQ("", err);
+  EXPECT_EQ("stream", timer->callback_protocol);
+  EXPECT_EQ("consumers", timer->callback_url);
+  EXPECT_EQ("stuff", timer->callback_body);
+  delete timer;
+
+  // Large opaque data is kept in the JSON it came from, and shared with any
+  // copies of the timer.
+  std::string large(4096, 'x');
+  std::string large_opaque = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"" + large + "\" }}}";
+  timer = Timer::from_json(1, 0, large_opaque, err, replicated);
+  EXPECT_NE((void*)NULL, timer);
+  EXPECT_EQ(large, timer->callback_body);
+  Timer* copy = new Timer(*timer);
+  EXPECT_EQ(timer->callback_body.data(), copy->callback_body.data());
+  delete timer;
+  EXPECT_EQ(large, copy->callback_body);
+  delete copy;
+
   // If specifc replicas are specified, use them (regardless of presence of bloom hash).
   timer = Timer::from_json(1, 0x11011100011101, specific_replicas, err, replicated);
   EXPECT_NE((void*)NULL, timer);
@@ -213,6 +273,65 @@ TEST_F(TestTimer, GenerateTimerIDTests)
   }
 }
 
+TEST_F(TestTimer, FromBatchJSON)
+{
+  Timer* t2 = new Timer(2, 1000, 2000);
+  t2->replicas = t1->replicas;
+  t2->callback_url = "http://localhost:80/callback";
+  t2->callback_body = "more stuff";
+  t1->interval = 1000;
+
+  std::string batch = "{\"timers\": [{\"id\": \"" + t1->url_id() + "\", \"timer\": " + t1->to_json() + "}, "
+                                     "{\"id\": \"" + t2->url_id() + "\", \"timer\": " + t2->to_json() + "}]}";
+  std::vector<Timer*> timers;
+  std::string err;
+  EXPECT_TRUE(Timer::from_batch_json(batch, timers, err)) << err;
+  ASSERT_EQ(2u, timers.size());
+  EXPECT_EQ(t1->id, timers[0]->id);
+  EXPECT_EQ(t1->replicas, timers[0]->replicas);
+  EXPECT_EQ("stuff stuff stuff", timers[0]->callback_body);
+  EXPECT_EQ(2u, timers[1]->id);
+  EXPECT_EQ(1000u, timers[1]->interval);
+  EXPECT_EQ("more stuff", timers[1]->callback_body);
+
+  // An empty batch is fine too.
+  std::vector<Timer*> no_timers;
+  EXPECT_TRUE(Timer::from_batch_json("{\"timers\": []}", no_timers, err));
+  EXPECT_TRUE(no_timers.empty());
+
+  delete t2;
+  delete timers[0];
+  delete timers[1];
+}
+
+TEST_F(TestTimer, FromBatchJSONFailures)
+{
+  std::string replica = "{\"id\": \"" + t1->url_id() + "\", \"timer\": " + t1->to_json() + "}";
+  std::vector<std::string> failing_test_data;
+  failing_test_data.push_back("Not JSON");
+  failing_test_data.push_back("[]");
+  failing_test_data.push_back("{\"timers\": {}}");
+  failing_test_data.push_back("{\"timers\": [" + replica + ", 1]}");
+  failing_test_data.push_back("{\"timers\": [" + replica + ", {\"timer\": {}}]}");
+  failing_test_data.push_back("{\"timers\": [" + replica + ", {\"id\": \"123\", \"timer\": {}}]}");
+  failing_test_data.push_back("{\"timers\": [" + replica + ", {\"id\": \"" + t1->url_id() + "\"}]}");
+  failing_test_data.push_back("{\"timers\": [" + replica + ", {\"id\": \"" + t1->url_id() + "\", \"timer\": {}}]}");
+
+  // Every timer in a batch must be a replica.
+  failing_test_data.push_back("{\"timers\": [" + replica + ", {\"id\": \"" + t1->url_id() + "\", \"timer\": "
+                              "{\"timing\": {\"interval\": 1, \"repeat-for\": 1}, \"callback\": {\"http\": {\"uri\": \"localhost\", \"opaque\": \"stuff\"}}}}]}");
+
+  for (auto it = failing_test_data.begin(); it != failing_test_data.end(); it++)
+  {
+    // Any timers created before the failure are destroyed.
+    std::vector<Timer*> timers;
+    std::string err;
+    EXPECT_FALSE(Timer::from_batch_json(*it, timers, err)) << *it;
+    EXPECT_TRUE(timers.empty()) << *it;
+    EXPECT_NE("", err) << *it;
+  }
+}
+
 /*****************************************************************************/
 /* Instance Functions                                                        */
 /*****************************************************************************/
@@ -220,6 +339,7 @@ TEST_F(TestTimer, GenerateTimerIDTests)
 TEST_F(TestTimer, URL)
 {
   EXPECT_EQ("http://hostname:9999/timers/00000001000000090010011000011001", t1->url("hostname"));
+  EXPECT_EQ("00000001000000090010011000011001", t1->url_id());
 }
 
 TEST_F(TestTimer, ToJSON)
@@ -239,6 +359,8 @@ TEST_F(TestTimer, ToJSON)
   t2->replicas = t1->replicas;
   t2->callback_url = "http://localhost:80/callback";
   t2->callback_body = "{\"stuff\": \"stuff\"}";
+  t2->callback_batch = true;
+  t2->replica_stagger_ms = 1500;
 
   std::string json = t2->to_json();
   std::string err;
@@ -257,8 +379,61 @@ TEST_F(TestTimer, ToJSON)
   EXPECT_EQ(t2->replicas, t3->replicas) << json;
   EXPECT_EQ("http://localhost:80/callback", t3->callback_url) << json;
   EXPECT_EQ("{\"stuff\": \"stuff\"}", t3->callback_body) << json;
+  EXPECT_TRUE(t3->callback_batch) << json;
+  EXPECT_EQ(1500u, t3->replica_stagger_ms) << json;
   delete t2;
   delete t3;
+
+  // TCP callbacks survive the round trip too.
+  Timer* t4 = new Timer(1, interval, repeat_for);
+  t4->replicas = t1->replicas;
+  t4->callback_protocol = "tcp";
+  t4->callback_url = "127.0.0.1:5555";
+  t4->callback_body = "stuff";
+
+  json = t4->to_json();
+  Timer* t5 = Timer::from_json(2, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, t5) << err;
+  EXPECT_EQ("tcp", t5->callback_protocol) << json;
+  EXPECT_EQ("127.0.0.1:5555", t5->callback_url) << json;
+  EXPECT_EQ("stuff", t5->callback_body) << json;
+  EXPECT_EQ(0u, t5->replica_stagger_ms) << json;
+
+  // And stream callbacks.
+  t4->callback_protocol = "stream";
+  t4->callback_url = "consumers";
+
+  json = t4->to_json();
+  Timer* t6 = Timer::from_json(3, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, t6) << err;
+  EXPECT_EQ("stream", t6->callback_protocol) << json;
+  EXPECT_EQ("consumers", t6->callback_url) << json;
+  EXPECT_EQ("stuff", t6->callback_body) << json;
+  delete t4;
+  delete t5;
+  delete t6;
+}
+
+TEST_F(TestTimer, ReplicationAllocations)
+{
+  // Once the buffers they use have grown to fit, serializing a timer for
+  // replication only allocates the returned JSON, and working out its replica
+  // hash doesn't allocate at all.
+  std::string json = t1->to_json();
+  EXPECT_EQ(0x0010011000011001u, t1->replica_hash());
+
+  {
+    AllocationCounter counter;
+    std::string json2 = t1->to_json();
+    EXPECT_EQ(1u, counter.count());
+    EXPECT_EQ(json, json2);
+  }
+
+  {
+    AllocationCounter counter;
+    EXPECT_EQ(0x0010011000011001u, t1->replica_hash());
+    EXPECT_EQ(0u, counter.count());
+  }
 }
 
 TEST_F(TestTimer, IsLocal)
@@ -284,3 +459,65 @@ TEST_F(TestTimer, BecomeTombstone)
   EXPECT_EQ(100, t1->interval);
   EXPECT_EQ(100, t1->repeat_for);
 }
+
+TEST_F(TestTimer, NextPopTime)
+{
+  // Local node is first in the replica list, so pops on the interval.
+  EXPECT_EQ(1000100, t1->next_pop_time());
+  t1->sequence_number = 1;
+  EXPECT_EQ(1000200, t1->next_pop_time());
+
+  // Pending retries override the interval.
+  t1->retry_time = 1000150;
+  EXPECT_EQ(1000150, t1->next_pop_time());
+}
+
+TEST_F(TestTimer, NextPopTimeBackupReplica)
+{
+  // The local node is the second replica, so pops after the replica stagger
+  // (which is the maximum until latency has been measured).
+  t1->replicas.insert(t1->replicas.begin(), "10.0.0.2");
+  EXPECT_EQ(1000100 + 2000, t1->next_pop_time());
+}
+
+TEST_F(TestTimer, NextPopTimeAdvertisedStagger)
+{
+  // A backup replica waits for the stagger advertised with the timer, rather
+  // than its own.
+  t1->replicas.insert(t1->replicas.begin(), "10.0.0.2");
+  t1->replica_stagger_ms = 7000;
+  EXPECT_EQ(1000100 + 7000, t1->next_pop_time());
+
+  // The primary replica isn't affected.
+  t1->replicas.erase(t1->replicas.begin());
+  EXPECT_EQ(1000100, t1->next_pop_time());
+}
+
+TEST_F(TestTimer, ReplicaStaggerOnlyFromReplicas)
+{
+  std::string err;
+  bool replicated;
+
+  // A client can't choose how long the replicas wait for each other.
+  std::string client = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replica-stagger-ms\": 1 }}";
+  Timer* timer = Timer::from_json(1, 0, client, err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_FALSE(replicated);
+  EXPECT_EQ(0u, timer->replica_stagger_ms);
+  delete timer;
+
+  // The stagger replicated from another node is kept within this node's
+  // configured floor and maximum.
+  std::string replica = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [ \"10.0.0.1\", \"10.0.0.2\" ], \"replica-stagger-ms\": 1 }}";
+  timer = Timer::from_json(1, 0, replica, err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_TRUE(replicated);
+  EXPECT_EQ(200u, timer->replica_stagger_ms);
+  delete timer;
+
+  replica = "{\"timing\": { \"interval\": 100, \"repeat-for\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\" }}, \"reliability\": { \"replicas\": [ \"10.0.0.1\", \"10.0.0.2\" ], \"replica-stagger-ms\": 60000 }}";
+  timer = Timer::from_json(1, 0, replica, err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_EQ(2000u, timer->replica_stagger_ms);
+  delete timer;
+}
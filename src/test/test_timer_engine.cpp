@@ -0,0 +1,82 @@
+#include "timer_engine.h"
+#include "globals.h"
+#include "statistics.h"
+#include "replica_stagger.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <unistd.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+// The engine is tested as an embedding process would use it, without the
+// globals that the other tests set up.
+class TestTimerEngine : public ::testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    ASSERT_TRUE(__globals == NULL);
+    ASSERT_TRUE(__statistics == NULL);
+    ASSERT_TRUE(__replica_stagger == NULL);
+    pops = 0;
+  }
+
+  // Let the engine's timer handler tick.  Its condition variable is mocked in
+  // the unit tests, so otherwise it only picks up timers added before it
+  // first waits.
+  void tick(TimerEngine* engine)
+  {
+    MockPThreadCondVar* cond = engine->_handler->_cond;
+    cond->block_till_waiting();
+    cond->signal_timeout();
+  }
+
+  // Wait for up to five seconds for the given number of pops.
+  bool wait_for_pops(int count)
+  {
+    for (int ii = 0; (ii < 500) && (pops < count); ii++)
+    {
+      usleep(10000);
+    }
+    return (pops >= count);
+  }
+
+  std::atomic<int> pops;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestTimerEngine, PopsWithoutGlobals)
+{
+  TimerEngine* engine = new TimerEngine();
+  EXPECT_TRUE(__globals != NULL);
+  EXPECT_TRUE(__statistics != NULL);
+  EXPECT_TRUE(__replica_stagger != NULL);
+
+  engine->register_function("count", [this](TimerID, uint32_t, const SharedBuffer&)
+  {
+    pops++;
+    return true;
+  });
+
+  // A timer that's already due pops straight away, and its callback latency
+  // is recorded.
+  Timer* timer = new Timer(Timer::generate_timer_id(), 100, 100);
+  timer->start_time -= 1000;
+  timer->callback_protocol = "function";
+  timer->callback_url = "count";
+  engine->add_timer(timer);
+  tick(engine);
+  EXPECT_TRUE(wait_for_pops(1));
+
+  // The engine destroys the globals it created.
+  delete engine;
+  EXPECT_TRUE(__globals == NULL);
+  EXPECT_TRUE(__statistics == NULL);
+  EXPECT_TRUE(__replica_stagger == NULL);
+}
@@ -3,12 +3,17 @@
 #include "mock_timer_store.h"
 #include "mock_callback.h"
 #include "mock_replicator.h"
+#include "allocation_counter.h"
 #include "base.h"
+#include "statistics.h"
+#include "globals.h"
 #include "test_interposer.hpp"
 
 #include "timer_handler.h"
 
 #include <gtest/gtest.h>
+#include <unistd.h>
+#include <atomic>
 
 using namespace ::testing;
 
@@ -25,6 +30,8 @@ protected:
     _store = new MockTimerStore();
     _callback = new MockCallback();
     _replicator = new MockReplicator();
+
+    EXPECT_CALL(*_callback, protocol()).WillRepeatedly(Return("http"));
   }
 
   void TearDown()
@@ -39,6 +46,10 @@ protected:
   // Accessor functions into the timer handler's private variables
   MockPThreadCondVar* _cond() { return _th->_cond; }
 
+  // Tick the timer handler from the test thread.  The test must hold the
+  // handler's mutex, with the handler thread waiting.
+  void tick() { _th->tick(); }
+
   MockTimerStore* _store;
   MockCallback* _callback;
   MockReplicator* _replicator;
@@ -47,6 +58,40 @@ protected:
 
 MATCHER(IsTombstone, "is a tombstone") { return arg->is_tombstone(); }
 
+// A callback handler that completes callbacks straight away, without
+// allocating memory.  The last callback in each batch of more than one is
+// deferred, so that timers also go back into the backlog.
+class InstantCallback : public Callback
+{
+public:
+  std::string protocol() { return "http"; }
+  bool perform(std::string, const SharedBuffer&, unsigned int) { return true; }
+
+  void perform_all(std::vector<CallbackRequest>& requests, uint64_t)
+  {
+    uint64_t now_us = CallbackRequest::now_us();
+    for (size_t ii = 0; ii < requests.size(); ii++)
+    {
+      if ((ii > 0) && (ii == requests.size() - 1))
+      {
+        requests[ii].deferred = true;
+        continue;
+      }
+
+      requests[ii].success = true;
+      requests[ii].started_us = now_us;
+      requests[ii].completed_us = now_us;
+    }
+  }
+};
+
+// A replicator that doesn't replicate anything.
+class NullReplicator : public Replicator
+{
+public:
+  void replicate(Timer*) {}
+};
+
 /*****************************************************************************/
 /* Instance function tests                                                   */
 /*****************************************************************************/
@@ -54,22 +99,22 @@ MATCHER(IsTombstone, "is a tombstone") { return arg->is_tombstone(); }
 TEST_F(TestTimerHandler, StartUpAndShutDown)
 {
   EXPECT_CALL(*_store, get_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   _th = new TimerHandler(_store, _replicator, _callback);
   _cond()->block_till_waiting();
 }
 
 TEST_F(TestTimerHandler, PopOneTimer)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
-  timers.insert(timer);
+  timers.push_back(timer);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer->callback_url, timer->callback_body, 1)).
                           WillOnce(Return(true));
@@ -80,21 +125,34 @@ TEST_F(TestTimerHandler, PopOneTimer)
 
   _th = new TimerHandler(_store, _replicator, _callback);
   _cond()->block_till_waiting();
+
+  // The timer was due to pop long ago, and the latencies are recorded against
+  // short timers.
+  Histogram* lateness = __statistics->latency(Statistics::POP_LATENESS,
+                                              Statistics::SHORT_TIMERS);
+  EXPECT_EQ(1u, lateness->count());
+  EXPECT_GT(lateness->max(), 1000000u);
+  EXPECT_EQ(1u, __statistics->latency(Statistics::DISPATCH_DELAY,
+                                      Statistics::SHORT_TIMERS)->count());
+  EXPECT_EQ(1u, __statistics->latency(Statistics::CALLBACK_RTT,
+                                      Statistics::SHORT_TIMERS)->count());
+  EXPECT_EQ(0u, __statistics->latency(Statistics::CALLBACK_RTT,
+                                      Statistics::LONG_TIMERS)->count());
   delete timer;
 }
 
 TEST_F(TestTimerHandler, PopRepeatedTimer)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
   timer->repeat_for = timer->interval * 2;
-  timers.insert(timer);
+  timers.push_back(timer);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer->callback_url, timer->callback_body, 1)).
                           WillOnce(Return(true));
@@ -114,16 +172,16 @@ TEST_F(TestTimerHandler, PopRepeatedTimer)
 
 TEST_F(TestTimerHandler, PopMultipleTimersSimultaneously)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers.insert(timer1);
-  timers.insert(timer2);
+  timers.push_back(timer1);
+  timers.push_back(timer2);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1->callback_url, timer1->callback_body, 1)).
                           WillOnce(Return(true));
@@ -142,18 +200,18 @@ TEST_F(TestTimerHandler, PopMultipleTimersSimultaneously)
 
 TEST_F(TestTimerHandler, PopMultipleTimersSeries)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
                        WillOnce(SetArgReferee<0>(timers2)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1->callback_url, timer1->callback_body, 1)).
                           WillOnce(Return(true));
@@ -172,22 +230,22 @@ TEST_F(TestTimerHandler, PopMultipleTimersSeries)
 
 TEST_F(TestTimerHandler, PopMultipleRepeatingTimers)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   timer1->repeat_for = timer1->interval * 2;
   Timer* timer2 = default_timer(2);
   timer2->repeat_for = timer2->interval * 2;
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
                        WillOnce(SetArgReferee<0>(timers2)).
                        WillOnce(SetArgReferee<0>(timers2)).
                        WillOnce(SetArgReferee<0>(timers1)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1->callback_url, timer1->callback_body, 1)).
                           WillOnce(Return(true));
@@ -212,40 +270,273 @@ TEST_F(TestTimerHandler, PopMultipleRepeatingTimers)
   delete timer2;
 }
 
+TEST_F(TestTimerHandler, PopInSlices)
+{
+  int max_slice_size = 2;
+  __globals->set_pop_max_slice_size(max_slice_size);
+
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  Timer* timer3 = default_timer(3);
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+  timers.push_back(timer3);
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(3);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(3);
+
+  // Two of the timers are popped, then the store is checked again before the
+  // third is popped.
+  {
+    InSequence s;
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(timers));
+    EXPECT_CALL(*_callback, perform(_, _, 1)).Times(2).
+                            WillRepeatedly(Return(true));
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+    EXPECT_CALL(*_callback, perform(_, _, 1)).
+                            WillOnce(Return(true));
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  }
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(2u, __statistics->get(Statistics::POP_SLICES));
+  EXPECT_EQ(3u, __statistics->get(Statistics::POP_BACKLOG_PEAK));
+  EXPECT_EQ(0u, __statistics->get(Statistics::POP_BACKLOG));
+  delete timer1;
+  delete timer2;
+  delete timer3;
+}
+
+// Add a timer to the timer handler from within a callback, then report the
+// callback as successful.
+ACTION_P2(AddTimerDuringCallback, th, timer) { (*th)->add_timer(timer); return true; }
+
+TEST_F(TestTimerHandler, DeleteBetweenSlicesSuppressesPop)
+{
+  int max_slice_size = 1;
+  __globals->set_pop_max_slice_size(max_slice_size);
+
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  timer2->start_time = timer1->start_time + 1000;
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+
+  // The second timer is deleted while the first timer's callback is being
+  // performed, by which time both timers have left the store.
+  Timer* tombstone = Timer::create_tombstone(2, 0);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillRepeatedly(SetArgReferee<0>(std::vector<Timer*>()));
+  EXPECT_CALL(*_callback, perform(timer1->callback_url, _, 1)).
+                          WillOnce(AddTimerDuringCallback(&_th, tombstone));
+  EXPECT_CALL(*_callback, perform(timer2->callback_url, _, _)).Times(0);
+  EXPECT_CALL(*_replicator, replicate(timer1)).Times(1);
+  EXPECT_CALL(*_store, add_timer(timer1)).Times(1);
+  EXPECT_CALL(*_store, add_timer(tombstone)).Times(1);
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  // The timer handler has deleted the old version of the second timer.
+  EXPECT_EQ(2u, __statistics->get(Statistics::POP_SLICES));
+  delete timer1;
+  delete tombstone;
+}
+
+TEST_F(TestTimerHandler, PopMostOverdueFirst)
+{
+  int max_slice_size = 1;
+  __globals->set_pop_max_slice_size(max_slice_size);
+
+  // Timers due at different times, all in the past.
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  Timer* timer3 = default_timer(3);
+  timer1->start_time = 3000000;
+  timer2->start_time = 1000000;
+  timer3->start_time = 2000000;
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+  timers.push_back(timer3);
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(3);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(3);
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillRepeatedly(SetArgReferee<0>(std::vector<Timer*>()));
+
+  {
+    InSequence s;
+    EXPECT_CALL(*_callback, perform(timer2->callback_url, _, 1)).
+                            WillOnce(Return(true));
+    EXPECT_CALL(*_callback, perform(timer3->callback_url, _, 1)).
+                            WillOnce(Return(true));
+    EXPECT_CALL(*_callback, perform(timer1->callback_url, _, 1)).
+                            WillOnce(Return(true));
+  }
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(3u, __statistics->latency(Statistics::DISPATCH_LATENESS,
+                                      Statistics::SHORT_TIMERS)->count());
+  EXPECT_GT(__statistics->get(Statistics::POP_BACKLOG_MAX_LATENESS), 0u);
+  delete timer1;
+  delete timer2;
+  delete timer3;
+}
+
+ACTION(SlowCallback) { usleep(2000); return true; }
+
+TEST_F(TestTimerHandler, DeferCallbacksPastSliceBudget)
+{
+  int slice_budget_us = 1;
+  __globals->set_pop_slice_budget_us(slice_budget_us);
+
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(2);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(2);
+
+  // The first callback overruns the slice's budget, so the second timer is
+  // deferred to the next slice (keeping its sequence number).
+  {
+    InSequence s;
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(timers));
+    EXPECT_CALL(*_callback, perform(_, _, 1)).
+                            WillOnce(SlowCallback());
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+    EXPECT_CALL(*_callback, perform(_, _, 1)).
+                            WillOnce(Return(true));
+    EXPECT_CALL(*_store, get_next_timers(_)).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                         WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  }
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(1u, __statistics->get(Statistics::POP_DEFERRALS));
+  delete timer1;
+  delete timer2;
+}
+
 TEST_F(TestTimerHandler, FailedCallback)
 {
-  std::unordered_set<Timer*> timers;
+  std::vector<Timer*> timers;
   Timer* timer = default_timer(1);
   timer->repeat_for = timer->interval * 2;
-  timers.insert(timer);
+  timers.push_back(timer);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  EXPECT_CALL(*_callback, perform(timer->callback_url, timer->callback_body, 1)).
+                          WillOnce(Return(false));
+
+  // The timer is put back in the store to retry, but not replicated.
+  EXPECT_CALL(*_replicator, replicate(_)).Times(0);
+  EXPECT_CALL(*_store, add_timer(timer)).Times(1);
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(1u, timer->retry_count);
+  EXPECT_NE(0u, timer->retry_time);
+  EXPECT_EQ(0u, timer->sequence_number);
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_FAILURES));
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_RETRIES));
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, RetriedCallbackSucceeds)
+{
+  std::vector<Timer*> timers;
+  Timer* timer = default_timer(1);
+  timers.push_back(timer);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  // The retry is sent with the same sequence number as the failed attempt.
+  EXPECT_CALL(*_callback, perform(timer->callback_url, timer->callback_body, 1)).
+                          WillOnce(Return(false)).
+                          WillOnce(Return(true));
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(1);
+  EXPECT_CALL(*_store, add_timer(timer)).Times(2);
+
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(0u, timer->retry_count);
+  EXPECT_EQ(0u, timer->retry_time);
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_SUCCESSES));
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, CallbackRetriesExhausted)
+{
+  std::vector<Timer*> timers;
+  Timer* timer = default_timer(1);
+  timer->retry_count = 2;
+  timers.push_back(timer);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer->callback_url, timer->callback_body, 1)).
                           WillOnce(Return(false));
 
+  // The timer has used up its retries so is deleted.
+  EXPECT_CALL(*_replicator, replicate(_)).Times(0);
+  EXPECT_CALL(*_store, add_timer(_)).Times(0);
+
   _th = new TimerHandler(_store, _replicator, _callback);
   _cond()->block_till_waiting();
+
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_RETRIES_EXHAUSTED));
 }
 
 TEST_F(TestTimerHandler, EmptyStore)
 {
-  std::unordered_set<Timer*> timers1;
-  std::unordered_set<Timer*> timers2;
+  std::vector<Timer*> timers1;
+  std::vector<Timer*> timers2;
   Timer* timer1 = default_timer(1);
   Timer* timer2 = default_timer(2);
-  timers1.insert(timer1);
-  timers2.insert(timer2);
+  timers1.push_back(timer1);
+  timers2.push_back(timer2);
 
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers1)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
                        WillOnce(SetArgReferee<0>(timers2)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   EXPECT_CALL(*_callback, perform(timer1->callback_url, timer1->callback_body, 1)).
                           WillOnce(Return(true));
@@ -271,31 +562,220 @@ TEST_F(TestTimerHandler, AddTimer)
 {
   Timer* timer = default_timer(1);
 
-  // Once we add the timer, we'll poll the store for a new timer, expect an extra
-  // call to get_next_timers().
+  // The timer is queued and only added to the store on the next tick, after
+  // which we'll poll the store for a new timer, expect an extra call to
+  // get_next_timers().
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  EXPECT_CALL(*_store, add_timer(timer)).Times(1);
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  _th->add_timer(timer);
+  _cond()->signal_timeout();
+  _cond()->block_till_waiting();
+
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, AddTimers)
+{
+  std::vector<Timer*> timers;
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  timers.push_back(timer1);
+  timers.push_back(timer2);
+
+  // The timers are added to the store together on the next tick.
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  {
+    InSequence s;
+    EXPECT_CALL(*_store, add_timer(timer1)).Times(1);
+    EXPECT_CALL(*_store, add_timer(timer2)).Times(1);
+  }
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  _th->add_timers(timers);
+  EXPECT_TRUE(timers.empty());
+  _cond()->signal_timeout();
+  _cond()->block_till_waiting();
+
+  delete timer1;
+  delete timer2;
+}
+
+TEST_F(TestTimerHandler, AddTimerAtShutdown)
+{
+  Timer* timer = default_timer(1);
+
+  // A timer that's still queued when the handler terminates is passed to the
+  // store (which owns it from then on).
   EXPECT_CALL(*_store, get_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   EXPECT_CALL(*_store, add_timer(timer)).Times(1);
   _th = new TimerHandler(_store, _replicator, _callback);
   _cond()->block_till_waiting();
 
   _th->add_timer(timer);
+  delete _th; _th = NULL;
+
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, RouteCallbacksByProtocol)
+{
+  std::vector<Timer*> timers;
+  Timer* http_timer = default_timer(1);
+  Timer* tcp_timer = default_timer(2);
+  tcp_timer->callback_protocol = "tcp";
+  timers.push_back(http_timer);
+  timers.push_back(tcp_timer);
+
+  MockCallback* tcp_callback = new MockCallback();
+  EXPECT_CALL(*tcp_callback, protocol()).WillRepeatedly(Return("tcp"));
+  std::vector<Callback*> callbacks;
+  callbacks.push_back(_callback);
+  callbacks.push_back(tcp_callback);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  // Each timer's callback goes to the handler for its protocol.
+  EXPECT_CALL(*_callback, perform(http_timer->callback_url, _, 1)).
+                          WillOnce(Return(true));
+  EXPECT_CALL(*tcp_callback, perform(tcp_timer->callback_url, _, 1)).
+                             WillOnce(Return(true));
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(2);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(2);
+
+  _th = new TimerHandler(_store, _replicator, callbacks);
   _cond()->block_till_waiting();
 
+  delete http_timer;
+  delete tcp_timer;
+}
+
+// Callback that waits (for up to a couple of seconds) for the callback
+// handler for another protocol to be performing its callbacks at the same
+// time, noting whether it was.
+class RendezvousCallback : public Callback
+{
+public:
+  RendezvousCallback(const std::string& protocol,
+                     std::atomic<int>* performing) :
+    _protocol(protocol), _performing(performing), overlapped(false) {}
+
+  std::string protocol() { return _protocol; }
+  bool perform(std::string, const SharedBuffer&, unsigned int) { return true; }
+
+  void perform_all(std::vector<CallbackRequest>& requests, uint64_t)
+  {
+    (*_performing)++;
+    for (int ii = 0; (ii < 200) && (*_performing < 2); ii++)
+    {
+      usleep(10000);
+    }
+    overlapped = (*_performing >= 2);
+
+    for (auto it = requests.begin(); it != requests.end(); it++)
+    {
+      it->started_us = CallbackRequest::now_us();
+      it->success = true;
+      it->completed_us = CallbackRequest::now_us();
+    }
+  }
+
+private:
+  std::string _protocol;
+  std::atomic<int>* _performing;
+
+public:
+  bool overlapped;
+};
+
+TEST_F(TestTimerHandler, ProtocolsPerformedInParallel)
+{
+  std::vector<Timer*> timers;
+  Timer* http_timer = default_timer(1);
+  Timer* tcp_timer = default_timer(2);
+  tcp_timer->callback_protocol = "tcp";
+  timers.push_back(http_timer);
+  timers.push_back(tcp_timer);
+
+  std::atomic<int> performing(0);
+  RendezvousCallback* http_callback = new RendezvousCallback("http", &performing);
+  RendezvousCallback* tcp_callback = new RendezvousCallback("tcp", &performing);
+  std::vector<Callback*> callbacks;
+  callbacks.push_back(http_callback);
+  callbacks.push_back(tcp_callback);
+  delete _callback; _callback = NULL;
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(2);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(2);
+
+  // Neither protocol's callbacks wait for the other's to finish.
+  _th = new TimerHandler(_store, _replicator, callbacks);
+  _cond()->block_till_waiting();
+  EXPECT_TRUE(http_callback->overlapped);
+  EXPECT_TRUE(tcp_callback->overlapped);
+
+  delete http_timer;
+  delete tcp_timer;
+}
+
+TEST_F(TestTimerHandler, PrepareUpcomingTimers)
+{
+  int lookahead_ms = 20;
+  __globals->set_pop_lookahead_ms(lookahead_ms);
+
+  Timer* timer = default_timer(1);
+  std::vector<Timer*> upcoming;
+  upcoming.push_back(timer);
+
+  // Between ticks, the handler looks ahead in the store and passes the timers
+  // about to pop to the callback handler (possibly more than once, depending
+  // on how quickly the handler is terminated).
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+  EXPECT_CALL(*_store, peek_upcoming_timers(20, _)).
+                       WillRepeatedly(SetArgReferee<1>(upcoming));
+  EXPECT_CALL(*_callback, prepare(ElementsAre(timer))).Times(AtLeast(1));
+  _th = new TimerHandler(_store, _replicator, _callback);
+  _cond()->block_till_waiting();
+
+  _cond()->signal_timeout();
+  _cond()->block_till_waiting();
+
+  delete _th; _th = NULL;
   delete timer;
 }
 
 TEST_F(TestTimerHandler, LeakTest)
 {
   Timer* timer = default_timer(1);
-  std::unordered_set<Timer*> timers;
-  timers.insert(timer);
+  std::vector<Timer*> timers;
+  timers.push_back(timer);
 
   // Make sure that the final call to get_next_timers actually returns some.  This
   // test should still pass valgrind's checking without leaking the timer.
   EXPECT_CALL(*_store, get_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
                        WillOnce(SetArgReferee<0>(timers));
 
   _th = new TimerHandler(_store, _replicator, _callback);
@@ -309,14 +789,14 @@ TEST_F(TestTimerHandler, FutureTimerLeakTest)
   clock_gettime(CLOCK_REALTIME, &ts);
   timer->start_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + 100;
 
-  std::unordered_set<Timer*> timers;
-  timers.insert(timer);
+  std::vector<Timer*> timers;
+  timers.push_back(timer);
 
   // Since this timer won't pop, and we're exiting from the 'have timers in hand' branch of
   // the core loop, we'll not hit the store again.
   EXPECT_CALL(*_store, get_next_timers(_)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
 
   _th = new TimerHandler(_store, _replicator, _callback);
   _cond()->block_till_waiting();
@@ -344,16 +824,16 @@ TEST_F(TestTimerHandler, FutureTimerPop)
   // time down to a millisecond.
   ts.tv_nsec = ts.tv_nsec - (ts.tv_nsec % (1000 * 1000));
 
-  std::unordered_set<Timer*> timers;
-  timers.insert(timer);
+  std::vector<Timer*> timers;
+  timers.push_back(timer);
 
   // After the timer pops, we'd expect to get a call back to get the next set of timers.
   // Then the standard one more check during termination.
   EXPECT_CALL(*_store, get_next_timers(_)).
                        WillOnce(SetArgReferee<0>(timers)).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
-                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
   EXPECT_CALL(*_callback, perform(_, _, _)).WillOnce(Return(true));
   EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(1);
   EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(1);
@@ -372,3 +852,152 @@ TEST_F(TestTimerHandler, FutureTimerPop)
   // and that's okay, that's good!
   cwtest_reset_time();
 }
+
+// Callback whose consumer accepts every pop, answering with the given
+// response.
+class RespondingCallback : public Callback
+{
+public:
+  RespondingCallback(const std::string& response) : _response(response) {}
+
+  std::string protocol() { return "http"; }
+  bool perform(std::string, const SharedBuffer&, unsigned int) { return true; }
+
+  void perform_all(std::vector<CallbackRequest>& requests, uint64_t)
+  {
+    for (auto it = requests.begin(); it != requests.end(); it++)
+    {
+      it->started_us = CallbackRequest::now_us();
+      it->success = true;
+      it->parse_response(_response.data(), _response.length());
+      it->completed_us = CallbackRequest::now_us();
+    }
+  }
+
+private:
+  std::string _response;
+};
+
+TEST_F(TestTimerHandler, RescheduledByResponse)
+{
+  std::vector<Timer*> timers;
+  Timer* timer = default_timer(1);
+  timers.push_back(timer);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  // The timer would otherwise have popped for the last time, but carries on
+  // with its new timing, replicated once.
+  EXPECT_CALL(*_replicator, replicate(timer)).Times(1);
+  EXPECT_CALL(*_store, add_timer(timer)).Times(1);
+
+  delete _callback; _callback = NULL;
+  _th = new TimerHandler(_store,
+                         _replicator,
+                         new RespondingCallback("{\"timing\": {\"interval\": 5, \"repeat-for\": 30}}"));
+  _cond()->block_till_waiting();
+
+  EXPECT_FALSE(timer->is_tombstone());
+  EXPECT_EQ(5000u, timer->interval);
+  EXPECT_EQ(30000u, timer->repeat_for);
+  EXPECT_EQ(0u, timer->sequence_number);
+  EXPECT_GT(timer->start_time, 1000000u);
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_RESCHEDULES));
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, CancelledByResponse)
+{
+  std::vector<Timer*> timers;
+  Timer* timer = default_timer(1);
+  timer->repeat_for = timer->interval * 10;
+  timers.push_back(timer);
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(timers)).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::vector<Timer*>()));
+
+  EXPECT_CALL(*_replicator, replicate(IsTombstone())).Times(1);
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).Times(1);
+
+  delete _callback; _callback = NULL;
+  _th = new TimerHandler(_store, _replicator, new RespondingCallback("{\"cancel\": true}"));
+  _cond()->block_till_waiting();
+
+  EXPECT_EQ(1u, __statistics->get(Statistics::CALLBACK_CANCELS));
+  delete timer;
+}
+
+TEST_F(TestTimerHandler, TickingDoesNotAllocate)
+{
+  // Use a real store, with a callback handler and replicator that don't
+  // allocate, so that everything the handler does on a tick is counted: adding
+  // new timers, popping timers from the store and the backlog, deferring
+  // callbacks and putting popped timers back in the store.  Time only moves
+  // when the test moves it, so the pattern of pops is the same on every run.
+  delete _callback;
+  delete _replicator;
+  cwtest_completely_control_time();
+  TimerStore* store = new TimerStore();
+  int lookahead_ms = 20;
+  __globals->set_pop_lookahead_ms(lookahead_ms);
+
+  // Repeating timers in the short and long wheels, with intervals chosen so
+  // that the pattern of pops repeats every 15s.
+  const uint32_t intervals[] = {10, 20, 50, 100, 250, 500, 1000, 1500, 2500};
+  const int num_intervals = sizeof(intervals) / sizeof(intervals[0]);
+  const int period_ms = 15000;
+  const int granularity_ms = 10;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  for (int ii = 0; ii < 90; ii++)
+  {
+    Timer* timer = default_timer(ii + 1);
+    timer->start_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+    timer->interval = intervals[ii % num_intervals];
+    timer->repeat_for = timer->interval * 10000;
+    store->add_timer(timer);
+  }
+
+  _th = new TimerHandler(store, new NullReplicator(), new InstantCallback());
+  _cond()->block_till_waiting();
+
+  // Tick through the pattern once so the handler's buffers grow to fit, then
+  // check that ticking through it again doesn't allocate.  A replacement for
+  // one of the timers is added on each tick.
+  _cond()->lock();
+  size_t allocations = 0;
+  uint64_t successes = 0;
+  for (int round = 0; round < 2; round++)
+  {
+    for (int ms = 0; ms < period_ms; ms += granularity_ms)
+    {
+      Timer* timer = default_timer(1000);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      timer->start_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+      timer->interval = 1000;
+      timer->repeat_for = 1000;
+      _th->add_timer(timer);
+
+      cwtest_advance_time_ms(granularity_ms);
+      AllocationCounter counter;
+      tick();
+      allocations += (round == 1) ? counter.count() : 0;
+    }
+  }
+  successes = __statistics->get(Statistics::CALLBACK_SUCCESSES);
+  _cond()->unlock();
+
+  EXPECT_GT(successes, 0u);
+  EXPECT_GT(__statistics->get(Statistics::POP_DEFERRALS), 0u);
+  EXPECT_EQ(0u, allocations);
+
+  delete _th;
+  _th = NULL;
+  delete store;
+  cwtest_reset_time();
+}
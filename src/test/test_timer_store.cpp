@@ -1,5 +1,7 @@
 #include "timer_store.h"
 #include "timer_helper.h"
+#include "allocation_counter.h"
+#include "replica_stagger.h"
 #include "test_interposer.hpp"
 #include "base.h"
 
@@ -73,7 +75,7 @@ protected:
 TEST_F(TestTimerStore, NearGetNextTimersTest)
 {
   ts->add_timer(timers[0]);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
 
   ASSERT_EQ(0, next_timers.size());
@@ -96,7 +98,7 @@ TEST_F(TestTimerStore, NearGetNextTimersOffsetTest)
 
   ts->add_timer(timers[0]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(1500);
   ts->get_next_timers(next_timers);
@@ -119,7 +121,7 @@ TEST_F(TestTimerStore, NearGetNextTimersOffsetTest)
 TEST_F(TestTimerStore, MidGetNextTimersTest)
 {
   ts->add_timer(timers[1]);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
 
   ASSERT_EQ(0, next_timers.size());
@@ -139,7 +141,7 @@ TEST_F(TestTimerStore, MidGetNextTimersTest)
 TEST_F(TestTimerStore, LongGetNextTimersTest)
 {
   ts->add_timer(timers[2]);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
 
   ASSERT_EQ(0, next_timers.size());
@@ -164,7 +166,7 @@ TEST_F(TestTimerStore, MultiNearGetNextTimersTest)
   ts->add_timer(timers[0]);
   ts->add_timer(timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(1000 + TIMER_GRANULARITY_MS);
 
@@ -189,7 +191,7 @@ TEST_F(TestTimerStore, ClashingMultiMidGetNextTimersTest)
   ts->add_timer(timers[0]);
   ts->add_timer(timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(timers[0]->interval + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
@@ -221,7 +223,7 @@ TEST_F(TestTimerStore, SeparateMultiMidGetNextTimersTest)
   ts->add_timer(timers[0]);
   ts->add_timer(timers[1]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(timers[0]->interval + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
@@ -253,7 +255,7 @@ TEST_F(TestTimerStore, MultiLongGetTimersTest)
   ts->add_timer(timers[1]);
   ts->add_timer(timers[2]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   cwtest_advance_time_ms(timers[0]->interval + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
@@ -289,7 +291,7 @@ TEST_F(TestTimerStore, ReallyLongTimer)
   timers[2]->interval = (3600 * 1000) * 10;
   ts->add_timer(timers[2]);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   ts->get_next_timers(next_timers);
   ASSERT_EQ(0, next_timers.size());
@@ -312,7 +314,7 @@ TEST_F(TestTimerStore, DeleteNearTimer)
   uint64_t interval = timers[0]->interval;
   ts->add_timer(timers[0]);
   ts->delete_timer(1);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(interval + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
   EXPECT_TRUE(next_timers.empty());
@@ -326,7 +328,7 @@ TEST_F(TestTimerStore, DeleteMidTimer)
   uint64_t interval = timers[2]->interval;
   ts->add_timer(timers[1]);
   ts->delete_timer(2);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(interval + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
   EXPECT_TRUE(next_timers.empty());
@@ -341,7 +343,7 @@ TEST_F(TestTimerStore, DeleteLongTimer)
   ts->add_timer(timers[2]);
   ts->delete_timer(3);
   cwtest_advance_time_ms(interval + TIMER_GRANULARITY_MS);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_TRUE(next_timers.empty());
   delete timers[0];
@@ -360,7 +362,7 @@ TEST_F(TestTimerStore, UpdateTimer)
   cwtest_advance_time_ms(1000000);
 
   // Fetch the newly updated timer.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_EQ(1, next_timers.size());
 
@@ -386,7 +388,7 @@ TEST_F(TestTimerStore, DontUpdateTimerAge)
   cwtest_advance_time_ms(1000000);
 
   // Fetch the newly updated timer.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_EQ(1, next_timers.size());
 
@@ -412,7 +414,7 @@ TEST_F(TestTimerStore, DontUpdateTimerSeqNo)
   cwtest_advance_time_ms(1000000);
 
   // Fetch the newly updated timer.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_EQ(1, next_timers.size());
 
@@ -431,7 +433,7 @@ TEST_F(TestTimerStore, AddTombstone)
 {
   ts->add_timer(tombstone);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(1000000);
   ts->get_next_timers(next_timers);
   EXPECT_EQ(1, next_timers.size());
@@ -447,7 +449,7 @@ TEST_F(TestTimerStore, OverwriteWithTombstone)
   ts->add_timer(timers[0]);
   ts->add_timer(tombstone);
 
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   cwtest_advance_time_ms(1000000);
   ts->get_next_timers(next_timers);
   ASSERT_EQ(1, next_timers.size());
@@ -477,7 +479,7 @@ TEST_F(TestTimerStore, Non10msShortTimerUpdate)
 
   // Attempting to get a set of timers updates the internal clock in the
   // timer store.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_EQ(0, next_timers.size());
 
@@ -520,7 +522,7 @@ TEST_F(TestTimerStore, Non10msMediumTimerUpdate)
 
   // Attempting to get a set of timers updates the internal clock in the
   // timer store.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
   EXPECT_EQ(0, next_timers.size());
 
@@ -555,7 +557,7 @@ TEST_F(TestTimerStore, MixtureOfTimerLengths)
   // Add timers that all pop at the same time, but in such a way that one ends
   // up in the short wheel, one in the long wheel, and one in the heap.  Check
   // they pop at the same time.
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
 
   // Timers all pop 1hr, 1s, 500ms from the start of the test.
   // Set timer 1.
@@ -597,7 +599,7 @@ TEST_F(TestTimerStore, MixtureOfTimerLengths)
 
 TEST_F(TestTimerStore, TimerPopsOnTheHour)
 {
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   uint64_t pop_time_ms;
 
   pop_time_ms = (timers[0]->start_time / (60 * 60 * 1000));
@@ -621,7 +623,7 @@ TEST_F(TestTimerStore, TimerPopsOnTheHour)
 TEST_F(TestTimerStore, PopOverdueTimer)
 {
   cwtest_advance_time_ms(500);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
 
   ts->add_timer(timers[0]);
@@ -640,7 +642,7 @@ TEST_F(TestTimerStore, PopOverdueTimer)
 TEST_F(TestTimerStore, DeleteOverdueTimer)
 {
   cwtest_advance_time_ms(500);
-  std::unordered_set<Timer*> next_timers;
+  std::vector<Timer*> next_timers;
   ts->get_next_timers(next_timers);
 
   ts->add_timer(timers[0]);
@@ -653,3 +655,131 @@ TEST_F(TestTimerStore, DeleteOverdueTimer)
   delete timers[2];
   delete tombstone;
 }
+
+TEST_F(TestTimerStore, DeleteBackupTimerAfterStaggerChanges)
+{
+  // This node is the timer's second replica, so the timer is filed under a
+  // pop time that includes the replica stagger.
+  timers[0]->replicas.clear();
+  timers[0]->replicas.push_back("10.0.0.2");
+  timers[0]->replicas.push_back("10.0.0.1");
+  ts->add_timer(timers[0]);
+
+  // The stagger shrinks as low latencies are measured, but the timer can still
+  // be found to delete it.
+  for (int ii = 0; ii < 100; ii++)
+  {
+    __replica_stagger->record_callback(1000);
+    __replica_stagger->record_replication(1000);
+  }
+  cwtest_advance_time_ms(1000);
+  __replica_stagger->record_callback(1000);
+  ASSERT_EQ(200u, __replica_stagger->stagger_ms());
+
+  ts->delete_timer(1);
+  cwtest_advance_time_ms(2000);
+  std::vector<Timer*> next_timers;
+  ts->get_next_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
+
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, PeekUpcomingTimers)
+{
+  ts->add_timer(timers[0]);
+
+  std::vector<Timer*> upcoming;
+  ts->peek_upcoming_timers(50, upcoming);
+  EXPECT_EQ(0, upcoming.size());
+
+  ts->peek_upcoming_timers(100 + TIMER_GRANULARITY_MS, upcoming);
+  ASSERT_EQ(1, upcoming.size());
+  EXPECT_EQ(timers[0], upcoming[0]);
+
+  // Peeking doesn't remove the timer from the store.
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  std::vector<Timer*> next_timers;
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, PeekUpcomingTimersInLongWheel)
+{
+  // Timer 2 pops in just over 10s, so is in the long wheel until shortly
+  // before it pops.
+  ts->add_timer(timers[1]);
+  cwtest_advance_time_ms(9500);
+  std::vector<Timer*> next_timers;
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(0, next_timers.size());
+
+  std::vector<Timer*> upcoming;
+  ts->peek_upcoming_timers(1000, upcoming);
+  ASSERT_EQ(1, upcoming.size());
+  EXPECT_EQ(timers[1], upcoming[0]);
+
+  delete timers[0];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, PoppingDoesNotAllocate)
+{
+  // Repeating timers in the short and long wheels, with intervals chosen so
+  // that the pattern of pops repeats every 15s.
+  const uint32_t intervals[] = {10, 20, 50, 100, 250, 500, 1000, 1500, 2500};
+  const int num_intervals = sizeof(intervals) / sizeof(intervals[0]);
+  const int period_ms = 15000;
+  std::vector<Timer*> store_timers;
+  for (int ii = 0; ii < 90; ii++)
+  {
+    Timer* timer = default_timer(ii + 10);
+    timer->start_time = timers[0]->start_time;
+    timer->interval = intervals[ii % num_intervals];
+    timer->repeat_for = timer->interval * 10000;
+    store_timers.push_back(timer);
+    ts->add_timer(timer);
+  }
+
+  // Run through the pattern once so the store's buckets and lookup table grow
+  // to fit, then check that running through it again doesn't allocate, either
+  // to pop the timers or to put them back in the store as the timer handler
+  // would.
+  std::vector<Timer*> next_timers;
+  next_timers.reserve(store_timers.size());
+  size_t allocations = 0;
+  size_t pops = 0;
+  for (int round = 0; round < 2; round++)
+  {
+    for (int ms = 0; ms < period_ms; ms += TIMER_GRANULARITY_MS)
+    {
+      cwtest_advance_time_ms(TIMER_GRANULARITY_MS);
+      AllocationCounter counter;
+      ts->get_next_timers(next_timers);
+
+      pops += next_timers.size();
+      for (auto it = next_timers.begin(); it != next_timers.end(); it++)
+      {
+        (*it)->sequence_number++;
+        ts->add_timer(*it);
+      }
+      next_timers.clear();
+      allocations += (round == 1) ? counter.count() : 0;
+    }
+  }
+
+  EXPECT_GT(pops, 0u);
+  EXPECT_EQ(0u, allocations);
+
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
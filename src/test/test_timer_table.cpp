@@ -0,0 +1,104 @@
+#include "timer_table.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestTimerTable : public Base
+{
+protected:
+  void TearDown()
+  {
+    table.clear();
+    for (auto it = timers.begin(); it != timers.end(); it++)
+    {
+      delete *it;
+    }
+    Base::TearDown();
+  }
+
+  Timer* make_timer(TimerID id)
+  {
+    Timer* timer = default_timer(id);
+    timers.push_back(timer);
+    return timer;
+  }
+
+  TimerTable table;
+  std::vector<Timer*> timers;
+};
+
+/*****************************************************************************/
+/* Instance function tests                                                   */
+/*****************************************************************************/
+
+TEST_F(TestTimerTable, InsertFindErase)
+{
+  Timer* timer = make_timer(1);
+  EXPECT_TRUE(table.empty());
+  EXPECT_TRUE(table.find(1) == NULL);
+
+  table.insert(timer);
+  EXPECT_EQ(1u, table.size());
+  EXPECT_EQ(timer, table.find(1));
+  EXPECT_TRUE(table.find(2) == NULL);
+
+  EXPECT_TRUE(table.erase(1));
+  EXPECT_FALSE(table.erase(1));
+  EXPECT_TRUE(table.find(1) == NULL);
+  EXPECT_TRUE(table.empty());
+}
+
+TEST_F(TestTimerTable, InsertReplaces)
+{
+  Timer* timer1 = make_timer(1);
+  Timer* timer2 = make_timer(1);
+
+  table.insert(timer1);
+  table.insert(timer2);
+  EXPECT_EQ(1u, table.size());
+  EXPECT_EQ(timer2, table.find(1));
+}
+
+// Insert enough timers to grow the table a few times, then remove every other
+// one.  Shifting timers back into the gaps left behind mustn't lose any.
+TEST_F(TestTimerTable, GrowAndErase)
+{
+  const TimerID count = 10000;
+  for (TimerID id = 1; id <= count; id++)
+  {
+    table.insert(make_timer(id));
+  }
+  EXPECT_EQ(count, table.size());
+
+  for (TimerID id = 1; id <= count; id += 2)
+  {
+    EXPECT_TRUE(table.erase(id));
+  }
+  EXPECT_EQ(count / 2, table.size());
+
+  size_t occupied = 0;
+  for (auto it = table.slots_begin(); it != table.slots_end(); it++)
+  {
+    occupied += (*it != NULL) ? 1 : 0;
+  }
+  EXPECT_EQ(count / 2, occupied);
+
+  for (TimerID id = 1; id <= count; id++)
+  {
+    Timer* timer = table.find(id);
+    if (id % 2 == 1)
+    {
+      EXPECT_TRUE(timer == NULL);
+    }
+    else
+    {
+      ASSERT_TRUE(timer != NULL);
+      EXPECT_EQ(id, timer->id);
+    }
+  }
+}